@@ -12,7 +12,9 @@ This is the core part of the code which emulates the drum controller.
 #include "MIDI.h"
 #include "Pinout.h"
 #include "Joystick.h"
-#include "USB\usb_device.h"
+#include "usb_config.h"
+#include "USB/usb_device.h"
+#include "main.h"
 
 
 // COMPILER FLAGS =====================================================
@@ -25,6 +27,10 @@ This is the core part of the code which emulates the drum controller.
 	!!!"ERROR: MIDI_OUT_ADAPTER not valid when LX_EXT_OUTS defined"
 #endif
 
+#if defined(MIDI_INTERRUPT) && defined(MIDI_RX_BUFFERED)
+	!!!"ERROR: MIDI_INTERRUPT and MIDI_RX_BUFFERED can't both be defined"
+#endif
+
 //#define ARCADE_INTERFACE // special output mode for Christian Cooper
 
 // CONSTANTS =======================================================
@@ -36,9 +42,33 @@ This is the core part of the code which emulates the drum controller.
 	#define MIDI_HOLD_COUNT 5 
 #endif
 
+/*
+The output timer interrupt runs every OUTPUT_TICK_US and takes care of turning the outputs 
+on and off (see OutputTimerISR()). Output times are kept in ticks.
+*/
+#define USEC_TO_TICKS(us)	(((us) + OUTPUT_TICK_US - 1) / OUTPUT_TICK_US)
+#define HOLD_COUNT_TICKS	USEC_TO_TICKS(10000) // g_MidiHoldCount is in 10ms units
+
+
+/*
+Each MIDI hit is output as a separate press (see DoMidiMapping()). In Xbox mode the external 
+output is released for MIDI_RELEASE_GAP_US before the next queued hit on the same channel,
+with USB the release just has to show up in one report. Queued hits older than 
+MIDI_HIT_MAX_AGE millisecs are discarded.
+*/
+#if defined(XBOX_RB2_INTERFACE)
+	#define MIDI_RELEASE_GAP_US		2048
+#else
+	#define MIDI_RELEASE_GAP_US		10000 // RB1 interface needs about one poll period
+#endif
+
+#define MIDI_HIT_MAX_AGE		200
 
 #define VELOCITY_INCREMENT	20
 
+// same as Velocity / VELOCITY_INCREMENT for 0-255, but without a divide
+#define VELOCITY_LEVEL(Velocity)	((UINT8)(((UINT16)(Velocity) * 205) >> 12))
+
 // Mode switch positions - don't change values, as these correspond to switch positions on the MR
 #define MODE_PROG_VELOCITY 	0  	// velocity program mode
 #define MODE_PROG_MAP 		1	// map program mode
@@ -74,7 +104,7 @@ This is the core part of the code which emulates the drum controller.
 	BYTE g_HostCmdResponseX, g_HostCmdResponseY, g_HostCmdResponseZ;
 #endif
 
-BYTE g_MidiHoldCount;
+BYTE g_MidiHoldCount; // how long a note output is held on, in 10ms units
 
 #ifdef MAP_SWAP_NOTE
 	UINT8 g_MidiSwapNote = INVALID_NOTE_NUMBER; // note for swapping maps
@@ -84,6 +114,8 @@ BYTE g_SystemMode; // Xbox, PS, or Wii
 
 BYTE g_GameMode = gmROCK_BAND; // Game Mode: Rock Band or Guitar Hero 
 
+BYTE g_UsbPollInterval = USB_POLL_INTERVAL_CONSOLE; // HID endpoint poll interval (ms)
+
 #if !defined(MR_LX)
 	BYTE g_AdjustKnobPos;
 	BYTE g_Dummy;
@@ -106,14 +138,113 @@ static BYTE m_bNavButtonFlags;
 #endif
 
 static INT8 m_MidiChannelToProgram = -1;
-static BYTE m_MidiHoldCounts[MIDI_CHANNEL_COUNT] = 
-{ 
-	0, 0, 0, 0, 
-	0, 0, 0, 0
-};
+static UINT8 m_MidiVelocities[MIDI_CHANNEL_COUNT]; // velocity of the hit being output
+static UINT8 m_OutputReleased = 0xFF; // channels that have been reported as released
+
+/*
+Output timer data. Each channel is busy while its output is pressed and then for the 
+release gap after that. The bit masks have 1 bit per channel (bit 0 = channel 0). Only
+StartOutput() and ReadOutputs() change these outside of the ISR, with the ISR disabled.
+*/
+static volatile UINT16 m_OutputTicks[MIDI_CHANNEL_COUNT];	 // ticks left in the press or gap
+static volatile UINT16 m_OutputGapTicks[MIDI_CHANNEL_COUNT]; // release gap after the press
+static volatile UINT8 m_OutputActive = 0;	// channels that are pressed
+static volatile UINT8 m_OutputBusy = 0;		// channels that are pressed or in the release gap
+static volatile UINT8 m_OutputLatch = 0;	// channels pressed since the last ReadOutputs()
+
+#if defined(PERF_STATS)
+	static UINT16 m_ChannelPresses[MIDI_CHANNEL_COUNT]; // outputs started, for dcGET_CHANNEL_STATS
+#endif
+
+#if defined(LX_EXT_OUTS)
+	static volatile UINT8 m_ExtButtonMask = 0; // external outputs activated by the buttons
+	static UINT8 m_ExtOutputState = 0;		   // what was last written to the external outputs
+#endif
+
+#if defined(MR_LX)
+	static UINT16 m_ChannelLeds = 0; // channels whose LEDs are on (see WriteChannelLeds())
+#endif
+
+volatile UINT16 g_MsTickCount = 0; // free running millisec counter
+volatile UINT8 g_TickCount = 0;	   // free running output timer tick counter (OUTPUT_TICK_US)
+BOOL g_NewHitInReport = FALSE;	   // a press was started since the last report was sent
 
 static UINT16 m_ChannelOutputFlags = 0;
 
+/*
+Input report data. The report is built in m_ReportNext each time, and CommitInputReport()
+copies just the field groups that changed over to the USB buffer (hid_report_in, or the
+other ping-pong buffer). If nothing changed, there's no need to send a report at all.
+*/
+#define rfBUTTONS	0x01	// bytes 0-2: button flags and hat switch
+#define rfAXES		0x02	// bytes 3-6: axes (host command responses)
+#define rfVELOCITY	0x04	// bytes 7-16: drum/cymbal velocities
+#define rfSTATUS	0x08	// bytes 17-26
+#define rfALL		0x0F
+
+static UINT8 m_ReportNext[HID_INT_IN_EP_SIZE]; // big enough for the data log too
+static UINT8 m_ReportDirty = rfALL; // field groups to send even if they look the same
+static UINT8 m_ReportGameMode = 0xFF; // game mode the constant part of m_ReportNext was set up for
+
+/*
+Velocity curves (see SetVelocityCurve). Each one maps the MIDI note velocity (0-127) to the
+velocity that is reported, and is never 0 for a non-zero velocity.
+*/
+static ROM UINT8 VELOCITY_CURVES[VELOCITY_CURVE_COUNT][128] =
+{
+	{	// vcLINEAR
+		  0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,
+		 16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,  30,  31,
+		 32,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,
+		 48,  49,  50,  51,  52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,
+		 64,  65,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,  77,  78,  79,
+		 80,  81,  82,  83,  84,  85,  86,  87,  88,  89,  90,  91,  92,  93,  94,  95,
+		 96,  97,  98,  99, 100, 101, 102, 103, 104, 105, 106, 107, 108, 109, 110, 111,
+		112, 113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127
+	},
+	{	// vcLOG - soft hits come out louder
+		  0,   5,  10,  14,  18,  22,  25,  28,  31,  34,  36,  39,  41,  43,  45,  47,
+		 49,  51,  53,  55,  56,  58,  59,  61,  62,  64,  65,  66,  68,  69,  70,  71,
+		 72,  73,  75,  76,  77,  78,  79,  80,  81,  81,  82,  83,  84,  85,  86,  87,
+		 87,  88,  89,  90,  91,  91,  92,  93,  93,  94,  95,  96,  96,  97,  97,  98,
+		 99,  99, 100, 101, 101, 102, 102, 103, 103, 104, 105, 105, 106, 106, 107, 107,
+		108, 108, 109, 109, 110, 110, 111, 111, 112, 112, 113, 113, 114, 114, 114, 115,
+		115, 116, 116, 117, 117, 117, 118, 118, 119, 119, 119, 120, 120, 121, 121, 121,
+		122, 122, 122, 123, 123, 124, 124, 124, 125, 125, 125, 126, 126, 126, 127, 127
+	},
+	{	// vcEXP - soft hits come out softer
+		  0,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   3,   3,
+		  3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,   7,   7,   7,
+		  8,   8,   8,   9,   9,   9,  10,  10,  10,  11,  11,  12,  12,  13,  13,  14,
+		 14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  20,  20,  21,  21,  22,  23,
+		 24,  24,  25,  26,  27,  27,  28,  29,  30,  31,  32,  32,  33,  34,  35,  36,
+		 37,  38,  40,  41,  42,  43,  44,  45,  47,  48,  49,  50,  52,  53,  55,  56,
+		 58,  59,  61,  62,  64,  66,  67,  69,  71,  73,  75,  77,  79,  81,  83,  85,
+		 87,  89,  92,  94,  96,  99, 101, 104, 107, 109, 112, 115, 118, 121, 124, 127
+	},
+	{	// vcCOMPRESSED - 40 to 127
+		  0,  41,  41,  42,  43,  43,  44,  45,  45,  46,  47,  48,  48,  49,  50,  50,
+		 51,  52,  52,  53,  54,  54,  55,  56,  56,  57,  58,  58,  59,  60,  61,  61,
+		 62,  63,  63,  64,  65,  65,  66,  67,  67,  68,  69,  69,  70,  71,  72,  72,
+		 73,  74,  74,  75,  76,  76,  77,  78,  78,  79,  80,  80,  81,  82,  82,  83,
+		 84,  85,  85,  86,  87,  87,  88,  89,  89,  90,  91,  91,  92,  93,  93,  94,
+		 95,  95,  96,  97,  98,  98,  99, 100, 100, 101, 102, 102, 103, 104, 104, 105,
+		106, 106, 107, 108, 109, 109, 110, 111, 111, 112, 113, 113, 114, 115, 115, 116,
+		117, 117, 118, 119, 119, 120, 121, 122, 122, 123, 124, 124, 125, 126, 126, 127
+	}
+};
+
+static ROM UINT8 * m_pVelocityCurve = VELOCITY_CURVES[vcLINEAR];
+
+/*
+Report velocity byte for each MIDI velocity, with the curve and the game's scaling already 
+applied. Rebuilt by BuildVelocityTable() whenever the curve or the game mode changes.
+*/
+static UINT8 m_VelocityReport[128];
+static UINT8 m_VelocityTableMode = 0xFF; // game mode m_VelocityReport was built for
+
+#define VELOCITY_TO_REPORT(Velocity)	m_VelocityReport[(Velocity) & 0x7F]
+
 #if defined(LOG_MIDI_DATA)
 	#define DATA_LOG_SIZE HID_INT_IN_EP_SIZE
 	static BOOL m_DataLoggingIsEnabled = FALSE;
@@ -133,11 +264,56 @@ static UINT16 m_ChannelOutputFlags = 0;
 
 typedef struct
 {
-	BOOL	StateChanged, Pressed;
+	BOOL	StateChanged;
 	BYTE 	State;
-	UINT16	Count;
+	UINT16	ChangeTime; // g_MsTickCount when the debounced switch last changed
 } TButtonStatus;
 
+/*
+LED sequencer. UI feedback (blinks, flashes and values) is queued as steps that 
+UpdateLedSequence() plays from the main loop using g_MsTickCount, instead of waiting in 
+DelayMillisecs() while the MIDI input and the USB go unserviced. Each step shows its first 
+state for Time, then its second state for Time, Count times over, except that the last 
+second state is just left showing. 
+*/
+#define LED_QUEUE_SIZE	8
+
+typedef struct
+{
+	BYTE	Action; // lsXXX (see App.h)
+	BYTE	Value;
+	UINT8	Time;	// LED_STEP_MS units
+	UINT8	Count;	// times to do the step
+} TLedStep;
+
+static TLedStep m_LedSteps[LED_QUEUE_SIZE];
+static UINT8 m_LedStepHead = 0;	 // index of the step that's playing
+static UINT8 m_LedStepCount = 0; // number of steps waiting to finish
+static BYTE m_LedPhase = 0;		 // 0 = step not started, 1 = first state showing, 2 = second state
+static UINT16 m_LedPhaseTime;	 // g_MsTickCount when the phase started
+static BYTE m_LedSaved;			 // state of the lsLED/lsSWEEP LED before it was turned on
+
+// boot light show (lsSWEEP)
+#if defined(MR_LX)
+	#define BOOT_SWEEP_LENGTH 12
+	static const rom BYTE BOOT_SWEEP[BOOT_SWEEP_LENGTH] = 
+	{ 
+		lnUSB, lnCH1, lnCH2, lnCH3, lnCH4, lnCH5, lnCH6, lnALT, lnM1, lnM2, lnPROG, lnMIDI 
+	};
+#else
+	#define BOOT_SWEEP_LENGTH 11
+	static const rom BYTE BOOT_SWEEP[BOOT_SWEEP_LENGTH] = 
+	{ 
+		lnUSB, lnCH1, lnCH2, lnCH3, lnCH4, lnCH5, lnCH4, lnCH3, lnCH2, lnCH1, lnMIDI 
+	};
+#endif
+
+// one bit mask for each port, used for the output pin tables
+typedef struct
+{
+	BYTE A, B, C, D;
+} TPortMasks;
+
 // number of entries in the button state machine (1 for each user interface button)
 #if defined(MR_LX)
 	#if defined(EXT_PEDAL)
@@ -155,6 +331,26 @@ typedef struct
 
 static TButtonStatus m_ButtonStatus[BUTTON_COUNT];
 
+/*
+The switches are debounced all together, as a bit vector with 1 bit per button (bit n is 
+m_ButtonStatus[n]), using a 2 bit "vertical" counter: bit n of m_ButtonCount0/1 are the 
+counter for button n. See UpdateButtonStates().
+*/
+#if (BUTTON_COUNT > 8)
+	typedef UINT16 TButtonBits;
+#else
+	typedef BYTE TButtonBits;
+#endif
+
+#define BUTTON_BIT(Index)	((TButtonBits)1 << (Index))
+
+static TButtonBits m_ButtonsDown = 0;		// debounced switch states (1 = pressed)
+static TButtonBits m_ButtonCount0 = (TButtonBits)~0;
+static TButtonBits m_ButtonCount1 = (TButtonBits)~0;
+static TButtonBits m_ButtonsTimed = 0;	// buttons waiting for a hold or release time
+static BOOL m_ButtonsChanged = FALSE;	// some StateChanged flags are set
+static UINT8 m_NextButtonTime = 0;		// g_MsTickCount for the next switch sample
+
 // indices to the button state array
 #define NAV_CENTER_INDEX	0
 #define NAV_LEFT_INDEX		1
@@ -169,26 +365,42 @@ static TButtonStatus m_ButtonStatus[BUTTON_COUNT];
 
 // LOCAL FUNCTION PROTOTYPES ====================================
 
-static void DoButtonStateMachine(BOOL Pressed, TButtonStatus * PState);
+static TButtonBits ReadButtons(void);
+static void ClearLedSequence(void);
+static void ShowErrorCode(UINT8 ErrorCode);
+static BYTE SwapLed(BYTE Led, BYTE State);
+static void ShowLedStep(TLedStep * pStep, BOOL First);
+static void UpdateLedSequence(void);
 static void DoMidiMapping(void);
 static void	DoMidiMapProgramming(void);
-static BYTE ScaleVelocity(BYTE Value); 
+static void DoPollRateSelect(void);
+static BYTE CalcSettingsCrc(void);
+static void UpdateSettingsCrc(void);
+static UINT8 HotSettingID(BYTE Address);
+static BOOL SettingIsValid(UINT8 Index, BYTE Value);
+static BYTE ReadSetting(BYTE Address);
+static void SaveSetting(BYTE Address, BYTE Value);
+static UINT8 ReadOutputs(void);
+static void BuildVelocityTable(void);
+static BYTE NextMidiMapNumber(void);
 
 #if defined(XBOX_RB2_INTERFACE)
-	static BYTE ScaleHoldCount(BYTE Channel, BYTE Velocity);
+	static UINT16 ScaleHoldCount(BYTE Channel, BYTE Velocity);
 #endif
 
 static void SelectProgramMode(INT8 ChannelNumber);
+static void StartOutput(UINT8 Channel, UINT16 PressTicks, UINT16 GapTicks);
 static void UpdateButtonStates(void);
 
 #if defined(MR_LX)
 	#define SetOutput(O, A)	SetOutput_LX(O, A)
 
 	#if defined(LX_EXT_OUTS)
-	static void SetExtOutput_LX(BYTE Output, BOOL Active);
+	static void WriteExtOutputs(void);
 	#endif
 
 	static void SetOutput_LX(BYTE Output, BOOL Active);
+	static void WriteChannelLeds(UINT16 Channels);
 #else
 	#define SetOutput(O, A)	SetOutput_MR(O, A)
 	static void SetOutput_MR(BYTE Output, BOOL Active);
@@ -230,27 +442,45 @@ void SendDataLog(void)
 	// if no data to send, just zero out the prefix byte
 	if (m_DataLogCount == 0)
 	{
-		hid_report_in[0] = 0; 
+		m_ReportNext[0] = 0; 
 		return;
 	}
 
 	// fill in log header: prefix, sequence number, and count
-	hid_report_in[0] = 0xBA; // prefix
+	m_ReportNext[0] = 0xBA; // prefix
 	++m_DataLogSequenceID; 
-	hid_report_in[1] = m_DataLogSequenceID; // sequence number
-	hid_report_in[2] = m_DataLogCount; // byte count, not including prefix
+	m_ReportNext[1] = m_DataLogSequenceID; // sequence number
+	m_ReportNext[2] = m_DataLogCount; // byte count, not including prefix
 
 	// copy data to report buffer
 	for (nIndex = 0; nIndex < m_DataLogCount; ++nIndex)
 	{
-		hid_report_in[3 + nIndex] = m_DataLog[nIndex];
+		m_ReportNext[3 + nIndex] = m_DataLog[nIndex];
 	}
 	m_DataLogCount = 0;
+	m_ReportGameMode = 0xFF; // log data is over the top of the normal report data
 }
 
 #endif  // #if defined(LOG_MIDI_DATA)
 
 
+/*
+Returns g_MsTickCount. The ISR can change it between the reads of its two bytes, so it's 
+read again until two reads match. Reading just the low byte doesn't need this.
+*/
+UINT16 ReadMsTick(void)
+{
+	UINT16 nTick;
+
+	do
+	{
+		nTick = g_MsTickCount;
+	} while (nTick != g_MsTickCount);
+
+	return nTick;
+}
+
+
 void Delay10Microsecs(UINT16 Count)
 {
 	/*
@@ -307,6 +537,33 @@ void DisplayValue(UINT8 Value)
 }
 
 
+/*
+PS3 mode is also used with a PC, where a faster USB poll rate is better. Hold UP at power 
+on to switch to 1ms polling, or DOWN to go back to the console rate. The setting is saved.
+*/
+static void DoPollRateSelect(void)
+{
+	BYTE nPollRate;
+
+	nPollRate = ReadEEData(EEADDR_POLL_RATE);
+	if (nPollRate > POLL_RATE_FAST)
+		nPollRate = POLL_RATE_CONSOLE; 
+
+	if ((swNAV_UP == SW_PRESSED) && (nPollRate != POLL_RATE_FAST))
+	{
+		nPollRate = POLL_RATE_FAST;
+		SaveSetting(EEADDR_POLL_RATE, nPollRate);
+	}
+	else if ((swNAV_DOWN == SW_PRESSED) && (nPollRate != POLL_RATE_CONSOLE))
+	{
+		nPollRate = POLL_RATE_CONSOLE;
+		SaveSetting(EEADDR_POLL_RATE, nPollRate);
+	}
+
+	SetPollRate(nPollRate);
+}
+
+
 #if defined(MR_LX)
 /*
 Figure out what operating mode to use
@@ -322,7 +579,7 @@ BYTE DoBootModeSelect_LX(void)
 	g_SystemMode = SYS_MODE_WII;	
 	
 	// get default game mode
-	g_GameMode = ReadEEData(EEADDR_GAME_MODE);
+	g_GameMode = ReadSetting(EEADDR_GAME_MODE);
 
 	// make sure g_GameMode is valid 
 	if (g_GameMode > gmGUITAR_HERO)
@@ -332,13 +589,13 @@ BYTE DoBootModeSelect_LX(void)
 	if ((swNAV_RIGHT == SW_PRESSED) && (g_GameMode != gmGUITAR_HERO))
 	{
 		g_GameMode = gmGUITAR_HERO;
-		WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+		SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 	}
 	else if ((swNAV_LEFT == SW_PRESSED) && (g_GameMode != gmROCK_BAND))
 	{
 		g_SystemMode = SYS_MODE_WII; 
 		g_GameMode = gmROCK_BAND;
-		WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+		SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 	}
 	
 	// hold down BACK button to put LX into Xbox mode to disable USB 
@@ -358,7 +615,7 @@ BYTE DoBootModeSelect_LX(void)
 	g_SystemMode = SYS_MODE_XBOX; 
 
 	// get default game mode
-	g_GameMode = ReadEEData(EEADDR_GAME_MODE);
+	g_GameMode = ReadSetting(EEADDR_GAME_MODE);
 	if (g_GameMode > gmGUITAR_HERO)
 		g_GameMode = gmROCK_BAND; 
 
@@ -366,12 +623,12 @@ BYTE DoBootModeSelect_LX(void)
 	if ((swNAV_RIGHT == SW_PRESSED) && (g_GameMode != gmGUITAR_HERO))
 	{
 		g_GameMode = gmGUITAR_HERO;
-		WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+		SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 	}
 	else if ((swNAV_LEFT == SW_PRESSED) && (g_GameMode != gmROCK_BAND))
 	{
 		g_GameMode = gmROCK_BAND;
-		WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+		SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 	}
 	
 	// hold down BACK button to put LX into PS3 mode for PC operation
@@ -406,7 +663,7 @@ BYTE DoBootModeSelect_LX(void)
 	else if (g_SystemMode == SYS_MODE_PS3)
 	{	
 		// get default game mode
-		g_GameMode = ReadEEData(EEADDR_GAME_MODE);
+		g_GameMode = ReadSetting(EEADDR_GAME_MODE);
 	
 		// set game mode depending on what buttons are pressed
 		if (g_GameMode > gmGUITAR_HERO)
@@ -416,12 +673,12 @@ BYTE DoBootModeSelect_LX(void)
 		if ((swNAV_RIGHT == SW_PRESSED) && (g_GameMode != gmGUITAR_HERO))
 		{
 			g_GameMode = gmGUITAR_HERO;
-			WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+			SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 		}
 		else if ((swNAV_LEFT == SW_PRESSED) && (g_GameMode != gmROCK_BAND))
 		{
 			g_GameMode = gmROCK_BAND;
-			WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+			SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 		}
 	}
 	else
@@ -431,6 +688,9 @@ BYTE DoBootModeSelect_LX(void)
 	}
 	
 #endif
+
+	if (g_SystemMode == SYS_MODE_PS3)
+		DoPollRateSelect();
 	
 	return g_SystemMode;
 } // DoBootModeSelect()
@@ -495,7 +755,7 @@ BYTE DoBootModeSelect_MR(void)
 	else if (g_SystemMode == SYS_MODE_PS3)
 	{
 		// get default game mode
-		g_GameMode = ReadEEData(EEADDR_GAME_MODE);
+		g_GameMode = ReadSetting(EEADDR_GAME_MODE);
 	
 		// set game mode depending on what buttons are pressed
 		if (g_GameMode > gmGUITAR_HERO)
@@ -504,12 +764,12 @@ BYTE DoBootModeSelect_MR(void)
 		if ((swNAV_RIGHT == SW_PRESSED) && (g_GameMode != gmGUITAR_HERO))
 		{
 			g_GameMode = gmGUITAR_HERO;
-			WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+			SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 		}
 		else if ((swNAV_LEFT == SW_PRESSED) && (g_GameMode != gmROCK_BAND))
 		{
 			g_GameMode = gmROCK_BAND;
-			WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+			SaveSetting(EEADDR_GAME_MODE, g_GameMode);
 		}
 	}
 	else 
@@ -518,6 +778,9 @@ BYTE DoBootModeSelect_MR(void)
 		g_GameMode = gmROCK_BAND; 
 	}
 
+	if (g_SystemMode == SYS_MODE_PS3)
+		DoPollRateSelect();
+
 	return g_SystemMode;
 } // DoBootModeSelect()
 
@@ -525,88 +788,103 @@ BYTE DoBootModeSelect_MR(void)
 
 static void DoMidiMapping(void)
 {
-	int nMidiInput;
+	UINT8 nChannel, nMask, nOutputs;
+	UINT16 nGapTicks;
+
+	// the release gap is only needed for the external outputs
+	if (g_SystemMode == SYS_MODE_XBOX)
+		nGapTicks = USEC_TO_TICKS(MIDI_RELEASE_GAP_US);
+	else
+		nGapTicks = 0;
 
 	/*
-	The MIDI input service routine will set a channel output when a note is recieved, so here
-	we check if any MIDI notes have been received and reset the hold count. 
+	The MIDI input service routine queues a hit for a channel when a note is received. Once the
+	output timer is done with the channel's last press (and the release gap after it), we take
+	the next hit from the queue and start a new press. With USB, the release also has to have 
+	gone out in a report first, otherwise the host would see two hits as one long press.
 	*/
-	for (nMidiInput = 0; nMidiInput < MIDI_CHANNEL_COUNT; ++nMidiInput)
+	nMask = 0x01;
+	for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel, nMask <<= 1)
 	{
-		if (g_MidiChannelOutputs[nMidiInput])
+		if (m_OutputBusy & nMask)
+			continue; 
+
+		if ((g_SystemMode != SYS_MODE_XBOX) && !(m_OutputReleased & nMask))
+			continue;
+
+		if (GetMidiHit(nChannel, MIDI_HIT_MAX_AGE, &m_MidiVelocities[nChannel]))
 		{
 			#if defined(XBOX_RB2_INTERFACE)
 				/*
-				For the Xbox RB2 interface, the note hold count depends on the MIDI note velocity --
+				For the Xbox RB2 interface, the note hold time depends on the MIDI note velocity --
 				this way, the output pulse width varies as a function of the note velocity.
 				*/
 				if (g_SystemMode == SYS_MODE_XBOX)
 				{
-					m_MidiHoldCounts[nMidiInput] = ScaleHoldCount(nMidiInput, g_MidiChannelVelocity[nMidiInput]);
+					StartOutput(nChannel, ScaleHoldCount(nChannel, m_MidiVelocities[nChannel]), nGapTicks);
 				}
 				else
 			#endif
-					m_MidiHoldCounts[nMidiInput] = g_MidiHoldCount;
+					StartOutput(nChannel, g_MidiHoldCount * HOLD_COUNT_TICKS, nGapTicks);
 
+			m_OutputReleased &= ~nMask;
+			g_NewHitInReport = TRUE;
 		}
 	}
 
+	nOutputs = ReadOutputs(); // channels pressed now, or since the last time
+	m_OutputReleased |= ~nOutputs;
+
 	/*
-	In drum mode, a midi note ON is used to activate a "midi channel output" and set 
-	the hold count for that channel (see above). So next we check the hold count of all
-	the channels and if it is > 0, we activate the corresponding drum output. This way,
+	In drum mode, a midi note ON is used to activate a "midi channel output" and start
+	the output timer for that channel (see above). So next we check which channels
+	the timer has active, and activate the corresponding drum output. This way,
 	each drum activation lasts for just a certain amount of time (determined by the 
-	g_MidiHoldCount value), rather than waiting for the note OFF.
+	g_MidiHoldCount value), rather than waiting for the note OFF. The output timer turns
+	the channel off again when the time is up.
 
-	The MIDI note velocity is stored in g_MidiChannelVelocity by the MIDI input service routine.
+	The MIDI note velocity of the hit being output is in m_MidiVelocities.
 	*/
 
-	ClearMidiOutputs(); // reset all the g_MidiChannelOutputs[] flags
-
-	if (m_MidiHoldCounts[0] > 0)
+	if (nOutputs & 0x01)
 	{
-		--m_MidiHoldCounts[0];
 		m_ChannelOutputFlags |= ofRED_PAD;
 
 		// set the velocity for this channel
-		hid_report_in[12] = ScaleVelocity(g_MidiChannelVelocity[0]);
+		m_ReportNext[12] = VELOCITY_TO_REPORT(m_MidiVelocities[0]);
 	}
 
-	if (m_MidiHoldCounts[1] > 0)
+	if (nOutputs & 0x02)
 	{
-		--m_MidiHoldCounts[1];
 		m_ChannelOutputFlags |= ofYELLOW_PAD;
 
 		// set the velocity for this channel
-		hid_report_in[11] = ScaleVelocity(g_MidiChannelVelocity[1]);
+		m_ReportNext[11] = VELOCITY_TO_REPORT(m_MidiVelocities[1]);
 	}	
 
-	if (m_MidiHoldCounts[2] > 0)
+	if (nOutputs & 0x04)
 	{
-		--m_MidiHoldCounts[2];
 		m_ChannelOutputFlags |= ofBLUE_PAD;
 
 		// set the velocity for this channel
-		hid_report_in[14] = ScaleVelocity(g_MidiChannelVelocity[2]);
+		m_ReportNext[14] = VELOCITY_TO_REPORT(m_MidiVelocities[2]);
 	}
 
-	if (m_MidiHoldCounts[3] > 0)
+	if (nOutputs & 0x08)
 	{
-		--m_MidiHoldCounts[3];
 		m_ChannelOutputFlags |= ofGREEN_PAD;
 
 		// set the velocity for this channel
-		hid_report_in[13] = ScaleVelocity(g_MidiChannelVelocity[3]);
+		m_ReportNext[13] = VELOCITY_TO_REPORT(m_MidiVelocities[3]);
 	}
 
-	if (m_MidiHoldCounts[4] > 0)
+	if (nOutputs & 0x10)
 	{
-		--m_MidiHoldCounts[4];
 		m_ChannelOutputFlags |= ofPEDAL1;
 
 		// set the velocity for this channel (guitar hero only)
 		if (g_GameMode == gmGUITAR_HERO)
-			hid_report_in[15] = ScaleVelocity(g_MidiChannelVelocity[3]);
+			m_ReportNext[15] = VELOCITY_TO_REPORT(m_MidiVelocities[3]);
 	}
 	
 #if defined(USE_HIHAT_THRESHOLD)
@@ -623,42 +901,38 @@ static void DoMidiMapping(void)
 	
 	if (g_GameMode == gmGUITAR_HERO)
 	{
-		if (m_MidiHoldCounts[5] > 0)
+		if (nOutputs & 0x20)
 		{
-			--m_MidiHoldCounts[5];
 			m_ChannelOutputFlags |= ofORANGE_CYMBAL;
 	
 			// set the velocity for this channel
-			hid_report_in[16] = ScaleVelocity(g_MidiChannelVelocity[5]);
+			m_ReportNext[16] = VELOCITY_TO_REPORT(m_MidiVelocities[5]);
 		}
 	}
 	else // ROCK BAND cymbals
 	{
-		if (m_MidiHoldCounts[5] > 0)
+		if (nOutputs & 0x20)
 		{
-			--m_MidiHoldCounts[5];
 			m_ChannelOutputFlags |= ofYELLOW_CYMBAL;
 			
 			// set the velocity for this channel
-			hid_report_in[11] = ScaleVelocity(g_MidiChannelVelocity[5]);
+			m_ReportNext[11] = VELOCITY_TO_REPORT(m_MidiVelocities[5]);
 		}
 		
-		if (m_MidiHoldCounts[6] > 0)
+		if (nOutputs & 0x40)
 		{
-			--m_MidiHoldCounts[6];
 			m_ChannelOutputFlags |= ofBLUE_CYMBAL;
 	
 			// set the velocity for this channel
-			hid_report_in[14] = ScaleVelocity(g_MidiChannelVelocity[6]);
+			m_ReportNext[14] = VELOCITY_TO_REPORT(m_MidiVelocities[6]);
 		}	
 		
-		if (m_MidiHoldCounts[7] > 0)
+		if (nOutputs & 0x80)
 		{
-			--m_MidiHoldCounts[7];
 			m_ChannelOutputFlags |= ofGREEN_CYMBAL;
 	
 			// set the velocity for this channel
-			hid_report_in[13] = ScaleVelocity(g_MidiChannelVelocity[7]);
+			m_ReportNext[13] = VELOCITY_TO_REPORT(m_MidiVelocities[7]);
 		}	
 	}
 } // DoMidiMapping()
@@ -682,27 +956,21 @@ static void	DoMidiMapProgramming(void)
 			; // TO DO: add some sort of error indication
 		else if (nNoteCount == 0) // duplicate note
 			; // do nothing
-		else 
+		else if (GetMidiMapNoteCount() < MIDI_MAP_MAX_NOTES)
+		{
+			// toggle the LED off/on
+			QueueLedStep(lsCHANNEL, m_MidiChannelToProgram, LED_MS(300), 1);
+		}
+		else // map is full
 		{
-			// toggle the LED off/on/off
-			SetOutput(m_MidiChannelToProgram, FALSE);
-			DelayMillisecs(300);
-			SetOutput(m_MidiChannelToProgram, TRUE);
-
-			if (nNoteCount >= NOTES_PER_CHANNEL)
-			{
 #if defined(MR_LX)
-				ledPROG = LED_OUTPUT_OFF;
-				DelayMillisecs(300);
-				ledPROG = LED_OUTPUT_ON;
+			// toggle the LED off/on, then the PROG LED
+			QueueLedStep(lsCHANNEL, m_MidiChannelToProgram, LED_MS(300), 1);
+			QueueLedStep(lsPROG, 0, LED_MS(300), 1);
 #else
-				// toggle the LED off/on/off
-				DelayMillisecs(300);
-				SetOutput(m_MidiChannelToProgram, FALSE);
-				DelayMillisecs(300);
-				SetOutput(m_MidiChannelToProgram, TRUE);
+			// toggle the LED off/on twice
+			QueueLedStep(lsCHANNEL, m_MidiChannelToProgram, LED_MS(300), 2);
 #endif
-			}
 		}
 
 		g_MidiOnNote = INVALID_NOTE_NUMBER; // reset note so it doesn't get programmed twice!
@@ -711,23 +979,198 @@ static void	DoMidiMapProgramming(void)
 
 
 
+/*
+Show an error code on the LEDs, in binary. Unless Halt is set, the LED sequencer shows it 
+so nothing has to wait. If Halt is set, then the code is flashed forever.
+*/
 void ErrorMessage(UINT8 ErrorCode, BOOL Halt)
 {
-	do
+	if (!Halt)
+	{
+		QueueLedStep(lsERROR, ErrorCode, LED_MS(1000), 1);
+		return;
+	}
+
+	while (TRUE)
 	{
-		ledCH1 = !(ErrorCode & 0x01);
-		ledCH2 = !(ErrorCode & 0x02);
-		ledCH3 = !(ErrorCode & 0x04);
-		ledCH4 = !(ErrorCode & 0x08);
-		ledCH5 = !(ErrorCode & 0x10);
+		ShowErrorCode(ErrorCode);
 		DelayMillisecs(1000);
-		ledCH1 = LED_OUTPUT_OFF;
-		ledCH2 = LED_OUTPUT_OFF;
-		ledCH3 = LED_OUTPUT_OFF;
-		ledCH4 = LED_OUTPUT_OFF;
-		ledCH5 = LED_OUTPUT_OFF;
+		ShowErrorCode(0);
 		DelayMillisecs(500);
-	} while (Halt);	
+	}
+}
+
+
+static void ShowErrorCode(UINT8 ErrorCode)
+{
+	ledCH1 = !(ErrorCode & 0x01);
+	ledCH2 = !(ErrorCode & 0x02);
+	ledCH3 = !(ErrorCode & 0x04);
+	ledCH4 = !(ErrorCode & 0x08);
+	ledCH5 = !(ErrorCode & 0x10);
+}
+
+
+/*
+Add a step to the LED sequence (see TLedStep). Time is in LED_STEP_MS units (use LED_MS()).
+If the queue is full, the step is just dropped.
+*/
+void QueueLedStep(BYTE Action, BYTE Value, UINT8 Time, UINT8 Count)
+{
+	TLedStep * pStep;
+
+	if (m_LedStepCount >= LED_QUEUE_SIZE)
+		return;
+
+	pStep = &m_LedSteps[(m_LedStepHead + m_LedStepCount) % LED_QUEUE_SIZE];
+	pStep->Action = Action;
+	pStep->Value = Value;
+	pStep->Time = Time;
+	pStep->Count = (Count != 0) ? Count : 1;
+
+	++m_LedStepCount;
+}
+
+
+/*
+Stop the LED sequence, and throw away the steps that haven't been done. The LEDs are left as
+they are.
+*/
+static void ClearLedSequence(void)
+{
+	m_LedStepCount = 0;
+	m_LedPhase = 0;
+}
+
+
+/*
+Returns TRUE while a LED sequence is playing. The code that shows the state of the outputs 
+on the LEDs every pass leaves them alone until it's done.
+*/
+BOOL LedSequenceBusy(void)
+{
+	return (m_LedStepCount != 0);
+}
+
+
+/*
+Set LED number Led (lnXXX) to State (LED_OUTPUT_ON/OFF), and return the state it was in.
+*/
+static BYTE SwapLed(BYTE Led, BYTE State)
+{
+	BYTE nOldState;
+
+	nOldState = LED_OUTPUT_OFF;
+
+	switch (Led)
+	{
+		case lnCH1:		nOldState = ledCH1;		ledCH1 = State;		break;
+		case lnCH2:		nOldState = ledCH2;		ledCH2 = State;		break;
+		case lnCH3:		nOldState = ledCH3;		ledCH3 = State;		break;
+		case lnCH4:		nOldState = ledCH4;		ledCH4 = State;		break;
+		case lnCH5:		nOldState = ledCH5;		ledCH5 = State;		break;
+		case lnUSB:		nOldState = ledUSB;		ledUSB = State;		break;
+		case lnMIDI:	nOldState = ledMIDI;	ledMIDI = State;	break;
+	#if defined(MR_LX)
+		case lnCH6:		nOldState = ledCH6;		ledCH6 = State;		break;
+		case lnALT:		nOldState = ledALT;		ledALT = State;		break;
+		case lnM1:		nOldState = ledM1;		ledM1 = State;		break;
+		case lnM2:		nOldState = ledM2;		ledM2 = State;		break;
+		case lnPROG:	nOldState = ledPROG;	ledPROG = State;	break;
+	#endif
+	}
+
+	return nOldState;
+}
+
+
+/*
+Shows the first or second state of a LED sequence step.
+*/
+static void ShowLedStep(TLedStep * pStep, BOOL First)
+{
+	BYTE nLed;
+
+	switch (pStep->Action)
+	{
+		case lsCHANNEL:
+			SetOutput(pStep->Value, !First);
+			break;
+
+	#if defined(MR_LX)
+		case lsPROG:
+			ledPROG = First ? LED_OUTPUT_OFF : LED_OUTPUT_ON;
+			break;
+
+		case lsBAR_PROG:
+			ledPROG = First ? LED_OUTPUT_OFF : LED_OUTPUT_ON;
+			DisplayValue(First ? pStep->Value : 0);
+			break;
+	#endif
+
+		case lsBAR:
+			DisplayValue(First ? pStep->Value : 0);
+			break;
+
+		case lsERROR:
+			ShowErrorCode(First ? pStep->Value : 0);
+			break;
+
+		case lsLED:
+		case lsSWEEP:
+			if (pStep->Action == lsSWEEP)
+				nLed = BOOT_SWEEP[BOOT_SWEEP_LENGTH - pStep->Count]; // Count goes down for each LED
+			else
+				nLed = pStep->Value;
+
+			if (First)
+				m_LedSaved = SwapLed(nLed, LED_OUTPUT_ON);
+			else
+				SwapLed(nLed, m_LedSaved);
+			break;
+	}
+}
+
+
+/*
+Plays the LED sequence, call this every pass of the main loop.
+*/
+static void UpdateLedSequence(void)
+{
+	TLedStep * pStep;
+	UINT16 nNow;
+
+	if (m_LedStepCount == 0)
+		return;
+
+	pStep = &m_LedSteps[m_LedStepHead];
+	nNow = ReadMsTick();
+
+	if ((m_LedPhase != 0) && ((UINT16)(nNow - m_LedPhaseTime) < (UINT16)pStep->Time * LED_STEP_MS))
+		return; // not done with this state yet
+
+	if (m_LedPhase == 1)
+	{
+		ShowLedStep(pStep, FALSE);
+
+		if (--pStep->Count == 0)
+		{
+			// step is done, leave the second state showing
+			m_LedStepHead = (m_LedStepHead + 1) % LED_QUEUE_SIZE;
+			--m_LedStepCount;
+			m_LedPhase = 0;
+			return;
+		}
+
+		m_LedPhase = 2;
+	}
+	else
+	{
+		ShowLedStep(pStep, TRUE);
+		m_LedPhase = 1;
+	}
+
+	m_LedPhaseTime = nNow;
 }
 
 
@@ -741,10 +1184,16 @@ void InitButtonStates(void)
 
 	for (nIndex = 0; nIndex < BUTTON_COUNT; ++nIndex)
 	{
-		m_ButtonStatus[nIndex].Pressed = FALSE;
+		m_ButtonStatus[nIndex].StateChanged = FALSE;
 		m_ButtonStatus[nIndex].State = bsUP;
-		m_ButtonStatus[nIndex].Count = 0;
+		m_ButtonStatus[nIndex].ChangeTime = 0;
 	}
+
+	m_ButtonsDown = 0;
+	m_ButtonCount0 = (TButtonBits)~0;
+	m_ButtonCount1 = (TButtonBits)~0;
+	m_ButtonsTimed = 0;
+	m_ButtonsChanged = FALSE;
 }
 
 
@@ -752,7 +1201,7 @@ void InitButtonStates(void)
 Initialize all the I/O pins and registers for the MIDI Rocker
 */
 
-#define LED_DELAY 150
+#define LED_DELAY 150 // time for each LED of the boot light show (on, then off)
 
 #if defined(MR_LX)
 void InitIO_LX(void)
@@ -889,92 +1338,26 @@ void InitIO_LX(void)
 	TRISE |= 0b00000111; // bits 210 are inputs
 
 	/*
-	Put on a little light show...
+	Put on a little light show... it's played by the LED sequencer from the main loop, so it 
+	doesn't hold up the MIDI and USB startup.
 	*/
-	ledUSB = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledUSB = LED_OUTPUT_OFF;
-
-	ledCH1 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH1 = LED_OUTPUT_OFF;
-
-	ledCH2 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH2 = LED_OUTPUT_OFF;
-
-	ledCH3 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH3 = LED_OUTPUT_OFF;
-
-	ledCH4 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH4 = LED_OUTPUT_OFF;
-
-	ledCH5 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH5 = LED_OUTPUT_OFF;
-
-	ledCH6 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH6 = LED_OUTPUT_OFF;
-
-	ledALT = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledALT = LED_OUTPUT_OFF;
-
-	ledM1 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledM1 = LED_OUTPUT_OFF;
-
-	ledM2 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledM2 = LED_OUTPUT_OFF;
-
-	ledPROG = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledPROG = LED_OUTPUT_OFF;
-
-	ledMIDI = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledMIDI = LED_OUTPUT_OFF;
+	QueueLedStep(lsSWEEP, 0, LED_MS(LED_DELAY / 2), BOOT_SWEEP_LENGTH);
 
 	#if 0 // defined(LX_EXT_OUTS) 
 	// test aux outputs
 	// while (1)
 	{
-		SetExtOutput_LX(0, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(0, FALSE);
-
-		SetExtOutput_LX(1, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(1, FALSE);
-
-		SetExtOutput_LX(2, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(2, FALSE);
-
-		SetExtOutput_LX(3, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(3, FALSE);
-
-		SetExtOutput_LX(4, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(4, FALSE);
-
-		SetExtOutput_LX(5, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(5, FALSE);
-
-		SetExtOutput_LX(6, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(6, FALSE);
+		UINT8 nOutput;
 
-		SetExtOutput_LX(7, TRUE);
-		DelayMillisecs(500);
-		SetExtOutput_LX(7, FALSE);
+		for (nOutput = 0; nOutput < 8; ++nOutput)
+		{
+			m_ExtButtonMask = 1 << nOutput;
+			WriteExtOutputs();
+			DelayMillisecs(500);
+		}
 
+		m_ExtButtonMask = 0;
+		WriteExtOutputs();
 	}
 	#endif
 
@@ -1066,50 +1449,10 @@ void InitIO_MR(void)
 	outEXT7 = 0;
 
 	/*
-	Put on a little light show...
+	Put on a little light show... it's played by the LED sequencer from the main loop, so it 
+	doesn't hold up the MIDI and USB startup.
 	*/
-
-	ledUSB = LED_OUTPUT_ON;
-	ledMIDI = LED_OUTPUT_ON;
-
-	ledCH1 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH1 = LED_OUTPUT_OFF;
-
-	ledCH2 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH2 = LED_OUTPUT_OFF;
-
-	ledCH3 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH3 = LED_OUTPUT_OFF;
-
-	ledCH4 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH4 = LED_OUTPUT_OFF;
-
-	ledCH5 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH5 = LED_OUTPUT_OFF;
-
-	ledCH4 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH4 = LED_OUTPUT_OFF;
-
-	ledCH3 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH3 = LED_OUTPUT_OFF;
-
-	ledCH2 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH2 = LED_OUTPUT_OFF;
-
-	ledCH1 = LED_OUTPUT_ON;
-	DelayMillisecs(LED_DELAY);
-	ledCH1 = LED_OUTPUT_OFF;
-
-	ledUSB = LED_OUTPUT_OFF;
-	ledMIDI = LED_OUTPUT_OFF;
+	QueueLedStep(lsSWEEP, 0, LED_MS(LED_DELAY / 2), BOOT_SWEEP_LENGTH);
 
 	#if 0 // test aux outputs
 	while (1)
@@ -1128,60 +1471,180 @@ void InitIO_MR(void)
 
 
 /*
-Set the HID report data to default values
+Setup the output timer interrupt. Timer1 is reset by the CCP1 special event trigger, so it
+interrupts every OUTPUT_TICK_US without any jitter from reloading the timer. This is a low 
+priority interrupt, the MIDI UART has the high priority one.
 */
-void InitReportData(void)
+void InitOutputTimer(void)
 {
-	// Fill in HID report data with default values
-	hid_report_in[0] = 0; 	// Button States (button 1 to 8) 
-	hid_report_in[1] = 0;	// Button States (buttons 9 to 13)
-	hid_report_in[2] = joyHAT_CENTER;	// hat switch position
-	hid_report_in[3] = joyAXIS_CENTER;  // X axis
-	hid_report_in[4] = joyAXIS_CENTER;	// Y axis
-	hid_report_in[5] = joyAXIS_CENTER;	// Z axis
-	hid_report_in[6] = joyAXIS_CENTER;	// Rz axis
-	hid_report_in[7] = 0;
-	hid_report_in[8] = 0;
-	hid_report_in[9] = 0;
-	hid_report_in[10] = 0;
-	hid_report_in[11] = 0;	
-	hid_report_in[12] = 0;	
-	hid_report_in[13] = 0;	
-	hid_report_in[14] = 0;	
-	hid_report_in[15] = 0;
-	hid_report_in[16] = 0;
+	T1CON = 0x80;		// RD16 (16 bit read/write), 1:1 prescale, internal clock, timer off
+	TMR1H = 0;
+	TMR1L = 0;
 
-	if (g_GameMode == gmGUITAR_HERO)
-	{
-		hid_report_in[17] = 0;
-		hid_report_in[18] = 0;
-		hid_report_in[19] = 0;
-		hid_report_in[20] = 0;
-		hid_report_in[21] = 0;
-		hid_report_in[22] = 0;
-		hid_report_in[23] = 0;
-		hid_report_in[24] = 0;
-		hid_report_in[25] = 0;
-		hid_report_in[26] = 2;
-	}
-	else // ROCK BAND
-	{
-		hid_report_in[17] = 0;
-		hid_report_in[18] = 0;
-		hid_report_in[19] = 2;
-		hid_report_in[20] = 0;
-		hid_report_in[21] = 2;
-		hid_report_in[22] = 0;
-		hid_report_in[23] = 2;
-		hid_report_in[24] = 0;
-		hid_report_in[25] = 2;
-		hid_report_in[26] = 0;
-	}
-} // InitReportData()
+	// instruction clocks per tick (CPU is running at 48Mhz, so 12 instructions per usec)
+	CCPR1H = (BYTE)((OUTPUT_TICK_US * 12) >> 8);
+	CCPR1L = (BYTE)(OUTPUT_TICK_US * 12);
+	CCP1CON = 0x0B;		// compare mode, special event trigger (resets Timer1)
 
+	RCONbits.IPEN = 1;	// enable priority interrupts
+	IPR1bits.CCP1IP = 0;// low priority
+	PIR1bits.CCP1IF = 0;
+	PIE1bits.CCP1IE = 1;
+
+	INTCONbits.GIEL = 1; // enable low priority interrupts
+	INTCONbits.GIEH = 1;
+
+	T1CONbits.TMR1ON = 1;
+}
+
+
+/*
+Set the HID report data to default values for the next report. Only the axes and velocities
+are reset every time, as they're only filled in when there's a host command response or a
+hit. The buttons and hat are always written when the report is built, and the rest only
+depends on the game mode, so it's only filled in when the mode changes.
+*/
+void InitReportData(void)
+{
+	m_ReportNext[3] = joyAXIS_CENTER;  // X axis (used in host command mode)
+	m_ReportNext[4] = joyAXIS_CENTER;	// Y axis
+	m_ReportNext[5] = joyAXIS_CENTER;	// Z axis
+	m_ReportNext[11] = 0;	// velocities
+	m_ReportNext[12] = 0;	
+	m_ReportNext[13] = 0;	
+	m_ReportNext[14] = 0;	
+	m_ReportNext[15] = 0;
+	m_ReportNext[16] = 0;
+	m_ReportNext[17] = 0;	// (used in host command mode)
+
+	if (g_GameMode != m_VelocityTableMode)
+		BuildVelocityTable();
+
+	if (g_GameMode == m_ReportGameMode)
+		return;
+
+	m_ReportGameMode = g_GameMode;
+
+	m_ReportNext[0] = 0; 	// Button States (button 1 to 8) 
+	m_ReportNext[1] = 0;	// Button States (buttons 9 to 13)
+	m_ReportNext[2] = joyHAT_CENTER;	// hat switch position
+	m_ReportNext[6] = joyAXIS_CENTER;	// Rz axis
+	m_ReportNext[7] = 0;
+	m_ReportNext[8] = 0;
+	m_ReportNext[9] = 0;
+	m_ReportNext[10] = 0;
+
+	if (g_GameMode == gmGUITAR_HERO)
+	{
+		m_ReportNext[18] = 0;
+		m_ReportNext[19] = 0;
+		m_ReportNext[20] = 0;
+		m_ReportNext[21] = 0;
+		m_ReportNext[22] = 0;
+		m_ReportNext[23] = 0;
+		m_ReportNext[24] = 0;
+		m_ReportNext[25] = 0;
+		m_ReportNext[26] = 2;
+	}
+	else // ROCK BAND
+	{
+		m_ReportNext[18] = 0;
+		m_ReportNext[19] = 2;
+		m_ReportNext[20] = 0;
+		m_ReportNext[21] = 2;
+		m_ReportNext[22] = 0;
+		m_ReportNext[23] = 2;
+		m_ReportNext[24] = 0;
+		m_ReportNext[25] = 2;
+		m_ReportNext[26] = 0;
+	}
+} // InitReportData()
+
+
+/*
+Returns TRUE if any of the report bytes from nStart to nEnd - 1 are different from
+the last report that was sent.
+*/
+static BOOL ReportFieldChanged(UINT8 * pLastReport, UINT8 nStart, UINT8 nEnd)
+{
+	for ( ; nStart < nEnd; ++nStart)
+	{
+		if (m_ReportNext[nStart] != pLastReport[nStart])
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+/*
+Copy the report bytes from nStart to nEnd - 1 to the USB buffer.
+*/
+static void CopyReportField(UINT8 * pReport, UINT8 nStart, UINT8 nEnd)
+{
+	for ( ; nStart < nEnd; ++nStart)
+		pReport[nStart] = m_ReportNext[nStart];
+}
+
+
+/*
+Patch the report that was just built into the USB buffer pReport. pLastReport is the 
+buffer the last report was sent from -- the same one unless the IN endpoint is ping-pong
+buffered, in which case the whole report is copied. Only call this when pReport isn't 
+owned by the USB engine. Returns TRUE if anything changed (and so the report needs to 
+be sent), FALSE if the host already has this data.
+*/
+BOOL CommitInputReport(UINT8 * pReport, UINT8 * pLastReport)
+{
+	// find the field groups that changed
+	if (ReportFieldChanged(pLastReport, 0, 3))
+		m_ReportDirty |= rfBUTTONS;
+
+	if (ReportFieldChanged(pLastReport, 3, 7))
+		m_ReportDirty |= rfAXES;
+
+	if (ReportFieldChanged(pLastReport, 7, 17))
+		m_ReportDirty |= rfVELOCITY;
+
+	if (ReportFieldChanged(pLastReport, 17, HID_INPUT_REPORT_BYTES))
+		m_ReportDirty |= rfSTATUS;
+
+	if (m_ReportDirty == 0)
+		return FALSE; // nothing to send
+
+	if (pReport != pLastReport)
+		m_ReportDirty = rfALL; // other buffer has an older report in it
+
+	if (m_ReportDirty & rfBUTTONS)
+		CopyReportField(pReport, 0, 3);
+
+	if (m_ReportDirty & rfAXES)
+		CopyReportField(pReport, 3, 7);
+
+	if (m_ReportDirty & rfVELOCITY)
+		CopyReportField(pReport, 7, 17);
+
+	if (m_ReportDirty & rfSTATUS)
+		CopyReportField(pReport, 17, HID_INPUT_REPORT_BYTES);
+
+	m_ReportDirty = 0;
+
+	return TRUE;
+} // CommitInputReport()
 
 
-#if defined(TARGET_WII)
+/*
+Make the next report get sent even if nothing changed (e.g. the host just configured 
+the device and hasn't seen any report yet).
+*/
+void ResendInputReport(void)
+{
+	m_ReportDirty = rfALL;
+}
+
+
+
+#if defined(TARGET_WII)
 /*
 Do infinite loop for Wii mode.
 */
@@ -1189,8 +1652,10 @@ void Main_Wii(void)
 {
     while (1)
     {
+	#if defined(USB_POLLING)
 		// Check bus status and service USB interrupts.
         USBDeviceTasks();     // Interrupt or polling method
+	#endif
         
 		// Application-specific tasks.
         ProcessIO();        
@@ -1206,8 +1671,10 @@ void Main_PS3(void)
 {
     while (1)
     {
+	#if defined(USB_POLLING)
 		// Check bus status and service USB interrupts.
         USBDeviceTasks();     // Interrupt or polling method
+	#endif
         
 		// Application-specific tasks.
         ProcessIO();        
@@ -1226,8 +1693,9 @@ using the USB to get power.
 Time count is set to simulate the USB poll rate of 100Hz.
 One timer count is 51.2secs.
 
-The RB2 interface loop must run at a much higher rate than the standard 100Hz in order
-generate the proper pulse widths required. (Someday this should all be done in an interrupt).
+The pulse widths of the external outputs are timed by the output timer interrupt, but the RB2
+interface loop still runs at a much higher rate than the standard 100Hz so that a new hit 
+gets started without waiting for a whole poll period.
 */
 
 #if defined(XBOX_RB2_INTERFACE)
@@ -1258,6 +1726,14 @@ void Main_Xbox360(void)
 		// wait for timer to expire, check MIDI UART in the meantime
 		while (ReadTimer0() < TIMER_POLL_COUNT)
 		{
+			// start the next queued EEPROM write (if any), and queue more of a map being saved
+			ServiceEEQueue();
+			ServiceSettingsSave();
+
+		#if defined(MIDI_RX_BUFFERED)
+			// parse the data collected by the UART ISR
+			MIDI_ServiceRxBuffer();
+		#else
 			// poll the UART for MIDI data
 			if (PIR1bits.RCIF)
 				MIDI_ServiceUARTRx();
@@ -1273,11 +1749,64 @@ void Main_Xbox360(void)
 				RCSTA &= 0xEF; // clear CREN
 				RCSTA |= 0x10; // set CREN, re-enable reception	
 			}
+		#endif
 		}
 	} // while (TRUE)
 }
 
 
+/*
+Output timer interrupt, called every OUTPUT_TICK_US from the low priority ISR. Counts down the 
+time left for each busy channel: when a press is done it starts the channel's release gap, and
+when the gap is done the channel is free for the next hit. Also keeps g_MsTickCount going.
+*/
+void OutputTimerISR(void)
+{
+	static UINT16 m_TickMicrosecs = 0;
+	UINT8 nChannel, nMask;
+
+	PIR1bits.CCP1IF = 0;
+
+	++g_TickCount;
+
+	m_TickMicrosecs += OUTPUT_TICK_US;
+	if (m_TickMicrosecs >= 1000)
+	{
+		m_TickMicrosecs -= 1000;
+		++g_MsTickCount;
+	}
+
+	if (m_OutputBusy)
+	{
+		nMask = 0x01;
+		for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel, nMask <<= 1)
+		{
+			if (!(m_OutputBusy & nMask))
+				continue;
+
+			if (--m_OutputTicks[nChannel] != 0)
+				continue;
+
+			if (m_OutputActive & nMask)
+			{
+				// press is done, so release the output for the gap time
+				m_OutputActive &= ~nMask;
+				m_OutputTicks[nChannel] = m_OutputGapTicks[nChannel];
+
+				if (m_OutputTicks[nChannel] == 0)
+					m_OutputBusy &= ~nMask;
+			}
+			else
+				m_OutputBusy &= ~nMask; // gap is done
+		}
+	}
+
+#if defined(LX_EXT_OUTS)
+	WriteExtOutputs();
+#endif
+}
+
+
 #ifdef PROCESS_HOST_CMD
 
 // host command bytes           	  Description        Parameters              Output
@@ -1306,6 +1835,20 @@ void Main_Xbox360(void)
 #define dcSET_HIHAT_THRESHOLD   22 //  set hi hat threshold  threshold			 none		 
 #define dcGET_FEATURES			23 //  get device features   none				 X,Y = feature bits
 #define dcSET_GAME_MODE			24 //  set game mode         value				 none
+#define dcGET_RX_STATS			25 //  get MIDI rx stats     0/1, clear          0: X,Y = overruns,overflows 1: X = max bytes buffered
+#define dcGET_EE_STATS			26 //  get EEPROM queue stats 0-3, clear         0: X,Y = queued,max queued 1: X,Y = coalesced,forced 2: X,Y = journal saves (MSB,LSB) 3: X,Y = journal records (MSB,LSB)
+#define dcGET_HIT_STATS			27 //  get MIDI hit stats    clear               X,Y = hits dropped,stale hits
+#define dcGET_LATENCY			28 //  get report latency    0-3, clear          0: X,Y = last,max (128us units) 1: X,Y = poll period,sync misses 2: X,Y = delivery last,max 3: X,Y = loops per 100ms (MSB,LSB)
+#define dcGET_POLL_RATE			29 //  get USB poll rate     none                X = poll rate setting, Y = interval in use (ms)
+#define dcSET_POLL_RATE			30 //  set USB poll rate     0/1                 X = 1 if saved, 0 if rejected (not in PS3 mode); used after the next power up
+#define dcGET_PERF_STATS		31 //  get perf stats        0-16, clear         0-6: X,Y = latency histogram bucket (MSB,LSB) 7: reports built 8: reports sent 9: max build usecs 10: max parse usecs 11: bytes parsed 12: parse usecs 13: max button usecs 14: boot msecs 15: journal read usecs 16: max output tick delay from the USB interrupt (usecs)
+#define dcGET_CHANNEL_STATS		32 //  get channel stats     channel, 0-3, clear 0: X,Y = hits (MSB,LSB) 1: X,Y = presses (MSB,LSB) 2: X,Y = merged,stale 3: X = max queue wait (ms)
+#define dcGET_VEL_CURVE			33 //  get velocity curve    none                X = curve (vcLINEAR etc...)
+#define dcSET_VEL_CURVE			34 //  set velocity curve    0-3                 none
+#define dcGET_LIB_MAP_INFO		35 //  get library map info  slot                X = note count (FF = empty), Y = slot count
+#define dcREAD_LIB_MAP			36 //  read library map      slot, index         X,Y = note, channel mask (X = FF if no entry)
+#define dcSAVE_LIB_MAP			37 //  save map in library   slot                X = 1 if saved (set the active map with dcSET_NOTE_MAPPING first)
+#define dcLOAD_LIB_MAP			38 //  load map from library slot                X = 1 if loaded into the active map
 
 /*
 Process a command from the host. The command and parameters are in g_HostCmdBuffer:
@@ -1371,12 +1914,12 @@ void ProcessHostCommand(void)
 
 		case dcSET_HOLD_COUNT:
 			g_MidiHoldCount = g_HostCmdBuffer[3];
-			WriteEEData(EEADDR_HOLD_COUNT, g_MidiHoldCount);
+			SaveSetting(EEADDR_HOLD_COUNT, g_MidiHoldCount);
 			break;
 
 		case dcGET_TABLE_SIZE:
 			g_HostCmdResponseX = MIDI_CHANNEL_COUNT;
-			g_HostCmdResponseY = NOTES_PER_CHANNEL; 			
+			g_HostCmdResponseY = MIDI_MAP_MAX_NOTES; // shared by all channels			
 			break;
 			
 		case dcGET_ADJUST_KNOB:
@@ -1399,7 +1942,7 @@ void ProcessHostCommand(void)
 
 		case dcSET_VEL_THRESH:
 			g_MinVelocity = g_HostCmdBuffer[3];
-			WriteEEData(EEADDR_VEL_THRESH, g_MinVelocity);
+			SaveSetting(EEADDR_VEL_THRESH, g_MinVelocity);
 			break;
 
 		case dcGET_MAP_COUNT:
@@ -1411,7 +1954,7 @@ void ProcessHostCommand(void)
 			break;
 
 		case dcSET_MAP_NUMBER:
-			SetMidiMapNumber(g_HostCmdBuffer[3], TRUE);
+			SetMidiMapNumber(g_HostCmdBuffer[3]);
 			break;
 			
 #ifdef MAP_SWAP_NOTE
@@ -1421,7 +1964,7 @@ void ProcessHostCommand(void)
 			
 		case dcSET_SWAP_NOTE:
 			g_MidiSwapNote = g_HostCmdBuffer[3];
-			WriteEEData(EEADDR_SWAP_NOTE, g_MidiSwapNote);
+			SaveSetting(EEADDR_SWAP_NOTE, g_MidiSwapNote);
 			break;
 			
 #endif			
@@ -1433,7 +1976,7 @@ void ProcessHostCommand(void)
 			
 		case dcSET_HIHAT_THRESHOLD:
 			g_HiHatThreshold = g_HostCmdBuffer[3];
-			WriteEEData(EEADDR_HIHAT_THRESHOLD, g_HiHatThreshold);
+			SaveSetting(EEADDR_HIHAT_THRESHOLD, g_HiHatThreshold);
 			break;
 #endif
 
@@ -1463,6 +2006,18 @@ void ProcessHostCommand(void)
 			#ifdef USE_HIHAT_THRESHOLD
 				g_HostCmdResponseY |= 0x04;
 			#endif			
+			#if defined(MIDI_RX_BUFFERED)
+				g_HostCmdResponseY |= 0x08;
+			#endif
+			#if defined(USB_SOF_SYNC)
+				g_HostCmdResponseY |= 0x10;
+			#endif
+			#if defined(USB_INTERRUPT)
+				g_HostCmdResponseY |= 0x20;
+			#endif
+			#if defined(PERF_STATS)
+				g_HostCmdResponseY |= 0x40;
+			#endif
 			break;
 			
 		case dcSET_GAME_MODE:
@@ -1470,9 +2025,246 @@ void ProcessHostCommand(void)
 			g_GameMode = g_HostCmdBuffer[3] & 0x01; // valid value is either 0 or 1
 			
 			// save in EEPROM for next time
-			WriteEEData(EEADDR_GAME_MODE, g_GameMode);
+			SaveSetting(EEADDR_GAME_MODE, g_GameMode);
+			break;
+
+		case dcGET_RX_STATS:
+			if (g_HostCmdBuffer[3] == 0)
+			{
+				g_HostCmdResponseX = g_MidiRxOverrunCount;
+				g_HostCmdResponseY = g_MidiRxOverflowCount;
+			}
+			else
+				g_HostCmdResponseX = g_MidiRxHighWater;
+
+			// non-zero 2nd parameter resets the counts
+			if (g_HostCmdBuffer[4])
+			{
+				g_MidiRxOverrunCount = 0;
+				g_MidiRxOverflowCount = 0;
+				g_MidiRxHighWater = 0;
+			}
+			break;
+
+		case dcGET_EE_STATS:
+			if (g_HostCmdBuffer[3] == 0)
+			{
+				g_HostCmdResponseX = GetEEQueueCount();
+				g_HostCmdResponseY = g_EEQueueHighWater;
+			}
+			else if (g_HostCmdBuffer[3] == 1)
+			{
+				g_HostCmdResponseX = g_EEQueueCoalesced;
+				g_HostCmdResponseY = g_EEQueueForced;
+			}
+			else if (g_HostCmdBuffer[3] == 2)
+			{
+				g_HostCmdResponseX = (BYTE)(g_EEJournalSaves >> 8);
+				g_HostCmdResponseY = (BYTE)g_EEJournalSaves;
+			}
+			else
+			{
+				g_HostCmdResponseX = (BYTE)(g_EEJournalRecords >> 8);
+				g_HostCmdResponseY = (BYTE)g_EEJournalRecords;
+			}
+
+			// non-zero 2nd parameter resets the counts
+			if (g_HostCmdBuffer[4])
+			{
+				g_EEQueueHighWater = 0;
+				g_EEQueueCoalesced = 0;
+				g_EEQueueForced = 0;
+				g_EEJournalSaves = 0;
+				g_EEJournalRecords = 0;
+			}
+			break;
+
+		case dcGET_HIT_STATS:
+			g_HostCmdResponseX = g_MidiHitsDropped;
+			g_HostCmdResponseY = g_MidiHitsStale;
+
+			// non-zero parameter resets the counts
+			if (g_HostCmdBuffer[3])
+			{
+				g_MidiHitsDropped = 0;
+				g_MidiHitsStale = 0;
+			}
+			break;
+
+		case dcGET_LATENCY:
+			if (g_HostCmdBuffer[3] == 0)
+			{
+				g_HostCmdResponseX = g_HitLatencyLast;
+				g_HostCmdResponseY = g_HitLatencyMax;
+			}
+			else if (g_HostCmdBuffer[3] == 1)
+			{
+				g_HostCmdResponseX = g_UsbPollPeriod;
+				g_HostCmdResponseY = g_SofSyncMisses;
+			}
+			else if (g_HostCmdBuffer[3] == 2)
+			{
+				// time from the NOTE ON to the host reading the report (128us units)
+				g_HostCmdResponseX = g_HitDeliveryLast;
+				g_HostCmdResponseY = g_HitDeliveryMax;
+			}
+			else
+			{
+				// main loop rate, to compare USB_POLLING and USB_INTERRUPT
+				g_HostCmdResponseX = (BYTE)(g_MainLoopRate >> 8);
+				g_HostCmdResponseY = (BYTE)g_MainLoopRate;
+			}
+
+			// non-zero 2nd parameter resets the counts
+			if (g_HostCmdBuffer[4])
+			{
+				g_HitLatencyMax = 0;
+				g_SofSyncMisses = 0;
+				g_HitDeliveryMax = 0;
+			}
 			break;
 			
+		case dcGET_POLL_RATE:
+			g_HostCmdResponseX = ReadEEData(EEADDR_POLL_RATE);
+			if (g_HostCmdResponseX > POLL_RATE_FAST)
+				g_HostCmdResponseX = POLL_RATE_CONSOLE;
+			g_HostCmdResponseY = g_UsbPollInterval;
+			break;
+
+		case dcSET_POLL_RATE:
+			// the poll rate is only used in PS3 mode, so don't pretend to change it in the others
+			g_HostCmdResponseX = 0;
+			if ((g_SystemMode == SYS_MODE_PS3) && (g_HostCmdBuffer[3] <= POLL_RATE_FAST))
+			{
+				SaveSetting(EEADDR_POLL_RATE, g_HostCmdBuffer[3]);
+				g_HostCmdResponseX = 1;
+			}
+			break;
+
+		case dcGET_VEL_CURVE:
+			g_HostCmdResponseX = ReadEEData(EEADDR_VEL_CURVE);
+			if (g_HostCmdResponseX >= VELOCITY_CURVE_COUNT)
+				g_HostCmdResponseX = vcLINEAR;
+			break;
+
+		case dcSET_VEL_CURVE:
+			if (g_HostCmdBuffer[3] < VELOCITY_CURVE_COUNT)
+			{
+				SetVelocityCurve(g_HostCmdBuffer[3]);
+				SaveSetting(EEADDR_VEL_CURVE, g_HostCmdBuffer[3]);
+			}
+			break;
+
+		case dcGET_LIB_MAP_INFO:
+			g_HostCmdResponseX = GetLibraryMapSize(g_HostCmdBuffer[3]);
+			g_HostCmdResponseY = MAP_LIBRARY_SLOTS;
+			break;
+
+		case dcREAD_LIB_MAP:
+			if (!ReadLibraryMapEntry(g_HostCmdBuffer[3], g_HostCmdBuffer[4], &g_HostCmdResponseX, &g_HostCmdResponseY))
+			{
+				g_HostCmdResponseX = INVALID_NOTE_NUMBER;
+				g_HostCmdResponseY = 0;
+			}
+			break;
+
+		case dcSAVE_LIB_MAP:
+			g_HostCmdResponseX = SaveMidiMapToLibrary(g_HostCmdBuffer[3]);
+			break;
+
+		case dcLOAD_LIB_MAP:
+			g_HostCmdResponseX = LoadMidiMapFromLibrary(g_HostCmdBuffer[3]);
+			break;
+			
+#if defined(PERF_STATS)
+		case dcGET_PERF_STATS:
+		{
+			WORD nValue;
+
+			nParam = g_HostCmdBuffer[3];
+			if (nParam < PERF_LATENCY_BUCKETS)
+				nValue = g_PerfLatencyHist[nParam];
+			else if (nParam == PERF_LATENCY_BUCKETS)
+				nValue = g_PerfReportsBuilt;
+			else if (nParam == PERF_LATENCY_BUCKETS + 1)
+				nValue = g_PerfReportsSent;
+			else if (nParam == PERF_LATENCY_BUCKETS + 2)
+				nValue = g_PerfBuildTimeMax;
+			else if (nParam == PERF_LATENCY_BUCKETS + 3)
+				nValue = g_PerfParseTimeMax;
+			else if (nParam == PERF_LATENCY_BUCKETS + 4)
+				nValue = g_PerfParseBytes;
+			else if (nParam == PERF_LATENCY_BUCKETS + 5)
+				nValue = g_PerfParseTime;
+			else if (nParam == PERF_LATENCY_BUCKETS + 6)
+				nValue = g_PerfButtonTimeMax;
+			else if (nParam == PERF_LATENCY_BUCKETS + 7)
+				nValue = g_PerfBootTime;
+			else if (nParam == PERF_LATENCY_BUCKETS + 8)
+				nValue = g_PerfJournalTime;
+			else
+			{
+				// the USB interrupt updates it, so read it until it holds still
+				do
+				{
+					nValue = g_PerfTickDelayMax;
+				} while (nValue != g_PerfTickDelayMax);
+				nValue /= 12; // instruction cycles to usecs
+			}
+
+			g_HostCmdResponseX = (BYTE)(nValue >> 8);
+			g_HostCmdResponseY = (BYTE)nValue;
+
+			// non-zero 2nd parameter resets the stats
+			if (g_HostCmdBuffer[4])
+				ClearPerfStats();
+			break;
+		}
+
+		case dcGET_CHANNEL_STATS:
+			/*
+			Compare these with the notes in a recorded performance that has been played into
+			the MIDI input: hits that were merged (queue full), went stale or weren't pressed.
+			*/
+			nParam = g_HostCmdBuffer[3] & (MIDI_CHANNEL_COUNT - 1); // channel
+
+			switch (g_HostCmdBuffer[4])
+			{
+				case 0:
+					g_HostCmdResponseX = (BYTE)(g_ChannelHits[nParam] >> 8);
+					g_HostCmdResponseY = (BYTE)g_ChannelHits[nParam];
+					break;
+
+				case 1:
+					g_HostCmdResponseX = (BYTE)(m_ChannelPresses[nParam] >> 8);
+					g_HostCmdResponseY = (BYTE)m_ChannelPresses[nParam];
+					break;
+
+				case 2:
+					g_HostCmdResponseX = g_ChannelDropped[nParam];
+					g_HostCmdResponseY = g_ChannelStale[nParam];
+					break;
+
+				default:
+					g_HostCmdResponseX = g_ChannelMaxWait[nParam];
+					break;
+			}
+
+			// non-zero 3rd parameter resets the stats for all channels
+			if (g_HostCmdBuffer[5])
+			{
+				for (nParam = 0; nParam < MIDI_CHANNEL_COUNT; ++nParam)
+				{
+					g_ChannelHits[nParam] = 0;
+					m_ChannelPresses[nParam] = 0;
+					g_ChannelDropped[nParam] = 0;
+					g_ChannelStale[nParam] = 0;
+					g_ChannelMaxWait[nParam] = 0;
+				}
+			}
+			break;
+#endif
+
 		default:
 			// unknown command - put invalid value in Z
 			g_HostCmdResponseZ = !g_HostCmdBuffer[2]; 
@@ -1483,101 +2275,491 @@ void ProcessHostCommand(void)
 
 
 /*
-Get stored settings from EEPROM. Initializes values to defaults if old settings are found.
+Returns a bit mask of the channels whose outputs are pressed, or have been pressed since the
+last call. This way a press that is shorter than the time between calls still gets seen.
+*/
+static UINT8 ReadOutputs(void)
+{
+	UINT8 nOutputs;
+
+	PIE1bits.CCP1IE = 0; // hold off the output timer ISR
+
+	nOutputs = m_OutputActive | m_OutputLatch;
+	m_OutputLatch = 0;
+
+	PIE1bits.CCP1IE = 1;
+
+	return nOutputs;
+}
+
+
+/*
+The settings record (EEADDR_SETTINGS) is checked with a CRC. If it's wrong, then only the 
+settings that are out of range are put back to their defaults. Each setting is valid if it's
+from Min to Max, or is the Default.
+*/
+typedef struct
+{
+	BYTE	Min;
+	BYTE	Max;
+	BYTE	Default;
+} TSettingRange;
+
+static ROM TSettingRange SETTING_RANGES[SETTINGS_SIZE] =
+{
+	{ 1, 0xFE, MIDI_HOLD_COUNT },							// EEADDR_HOLD_COUNT
+	{ 0, 127, DEFAULT_VELOCITY_THRESHOLD },					// EEADDR_VEL_THRESH
+	{ 0, MIDI_NOTE_COUNT - 1, INVALID_NOTE_NUMBER },		// EEADDR_SWAP_NOTE
+	{ 0, 127, INVALID_NOTE_NUMBER },						// EEADDR_HIHAT_THRESHOLD (default is off)
+	{ POLL_RATE_CONSOLE, POLL_RATE_FAST, POLL_RATE_CONSOLE }, // EEADDR_POLL_RATE
+	{ 0, VELOCITY_CURVE_COUNT - 1, vcLINEAR }				// EEADDR_VEL_CURVE
+};
+
+/*
+Settings that get changed a lot are saved in the EEPROM journal (see EEData.c) instead of 
+at their own address, so the writes are spread out. The position in this table is the 
+journal ID. Their own address still has the value from before there was a journal, which is 
+used until the setting is changed.
+*/
+#define HOT_SETTING_COUNT 4
+#define NOT_HOT_SETTING 0xFF // HotSettingID() for the settings that aren't in the journal
+
+#if (HOT_SETTING_COUNT > EE_JOURNAL_IDS) || (NOT_HOT_SETTING < EE_JOURNAL_IDS)
+	!!!"ERROR: the hot settings don't fit the journal IDs"
+#endif
+
+static ROM BYTE HOT_SETTINGS[HOT_SETTING_COUNT] =
+{
+	EEADDR_GAME_MODE,
+	EEADDR_VEL_THRESH,		// changed with NAV UP/DOWN
+	EEADDR_HOLD_COUNT,		// changed with NAV UP/DOWN
+	EEADDR_HIHAT_THRESHOLD
+};
+
+/*
+Older EEPROM layouts are brought up to date one version at a time, in this order.
+*/
+typedef struct
+{
+	BYTE	FromVersion;
+	BYTE	ToVersion;
+	void	(*Migrate)(void);
+} TEEMigration;
+
+static void MigrateFromVersion1(void);
+static void MigrateFromVersion1Partial(void);
+static void MigrateFromVersion2(void);
+
+static BOOL m_MapsConverted = FALSE;  // the maps in RAM are the converted version 1 tables
+static BOOL m_VersionPending = FALSE; // EE_VERSION still has to be saved (see ServiceSettingsSave())
+
+#define EE_MIGRATION_COUNT 3
+
+static ROM TEEMigration EE_MIGRATIONS[EE_MIGRATION_COUNT] =
+{
+	{ EE_VERSION_1_MIGRATING, EE_VERSION, MigrateFromVersion1Partial },
+	{ EE_VERSION_1, EE_VERSION_2, MigrateFromVersion1 },
+	{ EE_VERSION_2, EE_VERSION, MigrateFromVersion2 }
+};
+
+
+/*
+Version 1 had the same settings, but the maps were saved as 8x8 tables. The new maps are 
+written over the old tables, so once that starts the tables can't be converted again. The 
+version is changed to EE_VERSION_1_MIGRATING before then, so a power up after the conversion
+was cut short knows not to try. Both tables are read into RAM here, and the new maps are 
+saved from the main loop (see SaveMidiMap()), queued behind the version change.
+*/
+static void MigrateFromVersion1(void)
+{
+	BOOL bAllFit;
+
+	QueueEEData(EEADDR_VERSION, EE_VERSION_1_MIGRATING);
+
+	bAllFit = ConvertOldMidiMap(0);
+	if (!ConvertOldMidiMap(1))
+		bAllFit = FALSE;
+
+	m_MapsConverted = TRUE;
+
+	// an old map had more notes than the new ones can hold
+	if (!bAllFit)
+		ErrorMessage(ERR_SETTINGS, FALSE);
+}
+
+
+/*
+The power went off while the version 1 maps were being converted. The settings are fine, but
+the maps could be half old table and half new map, so their CRCs are made wrong and 
+RecallMidiMaps() keeps whatever part of them checks out.
+*/
+static void MigrateFromVersion1Partial(void)
+{
+	UINT8 nMap;
+	BYTE nAddress;
+
+	UpdateSettingsCrc();
+
+	for (nMap = 0; nMap < MIDI_MAP_COUNT; ++nMap)
+	{
+		UpdateMidiMapCrc(nMap);
+
+		nAddress = EEADDR_MIDI_MAP1 + (nMap * MIDI_MAP_EE_SIZE) + MIDI_MAP_EE_CRC;
+		UpdateEEData(nAddress, (BYTE)~ReadEEData(nAddress));
+	}
+}
+
+
+/*
+Version 2 didn't have any CRCs. (After a version 1 conversion the map CRCs are worked out 
+from the old tables, but the map saves put them right.)
+*/
+static void MigrateFromVersion2(void)
+{
+	UpdateSettingsCrc();
+	UpdateMidiMapCrc(0);
+	UpdateMidiMapCrc(1);
+}
+
+
+/*
+Works out the CRC of the settings record as it is in EEPROM (including the writes still in 
+the queue).
+*/
+static BYTE CalcSettingsCrc(void)
+{
+	UINT8 nIndex;
+	BYTE nCrc;
+
+	nCrc = CRC8_INIT;
+	for (nIndex = 0; nIndex < SETTINGS_SIZE; ++nIndex)
+		nCrc = UpdateCrc8(nCrc, ReadEEData(EEADDR_SETTINGS + nIndex));
+
+	return nCrc;
+}
+
+
+static void UpdateSettingsCrc(void)
+{
+	UpdateEEData(EEADDR_SETTINGS_CRC, CalcSettingsCrc());
+}
+
+
+/*
+Returns the journal ID for a setting, or NOT_HOT_SETTING if it isn't kept in the journal. 
+The journal ignores NOT_HOT_SETTING, so it can be passed straight on.
+*/
+static UINT8 HotSettingID(BYTE Address)
+{
+	UINT8 nId;
+
+	for (nId = 0; nId < HOT_SETTING_COUNT; ++nId)
+	{
+		if (HOT_SETTINGS[nId] == Address)
+			return nId;
+	}
+
+	return NOT_HOT_SETTING;
+}
+
+
+static BOOL SettingIsValid(UINT8 Index, BYTE Value)
+{
+	if ((Value >= SETTING_RANGES[Index].Min) && (Value <= SETTING_RANGES[Index].Max))
+		return TRUE;
+
+	return (Value == SETTING_RANGES[Index].Default);
+}
+
+
+/*
+Read a setting from the journal, or from its own address if it isn't in the journal.
+*/
+static BYTE ReadSetting(BYTE Address)
+{
+	BYTE nValue;
+
+	if (ReadEEJournal(HotSettingID(Address), &nValue))
+		return nValue;
+
+	return ReadEEData(Address);
+}
+
+
+/*
+Save one of the settings. The ones in HOT_SETTINGS go in the journal, the rest in the 
+settings record. The CRC is queued after the setting, so if the power goes off in between, 
+the next power up finds the CRC is wrong and checks the settings. If the CRC is already 
+wrong (the record hasn't been checked yet, this can be called at power up), then it's left 
+that way.
+*/
+static void SaveSetting(BYTE Address, BYTE Value)
+{
+	UINT8 nId;
+	BOOL bCrcIsGood;
+
+	nId = HotSettingID(Address);
+	if (nId != NOT_HOT_SETTING)
+	{
+		WriteEEJournal(nId, Value);
+		return;
+	}
+
+	bCrcIsGood = (CalcSettingsCrc() == ReadEEData(EEADDR_SETTINGS_CRC));
+
+	UpdateEEData(Address, Value);
+
+	if (bCrcIsGood)
+		UpdateSettingsCrc();
+}
+
+
+/*
+Get stored settings and the maps from EEPROM. An older layout is converted, settings that 
+were damaged are fixed, and everything is reset to defaults if the layout isn't known. The 
+maps that were converted or fixed, and then the new version number, are saved from the main 
+loop by ServiceSettingsSave(), so this doesn't wait for the EEPROM.
 */
 void RecallStoredSettings(void)
 {
-	/*
-	Get stored values from eeprom
-	*/
-	if (ReadEEData(EEADDR_VERSION) == EE_VERSION) // check stored version number
+	BYTE nVersion, nCrc, nValue;
+	BYTE nSettings[SETTINGS_SIZE];
+	UINT8 nIndex;
+	BOOL bRepaired;
+
+	nVersion = ReadEEData(EEADDR_VERSION);
+
+	for (nIndex = 0; nIndex < EE_MIGRATION_COUNT; ++nIndex)
 	{
-		g_MidiHoldCount = ReadEEData(EEADDR_HOLD_COUNT); 
-		g_MinVelocity = ReadEEData(EEADDR_VEL_THRESH);
-		
-	#ifdef MAP_SWAP_NOTE
-		g_MidiSwapNote = ReadEEData(EEADDR_SWAP_NOTE);
-	#endif
-	
-	#ifdef USE_HIHAT_THRESHOLD
-		g_HiHatThreshold = ReadEEData(EEADDR_HIHAT_THRESHOLD);
-	#endif
+		if (EE_MIGRATIONS[nIndex].FromVersion == nVersion)
+		{
+			(*EE_MIGRATIONS[nIndex].Migrate)();
+			nVersion = EE_MIGRATIONS[nIndex].ToVersion;
+			m_VersionPending = TRUE;
+		}
+	}
+
+	if (nVersion == EE_VERSION) // check stored version number
+	{
+		// read the whole record in one go, and check it
+		nCrc = CRC8_INIT;
+		for (nIndex = 0; nIndex < SETTINGS_SIZE; ++nIndex)
+		{
+			nSettings[nIndex] = ReadEEData(EEADDR_SETTINGS + nIndex);
+			nCrc = UpdateCrc8(nCrc, nSettings[nIndex]);
+		}
+
+		bRepaired = FALSE;
+		if (nCrc != ReadEEData(EEADDR_SETTINGS_CRC))
+		{
+			for (nIndex = 0; nIndex < SETTINGS_SIZE; ++nIndex)
+			{
+				if (SettingIsValid(nIndex, nSettings[nIndex]))
+					continue;
+
+				nSettings[nIndex] = SETTING_RANGES[nIndex].Default;
+				QueueEEData(EEADDR_SETTINGS + nIndex, nSettings[nIndex]);
+			}
+
+			UpdateSettingsCrc();
+			bRepaired = TRUE;
+		}
+
+		// the journal has the newer values of the hot settings
+		for (nIndex = 0; nIndex < SETTINGS_SIZE; ++nIndex)
+		{
+			if (ReadEEJournal(HotSettingID(EEADDR_SETTINGS + nIndex), &nValue) 
+			&& SettingIsValid(nIndex, nValue))
+				nSettings[nIndex] = nValue;
+		}
+
+		// all the maps are kept in RAM (the converted ones are already there)
+		if (!m_MapsConverted && (RecallMidiMaps() != 0))
+			bRepaired = TRUE;
+
+		if (bRepaired)
+			ErrorMessage(ERR_SETTINGS, FALSE);
 	}
 	else // invalid version, so reset to defaults
 	{
 		ErrorMessage(ERR_VERSION, FALSE);
 
-		g_MidiHoldCount	= MIDI_HOLD_COUNT;
-		WriteEEData(EEADDR_HOLD_COUNT, g_MidiHoldCount);
+		// only the bytes that are different get written
+		for (nIndex = 0; nIndex < SETTINGS_SIZE; ++nIndex)
+		{
+			nSettings[nIndex] = SETTING_RANGES[nIndex].Default;
+			UpdateEEData(EEADDR_SETTINGS + nIndex, nSettings[nIndex]);
 
-		g_MinVelocity = DEFAULT_VELOCITY_THRESHOLD;
-		WriteEEData(EEADDR_VEL_THRESH, g_MinVelocity);
+			// so an old value in the journal doesn't take its place (does nothing if it isn't hot)
+			WriteEEJournal(HotSettingID(EEADDR_SETTINGS + nIndex), nSettings[nIndex]);
+		}
 
-	#ifdef MAP_SWAP_NOTE
-		g_MidiSwapNote = INVALID_NOTE_NUMBER;
-		WriteEEData(EEADDR_SWAP_NOTE, g_MidiSwapNote);
-	#endif		
+		UpdateSettingsCrc();
 
-	#ifdef USE_HIHAT_THRESHOLD
-		g_HiHatThreshold = INVALID_NOTE_NUMBER; // default to disabled
-		WriteEEData(EEADDR_HIHAT_THRESHOLD, g_HiHatThreshold);
-	#endif
-			
 		// init maps to defaults
-		SetMidiMapNumber(0, FALSE); // to set g_MidiMapEEPROMAddress
 		RestoreDefaultMap(0);
-		SetMidiMapNumber(1, FALSE); // to set g_MidiMapEEPROMAddress
 		RestoreDefaultMap(1);		
 		
-		// update stored version number
-		WriteEEData(EEADDR_VERSION, EE_VERSION);
+		// update stored version number, once the maps are saved
+		m_VersionPending = TRUE;
+	}
+
+	g_MidiHoldCount = nSettings[EEADDR_HOLD_COUNT - EEADDR_SETTINGS]; 
+	g_MinVelocity = nSettings[EEADDR_VEL_THRESH - EEADDR_SETTINGS];
+	
+#ifdef MAP_SWAP_NOTE
+	g_MidiSwapNote = nSettings[EEADDR_SWAP_NOTE - EEADDR_SETTINGS];
+#endif
+
+#ifdef USE_HIHAT_THRESHOLD
+	g_HiHatThreshold = nSettings[EEADDR_HIHAT_THRESHOLD - EEADDR_SETTINGS];
+#endif
+
+	SetVelocityCurve(nSettings[EEADDR_VEL_CURVE - EEADDR_SETTINGS]);
+}
+
+
+/*
+Call this from the main loop, after ServiceEEQueue(). Saves the maps left by 
+RecallStoredSettings() (or changed since), and then the version number once the EEPROM 
+queue is empty, so it's written after the maps and isn't merged with the 
+EE_VERSION_1_MIGRATING write. If the power goes off before then, the next power up does 
+the conversion or repair again. Returns TRUE when there's nothing left to save.
+*/
+BOOL ServiceSettingsSave(void)
+{
+	if (!ServiceMidiMapSave())
+		return FALSE;
+
+	if (m_VersionPending)
+	{
+		if (GetEEQueueCount() != 0)
+			return FALSE;
+
+		QueueEEData(EEADDR_VERSION, EE_VERSION);
+		m_VersionPending = FALSE;
 	}
+
+	return TRUE;
+}
+
+
+/*
+Save everything now and wait for the writes, for when the power could be about to go off 
+(e.g. the host suspended the USB).
+*/
+void FlushSettingsSave(void)
+{
+	while (!ServiceSettingsSave())
+		FlushEEQueue();
+
+	FlushEEQueue();
 }
 
 
 #if defined(XBOX_RB2_INTERFACE)
 /*
-Computes the proper hold count depending on the velocity and channel. For the Rock 
-Band 2 Xbox interface, the hold count is used to control the pulse width of the 
+Computes the proper hold time (in output timer ticks) depending on the velocity and channel. 
+For the Rock Band 2 Xbox interface, the hold time is used to control the pulse width of the 
 external output signals in order to mimic the user hitting a pad or cymbal with 
-different amounts of force. These values were determined thru trial and error.
+different amounts of force. These values were determined thru trial and error, back when the
+pulse width was counted in 256us passes of the main loop, so they are still in those units.
 */
-static BYTE ScaleHoldCount(BYTE Channel, BYTE Velocity)
+#define RB2_PULSE_TICKS	USEC_TO_TICKS(256)
+
+static ROM UINT8 RB2_CYMBAL_PULSES[128] = // (Velocity / 5) + 5, 25 max
 {
-	BYTE Result;
+	  5,   5,   5,   5,   5,   6,   6,   6,   6,   6,   7,   7,   7,   7,   7,   8,
+	  8,   8,   8,   8,   9,   9,   9,   9,   9,  10,  10,  10,  10,  10,  11,  11,
+	 11,  11,  11,  12,  12,  12,  12,  12,  13,  13,  13,  13,  13,  14,  14,  14,
+	 14,  14,  15,  15,  15,  15,  15,  16,  16,  16,  16,  16,  17,  17,  17,  17,
+	 17,  18,  18,  18,  18,  18,  19,  19,  19,  19,  19,  20,  20,  20,  20,  20,
+	 21,  21,  21,  21,  21,  22,  22,  22,  22,  22,  23,  23,  23,  23,  23,  24,
+	 24,  24,  24,  24,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,
+	 25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25,  25
+};
+
+static ROM UINT8 RB2_PAD_PULSES[128] = // Velocity / 12
+{
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,   1,   1,   1,
+	  1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,   2,
+	  2,   2,   2,   2,   3,   3,   3,   3,   3,   3,   3,   3,   3,   3,   3,   3,
+	  4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   5,   5,   5,   5,
+	  5,   5,   5,   5,   5,   5,   5,   5,   6,   6,   6,   6,   6,   6,   6,   6,
+	  6,   6,   6,   6,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+	  8,   8,   8,   8,   8,   8,   8,   8,   8,   8,   8,   8,   9,   9,   9,   9,
+	  9,   9,   9,   9,   9,   9,   9,   9,  10,  10,  10,  10,  10,  10,  10,  10
+};
+
+static UINT16 ScaleHoldCount(BYTE Channel, BYTE Velocity)
+{
+	Velocity = m_pVelocityCurve[Velocity & 0x7F];
 
 	switch (Channel)
 	{
 		case 4: // kick pedal 
 			// It's not velocity sensitive, but some versions of the controller seem to need 
 			// a longer pulse.
-			return 20 * g_MidiHoldCount; //was 64; 	
+			return (UINT16)g_MidiHoldCount * (20 * RB2_PULSE_TICKS); //was 64; 	
 
 		// cymbals
 		case 5:
 		case 6:
 		case 7:
-			Result = (Velocity / 5) + 5;
-			if (Result > 25)			
-				Result = 25;
-			return Result;
+			return RB2_CYMBAL_PULSES[Velocity] * RB2_PULSE_TICKS;
 
 		// drum pads
 		default:
-			return (Velocity / 12);
+			return RB2_PAD_PULSES[Velocity] * RB2_PULSE_TICKS;
 	} // switch
 }
 #endif
 
 /*
-Convert MIDI note velocity value into value needed by game
+Fills in m_VelocityReport, which converts the MIDI note velocity into the value needed by
+the game (after the velocity curve).
 */
-static BYTE ScaleVelocity(BYTE Value)
+static void BuildVelocityTable(void)
 {
-	if (g_GameMode == gmGUITAR_HERO)
-		return Value;
+	UINT8 nVelocity, nValue;
+
+	for (nVelocity = 0; nVelocity < 128; ++nVelocity)
+	{
+		nValue = m_pVelocityCurve[nVelocity];
+
+		if (g_GameMode == gmGUITAR_HERO)
+			m_VelocityReport[nVelocity] = nValue;
+		else
+			m_VelocityReport[nVelocity] = 0xFF - (2 * nValue);
+	}
+
+	m_VelocityTableMode = g_GameMode;
+}
+
+
+/*
+Selects the velocity curve (vcLINEAR etc...) used for the reported velocities and for the RB2
+pulse widths.
+*/
+void SetVelocityCurve(BYTE Curve)
+{
+	if (Curve >= VELOCITY_CURVE_COUNT)
+		Curve = vcLINEAR;
+
+	m_pVelocityCurve = VELOCITY_CURVES[Curve];
+	BuildVelocityTable();
+}
+
+
+/*
+Returns the number of the map after the active one (wraps around to the first one).
+*/
+static BYTE NextMidiMapNumber(void)
+{
+	if (g_MidiMapNumber < (MIDI_MAP_COUNT - 1))
+		return g_MidiMapNumber + 1;
 	else
-		return (0xFF - (2 * Value));
+		return 0;
 }
 
 
@@ -1588,16 +2770,17 @@ is -1, then no outputs are to be put in program mode.
 */
 static void SelectProgramMode(INT8 ChannelNumber)
 {
+	ClearLedSequence(); // this sets all the LEDs
+
 	// turn off all the outputs and LEDs
+#if defined(MR_LX)
+	WriteChannelLeds(0);
+#else
 	ledCH1 = LED_OUTPUT_OFF;
 	ledCH2 = LED_OUTPUT_OFF;
 	ledCH3 = LED_OUTPUT_OFF;
 	ledCH4 = LED_OUTPUT_OFF;
 	ledCH5 = LED_OUTPUT_OFF;
-#if defined(MR_LX)
-	ledCH6 = LED_OUTPUT_OFF; 
-	ledALT = LED_OUTPUT_OFF;
-#else
 	ledCH2 = LED_OUTPUT_OFF;  // fixes a glitch when in 360 mode. Note sure why.
 	outEXT6 = 0;
 	outEXT7 = 0;
@@ -1626,104 +2809,119 @@ static void SelectProgramMode(INT8 ChannelNumber)
 #if defined(LX_EXT_OUTS)
 
 /*
-Sets the state of an external output on the LX. For the RB1 inteface, all the signals
-are active low, for RB2 the drums/cymbals are active-high, except the kick is active low.
+Port pins for each external output (outEXT0-7 in Pinout.h), one mask per port. The masks for 
+all the active outputs are OR'd together so that each LATx register only gets written once, 
+and outputs that change together (e.g. a pad and the kick) all change at the same instant.
+
+NOTE: the yellow and blue cymbal connections are swapped in the interface board/cable, so 
+outputs 5 and 6 go to EXT6 and EXT5 to compensate.
 */
-static void SetExtOutput_LX(BYTE Output, BOOL Active)
+static ROM TPortMasks EXT_OUTPUT_PINS[MIDI_CHANNEL_COUNT] =
 {
-	BOOL boolHigh;
-
-#if defined(XBOX_RB2_INTERFACE)
-	boolHigh = (Active != 0); // outputs are active high (except kick pedal) 
-
-	switch (Output)
-	{
-		case 0: // RED
-			outEXT0 = boolHigh;
-			outEXT0 = boolHigh; // it seems to take 2 times
-			break;
-
-		case 1: // YELLOW
-			outEXT1 = boolHigh;
-			break;
-
-		case 2: // BLUE
-			outEXT2 = boolHigh;
-			break;
-
-		case 3: // GREEN
-			outEXT3 = boolHigh;
-			break;
-
-		case 4: // KICK
-			outEXT4 = !boolHigh; // pedal is active low
-			break;
-
-		// NOTE: the yellow and blue cymbal connections are swapped in the board cable, so we
-		// swap them here to compensate.
-		
-		case 5: // YELLOW CYMBAL
-			outEXT6 = boolHigh;
-			break;
+	//  PORTA       PORTB       PORTC       PORTD
+	{ 0b00000001, 0b00000000, 0b00000000, 0b00000000 }, // 0: red (EXT0)
+	{ 0b00000010, 0b00000000, 0b00000000, 0b00000000 }, // 1: yellow (EXT1)
+	{ 0b00000100, 0b00000000, 0b00000000, 0b00000000 }, // 2: blue (EXT2)
+	{ 0b00000000, 0b00000000, 0b00000010, 0b00000000 }, // 3: green (EXT3)
+	{ 0b00000000, 0b00000000, 0b00000100, 0b00000000 }, // 4: kick (EXT4)
+	{ 0b00000000, 0b00000000, 0b00000000, 0b00000010 }, // 5: yellow cymbal (EXT6)
+	{ 0b00000000, 0b00000000, 0b00000000, 0b00000001 }, // 6: blue cymbal (EXT5)
+	{ 0b00000000, 0b01000000, 0b00000000, 0b00000000 }  // 7: green cymbal (EXT7)
+};
 
-		case 6: // BLUE CYMBAL
-			outEXT5 = boolHigh;
-			break;
+// all of the external output pins
+#define EXT_PINS_A	0b00000111
+#define EXT_PINS_B	0b01000000
+#define EXT_PINS_C	0b00000110
+#define EXT_PINS_D	0b00000011
 
-		case 7: // GREEN CYMBAL
-			outEXT7 = boolHigh;
-			break;
+/*
+Pins that are high when their output is NOT active. For RB1 all the signals are active low, 
+for RB2 the drums/cymbals are active high, except the kick which is active low.
+*/
+#if defined(XBOX_RB2_INTERFACE)
+	#define EXT_IDLE_A	0b00000000
+	#define EXT_IDLE_B	0b00000000
+	#define EXT_IDLE_C	0b00000100 // kick pedal
+	#define EXT_IDLE_D	0b00000000
+#else
+	#define EXT_IDLE_A	EXT_PINS_A
+	#define EXT_IDLE_B	EXT_PINS_B
+	#define EXT_IDLE_C	EXT_PINS_C
+	#define EXT_IDLE_D	EXT_PINS_D
+#endif
 
-	} // switch (Output)
 
-#else // not XBOX_RB2_INTERFACE, must be RB1
-		
-	boolHigh = (Active == 0); // outputs are active-low
+/*
+Update the external outputs from the channels the output timer has active and the outputs
+the buttons activate (m_ExtButtonMask). Only called from the output timer ISR, or with it 
+disabled. The outputs are only written when something changes.
+*/
+static void WriteExtOutputs(void)
+{
+	UINT8 nOutputs, nOutput;
+	BYTE nLatA, nLatB, nLatC, nLatD;
 
-	switch (Output)
-	{
-		case 0: // RED
-			outEXT0 = boolHigh;
-			outEXT0 = boolHigh; // it seems to take 2 times
-			break;
+#if defined(XBOX_RB2_INTERFACE) || defined(ARCADE_INTERFACE)
+	nOutputs = m_OutputActive;
+#else
+	// for RB1, cymbals use same outputs as pads
+	nOutputs = (m_OutputActive & 0x1F) | ((m_OutputActive >> 4) & 0x0E);
+#endif
+	nOutputs |= m_ExtButtonMask;
 
-		case 1: // YELLOW
-			outEXT1 = boolHigh;
-			break;
+	if (nOutputs == m_ExtOutputState)
+		return;
 
-		case 2: // BLUE
-			outEXT2 = boolHigh;
-			break;
+	m_ExtOutputState = nOutputs;
 
-		case 3: // GREEN
-			outEXT3 = boolHigh;
-			break;
+	// build the new pin states for each port
+	nLatA = 0;
+	nLatB = 0;
+	nLatC = 0;
+	nLatD = 0;
+	for (nOutput = 0; nOutputs != 0; ++nOutput, nOutputs >>= 1)
+	{
+		if (nOutputs & 0x01)
+		{
+			nLatA |= EXT_OUTPUT_PINS[nOutput].A;
+			nLatB |= EXT_OUTPUT_PINS[nOutput].B;
+			nLatC |= EXT_OUTPUT_PINS[nOutput].C;
+			nLatD |= EXT_OUTPUT_PINS[nOutput].D;
+		}
+	}
 
-		case 4: // KICK
-			outEXT4 = boolHigh;
-			break;
-			
-		// go ahead and activate the cymbal outputs too. They are not normally connected when
-		// using the RB1 interface, but there is a customer that needs this.
-		
-		// NOTE: the yellow and blue cymbal connections are swapped in the interface board, so we
-		// swap them here to compensate.
-		case 5: // YELLOW CYMBAL
-			outEXT6 = boolHigh;
-			break;
+	// write them all at once
+	LATA = (LATA & ~EXT_PINS_A) | (nLatA ^ EXT_IDLE_A);
+	LATB = (LATB & ~EXT_PINS_B) | (nLatB ^ EXT_IDLE_B);
+	LATC = (LATC & ~EXT_PINS_C) | (nLatC ^ EXT_IDLE_C);
+	LATD = (LATD & ~EXT_PINS_D) | (nLatD ^ EXT_IDLE_D);
+}
+#endif
 
-		case 6: // BLUE CYMBAL
-			outEXT5 = boolHigh;
-			break;
 
-		case 7: // GREEN CYMBAL
-			outEXT7 = boolHigh;
-			break;
-	} // switch (Output)
+extern BYTE g_UsbConfigIndex;
 
-	#endif
+/*
+Picks the configuration descriptor with the console or fast (1ms) HID endpoint poll interval.
+Like SetPID(), this has to be done before the USB is initialized. Returns FALSE (and uses the
+console rate) if PollRate isn't a valid setting.
+*/
+BOOL SetPollRate(BYTE PollRate)
+{
+	if (PollRate == POLL_RATE_FAST)
+	{
+		g_UsbConfigIndex = USB_CONFIG_FAST;
+		g_UsbPollInterval = USB_POLL_INTERVAL_FAST;
+	}
+	else
+	{
+		g_UsbConfigIndex = USB_CONFIG_CONSOLE;
+		g_UsbPollInterval = USB_POLL_INTERVAL_CONSOLE;
+	}
+	
+	return (PollRate <= POLL_RATE_FAST);
 }
-#endif
 
 
 /*
@@ -1752,87 +2950,86 @@ void SetPID(BYTE GameMode)
 Turn on LEDs or outputs to active the specified output channel.
 */
 #if defined(MR_LX)
-static void SetOutput_LX(BYTE Output, BOOL Active)
+
+/*
+LED pins for each output channel on the LX, one mask per port like EXT_OUTPUT_PINS. The RB 
+cymbals use the LED of the pad with the same color, plus the ALT LED. Channel 5 is the 
+orange cymbal in GH mode, which has its own LED (see WriteChannelLeds()).
+*/
+#define CHANNEL_LED_COUNT	9
+
+static ROM TPortMasks CHANNEL_LED_PINS[CHANNEL_LED_COUNT] =
 {
-	switch (Output)
-	{
-		case 0:  // red drum
-			if (Active)
-				ledCH1 = LED_OUTPUT_ON;
-			else
-				ledCH1 = LED_OUTPUT_OFF;
-			break;
+	//  PORTA       PORTB       PORTC       PORTD
+	{ 0b00000000, 0b00001000, 0b00000000, 0b00000000 }, // 0: red drum (CH1)
+	{ 0b00000000, 0b00000100, 0b00000000, 0b00000000 }, // 1: yellow drum (CH2)
+	{ 0b00000000, 0b00000010, 0b00000000, 0b00000000 }, // 2: blue drum (CH3)
+	{ 0b00000000, 0b00000001, 0b00000000, 0b00000000 }, // 3: green drum (CH4)
+	{ 0b00000000, 0b00000000, 0b00000000, 0b10000000 }, // 4: bass pedal (CH5)
+	{ 0b00000000, 0b00000100, 0b00000000, 0b00100000 }, // 5: yellow RB cymbal (CH2 + ALT)
+	{ 0b00000000, 0b00000010, 0b00000000, 0b00100000 }, // 6: blue RB cymbal (CH3 + ALT)
+	{ 0b00000000, 0b00000001, 0b00000000, 0b00100000 }, // 7: green RB cymbal (CH4 + ALT)
+	{ 0b00000000, 0b00000000, 0b00000000, 0b01000000 }  // 8: RB hi hat pedal (CH6)
+};
 
-		case 1: // yellow drum
-			if (Active)
-				ledCH2 = LED_OUTPUT_ON;
-			else
-				ledCH2 = LED_OUTPUT_OFF;
-			break;
+#define GH_CYMBAL_LED_D	0b01000000 // orange GH cymbal (CH6)
 
-		case 2: // blue drum
-			if (Active)
-				ledCH3 = LED_OUTPUT_ON;
-			else
-				ledCH3 = LED_OUTPUT_OFF;
-			break;
+// all of the channel LED pins (CH1-CH6 and ALT)
+#define CHANNEL_LED_PINS_B	0b00001111
+#define CHANNEL_LED_PINS_D	0b11100000
 
-		case 3: // green drum
-			if (Active)
-				ledCH4 = LED_OUTPUT_ON;
-			else
-				ledCH4 = LED_OUTPUT_OFF;
-			break;
+/*
+Turn on the LEDs for the channels in Channels (bit 0 = channel 0), and turn off the rest. 
+All the LEDs change with one write to LATB and LATD, so there's no flicker when a pad and 
+a cymbal of the same color share an LED. The output timer ISR writes the external outputs 
+on the same ports, so it's held off while the ports are updated.
+*/
+static void WriteChannelLeds(UINT16 Channels)
+{
+	UINT8 nChannel;
+	BYTE nLatB, nLatD;
 
-		case 4: // bass pedal (orange)
-			if (Active)
-				ledCH5 = LED_OUTPUT_ON;
-			else
-				ledCH5 = LED_OUTPUT_OFF;
-			break;
+	m_ChannelLeds = Channels;
 
-		case 5: 
-			if (g_GameMode == gmGUITAR_HERO) // orange GH cymbal
-			{
-				if (Active)
-					ledCH6 = LED_OUTPUT_ON;
-				else
-					ledCH6 = LED_OUTPUT_OFF;
-			}
-			else // yellow RB cymbal
-			{
-				if (Active)
-					ledCH2 = LED_OUTPUT_ON;
-				else
-					ledCH2 = LED_OUTPUT_OFF;
-				ledALT = ledCH2;
-			}
-			break;
+	nLatB = 0;
+	nLatD = 0;
+	for (nChannel = 0; (Channels != 0) && (nChannel < CHANNEL_LED_COUNT); ++nChannel, Channels >>= 1)
+	{
+		if (!(Channels & 0x01))
+			continue;
 
-		case 6: // blue RB cymbal
-			if (Active)
-				ledCH3 = LED_OUTPUT_ON;
-			else
-				ledCH3 = LED_OUTPUT_OFF;
-			ledALT = ledCH3;
-			break;
+		if ((nChannel == 5) && (g_GameMode == gmGUITAR_HERO))
+			nLatD |= GH_CYMBAL_LED_D;
+		else
+		{
+			nLatB |= CHANNEL_LED_PINS[nChannel].B;
+			nLatD |= CHANNEL_LED_PINS[nChannel].D;
+		}
+	}
 
-		case 7: // green RB cymbal
-			if (Active)
-				ledCH4 = LED_OUTPUT_ON;
-			else
-				ledCH4 = LED_OUTPUT_OFF;
-			ledALT = ledCH4;
-			break;
-			
-		case 8: // RB hi hat pedal
-			if (Active)
-				ledCH6 = LED_OUTPUT_ON;
-			else
-				ledCH6 = LED_OUTPUT_OFF;
-			break;
-	} // switch (Output)
+	// LEDs are active low (LED_OUTPUT_ON)
+	PIE1bits.CCP1IE = 0; // hold off the output timer ISR
+	LATB = (LATB | CHANNEL_LED_PINS_B) & ~nLatB;
+	LATD = (LATD | CHANNEL_LED_PINS_D) & ~nLatD;
+	PIE1bits.CCP1IE = 1;
+}
+
+
+static void SetOutput_LX(BYTE Output, BOOL Active)
+{
+	UINT16 nChannels;
+
+	nChannels = m_ChannelLeds;
+
+	if (Output < CHANNEL_LED_COUNT)
+	{
+		if (Active)
+			nChannels |= (1 << Output);
+		else
+			nChannels &= ~(1 << Output);
+	}
 
+	WriteChannelLeds(nChannels);
 } // SetOutput_LX()
 
 #else
@@ -1944,114 +3141,218 @@ static void SetOutput_MR(BYTE Output, BOOL Active)
 }
 #endif // if MR_LX..else
 
-// button press counts (16bit value)
-#if defined(XBOX_RB2_INTERFACE)
-	// Xbox loop runs much faster, so counts have to be longer
-	#define PRESS_COUNT 	80   // how long button has to be pressed (or released) before the state changes
-	#define HOLD_COUNT  	2000 // how long a button has to be pressed before it's considered held down
-	#define LONG_HOLD_COUNT 6000 // long press hold count
-	#define SUPER_LONG_HOLD_COUNT 16000 // super long press count 
-#else
-	#define PRESS_COUNT 	4   // how long button has to be pressed (or released) before the state changes
-	#define HOLD_COUNT  	100 // how long a button has to be pressed before it's considered held down
-	#define LONG_HOLD_COUNT 300	// long press hold count
-	#define SUPER_LONG_HOLD_COUNT 800 // super long press count 
+
+/*
+Start a press on the channel's output. The output timer ISR releases the output again after
+PressTicks, and then keeps the channel busy for GapTicks more. 
+*/
+static void StartOutput(UINT8 Channel, UINT16 PressTicks, UINT16 GapTicks)
+{
+	UINT8 nMask;
+
+	if (PressTicks == 0)
+		return;
+
+#if defined(PERF_STATS)
+	if (m_ChannelPresses[Channel] < 0xFFFF)
+		++m_ChannelPresses[Channel];
+#endif
+
+	nMask = 1 << Channel;
+
+	PIE1bits.CCP1IE = 0; // hold off the output timer ISR
+
+	m_OutputTicks[Channel] = PressTicks;
+	m_OutputGapTicks[Channel] = GapTicks;
+	m_OutputActive |= nMask;
+	m_OutputBusy |= nMask;
+	m_OutputLatch |= nMask;
+
+#if defined(LX_EXT_OUTS)
+	WriteExtOutputs(); // don't wait for the next tick
+#endif
+
+	PIE1bits.CCP1IE = 1;
+}
+
+/*
+Button timing. The switches are sampled every BUTTON_SAMPLE_MS, and have to read the same 
+for 4 samples in a row to change. The hold times are from when the button was pressed.
+These are all in ms of g_MsTickCount, so they are the same for every target and don't 
+depend on how fast the main loop runs.
+*/
+#define BUTTON_SAMPLE_MS			10
+#define BUTTON_RELEASED_MS			40   // how long the *_RELEASED states last before bsUP
+#define BUTTON_HOLD_MS				1000 // how long a button has to be pressed before it's considered held down
+#define BUTTON_LONG_HOLD_MS			3000 // long press hold time
+#define BUTTON_SUPER_LONG_HOLD_MS	8000 // super long press hold time
+
+#if (BUTTON_SAMPLE_MS >= 0x80) || (BUTTON_SUPER_LONG_HOLD_MS >= 0x8000)
+	!!!"ERROR: button times too long for the tick comparisons in UpdateButtonStates()"
 #endif
 
-static void DoButtonStateMachine(BOOL Pressed, TButtonStatus * PState)
+/*
+Reads all the switches into a bit vector (1 = pressed).
+*/
+static TButtonBits ReadButtons(void)
 {
+	TButtonBits nButtons = 0;
+
+	if (swNAV_CENTER == SW_PRESSED)
+		nButtons |= BUTTON_BIT(NAV_CENTER_INDEX);
+	if (swNAV_LEFT == SW_PRESSED)
+		nButtons |= BUTTON_BIT(NAV_LEFT_INDEX);
+	if (swNAV_RIGHT == SW_PRESSED)
+		nButtons |= BUTTON_BIT(NAV_RIGHT_INDEX);
+	if (swNAV_UP == SW_PRESSED)
+		nButtons |= BUTTON_BIT(NAV_UP_INDEX);
+	if (swNAV_DOWN == SW_PRESSED)
+		nButtons |= BUTTON_BIT(NAV_DOWN_INDEX);
+	if (swSTART == SW_PRESSED)
+		nButtons |= BUTTON_BIT(START_BTN_INDEX);
+	if (swBACK == SW_PRESSED)
+		nButtons |= BUTTON_BIT(BACK_BTN_INDEX);
+
+#if !defined(MR_LX)
+	// extra buttons on the MR-1
+	if (swHOME == SW_PRESSED)
+		nButtons |= BUTTON_BIT(HOME_BTN_INDEX);
+	if (swFUNCTION == SW_PRESSED)
+		nButtons |= BUTTON_BIT(FSWITCH_INDEX);
+#endif
+
+#if defined(EXT_PEDAL)
+	if (swEXT_PEDAL == SW_PRESSED)
+		nButtons |= BUTTON_BIT(EXT_PEDAL_INDEX);
+#endif
+
+	return nButtons;
+}
+
+
 /*
-Given the current state of the button (pressed or not), this routine updates the button status depending
-on how long it has been in the current state, what the previous state was etc...
+Checks the buttons and updates the states of each one. The StateChanged flags are only set 
+for the one call where the state changed.
+
+Every BUTTON_SAMPLE_MS all the switches are debounced at once with a vertical counter, which 
+counts down from 3 for each button that reads different from its debounced state, and gets 
+reset to 3 when it reads the same. The buttons that get to 0 change state. After that only 
+the buttons that are pressed (for the hold times), or were just released, need to be looked 
+at one by one.
 */
+static void UpdateButtonStates(void)
+{
+	TButtonBits nButtons, nDelta, nChanged, nPending, nMask;
+	TButtonStatus * pStatus;
+	UINT16 nNow, nElapsed;
+	UINT8 nIndex, nSamples;
 	BYTE bsState;
+#if defined(PERF_STATS)
+	BYTE nStartTick;
+	WORD nStartTimer;
 
-	PState->StateChanged = FALSE; // default to no change
-	bsState = PState->State; // current state
+	ReadPerfTime(&nStartTick, &nStartTimer);
+#endif
 
-	// if switch has changed position, reset the count
-	if (Pressed != PState->Pressed)
+	if (m_ButtonsChanged)
 	{
-		PState->Count = 0;
-		PState->Pressed = Pressed;
+		for (nIndex = 0; nIndex < BUTTON_COUNT; ++nIndex)
+			m_ButtonStatus[nIndex].StateChanged = FALSE;
+		m_ButtonsChanged = FALSE;
+	}
 
-		if (!Pressed) // no longer pressed
-		{
-			// if switch was pressed/held, then change it to be released
-			if (bsState & bsHELD_DOWN)
-				bsState = bsHOLD_RELEASED;
-			else if (bsState & bsPRESSED)
-				bsState = bsPRESS_RELEASED;
-		}
+	if ((UINT8)((UINT8)g_MsTickCount - m_NextButtonTime) >= 0x80)
+		return; // not time for the next sample yet
+
+	/*
+	Keep the samples on a fixed grid, so the sample rate doesn't depend on how often this 
+	gets called. If it's a whole sample late (a slow loop, or the loop was held up) then 
+	start over from now, and count this read as the sample that was missed as well, so 
+	the debounce still takes the same time. It never counts for more than two, so a 
+	button can't change on one read after a long stall.
+	*/
+	nNow = ReadMsTick();
+	nSamples = 1;
+	m_NextButtonTime += BUTTON_SAMPLE_MS;
+	if ((UINT8)((UINT8)nNow - m_NextButtonTime) < 0x80)
+	{
+		m_NextButtonTime = (UINT8)nNow + BUTTON_SAMPLE_MS;
+		nSamples = 2;
 	}
-	else // switch hasn't changed position
+
+	// debounce
+	nButtons = ReadButtons();
+	nChanged = 0;
+	do
+	{
+		nDelta = nButtons ^ m_ButtonsDown;
+		m_ButtonCount0 = ~(m_ButtonCount0 & nDelta);
+		m_ButtonCount1 = m_ButtonCount0 ^ (m_ButtonCount1 & nDelta);
+		nDelta &= m_ButtonCount0 & m_ButtonCount1;
+		m_ButtonsDown ^= nDelta;
+		nChanged |= nDelta;
+	} while (--nSamples);
+
+	// update the states
+	m_ButtonsTimed |= nChanged;
+	nPending = m_ButtonsTimed;
+	nMask = 1;
+	for (nIndex = 0; nPending != 0; ++nIndex, nMask <<= 1)
 	{
-		// increment count
-		if (PState->Count < SUPER_LONG_HOLD_COUNT)
-			++PState->Count;
+		if (!(nPending & nMask))
+			continue;
 
-		// if not pressed long enough, then don't update any further
-		if (PState->Count < PRESS_COUNT)
-			return;
+		nPending &= ~nMask;
+
+		pStatus = &m_ButtonStatus[nIndex];
+		bsState = pStatus->State;
 
-		if (Pressed) // button is pressed
+		if (nChanged & nMask)
 		{
-			// if pressed for long enough, then mark it as held down
-			if (bsState & bsPRESSED)
-			{
-				if (PState->Count >= SUPER_LONG_HOLD_COUNT) 
-					bsState |= bsHELD_DOWN_SUPER_LONG; // really long hold
-				if (PState->Count >= LONG_HOLD_COUNT)
-					bsState |= bsHELD_DOWN_LONG; // long hold
-				else if (PState->Count >= HOLD_COUNT)
-					bsState |= bsHELD_DOWN; // short hold
-			}
-			else 
+			pStatus->ChangeTime = nNow;
+
+			if (m_ButtonsDown & nMask)
 				bsState = bsPRESSED;
-		}
-		else // button not pressed
-		{
-			if (bsState & (bsPRESS_RELEASED | bsHOLD_RELEASED)) // if was released, then now it is up
-				bsState = bsUP;
 			else if (bsState & bsHELD_DOWN) // if it was held down, then now it is released
 				bsState = bsHOLD_RELEASED;
-			else if (bsState & bsPRESSED) // if it was pressed, then now it is released
+			else // it was pressed, so now it is released
 				bsState = bsPRESS_RELEASED;
 		}
-	}
-
-	// update state if changed
-	if (bsState != PState->State)
-	{
-		PState->State = bsState;
-		PState->StateChanged = TRUE;
-	}
-}
-
-
-/*
-Checks the buttons and updates the states of each one. Each button is like a mini state machine.
-*/
-static void UpdateButtonStates(void)
-{
-	BYTE bCurrentPosition;
+		else
+		{
+			nElapsed = nNow - pStatus->ChangeTime;
 
-	DoButtonStateMachine(swNAV_CENTER == SW_PRESSED, &m_ButtonStatus[NAV_CENTER_INDEX]);
-	DoButtonStateMachine(swNAV_LEFT == SW_PRESSED, &m_ButtonStatus[NAV_LEFT_INDEX]);
-	DoButtonStateMachine(swNAV_RIGHT == SW_PRESSED, &m_ButtonStatus[NAV_RIGHT_INDEX]);
-	DoButtonStateMachine(swNAV_UP == SW_PRESSED, &m_ButtonStatus[NAV_UP_INDEX]);
-	DoButtonStateMachine(swNAV_DOWN == SW_PRESSED, &m_ButtonStatus[NAV_DOWN_INDEX]);
-	DoButtonStateMachine(swSTART == SW_PRESSED, &m_ButtonStatus[START_BTN_INDEX]);
-	DoButtonStateMachine(swBACK == SW_PRESSED, &m_ButtonStatus[BACK_BTN_INDEX]);
+			if (m_ButtonsDown & nMask) 
+			{
+				// if pressed for long enough, then mark it as held down
+				if (nElapsed >= BUTTON_HOLD_MS)
+					bsState |= bsHELD_DOWN; // short hold
+				if (nElapsed >= BUTTON_LONG_HOLD_MS)
+					bsState |= bsHELD_DOWN_LONG; // long hold
+				if (nElapsed >= BUTTON_SUPER_LONG_HOLD_MS) 
+				{
+					bsState |= bsHELD_DOWN_SUPER_LONG; // really long hold
+					m_ButtonsTimed &= ~nMask; // nothing more to wait for
+				}
+			}
+			else if (nElapsed >= BUTTON_RELEASED_MS) // if was released, then now it is up
+			{
+				bsState = bsUP;
+				m_ButtonsTimed &= ~nMask;
+			}
+		}
 
-#if !defined(MR_LX)
-	// do extra buttons on the MR-1
-	DoButtonStateMachine(swHOME == SW_PRESSED, &m_ButtonStatus[HOME_BTN_INDEX]);
-	DoButtonStateMachine(swFUNCTION == SW_PRESSED, &m_ButtonStatus[FSWITCH_INDEX]);
-#endif
+		// update state if changed
+		if (bsState != pStatus->State)
+		{
+			pStatus->State = bsState;
+			pStatus->StateChanged = TRUE;
+			m_ButtonsChanged = TRUE;
+		}
+	}
 
-#if defined(EXT_PEDAL)
-	DoButtonStateMachine(swEXT_PEDAL == SW_PRESSED, &m_ButtonStatus[EXT_PEDAL_INDEX]);
+#if defined(PERF_STATS)
+	PerfTimeSince(nStartTick, nStartTimer, &g_PerfButtonTimeMax);
 #endif
 }
 
@@ -2100,8 +3401,8 @@ void UpdateButtonFlags_LX(void)
 		&&  (m_ButtonStatus[NAV_UP_INDEX].State & bsPRESSED))
 		{
 			// change the active map
-			g_MidiMapNumber = (g_MidiMapNumber + 1) % MIDI_MAP_COUNT;			
-			SetMidiMapNumber(g_MidiMapNumber, TRUE);
+			g_MidiMapNumber = NextMidiMapNumber();			
+			SetMidiMapNumber(g_MidiMapNumber);
 			return;
 		}
 				
@@ -2174,6 +3475,10 @@ void UpdateButtonFlags_LX(void)
 
 void UpdateInputReportData_LX(void)
 {
+#if defined(LX_EXT_OUTS)
+	UINT8 nExtButtons = 0; // external outputs activated by the front panel buttons
+#endif
+
 #if defined(LOG_MIDI_DATA)
 	/*
 	In logging mode, the input report data is filled in with the log data instead
@@ -2187,7 +3492,7 @@ void UpdateInputReportData_LX(void)
 #endif	
 
   	/*
-	The input report hid_report_in has the following structure:
+	The input report m_ReportNext has the following structure:
 
 	ROCK BAND 2 DRUMS
 
@@ -2242,6 +3547,7 @@ void UpdateInputReportData_LX(void)
 	Check button press states
 	*/
 	UpdateButtonStates(); // updates the state machine
+	UpdateLedSequence();
 
 	/*
 	Check for play/prog mode change by looking for START button to be held down.
@@ -2261,7 +3567,7 @@ void UpdateInputReportData_LX(void)
 				// exit program mode, go to play mode
 				m_bSystemMode = MODE_PLAY;
 				SelectProgramMode(-1); // update LED display for normal mode
-				SetMidiMapNumber(g_MidiMapNumber, FALSE); // update LED display
+				SetMidiMapNumber(g_MidiMapNumber); // update LED display
 			}
 		}
 	}
@@ -2294,8 +3600,8 @@ void UpdateInputReportData_LX(void)
 		if ((g_MidiSwapNote != INVALID_NOTE_NUMBER) && (g_MidiOnNote == g_MidiSwapNote))
 		{
 			// change the active map
-			g_MidiMapNumber = (g_MidiMapNumber + 1) % MIDI_MAP_COUNT;			
-			SetMidiMapNumber(g_MidiMapNumber, TRUE);
+			g_MidiMapNumber = NextMidiMapNumber();			
+			SetMidiMapNumber(g_MidiMapNumber);
 			g_MidiOnNote = INVALID_NOTE_NUMBER;
 		}
 #endif
@@ -2305,8 +3611,8 @@ void UpdateInputReportData_LX(void)
  		if (m_ButtonStatus[EXT_PEDAL_INDEX].StateChanged && (m_ButtonStatus[EXT_PEDAL_INDEX].State == bsPRESSED))
 		{
 			// change the active map
-			g_MidiMapNumber = (g_MidiMapNumber + 1) % MIDI_MAP_COUNT;			
-			SetMidiMapNumber(g_MidiMapNumber, TRUE);
+			g_MidiMapNumber = NextMidiMapNumber();			
+			SetMidiMapNumber(g_MidiMapNumber);
 			g_MidiOnNote = INVALID_NOTE_NUMBER;
 		}
 #endif
@@ -2332,85 +3638,52 @@ void UpdateInputReportData_LX(void)
 	
 	
 		/*
-		Turn on/off indicator lights.
+		Turn on/off indicator lights (unless a LED sequence is playing).
 		*/
 		if (g_GameMode == gmGUITAR_HERO)
 		{
-			// Guitar Hero mode (6 channels)
-			SetOutput(0, m_ChannelOutputFlags & ofRED_PAD);
-			SetOutput(1, m_ChannelOutputFlags & ofYELLOW_PAD); // yellow cymbal on GH
-			SetOutput(2, m_ChannelOutputFlags & ofBLUE_PAD);
-			SetOutput(3, m_ChannelOutputFlags & ofGREEN_PAD);
-			SetOutput(4, m_ChannelOutputFlags & ofPEDAL1);
-			SetOutput(5, m_ChannelOutputFlags & ofORANGE_CYMBAL); // orange cymbal on GH
+			// Guitar Hero mode (6 channels), the yellow cymbal is on channel 1
+			if (!LedSequenceBusy())
+				WriteChannelLeds(m_ChannelOutputFlags & (ofRED_PAD | ofYELLOW_PAD | ofBLUE_PAD | ofGREEN_PAD 
+					| ofPEDAL1 | ofORANGE_CYMBAL));
 		}
 		else 
 		{
-			// Rock Band mode (5 channels plus 3 cymbals)
-			SetOutput(0, (m_ChannelOutputFlags & ofRED_PAD));
-			SetOutput(1, (m_ChannelOutputFlags & (ofYELLOW_PAD | ofYELLOW_CYMBAL)));
-			SetOutput(2, (m_ChannelOutputFlags & (ofBLUE_PAD | ofBLUE_CYMBAL)));
-			SetOutput(3, (m_ChannelOutputFlags & (ofGREEN_PAD | ofGREEN_CYMBAL)));
-			SetOutput(4, (m_ChannelOutputFlags & ofPEDAL1));
-			SetOutput(8, (m_ChannelOutputFlags & ofPEDAL2) != 0); // hi hat pedal in RB3
-
-			// turn on ALT LED if any of the cymbals is active
-			if (m_ChannelOutputFlags & (ofYELLOW_CYMBAL | ofBLUE_CYMBAL | ofGREEN_CYMBAL))
-				ledALT = LED_OUTPUT_ON;
-			else
-				ledALT = LED_OUTPUT_OFF;
+			/*
+			Rock Band mode (5 channels plus 3 cymbals and the hi hat pedal). The channel flags are 
+			in the same order as the channels, and the cymbals turn on the ALT LED too.
+			*/
+			if (!LedSequenceBusy())
+				WriteChannelLeds(m_ChannelOutputFlags);
 
 	#if defined(LX_EXT_OUTS) 
 			/*
 			Activate the external outputs for the Xbox interface. The RB1 and RB2 interfaces are a 
 			little different since RB1 doesn't have the cymbals.
 			
-			The main drum pads and kick pedal are activated by a mapped MIDI note (which sets a bit in 
-			m_ChannelOutputFlags), OR by one of the front panel buttons so that the user can navigate 
-			the menus on the Xbox using the buttons.
+			The main drum pads and kick pedal are activated by a mapped MIDI note (the output timer
+			ISR takes care of those), OR by one of the front panel buttons so that the user can navigate 
+			the menus on the Xbox using the buttons. Here we just figure out which outputs the buttons
+			activate, the ISR combines these with the MIDI outputs (see WriteExtOutputs()).
 			*/
-		#if defined(XBOX_RB2_INTERFACE)
-			// drum pad outputs
-			SetExtOutput_LX(0, (m_ChannelOutputFlags & ofRED_PAD)    || (m_wButtonFlags & BACK_BUTTON));		
-			SetExtOutput_LX(1, (m_ChannelOutputFlags & ofYELLOW_PAD) || (m_bNavButtonFlags == joyHAT_UP));
-			SetExtOutput_LX(2, (m_ChannelOutputFlags & ofBLUE_PAD)   || (m_bNavButtonFlags == joyHAT_DOWN));
-			SetExtOutput_LX(3, (m_ChannelOutputFlags & ofGREEN_PAD)  || (m_wButtonFlags & GREEN_DRUM));
-			
-			// activate pedal output when sticky flag is set too
-			SetExtOutput_LX(4, (m_ChannelOutputFlags & ofPEDAL1) || (m_bStickyButtonFlag == KICK_PEDAL));
+			if (m_wButtonFlags & BACK_BUTTON)
+				nExtButtons |= 0x01; // red pad
+			if (m_bNavButtonFlags == joyHAT_UP)
+				nExtButtons |= 0x02; // yellow pad
+			if (m_bNavButtonFlags == joyHAT_DOWN)
+				nExtButtons |= 0x04; // blue pad
 
-			// RB2 cymbal outputs
-			SetExtOutput_LX(5, m_ChannelOutputFlags & ofYELLOW_CYMBAL);
-			SetExtOutput_LX(6, m_ChannelOutputFlags & ofBLUE_CYMBAL);
-			SetExtOutput_LX(7, m_ChannelOutputFlags & ofGREEN_CYMBAL);
-			
-		#elif defined(ARCADE_INTERFACE)
-		
-			// for arcade interface, pads and cymbals are separate
-			SetExtOutput_LX(0, (m_ChannelOutputFlags & ofRED_PAD)    || (m_wButtonFlags & BACK_BUTTON));		
-			SetExtOutput_LX(1, (m_ChannelOutputFlags & ofYELLOW_PAD) || (m_bNavButtonFlags == joyHAT_UP));
-			SetExtOutput_LX(2, (m_ChannelOutputFlags & ofBLUE_PAD)   || (m_bNavButtonFlags == joyHAT_DOWN));
-			SetExtOutput_LX(3, (m_ChannelOutputFlags & ofGREEN_PAD)  || (m_wButtonFlags & START_BUTTON));
-			
-			// activate pedal output when sticky flag is set too
-			SetExtOutput_LX(4, (m_ChannelOutputFlags & ofPEDAL1) || (m_bStickyButtonFlag == KICK_PEDAL));
-			
-			// RB2 cymbal outputs
-			SetExtOutput_LX(5, m_ChannelOutputFlags & ofYELLOW_CYMBAL);
-			SetExtOutput_LX(6, m_ChannelOutputFlags & ofBLUE_CYMBAL);
-			SetExtOutput_LX(7, m_ChannelOutputFlags & ofGREEN_CYMBAL);
-			
+		#if defined(XBOX_RB2_INTERFACE)
+			if (m_wButtonFlags & GREEN_DRUM)
+				nExtButtons |= 0x08; // green pad
 		#else
-		
-			// for RB1, cymbals use same outputs as pads
-			SetExtOutput_LX(0, (m_ChannelOutputFlags & ofRED_PAD)                        || (m_wButtonFlags & BACK_BUTTON));		
-			SetExtOutput_LX(1, (m_ChannelOutputFlags & (ofYELLOW_PAD | ofYELLOW_CYMBAL)) || (m_bNavButtonFlags == joyHAT_UP));
-			SetExtOutput_LX(2, (m_ChannelOutputFlags & (ofBLUE_PAD | ofBLUE_CYMBAL))     || (m_bNavButtonFlags == joyHAT_DOWN));
-			SetExtOutput_LX(3, (m_ChannelOutputFlags & (ofGREEN_PAD | ofGREEN_CYMBAL))   || (m_wButtonFlags & START_BUTTON));
+			if (m_wButtonFlags & START_BUTTON)
+				nExtButtons |= 0x08; // green pad
+		#endif
 			
 			// activate pedal output when sticky flag is set too
-			SetExtOutput_LX(4, (m_ChannelOutputFlags & ofPEDAL1) || (m_bStickyButtonFlag == KICK_PEDAL));
-		#endif
+			if (m_bStickyButtonFlag == KICK_PEDAL)
+				nExtButtons |= 0x10;
 	#endif
 		} 
 
@@ -2423,19 +3696,20 @@ void UpdateInputReportData_LX(void)
 		ledALT = LED_OUTPUT_ON;
 		ledM1 = LED_OUTPUT_OFF;
 		ledM2 = LED_OUTPUT_OFF;
-		DisplayValue(g_MinVelocity / VELOCITY_INCREMENT);
+		if (!LedSequenceBusy())
+			DisplayValue(VELOCITY_LEVEL(g_MinVelocity));
 
 		// if BACK button (button 2) is held down, reset velocity to default
 		if (m_ButtonStatus[BACK_BTN_INDEX].StateChanged && (m_ButtonStatus[BACK_BTN_INDEX].State & bsHELD_DOWN))
 		{
 			g_MinVelocity = DEFAULT_VELOCITY_THRESHOLD;
-			WriteEEData(EEADDR_VEL_THRESH, g_MinVelocity);
+			SaveSetting(EEADDR_VEL_THRESH, g_MinVelocity);
 		}
 
 		/*
 		The NAV UP/DOWN button is used to change the velocity setting		
 		*/
-		nLevel = (g_MinVelocity / VELOCITY_INCREMENT);
+		nLevel = VELOCITY_LEVEL(g_MinVelocity);
 
 		if (m_ButtonStatus[NAV_UP_INDEX].StateChanged && (m_ButtonStatus[NAV_UP_INDEX].State == bsPRESSED))
 		{
@@ -2445,7 +3719,7 @@ void UpdateInputReportData_LX(void)
 			else
 				g_MinVelocity = 0;
 
-			WriteEEData(EEADDR_VEL_THRESH, g_MinVelocity);
+			SaveSetting(EEADDR_VEL_THRESH, g_MinVelocity);
 		}
 		else if (m_ButtonStatus[NAV_DOWN_INDEX].StateChanged && (m_ButtonStatus[NAV_DOWN_INDEX].State == bsPRESSED))
 		{
@@ -2455,7 +3729,7 @@ void UpdateInputReportData_LX(void)
 			else
 				g_MinVelocity = 6 * VELOCITY_INCREMENT; // max MIDI velocity is 127
 
-			WriteEEData(EEADDR_VEL_THRESH, g_MinVelocity);
+			SaveSetting(EEADDR_VEL_THRESH, g_MinVelocity);
 		}
 
 		// If NAV CENTER button is held down, then go to PROG3 mode
@@ -2479,7 +3753,7 @@ void UpdateInputReportData_LX(void)
 			if (g_MidiMapNumber > 0)
 			{
 				--g_MidiMapNumber;
-				SetMidiMapNumber(g_MidiMapNumber, TRUE);
+				SetMidiMapNumber(g_MidiMapNumber);
 				SelectProgramMode(0);
 			}
 		}
@@ -2488,7 +3762,7 @@ void UpdateInputReportData_LX(void)
 			if (g_MidiMapNumber < MIDI_MAP_COUNT - 1)
 			{
 				++g_MidiMapNumber;
-				SetMidiMapNumber(g_MidiMapNumber, TRUE);
+				SetMidiMapNumber(g_MidiMapNumber);
 				SelectProgramMode(0);
 			}
 		}
@@ -2525,25 +3799,13 @@ void UpdateInputReportData_LX(void)
 		// if BACK button held down for a super long time, reset map to default
 		if (m_ButtonStatus[BACK_BTN_INDEX].StateChanged && (m_ButtonStatus[BACK_BTN_INDEX].State & bsHELD_DOWN_SUPER_LONG))
 		{
-			DisplayValue(0x0F);
-			DelayMillisecs(75);
-			
-			DisplayValue(0x00);
-			DelayMillisecs(75);
-			
-			DisplayValue(0x0F);
-			DelayMillisecs(75);
-			
-			DisplayValue(0x00);
-			DelayMillisecs(75);
-			
-			DisplayValue(0x0F);
-			DelayMillisecs(75);
-			
 			RestoreDefaultMap(g_MidiMapNumber);
 			
 			m_bSystemMode = MODE_PLAY;
 			SelectProgramMode(-1); // exit program mode
+
+			// flash all the LEDs 3 times
+			QueueLedStep(lsBAR, 0x0F, LED_MS(80), 3);
 		}
 		// if BACK button held down for a long time, erase the whole map
 		else if (m_ButtonStatus[BACK_BTN_INDEX].StateChanged && (m_ButtonStatus[BACK_BTN_INDEX].State & bsHELD_DOWN_LONG))
@@ -2552,28 +3814,20 @@ void UpdateInputReportData_LX(void)
 			
 			// erase all channels
 			for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
-			{
-				ledPROG = LED_OUTPUT_OFF;
-				DisplayValue(0x0F);
-				DelayMillisecs(50);
-
 				ClearMidiMapChannel(nChannel);
-
-				ledPROG = LED_OUTPUT_ON;
-				DisplayValue(0x00);
-				DelayMillisecs(50);
-			}
 			
 			// restore LEDs to proper state
 			SelectProgramMode(m_MidiChannelToProgram);
+
+			// flash all the LEDs once for each channel, then turn the channel's LED back on
+			QueueLedStep(lsBAR_PROG, 0x0F, LED_MS(50), MIDI_CHANNEL_COUNT);
+			QueueLedStep(lsCHANNEL, m_MidiChannelToProgram, 0, 1);
 		}
 		// if BACK button is held down, clear out the map for this output
 		else if (m_ButtonStatus[BACK_BTN_INDEX].StateChanged && (m_ButtonStatus[BACK_BTN_INDEX].State & bsHELD_DOWN))
 		{
 			ClearMidiMapChannel(m_MidiChannelToProgram);
-			ledPROG = LED_OUTPUT_OFF;
-			DelayMillisecs(250);
-			ledPROG = LED_OUTPUT_ON;
+			QueueLedStep(lsPROG, 0, LED_MS(250), 1);
 		}
 
 		// check for MIDI data, assign to the channel
@@ -2596,13 +3850,14 @@ void UpdateInputReportData_LX(void)
 		ledALT = LED_OUTPUT_OFF;
 		ledM1 = LED_OUTPUT_OFF;
 		ledM2 = LED_OUTPUT_OFF;
-		DisplayValue(g_MidiHoldCount);
+		if (!LedSequenceBusy())
+			DisplayValue(g_MidiHoldCount);
 
 		// if BACK button is held down, reset value to default
 		if (m_ButtonStatus[BACK_BTN_INDEX].StateChanged && (m_ButtonStatus[BACK_BTN_INDEX].State & bsHELD_DOWN))
 		{
 			g_MidiHoldCount = MIDI_HOLD_COUNT;
-			WriteEEData(EEADDR_HOLD_COUNT, g_MidiHoldCount);
+			SaveSetting(EEADDR_HOLD_COUNT, g_MidiHoldCount);
 		}
 
 		/*
@@ -2615,7 +3870,7 @@ void UpdateInputReportData_LX(void)
 			if (g_MidiHoldCount > 1)
 				--g_MidiHoldCount;
 
-			WriteEEData(EEADDR_HOLD_COUNT, g_MidiHoldCount);
+			SaveSetting(EEADDR_HOLD_COUNT, g_MidiHoldCount);
 		}
 		else if (m_ButtonStatus[NAV_DOWN_INDEX].StateChanged && (m_ButtonStatus[NAV_DOWN_INDEX].State == bsPRESSED))
 		{
@@ -2623,14 +3878,14 @@ void UpdateInputReportData_LX(void)
 			if (g_MidiHoldCount < 6)
 				++g_MidiHoldCount;
 
-			WriteEEData(EEADDR_HOLD_COUNT, g_MidiHoldCount);
+			SaveSetting(EEADDR_HOLD_COUNT, g_MidiHoldCount);
 		}
 
 		// If NAV CENTER button is held down, then go to note map program mode
 		if (m_ButtonStatus[NAV_CENTER_INDEX].StateChanged 
 		&& (m_ButtonStatus[NAV_CENTER_INDEX].State & bsHELD_DOWN))
 		{
-			SetMidiMapNumber(g_MidiMapNumber, FALSE); // to turn the LEDs back on
+			SetMidiMapNumber(g_MidiMapNumber); // to turn the LEDs back on
 			SelectProgramMode(0); // default to programming CH1
 			m_bSystemMode = MODE_PROG_MAP;
 		}
@@ -2685,10 +3940,14 @@ void UpdateInputReportData_LX(void)
 			m_wButtonFlags |= GREEN_DRUM | CYMBAL_FLAG;
 	}
 
+#if defined(LX_EXT_OUTS)
+	m_ExtButtonMask = nExtButtons; // the output timer ISR writes it to the outputs
+#endif
+
 	// copy bit flags to report buffer
-	hid_report_in[0] = (BYTE)m_wButtonFlags; // reports buttons 1-8 
-	hid_report_in[1] = (BYTE)(m_wButtonFlags >> 8); // buttons 9 thru 13
-	hid_report_in[2] = m_bNavButtonFlags; // reports strummer or nav switch position
+	m_ReportNext[0] = (BYTE)m_wButtonFlags; // reports buttons 1-8 
+	m_ReportNext[1] = (BYTE)(m_wButtonFlags >> 8); // buttons 9 thru 13
+	m_ReportNext[2] = m_bNavButtonFlags; // reports strummer or nav switch position
 
 	#if defined(PROCESS_HOST_CMD)
 	/*
@@ -2696,13 +3955,13 @@ void UpdateInputReportData_LX(void)
 	*/
 	if (g_HostCmdMode)
 	{
-		hid_report_in[3] = g_HostCmdResponseX; // send command response in X axis data
-		hid_report_in[4] = g_HostCmdResponseY; // send command response in Y axis data
-		hid_report_in[5] = g_HostCmdResponseZ; // send command response in Z axis data
+		m_ReportNext[3] = g_HostCmdResponseX; // send command response in X axis data
+		m_ReportNext[4] = g_HostCmdResponseY; // send command response in Y axis data
+		m_ReportNext[5] = g_HostCmdResponseZ; // send command response in Z axis data
 
-		hid_report_in[15] = (BYTE)m_wButtonFlags;
-		hid_report_in[16] = (BYTE)(m_wButtonFlags >> 8);
-		hid_report_in[17] = m_bNavButtonFlags;
+		m_ReportNext[15] = (BYTE)m_wButtonFlags;
+		m_ReportNext[16] = (BYTE)(m_wButtonFlags >> 8);
+		m_ReportNext[17] = m_bNavButtonFlags;
 	}
 	#endif
 }
@@ -2810,7 +4069,7 @@ Polls all the switches and midi channels and updates the HID input report accord
 #endif	
 
   	/*
-	The input report hid_report_in has the following structure:
+	The input report m_ReportNext has the following structure:
 
 	ROCK BAND 2 DRUMS
 
@@ -2865,6 +4124,7 @@ Polls all the switches and midi channels and updates the HID input report accord
 	Check button press states
 	*/
 	UpdateButtonStates();
+	UpdateLedSequence();
 
 	/*
 	Get position of analog knobs (mode, velocity)
@@ -2877,12 +4137,12 @@ Polls all the switches and midi channels and updates the HID input report accord
 		if (m_ButtonStatus[FSWITCH_INDEX].StateChanged)
 		{
 			// function switch determines which map to use
-			if (m_ButtonStatus[FSWITCH_INDEX].Pressed)
+			if (m_ButtonStatus[FSWITCH_INDEX].State & bsPRESSED)
 				g_MidiMapNumber = 1;
 			else
 				g_MidiMapNumber = 0;
 		
-			SetMidiMapNumber(g_MidiMapNumber, TRUE); // gets saved map
+			SetMidiMapNumber(g_MidiMapNumber);
 		}
 
 		// check if mode has changed
@@ -2909,8 +4169,8 @@ Polls all the switches and midi channels and updates the HID input report accord
 		if ((g_MidiSwapNote != INVALID_NOTE_NUMBER) && (g_MidiOnNote == g_MidiSwapNote))
 		{
 			// change the active map
-			g_MidiMapNumber = (g_MidiMapNumber + 1) % MIDI_MAP_COUNT;			
-			SetMidiMapNumber(g_MidiMapNumber, TRUE);
+			g_MidiMapNumber = NextMidiMapNumber();			
+			SetMidiMapNumber(g_MidiMapNumber);
 			g_MidiOnNote = INVALID_NOTE_NUMBER;
 		}
 #endif
@@ -2920,8 +4180,8 @@ Polls all the switches and midi channels and updates the HID input report accord
  		if (m_ButtonStatus[EXT_PEDAL_INDEX].StateChanged && (m_ButtonStatus[EXT_PEDAL_INDEX].State == bsPRESSED))
 		{
 			// change the active map
-			g_MidiMapNumber = (g_MidiMapNumber + 1) % MIDI_MAP_COUNT;			
-			SetMidiMapNumber(g_MidiMapNumber, TRUE);
+			g_MidiMapNumber = NextMidiMapNumber();			
+			SetMidiMapNumber(g_MidiMapNumber);
 			g_MidiOnNote = INVALID_NOTE_NUMBER;
 		}
 #endif
@@ -2958,7 +4218,7 @@ Polls all the switches and midi channels and updates the HID input report accord
 			SetOutput(6, m_ChannelOutputFlags & ofBLUE_CYMBAL);
 			SetOutput(7, m_ChannelOutputFlags & ofGREEN_CYMBAL);
 		}
-		else
+		else if (!LedSequenceBusy()) // these are only LEDs, so leave them alone during a LED sequence
 		{
 			if (g_GameMode == gmGUITAR_HERO)
 			{
@@ -3030,10 +4290,8 @@ Polls all the switches and midi channels and updates the HID input report accord
 		{
 			ClearMidiMapChannel(m_MidiChannelToProgram);
 
-			// toggle the LED off/on/off
-			SetOutput(m_MidiChannelToProgram, FALSE);
-			DelayMillisecs(300);
-			SetOutput(m_MidiChannelToProgram, TRUE);
+			// toggle the LED off/on
+			QueueLedStep(lsCHANNEL, m_MidiChannelToProgram, LED_MS(300), 1);
 		}
 
 		// check for MIDI data, assign to the channel
@@ -3093,9 +4351,9 @@ Polls all the switches and midi channels and updates the HID input report accord
 	}
 
 	// copy bit flags to report buffer
-	hid_report_in[0] = (BYTE)m_wButtonFlags; // reports drum buttons
-	hid_report_in[1] = (BYTE)(m_wButtonFlags >> 8); // buttons 9 thru 13
-	hid_report_in[2] = m_bNavButtonFlags; // reports strummer or nav switch position
+	m_ReportNext[0] = (BYTE)m_wButtonFlags; // reports drum buttons
+	m_ReportNext[1] = (BYTE)(m_wButtonFlags >> 8); // buttons 9 thru 13
+	m_ReportNext[2] = m_bNavButtonFlags; // reports strummer or nav switch position
 
 	#if defined(PROCESS_HOST_CMD)
 	/*
@@ -3103,13 +4361,13 @@ Polls all the switches and midi channels and updates the HID input report accord
 	*/
 	if (g_HostCmdMode)
 	{
-		hid_report_in[3] = g_HostCmdResponseX; // send command response in X axis data
-		hid_report_in[4] = g_HostCmdResponseY; // send command response in Y axis data
-		hid_report_in[5] = g_HostCmdResponseZ; // send command response in Z axis data
+		m_ReportNext[3] = g_HostCmdResponseX; // send command response in X axis data
+		m_ReportNext[4] = g_HostCmdResponseY; // send command response in Y axis data
+		m_ReportNext[5] = g_HostCmdResponseZ; // send command response in Z axis data
 
-		hid_report_in[15] = g_AdjustKnobPos;
-		hid_report_in[16] = m_bModePos;
-		hid_report_in[17] = swFUNCTION;
+		m_ReportNext[15] = g_AdjustKnobPos;
+		m_ReportNext[16] = m_bModePos;
+		m_ReportNext[17] = swFUNCTION;
 	}
 	#endif
 } // UpdateInputReportData_MR
@@ -6,6 +6,7 @@
 // CONDITIONAL COMPILE FLAGS ----------------------------------------------
 
 //#define MIDI_INTERRUPT // service the MIDI UART in an interrupt, otherwise it is polled.
+#define MIDI_RX_BUFFERED // UART interrupt only buffers the data, it gets parsed in the main loop
 //#define NOTE_OFF_CLEARS_FLAG // note OFF event clears the midi channel output
 
 #define STICKY_SORT   // for mimicing holding down the kick pedal
@@ -17,6 +18,8 @@
 #define MULTIPLE_CHANNELS_PER_NOTE // one note can trigger multiple outputs
 
 #define USE_HIHAT_THRESHOLD // use pedal position to determine hi hat note 
+#define USB_SOF_SYNC		// build the input report just before the host is expected to ask for it
+//#define PERF_STATS		// keep hit latency histogram and timing stats (see dcGET_PERF_STATS), only for measurement builds
 
 
 // CONSTANTS --------------------------------------------------------------
@@ -65,7 +68,10 @@
 
 
 // EEPROM addresses of various settings
-#define EE_VERSION 0x01
+#define EE_VERSION 0x03
+#define EE_VERSION_2 0x02 // no CRCs
+#define EE_VERSION_1 0x01 // MIDI maps saved as 8x8 tables (see ConvertOldMidiMap())
+#define EE_VERSION_1_MIGRATING 0x81 // the version 1 maps were being converted when the power went off
 
 //                        Address     Contents
 #define EEADDR_SYSTEM	  0x00  // System mode
@@ -73,13 +79,19 @@
 #define EEADDR_PCB_VER    0x02  // PCB version (FF if before V1.3)
 
 #define EEADDR_VERSION    0x10	// EEData Version
-#define EEADDR_HOLD_COUNT 0x12  // MIDI Note Duration
+#define EEADDR_SETTINGS_CRC 0x11 // CRC-8 of the settings record (see UpdateCrc8())
+#define EEADDR_SETTINGS   0x12  // settings record, SETTINGS_SIZE bytes:
+#define EEADDR_HOLD_COUNT 0x12  // MIDI Note Duration (10ms units)
 #define EEADDR_VEL_THRESH 0x13  // MIDI Note Velocity Threshold
 #define EEADDR_SWAP_NOTE  0x14  // MIDI Note number which switches to other map
 #define EEADDR_HIHAT_THRESHOLD 0x15 // Hi Hat pedal position threshold
+#define EEADDR_POLL_RATE  0x16  // USB poll rate in PS3 mode (POLL_RATE_CONSOLE or POLL_RATE_FAST)
+#define EEADDR_VEL_CURVE  0x17  // velocity curve (vcLINEAR etc...)
+#define SETTINGS_SIZE	  6
 
 #define EEADDR_MIDI_MAP1  0x20 // starting address of MIDI map table in EEPROM
-#define EEADDR_MIDI_MAP2  (EEADDR_MIDI_MAP1 + MIDI_TABLE_SIZE)
+#define EEADDR_MIDI_MAP2  (EEADDR_MIDI_MAP1 + MIDI_MAP_EE_SIZE)
+// 0xA0 - 0xFF is the EEPROM journal (see EEADDR_JOURNAL in EEData.h)
 
 #define SYS_MODE_PS3 	0  // Playstation 3
 #define SYS_MODE_XBOX 	1  // Xbox360
@@ -117,20 +129,66 @@
 #define gmROCK_BAND 	0
 #define gmGUITAR_HERO 	1
 
+#define OUTPUT_TICK_US	128 // output timer tick (g_TickCount)
+
+// USB poll rate options, the HID endpoint interval is in ms
+#define POLL_RATE_CONSOLE	0
+#define POLL_RATE_FAST		1  // for use with a PC
+#define USB_POLL_INTERVAL_CONSOLE	10
+#define USB_POLL_INTERVAL_FAST		1
+
+// velocity curves
+#define vcLINEAR		0
+#define vcLOG			1
+#define vcEXP			2
+#define vcCOMPRESSED	3
+#define VELOCITY_CURVE_COUNT	4
+
 #define HOST_CMD_BUF_SIZE 8 // make sure this is not bigger than HID_INT_OUT_EP_SIZE
 
 // error message constants
 #define ERR_VERSION 0x01
+#define ERR_SETTINGS 0x02 // settings or a map were damaged and had to be fixed, or an old map lost notes
 #define ERR_UART 	0x06
 #define ERR_EEPROM	0x08
 
+// LED sequence step actions (see QueueLedStep())
+#define lsCHANNEL	0 // turn the LED for output channel Value off, then back on
+#define lsPROG		1 // turn the PROG LED off, then back on (LX only)
+#define lsBAR		2 // show Value with DisplayValue(), then turn the LEDs off
+#define lsBAR_PROG	3 // same as lsBAR, and the PROG LED is off while Value is shown (LX only)
+#define lsERROR		4 // show error code Value in binary, then turn the LEDs off
+#define lsLED		5 // turn LED lnXXX Value on, then put it back the way it was
+#define lsSWEEP		6 // boot light show, lights the LEDs in BOOT_SWEEP[] one at a time like lsLED
+
+// LED numbers for lsLED (lnCH6 and lnALT to lnPROG are LX only)
+#define lnCH1		0
+#define lnCH2		1
+#define lnCH3		2
+#define lnCH4		3
+#define lnCH5		4
+#define lnCH6		5
+#define lnUSB		6
+#define lnMIDI		7
+#define lnALT		8
+#define lnM1		9
+#define lnM2		10
+#define lnPROG		11
+
+#define LED_STEP_MS		10 // units of the LED step times
+#define LED_MS(ms)		((UINT8)((ms) / LED_STEP_MS))
+
 
 // GLOBAL DATA -------------------------------------------------------
 
 
 extern BYTE g_SystemMode;
 extern BYTE g_MidiHoldCount;
+extern volatile UINT16 g_MsTickCount;
+extern volatile UINT8 g_TickCount;
+extern BOOL g_NewHitInReport;
 extern BYTE g_GameMode;
+extern BYTE g_UsbPollInterval;
 
 #ifdef PROCESS_HOST_CMD
 	extern BYTE g_HostCmdBuffer[HOST_CMD_BUF_SIZE];
@@ -148,10 +206,16 @@ extern BYTE g_GameMode;
 
 extern void Delay10Microsecs(UINT16 Count);
 extern void DelayMillisecs(UINT16 Count);
+extern UINT16 ReadMsTick(void);
 extern void DisplayValue(UINT8 Value);
 extern void ErrorMessage(UINT8 ErrorCode, BOOL Halt);
 extern void InitButtonStates(void);
+extern void InitOutputTimer(void);
 extern void InitReportData(void);
+extern BOOL LedSequenceBusy(void);
+extern void QueueLedStep(BYTE Action, BYTE Value, UINT8 Time, UINT8 Count);
+extern BOOL CommitInputReport(UINT8 * pReport, UINT8 * pLastReport);
+extern void ResendInputReport(void);
 
 #if defined(LOG_MIDI_DATA)
 	extern void AddDataToLog(UINT8 DataID, UINT Data);
@@ -160,13 +224,18 @@ extern void InitReportData(void);
 extern void Main_PS3(void);
 extern void Main_Wii(void);
 extern void Main_Xbox360(void);
+extern void OutputTimerISR(void);
 
 #ifdef PROCESS_HOST_CMD
 	extern void ProcessHostCommand(void);
 #endif
 
 extern void RecallStoredSettings(void);
+extern BOOL ServiceSettingsSave(void);
+extern void FlushSettingsSave(void);
 extern void SetPID(BYTE GameMode);
+extern BOOL SetPollRate(BYTE PollRate);
+extern void SetVelocityCurve(BYTE Curve);
 
 #if defined(MR_LX)
 	extern BYTE DoBootModeSelect_LX(void);
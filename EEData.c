@@ -1,11 +1,44 @@
 #include "EEData.h"
 #include <p18cxxx.h>
+#include "HardwareProfile.h" // for the flash block sizes
 
 /*
-Read a byte from EEPROM. This code is copied from read_B.c in the C18 library
+Queue of pending EEPROM writes. Each byte takes about 4ms to write, so instead of 
+waiting for every write to finish, the writes are put in this queue and 
+ServiceEEQueue() starts the next one from the main loop once the previous write is done.
+*/
+#define EE_QUEUE_SIZE	32
+
+static BYTE m_EEQueueAddress[EE_QUEUE_SIZE];
+static BYTE m_EEQueueData[EE_QUEUE_SIZE];
+static UINT8 m_EEQueueHead = 0;  // index of oldest entry
+static UINT8 m_EEQueueCount = 0; // number of entries waiting to be written
+
+// queue statistics (these stop counting at 255)
+UINT8 g_EEQueueHighWater = 0; // max number of entries that were waiting
+UINT8 g_EEQueueCoalesced = 0; // writes merged with one already in the queue
+UINT8 g_EEQueueForced = 0;	  // writes that had to wait because the queue was full
+
+
+/*
+Read a byte from EEPROM. This code is copied from read_B.c in the C18 library.
+If there is a write for this address still in the queue, then that value is
+returned instead.
 */
 BYTE ReadEEData(BYTE Address)
 {
+	UINT8 nCount, nIndex;
+
+	// newest value is the one in the queue
+	nIndex = m_EEQueueHead;
+	for (nCount = 0; nCount < m_EEQueueCount; ++nCount)
+	{
+		if (m_EEQueueAddress[nIndex] == Address)
+			return (m_EEQueueData[nIndex]);
+
+		nIndex = (nIndex + 1) % EE_QUEUE_SIZE;
+	}
+
 	// wait for any previous write to finish
 	while (EECON1bits.WR)
 		; // do nothing
@@ -20,8 +53,9 @@ BYTE ReadEEData(BYTE Address)
 
 
 /*
-Write to EEPROM. Waits for the write to complete before returning. This code comes 
-from write_B.c in the C18 library. 
+Write to EEPROM. Waits for any previous write to complete, and then starts the write 
+(it does NOT wait for this write to finish). This code comes from write_B.c in the 
+C18 library. Normally QueueEEData() should be used instead.
 */
 void WriteEEData(BYTE Address, BYTE Data)
 {
@@ -42,3 +76,395 @@ void WriteEEData(BYTE Address, BYTE Data)
 	EECON1bits.WREN = 0;// disable write to EEPROM
 }
 
+
+/*
+Add a write to the queue. If there is already a write for the same address in the queue 
+then its value is just replaced. If the queue is full, then the oldest entry is written 
+now (which has to wait for the current write to finish).
+*/
+void QueueEEData(BYTE Address, BYTE Data)
+{
+	UINT8 nCount, nIndex;
+
+	// look for a pending write to the same address
+	nIndex = m_EEQueueHead;
+	for (nCount = 0; nCount < m_EEQueueCount; ++nCount)
+	{
+		if (m_EEQueueAddress[nIndex] == Address)
+		{
+			m_EEQueueData[nIndex] = Data;
+
+			if (g_EEQueueCoalesced < 0xFF)
+				++g_EEQueueCoalesced;
+
+			return;
+		}
+
+		nIndex = (nIndex + 1) % EE_QUEUE_SIZE;
+	}
+
+	// make room if the queue is full
+	if (m_EEQueueCount >= EE_QUEUE_SIZE)
+	{
+		WriteEEData(m_EEQueueAddress[m_EEQueueHead], m_EEQueueData[m_EEQueueHead]);
+		m_EEQueueHead = (m_EEQueueHead + 1) % EE_QUEUE_SIZE;
+		--m_EEQueueCount;
+
+		if (g_EEQueueForced < 0xFF)
+			++g_EEQueueForced;
+	}
+
+	// add the new entry to the end of the queue
+	nIndex = (m_EEQueueHead + m_EEQueueCount) % EE_QUEUE_SIZE;
+	m_EEQueueAddress[nIndex] = Address;
+	m_EEQueueData[nIndex] = Data;
+	++m_EEQueueCount;
+
+	if (m_EEQueueCount > g_EEQueueHighWater)
+		g_EEQueueHighWater = m_EEQueueCount;
+}
+
+
+/*
+Queue a write only if the byte in EEPROM (or in the queue) is different. This saves
+EEPROM wear, and time, when only part of a block of data has changed.
+*/
+void UpdateEEData(BYTE Address, BYTE Data)
+{
+	if (ReadEEData(Address) != Data)
+		QueueEEData(Address, Data);
+}
+
+
+/*
+Adds Data to a CRC-8 (polynomial x^8 + x^2 + x + 1), start with CRC8_INIT. Used to check 
+the blocks of settings in EEPROM, so a block that was only partly written (e.g. the power 
+went off) can be found.
+*/
+BYTE UpdateCrc8(BYTE Crc, BYTE Data)
+{
+	UINT8 nBit;
+
+	Crc ^= Data;
+	for (nBit = 0; nBit < 8; ++nBit)
+	{
+		if (Crc & 0x80)
+			Crc = (Crc << 1) ^ 0x07;
+		else
+			Crc <<= 1;
+	}
+
+	return (Crc);
+}
+
+
+/*
+Call this from the main loop. If the EEPROM isn't busy, start writing the oldest 
+entry in the queue.
+*/
+void ServiceEEQueue(void)
+{
+	if ((m_EEQueueCount == 0) || EECON1bits.WR)
+		return;
+
+	WriteEEData(m_EEQueueAddress[m_EEQueueHead], m_EEQueueData[m_EEQueueHead]);
+	m_EEQueueHead = (m_EEQueueHead + 1) % EE_QUEUE_SIZE;
+	--m_EEQueueCount;
+}
+
+
+/*
+Write everything in the queue and wait for the last write to finish. Use this before
+anything that could lose the queued data (e.g. suspend or reset).
+*/
+void FlushEEQueue(void)
+{
+	while (m_EEQueueCount)
+	{
+		WriteEEData(m_EEQueueAddress[m_EEQueueHead], m_EEQueueData[m_EEQueueHead]);
+		m_EEQueueHead = (m_EEQueueHead + 1) % EE_QUEUE_SIZE;
+		--m_EEQueueCount;
+	}
+
+	// wait for the last write to finish
+	while (EECON1bits.WR)
+		; // do nothing
+}
+
+
+/*
+Returns the number of writes waiting in the queue.
+*/
+UINT8 GetEEQueueCount(void)
+{
+	return (m_EEQueueCount);
+}
+
+
+
+/*------------------------------------------------------------------------------
+
+	EEPROM journal
+
+	Settings that change a lot (e.g. the velocity threshold, which is saved every time 
+	NAV UP/DOWN is pressed) are appended to a ring of records instead of being written to 
+	the same byte every time, so the writes are spread over EE_JOURNAL_SLOTS bytes. Each 
+	record is 2 bytes:
+
+	byte 0	key: bit 7 = lap, bits 6-4 = setting ID (7 = empty), bits 3-0 = check
+	byte 1	value
+
+	The check is the low 4 bits of the CRC-8 of the top of the key and the value. The value
+	is written first and the key last, so a record that was cut off by the power going off
+	fails the check and is skipped.
+
+	The lap bit is flipped each time the ring wraps around, so the next free slot is the
+	first one whose lap bit is different from slot 0's. At power up the ring is read from
+	the oldest record to the newest to find the latest value of each setting, which is kept
+	in RAM along with the slot it's in. Before a record is written over, if it has the
+	latest value of a setting then that record is copied to the front first, so the ring
+	never loses a setting that hasn't been changed in a while.
+
+------------------------------------------------------------------------------*/
+
+#define EE_JOURNAL_FORMAT	0x4A // EEADDR_JOURNAL has this once the journal has been set up
+#define EEADDR_JOURNAL_SLOTS (EEADDR_JOURNAL + 2)
+
+#define JOURNAL_LAP			0x80
+#define JOURNAL_EMPTY_ID	7
+#define JOURNAL_NO_SLOT		0xFF
+
+static BYTE m_JournalValue[EE_JOURNAL_IDS];
+static UINT8 m_JournalSlot[EE_JOURNAL_IDS]; // slot with the latest value, or JOURNAL_NO_SLOT
+static UINT8 m_JournalHead = 0;				// next slot to write
+static BYTE m_JournalLap = 0;				// lap bit for the records written this time around
+
+// journal statistics (these stop counting at 0xFFFF)
+WORD g_EEJournalSaves = 0;	 // settings that were changed
+WORD g_EEJournalRecords = 0; // records written for them (including the ones copied forward)
+
+
+static BYTE JournalKey(BYTE Lap, BYTE Id, BYTE Value)
+{
+	BYTE nKey;
+
+	nKey = Lap | (Id << 4);
+	return (nKey | (UpdateCrc8(nKey, Value) & 0x0F));
+}
+
+
+/*
+Set up an empty journal. Only the keys need to be written (as empty), the format byte 
+goes last.
+*/
+void FormatEEJournal(void)
+{
+	UINT8 nSlot;
+
+	for (nSlot = 0; nSlot < EE_JOURNAL_SLOTS; ++nSlot)
+		UpdateEEData(EEADDR_JOURNAL_SLOTS + (nSlot * 2), 0xFF);
+
+	UpdateEEData(EEADDR_JOURNAL, EE_JOURNAL_FORMAT);
+
+	for (nSlot = 0; nSlot < EE_JOURNAL_IDS; ++nSlot)
+		m_JournalSlot[nSlot] = JOURNAL_NO_SLOT;
+
+	m_JournalHead = 0;
+	m_JournalLap = 0; // the empty keys have the lap bit set
+}
+
+
+/*
+Read the journal at power up, to find the next free slot and the latest value of each 
+setting.
+*/
+void InitEEJournal(void)
+{
+	UINT8 nSlot, nCount;
+	BYTE nKey, nValue, nId, nLap;
+
+	if (ReadEEData(EEADDR_JOURNAL) != EE_JOURNAL_FORMAT)
+	{
+		FormatEEJournal();
+		return;
+	}
+
+	for (nId = 0; nId < EE_JOURNAL_IDS; ++nId)
+		m_JournalSlot[nId] = JOURNAL_NO_SLOT;
+
+	// find the first slot that hasn't been written this time around
+	nLap = ReadEEData(EEADDR_JOURNAL_SLOTS) & JOURNAL_LAP;
+	m_JournalHead = 0;
+	m_JournalLap = nLap ^ JOURNAL_LAP; // all the slots were written, so start the next lap
+
+	for (nSlot = 1; nSlot < EE_JOURNAL_SLOTS; ++nSlot)
+	{
+		if ((ReadEEData(EEADDR_JOURNAL_SLOTS + (nSlot * 2)) & JOURNAL_LAP) != nLap)
+		{
+			m_JournalHead = nSlot;
+			m_JournalLap = nLap;
+			break;
+		}
+	}
+
+	// go from the oldest record to the newest, so the newest value of each setting is kept
+	nSlot = m_JournalHead;
+	for (nCount = 0; nCount < EE_JOURNAL_SLOTS; ++nCount)
+	{
+		nKey = ReadEEData(EEADDR_JOURNAL_SLOTS + (nSlot * 2));
+		nValue = ReadEEData(EEADDR_JOURNAL_SLOTS + (nSlot * 2) + 1);
+		nId = (nKey >> 4) & 0x07;
+
+		if ((nId != JOURNAL_EMPTY_ID) && (nKey == JournalKey(nKey & JOURNAL_LAP, nId, nValue)))
+		{
+			m_JournalValue[nId] = nValue;
+			m_JournalSlot[nId] = nSlot;
+		}
+
+		if (++nSlot >= EE_JOURNAL_SLOTS)
+			nSlot = 0;
+	}
+}
+
+
+/*
+Get the latest value of setting Id. Returns FALSE if it isn't in the journal (it hasn't been
+saved since the journal was set up).
+*/
+BOOL ReadEEJournal(BYTE Id, BYTE * pValue)
+{
+	if ((Id >= EE_JOURNAL_IDS) || (m_JournalSlot[Id] == JOURNAL_NO_SLOT))
+		return FALSE;
+
+	*pValue = m_JournalValue[Id];
+	return TRUE;
+}
+
+
+static void AppendJournalRecord(BYTE Id, BYTE Value)
+{
+	BYTE nAddress;
+
+	nAddress = EEADDR_JOURNAL_SLOTS + (m_JournalHead * 2);
+
+	// the key goes last, so the record doesn't count until it's all there
+	UpdateEEData(nAddress + 1, Value);
+	QueueEEData(nAddress, JournalKey(m_JournalLap, Id, Value));
+
+	m_JournalValue[Id] = Value;
+	m_JournalSlot[Id] = m_JournalHead;
+
+	if (++m_JournalHead >= EE_JOURNAL_SLOTS)
+	{
+		m_JournalHead = 0;
+		m_JournalLap ^= JOURNAL_LAP;
+	}
+
+	if (g_EEJournalRecords < 0xFFFF)
+		++g_EEJournalRecords;
+}
+
+
+/*
+Save a new value for setting Id (0 to EE_JOURNAL_IDS - 1). Nothing is written if it hasn't
+changed.
+*/
+void WriteEEJournal(BYTE Id, BYTE Value)
+{
+	BYTE nId;
+
+	if (Id >= EE_JOURNAL_IDS)
+		return;
+
+	if ((m_JournalSlot[Id] != JOURNAL_NO_SLOT) && (m_JournalValue[Id] == Value))
+		return;
+
+	if (g_EEJournalSaves < 0xFFFF)
+		++g_EEJournalSaves;
+
+	// copy the latest value of a setting to the front before its record is written over
+	nId = 0;
+	while (nId < EE_JOURNAL_IDS)
+	{
+		if (m_JournalSlot[nId] == m_JournalHead)
+		{
+			AppendJournalRecord(nId, m_JournalValue[nId]);
+			nId = 0; // the next slot could be one too
+		}
+		else
+			++nId;
+	}
+
+	AppendJournalRecord(Id, Value);
+}
+
+
+
+/*
+Erase the ERASE_BLOCK_SIZE bytes of program memory starting at Address, which must be on an
+erase block boundary. The CPU stops until the erase is done (about 2ms). Be careful not to
+erase any code!
+*/
+void EraseFlashBlock(DWORD Address)
+{
+	// wait for any EEPROM write to finish
+	while (EECON1bits.WR)
+		; // do nothing
+
+	TBLPTRU = (BYTE)(Address >> 16);
+	TBLPTRH = (BYTE)(Address >> 8);
+	TBLPTRL = (BYTE)Address;
+
+	EECON1bits.EEPGD = 1; // point to program memory
+	EECON1bits.CFGS = 0; // access flash
+	EECON1bits.WREN = 1; // enable writes
+	EECON1bits.FREE = 1; // erase
+	INTCONbits.GIE = 0; // disable interrupts
+	EECON2 = 0x55;		// required sequence #1
+	EECON2 = 0xAA;		// #2
+	EECON1bits.WR = 1;	// start erase (CPU stalls)
+	INTCONbits.GIE = 1;	// restore interrupts
+	EECON1bits.WREN = 0;// disable writes
+}
+
+
+/*
+Write WRITE_BLOCK_SIZE bytes from pData to program memory at Address, which must be on a 
+write block boundary, and must have been erased first. The CPU stops until the write is 
+done (about 2ms).
+*/
+void WriteFlashBlock(DWORD Address, BYTE * pData)
+{
+	UINT8 nIndex;
+
+	// wait for any EEPROM write to finish
+	while (EECON1bits.WR)
+		; // do nothing
+
+	TBLPTRU = (BYTE)(Address >> 16);
+	TBLPTRH = (BYTE)(Address >> 8);
+	TBLPTRL = (BYTE)Address;
+
+	// load the holding registers
+	for (nIndex = 0; nIndex < WRITE_BLOCK_SIZE; ++nIndex)
+	{
+		TABLAT = *pData++;
+		_asm TBLWTPOSTINC _endasm
+	}
+
+	// TBLPTR has to point inside the block being written
+	TBLPTRU = (BYTE)(Address >> 16);
+	TBLPTRH = (BYTE)(Address >> 8);
+	TBLPTRL = (BYTE)Address;
+
+	EECON1bits.EEPGD = 1; // point to program memory
+	EECON1bits.CFGS = 0; // access flash
+	EECON1bits.WREN = 1; // enable writes
+	EECON1bits.FREE = 0; // write, not erase
+	INTCONbits.GIE = 0; // disable interrupts
+	EECON2 = 0x55;		// required sequence #1
+	EECON2 = 0xAA;		// #2
+	EECON1bits.WR = 1;	// start write (CPU stalls)
+	INTCONbits.GIE = 1;	// restore interrupts
+	EECON1bits.WREN = 0;// disable writes
+}
@@ -3,7 +3,36 @@
 
 #include <GenericTypeDefs.h>
 
+extern UINT8 g_EEQueueHighWater;
+extern UINT8 g_EEQueueCoalesced;
+extern UINT8 g_EEQueueForced;
+
+#define CRC8_INIT	0xFF // starting value for UpdateCrc8()
+
+/*
+EEPROM journal (see EEData.c). It takes up the EEPROM from EEADDR_JOURNAL to the end: a 
+format byte, a spare byte, then EE_JOURNAL_SLOTS records of 2 bytes each.
+*/
+#define EEADDR_JOURNAL		0xA0
+#define EE_JOURNAL_SLOTS	47
+#define EE_JOURNAL_IDS		7 // settings are numbered 0-6
+
+extern WORD g_EEJournalSaves;
+extern WORD g_EEJournalRecords;
+
+void EraseFlashBlock(DWORD Address);
+void FlushEEQueue(void);
+void FormatEEJournal(void);
+UINT8 GetEEQueueCount(void);
+void InitEEJournal(void);
+void QueueEEData(BYTE Address, BYTE Data);
 BYTE ReadEEData(BYTE Address);
+BOOL ReadEEJournal(BYTE Id, BYTE * pValue);
+void ServiceEEQueue(void);
+void UpdateEEData(BYTE Address, BYTE Data);
+BYTE UpdateCrc8(BYTE Crc, BYTE Data);
 void WriteEEData(BYTE Address, BYTE Data);
+void WriteEEJournal(BYTE Id, BYTE Value);
+void WriteFlashBlock(DWORD Address, BYTE * pData);
 
 #endif
\ No newline at end of file
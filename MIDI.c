@@ -16,6 +16,7 @@
 #include "Pinout.h"
 #include "MIDI.h"
 #include "App.h"
+#include "HardwareProfile.h" // for the flash block sizes
 
 /*------------------------------------------------------------------------------
 	Defines
@@ -23,6 +24,36 @@
 		
 #define BAUD	31250  // use 19200 for help when debugging
 
+#define TABLE_NOTES_PER_CHANNEL	8 // size of the default maps, and the maps from EE_VERSION 0x01
+
+/*
+Byte classes for the parser transition table. Channel messages are classed by the status
+nibble, system common messages (0xF0-0xF7) by the whole byte, and all data bytes are in 
+one class. System real-time bytes never get this far (see ParseMidiByte).
+*/
+#define bcSYSTEM_COMMON		7	// class of SYS_EX_START, the others follow on from it
+#define bcDATA				15
+#define BYTE_CLASS_COUNT	16
+
+/*
+Actions run by the parser. The action is kept in the upper nibble of a transition table
+entry and the next state in the lower nibble.
+*/
+#define acNONE				0x00
+#define acNOTE_ON_STATUS	0x10
+#define acNOTE_NUMBER		0x20
+#define acNOTE_VELOCITY		0x30
+#define acNOTE_OFF			0x40
+#define acCC_NUMBER			0x50
+#define acPEDAL_POSITION	0x60
+#define acSYS_EX_START		0x70
+#define acSYS_EX_DATA		0x80
+
+#define ACTION_MASK			0xF0
+#define STATE_MASK			0x0F
+
+#define TRANSITION(Action, NextState)	((Action) | (NextState))
+
 
 // TYPES ---------------------------------------------------------------
 
@@ -42,7 +73,11 @@ typedef enum
 	COLLECT_SYS_EX_DATA,		// 8
 	WAITING_FOR_CC_DATA1,		// 9
 	WAITING_FOR_PEDAL_DATA,		// 10
-	WAITING_FOR_CC_DATA2		// 11
+	WAITING_FOR_CC_DATA2,		// 11
+	WAITING_FOR_SYS_DATA1_ONLY,	// 12
+	WAITING_FOR_SYS_DATA1_OF_2,	// 13
+	WAITING_FOR_SYS_DATA2,		// 14
+	MIDI_STATE_COUNT			// must be 16 or less (see m_MidiTransitions)
 } TMidiState;
 
 
@@ -54,8 +89,32 @@ typedef enum
 BYTE g_RxData;
 BYTE g_TxData;
 
+#if defined(MIDI_RX_BUFFERED)
+	/*
+	Ring buffer between the UART ISR and the main loop. The ISR is the only writer of 
+	m_RxHead and the main loop is the only writer of m_RxTail, so no locking is needed
+	as long as each index is a single byte. 64 bytes is about 20ms of continuous MIDI data.
+	*/
+	#define MIDI_RX_BUF_SIZE	64 // must be a power of 2
+	#define MIDI_RX_BUF_MASK	(MIDI_RX_BUF_SIZE - 1)
+
+	static volatile BYTE m_RxBuf[MIDI_RX_BUF_SIZE];
+	static volatile BYTE m_RxHead = 0; 
+	static volatile BYTE m_RxTail = 0;
+	static volatile UINT8 m_RxByteTick; // g_TickCount when the last byte came in
+#endif
+
+static UINT8 m_ParseTick; // g_TickCount when the byte being parsed came in
+UINT8 g_MidiNoteTick;	  // g_TickCount when the last NOTE ON (that was used) came in
+UINT8 g_MidiNoteCount = 0; // bumped for every NOTE ON that was used
+
+// receive statistics (these stop counting at 255)
+UINT8 g_MidiRxOverrunCount = 0;  // number of UART overrun errors (OERR)
+UINT8 g_MidiRxOverflowCount = 0; // number of bytes dropped because the ring buffer was full
+UINT8 g_MidiRxHighWater = 0;	 // max number of bytes waiting in the ring buffer
+
 BYTE g_MidiMapNumber = 0;
-BYTE g_MidiMapEEPROMAddress = EEADDR_MIDI_MAP1;
+static volatile UINT8 m_ActiveMap = 0; // map used for the note lookups (see SetMidiMapNumber())
 
 UINT8 g_MessageID = 0;
 UINT8 g_MidiOnNote = INVALID_NOTE_NUMBER;
@@ -69,28 +128,83 @@ UINT8 g_HiHatThreshold = 64; // default to half-way pressed
 TMidiState	g_MessageState = WAITING_FOR_STATUS;
 
 /*
-Table which contains state of all the MIDI note flags. A flag is set when one of the notes 
-to which it's mapped is recieved.
+Queue of received hits for each channel. A hit is added when one of the notes to which the 
+channel is mapped is received, and removed by the app (see GetMidiHit()) when it's ready to
+output another press. This way hits that come in faster than the report rate aren't merged 
+into one press. The parser only writes m_HitIn[] and the app only writes m_HitOut[] (both
+free running), so the count of queued hits is m_HitIn - m_HitOut.
 */
-BOOL g_MidiChannelOutputs[MIDI_CHANNEL_COUNT] =
-{
-	0, 0, 0, 0, 
-	0, 0, 0, 0
-};
+#define HIT_QUEUE_SIZE	4 // must be a power of 2
+#define HIT_QUEUE_MASK	(HIT_QUEUE_SIZE - 1)
+
+static UINT8 m_HitVelocity[MIDI_CHANNEL_COUNT][HIT_QUEUE_SIZE];
+static UINT8 m_HitTime[MIDI_CHANNEL_COUNT][HIT_QUEUE_SIZE]; // low byte of g_MsTickCount when hit arrived
+static UINT8 m_HitIn[MIDI_CHANNEL_COUNT];
+static UINT8 m_HitOut[MIDI_CHANNEL_COUNT];
+
+UINT8 g_MidiHitsDropped = 0;	// hits lost because the queue was full (stops at 255)
+UINT8 g_MidiHitsStale = 0;		// hits discarded because they waited too long (stops at 255)
 
-UINT8 g_MidiChannelVelocity[MIDI_CHANNEL_COUNT];
+#if defined(PERF_STATS)
+	/*
+	Per channel hit accounting, so a recorded performance played into the MIDI input can be 
+	checked against what the controller did with it (see dcGET_CHANNEL_STATS).
+	*/
+	UINT16 g_ChannelHits[MIDI_CHANNEL_COUNT];	// mapped NOTE ONs (stops at 0xFFFF)
+	UINT8 g_ChannelDropped[MIDI_CHANNEL_COUNT]; // hits merged because the queue was full (stops at 255)
+	UINT8 g_ChannelStale[MIDI_CHANNEL_COUNT];	// hits that waited too long (stops at 255)
+	UINT8 g_ChannelMaxWait[MIDI_CHANNEL_COUNT]; // longest a hit was queued before being used (ms)
+#endif
 
 static BYTE m_SysExtDataBuf[16];
 static BYTE m_SysExtDataIndex = 0;
 
+static UINT8 m_PendingNote; // NOTE ON data 1 goes here until the velocity comes in
+
+#if defined(MIDI_OUT_ADAPTER)
+	static BOOL m_SendDataOut; // if false, then the byte being parsed isn't sent out MIDI OUT
+#endif
+
+/*
+All of the maps are kept in RAM, so changing maps is just a matter of changing m_ActiveMap
+(one byte, so the parser always sees a whole map) and the EEPROM is only used when a map 
+is edited. These tables are in the otherwise unused USB RAM banks (see the .lkr file).
+*/
+
+/*
+The maps. Each one is a list of the notes that are mapped to any channel, in note order, 
+with a bit mask of the channels each note is mapped to (bit 0 = channel 0). A channel can 
+have any number of notes, as long as the map has room for them. This is also how the maps 
+are saved in EEPROM (see SaveMidiMap()).
+*/
+#pragma udata MIDI_MAPS
+static UINT8 m_MapLength[MIDI_MAP_COUNT];
+static UINT8 m_MapNotes[MIDI_MAP_COUNT][MIDI_MAP_MAX_NOTES];
+static UINT8 m_MapMasks[MIDI_MAP_COUNT][MIDI_MAP_MAX_NOTES];
+
+/*
+Index for looking up the received notes: the index into this table is the MIDI note, and 
+the contents are the channel mask for the note (0 if it isn't mapped). It has to be kept up
+to date whenever the map is changed (see SetNoteChannels() and UpdateNoteIndex()).
+*/
+#pragma udata MIDI_NOTE_INDEX
+static UINT8 m_NoteChannelIndex[MIDI_MAP_COUNT][MIDI_NOTE_COUNT];
+#pragma udata
+
 /*
-Table that converts between the incoming MIDI note and a user-defined drum pad bit.
-The index into the table is the drum pad bit number, and the 
-contents of the table are the MIDI note corresponding to that pad.
+Maps that are being saved in EEPROM (see SaveMidiMap()): bit n is map n, and 
+m_MapSavePos[n] is the next entry of it to save.
 */
-static UINT8 m_MidiMapTable[MIDI_CHANNEL_COUNT][NOTES_PER_CHANNEL];
+#define MAP_SAVE_QUEUE_DEPTH	4 // entries are only queued while the EEPROM queue is shorter than this
 
-const static UINT8 DEFAULT_MAP0[MIDI_CHANNEL_COUNT][NOTES_PER_CHANNEL] =
+static BYTE m_MapSavePending = 0;
+static UINT8 m_MapSavePos[MIDI_MAP_COUNT];
+
+/*
+The default maps are tables of TABLE_NOTES_PER_CHANNEL notes for each channel (one column 
+per channel), where an invalid note ends the list for a channel. 
+*/
+static ROM UINT8 DEFAULT_MAP0[TABLE_NOTES_PER_CHANNEL][MIDI_CHANNEL_COUNT] =
 {
 	{  31,  48,  45,  39,  33,  22,  25,  49 },
 	{  34,  50,  47,  41,  35,  26,  51,  52 },
@@ -102,7 +216,7 @@ const static UINT8 DEFAULT_MAP0[MIDI_CHANNEL_COUNT][NOTES_PER_CHANNEL] =
 	{ 255, 255, 255, 255, 255, 255, 255, 255 }
 };
 
-const static UINT8 DEFAULT_MAP1[MIDI_CHANNEL_COUNT][NOTES_PER_CHANNEL] =
+static ROM UINT8 DEFAULT_MAP1[TABLE_NOTES_PER_CHANNEL][MIDI_CHANNEL_COUNT] =
 {
 	{  31,  22,  48,  39,  33,  49, 255, 255 },
 	{  34,  26,  50,  41,  35,  52, 255, 255 },
@@ -114,6 +228,52 @@ const static UINT8 DEFAULT_MAP1[MIDI_CHANNEL_COUNT][NOTES_PER_CHANNEL] =
 	{ 255, 255, 255, 255, 255, 255, 255, 255 }
 };
 
+/*
+A status byte starts a new message whatever state the parser is in, so every row of the
+table has the same status columns.
+*/
+#define STATUS_TRANSITIONS \
+	TRANSITION(acNONE, WAITING_FOR_NOTE_OFF),				/* 0x8n */ \
+	TRANSITION(acNOTE_ON_STATUS, WAITING_FOR_NOTE_ON),		/* 0x9n */ \
+	TRANSITION(acNONE, WAITING_FOR_DATA1_OF_2),				/* 0xAn poly aftertouch */ \
+	TRANSITION(acNONE, WAITING_FOR_CC_DATA1),				/* 0xBn */ \
+	TRANSITION(acNONE, WAITING_FOR_DATA1_ONLY),				/* 0xCn program change */ \
+	TRANSITION(acNONE, WAITING_FOR_DATA1_ONLY),				/* 0xDn channel aftertouch */ \
+	TRANSITION(acNONE, WAITING_FOR_DATA1_OF_2),				/* 0xEn pitch bend */ \
+	TRANSITION(acSYS_EX_START, COLLECT_SYS_EX_DATA),		/* 0xF0 */ \
+	TRANSITION(acNONE, WAITING_FOR_SYS_DATA1_ONLY),			/* 0xF1 quarter frame */ \
+	TRANSITION(acNONE, WAITING_FOR_SYS_DATA1_OF_2),			/* 0xF2 song position */ \
+	TRANSITION(acNONE, WAITING_FOR_SYS_DATA1_ONLY),			/* 0xF3 song select */ \
+	TRANSITION(acNONE, WAITING_FOR_STATUS),					/* 0xF4 undefined */ \
+	TRANSITION(acNONE, WAITING_FOR_STATUS),					/* 0xF5 undefined */ \
+	TRANSITION(acNONE, WAITING_FOR_STATUS),					/* 0xF6 tune request */ \
+	TRANSITION(acNONE, WAITING_FOR_STATUS)					/* 0xF7 end of sys-ex */
+
+/*
+The MIDI message state machine, indexed by [current state][byte class]. After the last 
+data byte of a channel message the state goes back to waiting for the first data byte of 
+the same message ("running status"), since the sender can leave out the status byte when
+it's the same as the last one. System common messages cancel the running status.
+*/
+static ROM UINT8 m_MidiTransitions[MIDI_STATE_COUNT][BYTE_CLASS_COUNT] =
+{
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_STATUS) },				// WAITING_FOR_STATUS
+	{ STATUS_TRANSITIONS, TRANSITION(acNOTE_NUMBER, WAITING_FOR_ON_VELOCITY) },	// WAITING_FOR_NOTE_ON
+	{ STATUS_TRANSITIONS, TRANSITION(acNOTE_VELOCITY, WAITING_FOR_NOTE_ON) },	// WAITING_FOR_ON_VELOCITY
+	{ STATUS_TRANSITIONS, TRANSITION(acNOTE_OFF, WAITING_FOR_OFF_VELOCITY) },	// WAITING_FOR_NOTE_OFF
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_NOTE_OFF) },			// WAITING_FOR_OFF_VELOCITY
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_DATA1_ONLY) },			// WAITING_FOR_DATA1_ONLY
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_DATA2) },				// WAITING_FOR_DATA1_OF_2
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_DATA1_OF_2) },			// WAITING_FOR_DATA2
+	{ STATUS_TRANSITIONS, TRANSITION(acSYS_EX_DATA, COLLECT_SYS_EX_DATA) },		// COLLECT_SYS_EX_DATA
+	{ STATUS_TRANSITIONS, TRANSITION(acCC_NUMBER, WAITING_FOR_CC_DATA2) },		// WAITING_FOR_CC_DATA1
+	{ STATUS_TRANSITIONS, TRANSITION(acPEDAL_POSITION, WAITING_FOR_CC_DATA1) },	// WAITING_FOR_PEDAL_DATA
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_CC_DATA1) },			// WAITING_FOR_CC_DATA2
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_STATUS) },				// WAITING_FOR_SYS_DATA1_ONLY
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_SYS_DATA2) },			// WAITING_FOR_SYS_DATA1_OF_2
+	{ STATUS_TRANSITIONS, TRANSITION(acNONE, WAITING_FOR_STATUS) }				// WAITING_FOR_SYS_DATA2
+};
+
 /*------------------------------------------------------------------------------
 	Prototypes
 ------------------------------------------------------------------------------*/
@@ -121,9 +281,20 @@ const static UINT8 DEFAULT_MAP1[MIDI_CHANNEL_COUNT][NOTES_PER_CHANNEL] =
 #if defined(NOTE_OFF_CLEARS_FLAG)
 	static void ClearMidiOutput(UINT8 MidiNote);
 #endif
-static UINT8 DoMidiTableLookup(UINT8 MidiNote, UINT StartingOutputIndex);
-static void	HandleSystemMessage(void);
+static void AddMidiHit(UINT8 Channel, UINT8 Velocity);
+static UINT8 FillLibraryBlock(BYTE * pBuffer, UINT8 Offset, UINT8 Pos);
+static UINT8 FindChannelNote(UINT8 MapNumber, UINT8 ChannelNumber, UINT8 NoteIndex);
+static UINT8 FindFirstChannel(UINT8 MidiNote);
+static UINT8 FindMapNote(UINT8 MapNumber, UINT8 Note);
+static void OnControllerNumber(void);
+static void OnNoteNumber(void);
+static void OnNoteOff(void);
+static void OnNoteVelocity(void);
+static void ParseMidiByte(void);
 static void	SetMidiOutputFlag(UINT8 MidiNote, UINT8 Velocity);
+static void SaveMidiMap(UINT8 MapNumber, UINT8 FromPos);
+static UINT8 SetNoteChannels(UINT8 MapNumber, UINT8 Note, UINT8 ChannelMask);
+static void UpdateNoteIndex(UINT8 MapNumber);
 
 #if defined(MIDI_OUT_ADAPTER)
 	static UINT8 TranslateNoteForGHWT(UINT8 Note);
@@ -164,7 +335,7 @@ Sets up the UART for the MIDI input.
 	RCSTA				= 0x90;	// SPEN (serial port enabled), CREN (continuous RX)
 	BAUDCON				= 0x08;	// BRG16 (16bit baud generator)
 
-#ifdef MIDI_INTERRUPT
+#if defined(MIDI_INTERRUPT) || defined(MIDI_RX_BUFFERED)
 	RCON				|= 0x80;	// Enable priority interrupt selection
 
 	IPR1				|= 0x20;	// RCIP = 1; // Receive ISR High Priority
@@ -180,546 +351,1166 @@ Sets up the UART for the MIDI input.
 }
 
 
-void ClearMidiOutputs(void)
+static void AddMidiHit(UINT8 Channel, UINT8 Velocity)
 {
 /*
-Clear all the midi "channel" output flags. 
+Add a hit to the channel's queue. If the queue is full the hit is dropped.
 */
-	UINT8 nFlag;
+	UINT8 nIndex;
+
+#if defined(PERF_STATS)
+	if (g_ChannelHits[Channel] < 0xFFFF)
+		++g_ChannelHits[Channel];
+#endif
+
+	if ((UINT8)(m_HitIn[Channel] - m_HitOut[Channel]) >= HIT_QUEUE_SIZE)
+	{
+		if (g_MidiHitsDropped < 0xFF)
+			++g_MidiHitsDropped;
+
+	#if defined(PERF_STATS)
+		if (g_ChannelDropped[Channel] < 0xFF)
+			++g_ChannelDropped[Channel];
+	#endif
+
+		return;
+	}
 
-	for (nFlag = 0; nFlag < MIDI_CHANNEL_COUNT; ++nFlag)
-		g_MidiChannelOutputs[nFlag] = FALSE;
+	nIndex = m_HitIn[Channel] & HIT_QUEUE_MASK;
+	m_HitVelocity[Channel][nIndex] = Velocity;
+	m_HitTime[Channel][nIndex] = (UINT8)g_MsTickCount;
+
+	++m_HitIn[Channel];
 }
 
 
-void RecallMidiMap(void)
+BOOL GetMidiHit(UINT8 Channel, UINT8 MaxAge, UINT8 * pVelocity)
 {
 /*
-Read the pre-programmed notes (if any) from EEPROM into RAM (m_MidiMapTable).
-g_MidiMapEEPROMAddress must be set to the desired map address prior to this
-(see SetMidiMapNumber())
+Get the oldest queued hit for the channel. Hits that have been waiting for more than MaxAge 
+millisecs are thrown away. Returns FALSE if there is no hit.
 */
-	UINT8	nIndex, nNote; 
-	UINT8 * pTable;
+	UINT8 nIndex;
+	UINT8 nAge;
 
-	pTable = &m_MidiMapTable[0][0]; // pointer to start of table array
-	for (nIndex = 0; nIndex < MIDI_TABLE_SIZE; ++nIndex)
+	while (m_HitOut[Channel] != m_HitIn[Channel])
 	{
-		// Note: g_MidiMapEEPROMAddress changes depending on the current map number
-		*pTable = ReadEEData(g_MidiMapEEPROMAddress + nIndex);
-		
-		// a little delay here seems to fix read errors
-		if (*pTable == 0)
-			;
-			
-		++pTable; // index next array entry
-	}
-}
+		nIndex = m_HitOut[Channel] & HIT_QUEUE_MASK;
+		++m_HitOut[Channel];
 
-void RestoreDefaultMap(UINT8 MapNumber)
-{
-	UINT8 nNoteIndex, nChannel, nNoteValue;
-	const UINT8 * pMap; // (* pMap)[MIDI_CHANNEL_COUNT][NOTES_PER_CHANNEL];
-	
-	if (MapNumber == 0)
-		pMap = &DEFAULT_MAP0[0][0];
-	else
-		pMap = &DEFAULT_MAP1[0][0];
-	
-	for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
-	{
-		for (nNoteIndex = 0; nNoteIndex < NOTES_PER_CHANNEL; ++nNoteIndex)
+		nAge = (UINT8)g_MsTickCount - m_HitTime[Channel][nIndex];
+		if (nAge <= MaxAge)
 		{
-			nNoteValue = *(pMap + (nNoteIndex * NOTES_PER_CHANNEL) + nChannel);
-			SetMidiMapEntry(nChannel, nNoteIndex, nNoteValue);
+		#if defined(PERF_STATS)
+			if (nAge > g_ChannelMaxWait[Channel])
+				g_ChannelMaxWait[Channel] = nAge;
+		#endif
+
+			*pVelocity = m_HitVelocity[Channel][nIndex];
+			return TRUE;
 		}
+
+		if (g_MidiHitsStale < 0xFF)
+			++g_MidiHitsStale;
+
+	#if defined(PERF_STATS)
+		if (g_ChannelStale[Channel] < 0xFF)
+			++g_ChannelStale[Channel];
+	#endif
 	}
+
+	return FALSE;
 }
 
 
-UINT8 GetMidiMapEntry(INT8 ChannelNumber, UINT8 NoteIndex)
+void ClearMidiOutputs(void)
 {
 /*
-Get the specified note map entry.
+Throw away all the queued hits.
 */
-	return m_MidiMapTable[ChannelNumber][NoteIndex];
-}
+	UINT8 nChannel;
 
+	for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
+		m_HitOut[nChannel] = m_HitIn[nChannel];
+}
 
 
-void MIDI_ServiceUARTRx(void)
+UINT8 RecallMidiMaps(void)
 {
 /*
-This routine is called when data is available from the UART
+Read all the maps from EEPROM into RAM. This only needs to be done at power up. If a map 
+doesn't look right, then it's cut short at the first bad entry. If the CRC is wrong too (e.g.
+the power went off while the map was being saved), then the map is saved again as it was 
+loaded, or the default map is used if there was nothing left of it. Returns the number of 
+maps that had to be fixed.
 */
-	static UINT8 m_PendingNote; // Note ON data goes here
-	UINT8 nTranslatedNote; // value for sending out to GH or MIDI Pro adapter
-	BOOL boolSendDataOut;  // if true, then data isn't sent out MIDI OUT
-	
-	// read MIDI data from UART
-	g_RxData = RCREG;
-	
-	#if defined(MIDI_OUT_ADAPTER)	
-		boolSendDataOut = FALSE; // don't send data by default
-		g_TxData = g_RxData; // data passthru 
-	#endif
-		
-	/*
-	The first byte of any MIDI message is the "status" byte. It is different
-	from a "data" byte in that it has bit 7 set.
-	No matter what state we were in, if this is a status byte, reset
-	the state machine, unless we're collecting a sys-ex message.
-	*/
-	if (g_RxData & 0x80)	// Bit 7 is set in the first byte of every message.
+	UINT8 nMap, nLength, nPos, nNote, nRepaired;
+	BYTE nAddress, nCrc;
+
+	nRepaired = 0;
+
+	for (nMap = 0; nMap < MIDI_MAP_COUNT; ++nMap)
 	{
-		/*
-		Find out what type of message this is.
-		*/
-		g_MessageID	= g_RxData & 0xF0;
+		nAddress = EEADDR_MIDI_MAP1 + (nMap * MIDI_MAP_EE_SIZE);
+
+		nLength = ReadEEData(nAddress++);
+		nCrc = UpdateCrc8(CRC8_INIT, nLength);
 
-		switch (g_MessageID)
+		if (nLength > MIDI_MAP_MAX_NOTES)
+			nLength = 0;
+
+		for (nPos = 0; nPos < nLength; ++nPos)
 		{
-			case NOTE_ON:
-				boolSendDataOut = TRUE;
-				g_MessageState = WAITING_FOR_NOTE_ON;
-				break;
+			nNote = ReadEEData(nAddress++);
 
-			case NOTE_OFF:
-				g_MessageState = WAITING_FOR_NOTE_OFF;
+			// notes have to be valid and in order
+			if ((nNote >= MIDI_NOTE_COUNT) || ((nPos > 0) && (nNote <= m_MapNotes[nMap][nPos - 1])))
 				break;
 
-			case CONTROL_CHANGE:
-				g_MessageState = WAITING_FOR_CC_DATA1;
-				break;
-			
-			case POLY_AFTERTOUCH:
-			case PITCH_BEND:
-				g_MessageState = WAITING_FOR_DATA1_OF_2;
-				break;
+			m_MapNotes[nMap][nPos] = nNote;
+			m_MapMasks[nMap][nPos] = ReadEEData(nAddress++);
 
-			case PROGRAM_CHANGE:
-			case CHANNEL_AFTERTOUCH:			
-				g_MessageState = WAITING_FOR_DATA1_ONLY;
-				break;
+			nCrc = UpdateCrc8(nCrc, nNote);
+			nCrc = UpdateCrc8(nCrc, m_MapMasks[nMap][nPos]);
+		}
 
-			case SYS_EX_START: 
-				HandleSystemMessage();
-				break;
-				
-			case ACTIVE_SENSING:
-			case TIMING_CLOCK:
-				break;
-				
-			default:
+		m_MapLength[nMap] = nPos;
+		UpdateNoteIndex(nMap);
+
+		if (nCrc == ReadEEData(EEADDR_MIDI_MAP1 + (nMap * MIDI_MAP_EE_SIZE) + MIDI_MAP_EE_CRC))
+			continue; // map is good
+
+		++nRepaired;
+
+		if (nPos == 0)
+			RestoreDefaultMap(nMap);
+		else
+			SaveMidiMap(nMap, nPos); // just the length and the CRC
+	}
+
+	return nRepaired;
+}
+
+
+/*
+Converts a map that was saved the old way (EE_VERSION 0x01), as a table of 
+TABLE_NOTES_PER_CHANNEL notes for each channel where an invalid note ended the list for 
+the channel. The old tables are at the same addresses as the new maps. Any notes past
+MIDI_MAP_MAX_NOTES are lost, and FALSE is returned if that happens.
+*/
+BOOL ConvertOldMidiMap(UINT8 MapNumber)
+{
+	UINT8 nChannel, nNoteIndex, nNote;
+	BYTE nAddress;
+	BOOL bAllFit;
+
+	bAllFit = TRUE;
+	m_MapLength[MapNumber] = 0;
+	UpdateNoteIndex(MapNumber);
+
+	nAddress = EEADDR_MIDI_MAP1 + (MapNumber * MIDI_CHANNEL_COUNT * TABLE_NOTES_PER_CHANNEL);
+
+	for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
+	{
+		for (nNoteIndex = 0; nNoteIndex < TABLE_NOTES_PER_CHANNEL; ++nNoteIndex)
+		{
+			nNote = ReadEEData(nAddress + (nChannel * TABLE_NOTES_PER_CHANNEL) + nNoteIndex);
+
+			if (nNote == INVALID_NOTE_NUMBER)
 				break;
+
+			if ((nNote < MIDI_NOTE_COUNT) 
+			&& (SetNoteChannels(MapNumber, nNote, m_NoteChannelIndex[MapNumber][nNote] | (1 << nChannel)) == INVALID_NOTE_NUMBER))
+				bAllFit = FALSE;
 		}
 	}
+
+	// (a note that didn't fit was still put in the index)
+	if (!bAllFit)
+		UpdateNoteIndex(MapNumber);
+
+	SaveMidiMap(MapNumber, 0);
+
+	return bAllFit;
+}
+
+
+void RestoreDefaultMap(UINT8 MapNumber)
+{
+	UINT8 nNoteIndex, nChannel, nNoteValue;
+	ROM UINT8 * pMap; // (* pMap)[TABLE_NOTES_PER_CHANNEL][MIDI_CHANNEL_COUNT];
+	
+	if (MapNumber == 0)
+		pMap = &DEFAULT_MAP0[0][0];
 	else
+		pMap = &DEFAULT_MAP1[0][0];
+	
+	m_MapLength[MapNumber] = 0;
+	UpdateNoteIndex(MapNumber);
+
+	for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
 	{
-		/*
-		The incoming byte is data for a message. Figure out what 
-		to do with it based on the state (set by the first byte).
-		*/
-		#if defined(LOG_MIDI_DATA)
-			AddDataToLog(g_MessageState, g_RxData); 
-		#endif
-		
-		switch (g_MessageState)
+		for (nNoteIndex = 0; nNoteIndex < TABLE_NOTES_PER_CHANNEL; ++nNoteIndex)
 		{
-			case WAITING_FOR_NOTE_ON:
-				ledMIDI = LED_OUTPUT_ON; 
-				m_PendingNote = g_RxData; 
-				
-				#if defined(MIDI_OUT_ADAPTER)
-					if (g_GameMode == gmGUITAR_HERO)
-					{
-						/*
-						Translate note into value to be sent out to GHWT controller,
-						returns INVALID_NOTE_NUMBER if note is not mapped. Variable m_PendingNote is 
-						NOT set to the translated value because that would affect the value used to
-						map the output channel later in the WAITING_FOR_ON_VELOCITY event, which
-						calls SetMidiOutputFlag() and which in turns calls DoMidiTableLookup(). 
-						*/
-						nTranslatedNote = TranslateNoteForGHWT(g_RxData); // uses DoMidiTableLookup()
-						
-						// if note is mapped, then go ahead and send it
-						if (nTranslatedNote != INVALID_NOTE_NUMBER)
-						{
-							g_TxData = nTranslatedNote; // send translated note
-							boolSendDataOut = TRUE;
-						}
-					}
-					else if (g_GameMode == gmROCK_BAND)
-					{
-						/*
-						Translate note into value to be sent out to MIDI PRO controller, 
-						returns INVALID_NOTE_NUMBER if note is not mapped. See note above about
-						the translated note value.
-						*/
-						nTranslatedNote = TranslateNoteForMidiPro(g_RxData); // uses DoMidiTableLookup()
-						
-						// if note is mapped, then go ahead and send it
-						if (nTranslatedNote != INVALID_NOTE_NUMBER)
-						{
-							g_TxData = nTranslatedNote; // send translated note
-							boolSendDataOut = TRUE;
-						}
-					}
-				#endif
-								
-				g_MidiOffNote = INVALID_NOTE_NUMBER;
-				g_MessageState = WAITING_FOR_ON_VELOCITY;
-				break;
-		
-			case WAITING_FOR_ON_VELOCITY:
-				g_NoteVelocity = g_RxData;
-				g_MidiOnNote = m_PendingNote; // note is "official" now that we got the velocity data
-
-				// NOTE ON with velocity 0 is really a NOTE OFF
-				if (g_NoteVelocity == 0) 
-				{
-					g_MidiOffNote = g_MidiOnNote;
-					g_MidiOnNote = INVALID_NOTE_NUMBER; // invalidate the ON note
-					
-					#if defined(NOTE_OFF_CLEARS_FLAG)
-						ClearMidiOutput(g_MidiOnNote);
-					#endif
-					
-					ledMIDI = LED_OUTPUT_OFF; 
-				}
-				else if (g_NoteVelocity >= g_MinVelocity) 
-				{
-					// Lookup the note and map it to an output
-					SetMidiOutputFlag(g_MidiOnNote, g_NoteVelocity); // uses DoMidiTableLookup()
-				}
-			#if defined(MIDI_OUT_ADAPTER)
-				else 
-					g_TxData = 0; // velocity < theshold, so set it to 0 so GHWT controller ignores the note
-
-				// if note wasn't supressed, then go ahead and send velocity
-				if (m_PendingNote != INVALID_NOTE_NUMBER)
-					boolSendDataOut = TRUE;
-			#endif					
-				
-				/*
-				There is a note in one of the MIDI technical documents that
-				says a note-on message can be followed by another one, 
-				without having a "status" byte.
-				*/
-				g_MessageState = WAITING_FOR_NOTE_ON;
-				break;
-			
-			case WAITING_FOR_NOTE_OFF:
-				g_MidiOffNote = g_RxData;
-				g_MidiOnNote = INVALID_NOTE_NUMBER; // note on is now invalidated
-				
-				#if defined(NOTE_OFF_CLEARS_FLAG)
-					ClearMidiOutput(g_MidiOffNote);
-				#endif
-				
-				ledMIDI = LED_OUTPUT_OFF; 
-				g_MessageState = WAITING_FOR_OFF_VELOCITY; // next data is OFF velocity
-				break;
+			nNoteValue = *(pMap + (nNoteIndex * MIDI_CHANNEL_COUNT) + nChannel);
 
-			case WAITING_FOR_OFF_VELOCITY:
-				g_MessageState = WAITING_FOR_STATUS;
-				break;
-			
-			case WAITING_FOR_DATA1_OF_2:			
-				g_MessageState = WAITING_FOR_DATA2;
-			 	break;
-			
-			case COLLECT_SYS_EX_DATA:
-				// Store this byte in the sys-ex array. First make sure there's room.
-				if (m_SysExtDataIndex < (sizeof(m_SysExtDataBuf) - 1))
-				{
-					m_SysExtDataBuf[m_SysExtDataIndex++] = g_RxData;
-					m_SysExtDataBuf[m_SysExtDataIndex] = 0;
-				}
-				break;
-				
-			case WAITING_FOR_CC_DATA1: // controller change data -- this is the controller number
-				if (g_RxData == 4) // hi hat pedal is controller 4
-				{
-					g_MessageState = WAITING_FOR_PEDAL_DATA; // get pedal position in next step
-				#if defined(MIDI_OUT_ADAPTER)
-					if (g_GameMode == gmROCK_BAND)
-						boolSendDataOut = TRUE;
-				#endif					
-				}
-				else
-					g_MessageState = WAITING_FOR_CC_DATA2; // data for different controller
-
-				break;
-			
-			case WAITING_FOR_PEDAL_DATA: // hi hat pedal (controller 4) position
-				g_HiHatPedalPosition = g_RxData;
-				g_MessageState = WAITING_FOR_STATUS;
-				
-			#if defined(MIDI_OUT_ADAPTER)
-				if (g_GameMode == gmROCK_BAND)
-					boolSendDataOut = TRUE;
-			#endif					
+			if (nNoteValue >= MIDI_NOTE_COUNT)
 				break;
 
-			case WAITING_FOR_DATA1_ONLY:
-			case WAITING_FOR_DATA2:
-			case WAITING_FOR_CC_DATA2:
-			default:
-				g_MessageState = WAITING_FOR_STATUS;
-				break;
+			SetNoteChannels(MapNumber, nNoteValue, m_NoteChannelIndex[MapNumber][nNoteValue] | (1 << nChannel));
 		}
 	}
 
-	#if defined(MIDI_OUT_ADAPTER)
-		if (boolSendDataOut)	
-		{
-			// echo the recieved data to the MIDI OUT
-			if (PIR1bits.TXIF) // ready to send? (TXIF is set when TXREG is empty)
-				TXREG = g_TxData; // send data to MIDI OUT
-		}
-	#endif
-} // MIDI_ServiceUARTRx
+	SaveMidiMap(MapNumber, 0);
+}
 
 
-#if defined(NOTE_OFF_CLEARS_FLAG)
-static void ClearMidiOutput(UINT8 MidiNote)
+UINT8 GetMidiMapEntry(INT8 ChannelNumber, UINT8 NoteIndex)
+{
 /*
-Clear the output which is mapped to the specified note.
+Get the NoteIndex'th note (in note order) that is mapped to the channel in the active map, or
+INVALID_NOTE_NUMBER if the channel doesn't have that many notes.
 */
-{
-	UINT8 nChannel = 0;
-#if defined(MULTIPLE_CHANNELS_PER_NOTE)
-	while (TRUE)
-	{
-#endif
-		nChannel = DoMidiTableLookup(MidiNote, nChannel);
-	
-		if (nChannel == INVALID_TABLE_INDEX)
-			return;	
-	
-		g_MidiChannelOutputs[nChannel] = FALSE; // deactivate this channel
+	UINT8 nMap, nPos;
 
-#if defined(MULTIPLE_CHANNELS_PER_NOTE)
-		++nChannel;	// check the next channel to see if note is also assigned to it
-	} // while
-#endif
+	if ((ChannelNumber < 0) || (ChannelNumber >= MIDI_CHANNEL_COUNT))
+		return INVALID_NOTE_NUMBER;
+
+	nMap = m_ActiveMap;
+	nPos = FindChannelNote(nMap, ChannelNumber, NoteIndex);
 
+	if (nPos == INVALID_NOTE_NUMBER)
+		return INVALID_NOTE_NUMBER;
+
+	return m_MapNotes[nMap][nPos];
 }
-#endif
+
 
 /*
-Updates the map in memory, and also writes the new value to EEPROM. Be sure that
-g_MidiMapEEPROMAddress is set correctly first!
+Returns the number of notes in the active map (MIDI_MAP_MAX_NOTES when it's full).
 */
-void SetMidiMapEntry(INT8 ChannelNumber, UINT8 NoteIndex, UINT8 MidiNote)
+UINT8 GetMidiMapNoteCount(void)
 {
-	UINT8 nAddress;
+	return m_MapLength[m_ActiveMap];
+}
+
+
+/*
+Returns the position of Note in a map, or the position it should be put at if it isn't in 
+the map.
+*/
+static UINT8 FindMapNote(UINT8 MapNumber, UINT8 Note)
+{
+	UINT8 nLow, nHigh, nMid;
 
-	if ((ChannelNumber >= 0) && (ChannelNumber < MIDI_CHANNEL_COUNT) && (NoteIndex < NOTES_PER_CHANNEL))
+	// binary search
+	nLow = 0;
+	nHigh = m_MapLength[MapNumber];
+
+	while (nLow < nHigh)
 	{
-		m_MidiMapTable[ChannelNumber][NoteIndex] = MidiNote;
+		nMid = (nLow + nHigh) >> 1;
 
-		// save the new map value in EEPROM
-		nAddress = g_MidiMapEEPROMAddress + (ChannelNumber * NOTES_PER_CHANNEL) + NoteIndex;
-		WriteEEData(nAddress, MidiNote);
+		if (m_MapNotes[MapNumber][nMid] < Note)
+			nLow = nMid + 1;
+		else
+			nHigh = nMid;
 	}
+
+	return nLow;
 }
 
 
 /*
-Add a note to the note map for the specified output.
-Returns the number of notes that are mapped to that output, 0 if note is already
-programmed, or -1 on error.
+Returns the position in a map of the NoteIndex'th note that is mapped to the channel, or
+INVALID_NOTE_NUMBER if the channel doesn't have that many notes.
 */
-INT8 AddMidiNoteMapping(INT8 ChannelNumber, UINT8 MidiNote, UINT8 Velocity, BOOL Append)
+static UINT8 FindChannelNote(UINT8 MapNumber, UINT8 ChannelNumber, UINT8 NoteIndex)
 {
-	UINT8 nNoteIndex, nAddress;
+	UINT8 nPos, nMask;
 
-	if ((ChannelNumber >= 0) && (ChannelNumber < MIDI_CHANNEL_COUNT))
+	nMask = 1 << ChannelNumber;
+
+	for (nPos = 0; nPos < m_MapLength[MapNumber]; ++nPos)
 	{
-		/*
-		If appending a note to the map, then put the new note in the next available note slot for
-		this flag, otherwise just put the note in the first slot.
-		*/
-		if (Append)
+		if (m_MapMasks[MapNumber][nPos] & nMask)
 		{
-			// find the first duplicate or unassigned note slot in the map table
-			for (nNoteIndex = 0; nNoteIndex < NOTES_PER_CHANNEL; ++nNoteIndex)
-			{
-				if (m_MidiMapTable[ChannelNumber][nNoteIndex] == MidiNote)
-					return 0; // note already programmed -- we are done
-
-				if (m_MidiMapTable[ChannelNumber][nNoteIndex] == INVALID_NOTE_NUMBER)
-					break; // found unused slot to store the note in
-			}
+			if (NoteIndex == 0)
+				return nPos;
 
-			// if all the slots are used up, then re-use the last one
-			if (nNoteIndex >= NOTES_PER_CHANNEL)
-				nNoteIndex = NOTES_PER_CHANNEL - 1;
+			--NoteIndex;
 		}
-		else
-			nNoteIndex = 0; // not appending, so put in first slot
-		
-		SetMidiMapEntry(ChannelNumber, nNoteIndex, MidiNote);
-		
-		// if not last slot, then write an "invalid" note marker into the next slot
-		if (nNoteIndex < NOTES_PER_CHANNEL - 1)
-			SetMidiMapEntry(ChannelNumber, nNoteIndex + 1, INVALID_NOTE_NUMBER);
-
-		return nNoteIndex + 1;
 	}
 
-	return -1;
+	return INVALID_NOTE_NUMBER;
 }
 
+
 /*
-Sets the output to which the specified note is assigned and records the velocity also. If the
-note is not assigned to any outputs, then it doesn't do anything.
+Sets the channels a note is mapped to in a map (a mask of 0 takes the note out of the map), 
+keeping the notes in order, and updates the note index. Returns the position of the first 
+entry that changed, or INVALID_NOTE_NUMBER if the map is full. The map is NOT saved in EEPROM,
+see SaveMidiMap().
 */
-static void SetMidiOutputFlag(UINT8 MidiNote, UINT8 Velocity)
+static UINT8 SetNoteChannels(UINT8 MapNumber, UINT8 Note, UINT8 ChannelMask)
 {
-	UINT8 nChannel = 0;
-	
-#if defined(USE_HIHAT_THRESHOLD) 
-	/*
-	Change the hi hat open note to hi hat close note depending on the hi hat pedal position. This is
-	for some drum controllers which don't handle this very well.
-	*/
-	if (g_HiHatThreshold != INVALID_NOTE_NUMBER)	
+	UINT8 nPos, nIndex, nLength;
+
+	nPos = FindMapNote(MapNumber, Note);
+	nLength = m_MapLength[MapNumber];
+
+	if ((nPos < nLength) && (m_MapNotes[MapNumber][nPos] == Note))
 	{
-		// change the hi hat note from an "open" to a "closed" depending on the current pedal position	
-		if ((MidiNote == HIHAT_OPEN_NOTE) || (MidiNote == HIHAT_RIM_OPEN_NOTE) 
-		|| (MidiNote == HIHAT_EDGE_OPEN_NOTE))
+		if (ChannelMask == 0)
 		{
-			// Note: the position value increases as the pedal is pressed, 0 means not pressed at all
-			// while 127 means fully pressed.
-			
-			// if pedal is past threshold, then it's a "closed" note
-			if (g_HiHatPedalPosition > g_HiHatThreshold)
-				MidiNote = HIHAT_CLOSED_NOTE;
-			else
-				MidiNote = HIHAT_OPEN_NOTE;
+			// take the note out
+			--nLength;
+			for (nIndex = nPos; nIndex < nLength; ++nIndex)
+			{
+				m_MapNotes[MapNumber][nIndex] = m_MapNotes[MapNumber][nIndex + 1];
+				m_MapMasks[MapNumber][nIndex] = m_MapMasks[MapNumber][nIndex + 1];
+			}
+			m_MapLength[MapNumber] = nLength;
 		}
+		else
+			m_MapMasks[MapNumber][nPos] = ChannelMask;
 	}
-#endif	
-	
-#if defined(MULTIPLE_CHANNELS_PER_NOTE)
-	// check the entire table for all matches, not just the first
-	while (TRUE)
+	else if (ChannelMask != 0)
 	{
-#endif
-		nChannel = DoMidiTableLookup(MidiNote, nChannel);
-	
-		if (nChannel == INVALID_TABLE_INDEX)
-			return;	
-	
-		g_MidiChannelOutputs[nChannel] = TRUE; // activate this channel
-		g_MidiChannelVelocity[nChannel] = Velocity; // record the note velocity
+		if (nLength >= MIDI_MAP_MAX_NOTES)
+			return INVALID_NOTE_NUMBER;
 
-#if defined(MULTIPLE_CHANNELS_PER_NOTE)
-		++nChannel;	// check the next channel to see if note is also assigned to it
-	} // while
-#endif
-}
+		// make room for the new note
+		for (nIndex = nLength; nIndex > nPos; --nIndex)
+		{
+			m_MapNotes[MapNumber][nIndex] = m_MapNotes[MapNumber][nIndex - 1];
+			m_MapMasks[MapNumber][nIndex] = m_MapMasks[MapNumber][nIndex - 1];
+		}
 
-/*------------------------------------------------------------------------------
+		m_MapNotes[MapNumber][nPos] = Note;
+		m_MapMasks[MapNumber][nPos] = ChannelMask;
+		m_MapLength[MapNumber] = nLength + 1;
+	}
 
-	Function:	HandleSystemMessage
+	m_NoteChannelIndex[MapNumber][Note] = ChannelMask;
 
-	Synopsis:	Ignore most system messages, but deal with them correctly.
-				Some of them expect data.
+	return nPos;
+}
 
-	Parameters:	none
 
-	Returns:	none
+/*
+Saves a map in EEPROM, from position FromPos to the end, and its CRC. Only the bytes that 
+have changed are written. A whole map is more than the EEPROM queue holds, so this only 
+marks where the save starts, and ServiceMidiMapSave() queues the entries a few at a time 
+from the main loop instead of waiting for the writes here.
+*/
+static void SaveMidiMap(UINT8 MapNumber, UINT8 FromPos)
+{
+	BYTE nMask;
 
-	Warnings:	
+	nMask = 1 << MapNumber;
+	if (!(m_MapSavePending & nMask) || (FromPos < m_MapSavePos[MapNumber]))
+		m_MapSavePos[MapNumber] = FromPos;
 
-------------------------------------------------------------------------------*/
-static void HandleSystemMessage(void)
-{
-	switch (g_RxData)
-	{
-		case SYS_EX_START:
+	m_MapSavePending |= nMask;
+}
+
+
+/*
+Call this from the main loop, after ServiceEEQueue(). Queues the next entries of the maps 
+being saved (see SaveMidiMap()) while the EEPROM queue is nearly empty, one map at a time. 
+Returns TRUE when there's nothing left to save.
+*/
+BOOL ServiceMidiMapSave(void)
+{
+	UINT8 nMap, nPos;
+	BYTE nAddress, nMask;
+
+	for (nMap = 0, nMask = 1; nMap < MIDI_MAP_COUNT; ++nMap, nMask <<= 1)
+	{
+		if (!(m_MapSavePending & nMask))
+			continue;
+
+		nAddress = EEADDR_MIDI_MAP1 + (nMap * MIDI_MAP_EE_SIZE);
+
+		while (GetEEQueueCount() < MAP_SAVE_QUEUE_DEPTH)
 		{
-			g_MessageState = COLLECT_SYS_EX_DATA;
-			m_SysExtDataIndex = 0;
-		} break;
-		
-		case QUARTER_FRAME:
-		case SONG_SELECT:
+			nPos = m_MapSavePos[nMap];
+			if (nPos >= m_MapLength[nMap])
+			{
+				// the CRC goes last, so it's only right once the whole map has been written
+				UpdateEEData(nAddress, m_MapLength[nMap]);
+				UpdateMidiMapCrc(nMap);
+				m_MapSavePending &= ~nMask;
+				break;
+			}
+
+			UpdateEEData(nAddress + 1 + (nPos * 2), m_MapNotes[nMap][nPos]);
+			UpdateEEData(nAddress + 2 + (nPos * 2), m_MapMasks[nMap][nPos]);
+			m_MapSavePos[nMap] = nPos + 1;
+		}
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/*
+Works out the CRC of a map as it is in EEPROM (including the writes still in the queue), and
+saves it.
+*/
+void UpdateMidiMapCrc(UINT8 MapNumber)
+{
+	UINT8 nCount;
+	BYTE nAddress, nCrc;
+
+	nAddress = EEADDR_MIDI_MAP1 + (MapNumber * MIDI_MAP_EE_SIZE);
+
+	nCount = ReadEEData(nAddress);
+	if (nCount > MIDI_MAP_MAX_NOTES)
+		nCount = 0; // only the length byte is checked
+
+	nCount = 1 + (nCount * 2);
+	nCrc = CRC8_INIT;
+	while (nCount--)
+		nCrc = UpdateCrc8(nCrc, ReadEEData(nAddress++));
+
+	UpdateEEData(EEADDR_MIDI_MAP1 + (MapNumber * MIDI_MAP_EE_SIZE) + MIDI_MAP_EE_CRC, nCrc);
+}
+
+
+/*------------------------------------------------------------------------------
+
+	Map library
+
+	Up to MAP_LIBRARY_SLOTS maps can be kept in program flash (MAP_LIBRARY_ADDRESS, which is
+	kept free of code by the .lkr file). Each slot is MAP_SLOT_SIZE bytes:
+	
+	byte 0		number of notes (N)
+	byte 1		~N (so an erased slot, 0xFF 0xFF, isn't mistaken for a map)
+	2..			N pairs of (note, channel mask), in note order
+	
+	This is the same as the format of the maps in RAM. A map is loaded from the library into
+	the active map in RAM, so the note lookups never read the flash.
+
+------------------------------------------------------------------------------*/
+
+/*
+Fills Buffer with the WRITE_BLOCK_SIZE bytes at Offset in the library image of the active map.
+Pos is the position in the map of the next note to put in, and the position after the last 
+note in the buffer is returned. Everything after the last pair is left as 0xFF (erased).
+*/
+static UINT8 FillLibraryBlock(BYTE * pBuffer, UINT8 Offset, UINT8 Pos)
+{
+	UINT8 nMap, nIndex;
+
+	nMap = m_ActiveMap;
+	nIndex = 0;
+
+	if (Offset == 0)
+	{
+		pBuffer[0] = m_MapLength[nMap];
+		pBuffer[1] = ~m_MapLength[nMap];
+		nIndex = 2;
+	}
+
+	for (; nIndex < WRITE_BLOCK_SIZE; nIndex += 2)
+	{
+		if (Pos < m_MapLength[nMap])
 		{
-			g_MessageState = WAITING_FOR_DATA1_ONLY;
-		} 
-		break;
-		
-		case SONG_POSITION_PTR:
+			pBuffer[nIndex] = m_MapNotes[nMap][Pos];
+			pBuffer[nIndex + 1] = m_MapMasks[nMap][Pos];
+			++Pos;
+		}
+		else
 		{
-			g_MessageState = WAITING_FOR_DATA1_OF_2;
-		} break;
-		
-		case SYS_EX_END:
+			pBuffer[nIndex] = 0xFF;
+			pBuffer[nIndex + 1] = 0xFF;
+		}
+	}
+
+	return Pos;
+}
+
+
+/*
+Saves the active map in the library (it's the same format as in RAM). Returns FALSE if the
+slot number is bad. The flash is only erased and written if the slot doesn't already hold the 
+same map, and blank write blocks are skipped. This stops the CPU for a few ms per block, so 
+don't use it while playing.
+*/
+BOOL SaveMidiMapToLibrary(UINT8 Slot)
+{
+	BYTE Buffer[WRITE_BLOCK_SIZE];
+	ROM UINT8 * pFlash;
+	DWORD nAddress;
+	UINT8 nPos, nOffset, nIndex;
+	BOOL bSame;
+
+	if (Slot >= MAP_LIBRARY_SLOTS)
+		return FALSE;
+
+	nAddress = MAP_LIBRARY_ADDRESS + ((UINT16)Slot * MAP_SLOT_SIZE);
+	pFlash = (ROM UINT8 *)nAddress;
+
+	// compare with what's there already
+	bSame = TRUE;
+	nPos = 0;
+	for (nOffset = 0; bSame && (nOffset < MAP_SLOT_SIZE); nOffset += WRITE_BLOCK_SIZE)
+	{
+		nPos = FillLibraryBlock(Buffer, nOffset, nPos);
+
+		for (nIndex = 0; nIndex < WRITE_BLOCK_SIZE; ++nIndex)
 		{
-			g_MessageState = WAITING_FOR_STATUS;
-		} break;
+			if (Buffer[nIndex] != pFlash[nOffset + nIndex])
+			{
+				bSame = FALSE;
+				break;
+			}
+		}
+	}
+
+	if (bSame)
+		return TRUE;
+
+	// erasing the first block takes out the note count, so the slot reads as empty from here on
+	for (nOffset = 0; nOffset < MAP_SLOT_SIZE; nOffset += ERASE_BLOCK_SIZE)
+		EraseFlashBlock(nAddress + nOffset);
+
+	// write the blocks that only hold pairs first...
+	nPos = (WRITE_BLOCK_SIZE - 2) / 2; // (the number of pairs in the first block)
+	for (nOffset = WRITE_BLOCK_SIZE; nOffset < MAP_SLOT_SIZE; nOffset += WRITE_BLOCK_SIZE)
+	{
+		nPos = FillLibraryBlock(Buffer, nOffset, nPos);
 
-		case ACTIVE_SENSING:
+		// an erased block is already all 0xFF
+		for (nIndex = 0; nIndex < WRITE_BLOCK_SIZE; ++nIndex)
 		{
-		} break;
+			if (Buffer[nIndex] != 0xFF)
+			{
+				WriteFlashBlock(nAddress + nOffset, Buffer);
+				break;
+			}
+		}
+	}
+
+	// ...and the one with the note count last, so a slot that was only partly written when
+	// the power went off is still seen as empty
+	FillLibraryBlock(Buffer, 0, 0);
+	WriteFlashBlock(nAddress, Buffer);
+
+	return TRUE;
+}
+
+
+/*
+Returns the number of notes in a library map, or INVALID_NOTE_NUMBER if the slot is empty.
+*/
+UINT8 GetLibraryMapSize(UINT8 Slot)
+{
+	ROM UINT8 * pFlash;
+
+	if (Slot >= MAP_LIBRARY_SLOTS)
+		return INVALID_NOTE_NUMBER;
+
+	pFlash = (ROM UINT8 *)(MAP_LIBRARY_ADDRESS + ((UINT16)Slot * MAP_SLOT_SIZE));
+
+	if ((pFlash[0] > MAP_SLOT_MAX_NOTES) || (pFlash[1] != (UINT8)~pFlash[0]))
+		return INVALID_NOTE_NUMBER;
+
+	return pFlash[0];
+}
+
+
+/*
+Gets one (note, channel mask) pair of a library map. Returns FALSE if there's no such entry.
+*/
+BOOL ReadLibraryMapEntry(UINT8 Slot, UINT8 Index, UINT8 * pNote, UINT8 * pChannelMask)
+{
+	ROM UINT8 * pFlash;
+
+	if (Index >= GetLibraryMapSize(Slot)) // (also covers a bad slot number)
+		return FALSE;
+
+	pFlash = (ROM UINT8 *)(MAP_LIBRARY_ADDRESS + ((UINT16)Slot * MAP_SLOT_SIZE) + 2 + (Index * 2));
+	*pNote = pFlash[0];
+	*pChannelMask = pFlash[1];
+
+	return TRUE;
+}
+
+
+/*
+Replaces the active map with one from the library, and saves it in EEPROM. Returns FALSE if 
+the slot is empty, the map has more than MIDI_MAP_MAX_NOTES notes, or its notes aren't valid
+and in order (the same check as RecallMidiMaps()). The active map is left alone if so.
+*/
+BOOL LoadMidiMapFromLibrary(UINT8 Slot)
+{
+	UINT8 nMap, nCount, nPos, nNote, nMask, nLastNote;
+
+	nCount = GetLibraryMapSize(Slot);
+	if ((nCount == INVALID_NOTE_NUMBER) || (nCount > MIDI_MAP_MAX_NOTES))
+		return FALSE;
+
+	// check the whole map before any of it is used
+	nLastNote = 0;
+	for (nPos = 0; nPos < nCount; ++nPos)
+	{
+		ReadLibraryMapEntry(Slot, nPos, &nNote, &nMask);
+
+		if ((nNote >= MIDI_NOTE_COUNT) || ((nPos > 0) && (nNote <= nLastNote)))
+			return FALSE;
+
+		nLastNote = nNote;
+	}
+
+	nMap = m_ActiveMap;
+	for (nPos = 0; nPos < nCount; ++nPos)
+		ReadLibraryMapEntry(Slot, nPos, &m_MapNotes[nMap][nPos], &m_MapMasks[nMap][nPos]);
+
+	m_MapLength[nMap] = nCount;
+	UpdateNoteIndex(nMap);
+	SaveMidiMap(nMap, 0);
+
+	return TRUE;
+}
+
+
+void MIDI_ServiceUARTRx(void)
+{
+/*
+This routine is called when data is available from the UART
+*/
+	// read MIDI data from UART
+	g_RxData = RCREG;
+	m_ParseTick = g_TickCount;
+
+	ParseMidiByte();
+}
+
+
+#if defined(MIDI_RX_BUFFERED)
+void MIDI_RxISR(void)
+{
+/*
+Called from the high priority ISR when the UART has data. All this does is move the 
+received bytes into the ring buffer -- the parsing is done in the main loop by
+MIDI_ServiceRxBuffer().
+*/
+	BYTE nNext, nData;
+
+	// check for overrun error (OERR), have to reset CREN to clear it
+	if (RCSTA & 0b0010)
+	{
+		RCSTA &= 0xEF; // clear CREN
+		RCSTA |= 0x10; // set CREN, re-enable reception	
+
+		if (g_MidiRxOverrunCount < 0xFF)
+			++g_MidiRxOverrunCount;
+	}
+
+	// empty the UART FIFO (reading RCREG also clears a framing error)
+	while (PIR1bits.RCIF)
+	{
+		nData = RCREG;
+		nNext = (m_RxHead + 1) & MIDI_RX_BUF_MASK;
+
+		if (nNext == m_RxTail) // buffer is full, so the byte is lost
+		{
+			if (g_MidiRxOverflowCount < 0xFF)
+				++g_MidiRxOverflowCount;
+		}
+		else
+		{
+			m_RxBuf[m_RxHead] = nData;
+			m_RxHead = nNext;
+			m_RxByteTick = g_TickCount;
+		}
+	}
+}
+
+
+UINT8 MIDI_ServiceRxBuffer(void)
+{
+/*
+Parse all the bytes the UART ISR has put into the ring buffer. Only the bytes that
+are in the buffer on entry are handled, anything that comes in while we are parsing
+gets picked up on the next call. Returns the number of bytes parsed.
+*/
+	BYTE nHead, nCount;
+
+	nHead = m_RxHead; // snapshot, the ISR may add more while we work
+	m_ParseTick = m_RxByteTick; // close enough for all the bytes in this batch
+
+	nCount = (nHead - m_RxTail) & MIDI_RX_BUF_MASK;
+	if (nCount > g_MidiRxHighWater)
+		g_MidiRxHighWater = nCount;
+
+	while (m_RxTail != nHead)
+	{
+		g_RxData = m_RxBuf[m_RxTail];
+		m_RxTail = (m_RxTail + 1) & MIDI_RX_BUF_MASK;
+
+		ParseMidiByte();
+	}
+
+	return nCount;
+}
+#endif
+
+
+static void ParseMidiByte(void)
+{
+/*
+Run the received byte (in g_RxData) thru the MIDI message state machine. The next state 
+and the action to take both come from m_MidiTransitions, so the work done for each byte 
+is the same apart from the action itself.
+*/
+	UINT8 nClass;
+	UINT8 nTransition;
+	
+	/*
+	System real-time messages (clock, active sensing etc...) can come in at any time, 
+	even between the bytes of another message. They don't have any data, so just
+	ignore them without touching the message state or ID.
+	*/
+	if (g_RxData >= TIMING_CLOCK)
+		return;
+
+	#if defined(MIDI_OUT_ADAPTER)	
+		m_SendDataOut = FALSE; // don't send data by default
+		g_TxData = g_RxData; // data passthru 
+	#endif
 		
-		default: 
+	/*
+	The first byte of any MIDI message is the "status" byte. It is different
+	from a "data" byte in that it has bit 7 set.
+	*/
+	if (g_RxData & 0x80)
+	{
+		g_MessageID	= g_RxData & 0xF0;
+
+		if (g_RxData >= SYS_EX_START)
+			nClass = g_RxData - (SYS_EX_START - bcSYSTEM_COMMON);
+		else
+			nClass = (g_RxData >> 4) - (NOTE_OFF >> 4);
+	}
+	else
+	{
+		#if defined(LOG_MIDI_DATA)
+			AddDataToLog(g_MessageState, g_RxData); 
+		#endif
+
+		nClass = bcDATA;
+	}
+
+	nTransition = m_MidiTransitions[g_MessageState][nClass];
+	g_MessageState = nTransition & STATE_MASK; // the action can override this
+
+	switch (nTransition & ACTION_MASK)
+	{
+		case acNONE:
+			break;
+
+		case acNOTE_ON_STATUS:
+		#if defined(MIDI_OUT_ADAPTER)
+			m_SendDataOut = TRUE;
+		#endif
+			break;
+
+		case acNOTE_NUMBER:
+			OnNoteNumber();
+			break;
+
+		case acNOTE_VELOCITY:
+			OnNoteVelocity();
+			break;
+
+		case acNOTE_OFF:
+			OnNoteOff();
+			break;
+
+		case acCC_NUMBER:
+			OnControllerNumber();
+			break;
+
+		case acPEDAL_POSITION:
+			g_HiHatPedalPosition = g_RxData;
+		#if defined(MIDI_OUT_ADAPTER)
+			if (g_GameMode == gmROCK_BAND)
+				m_SendDataOut = TRUE;
+		#endif					
+			break;
+
+		case acSYS_EX_START:
+			m_SysExtDataIndex = 0;
+			break;
+
+		case acSYS_EX_DATA:
+			// Store this byte in the sys-ex array. First make sure there's room.
+			if (m_SysExtDataIndex < (sizeof(m_SysExtDataBuf) - 1))
+			{
+				m_SysExtDataBuf[m_SysExtDataIndex++] = g_RxData;
+				m_SysExtDataBuf[m_SysExtDataIndex] = 0;
+			}
 			break;
 	}
+
+	#if defined(MIDI_OUT_ADAPTER)
+		if (m_SendDataOut)	
+		{
+			// echo the recieved data to the MIDI OUT
+			if (PIR1bits.TXIF) // ready to send? (TXIF is set when TXREG is empty)
+				TXREG = g_TxData; // send data to MIDI OUT
+		}
+	#endif
+} // ParseMidiByte
+
+
+/*
+NOTE ON data 1 (the note number). The note isn't used until the velocity comes in.
+*/
+static void OnNoteNumber(void)
+{
+#if defined(MIDI_OUT_ADAPTER)
+	UINT8 nTranslatedNote; // value for sending out to GH or MIDI Pro adapter
+#endif
+
+	ledMIDI = LED_OUTPUT_ON; 
+	m_PendingNote = g_RxData; 
+	
+	#if defined(MIDI_OUT_ADAPTER)
+		if (g_GameMode == gmGUITAR_HERO)
+		{
+			/*
+			Translate note into value to be sent out to GHWT controller,
+			returns INVALID_NOTE_NUMBER if note is not mapped. Variable m_PendingNote is 
+			NOT set to the translated value because that would affect the value used to
+			map the output channel later in OnNoteVelocity(), which calls 
+			SetMidiOutputFlag() to look the note up in m_NoteChannelIndex. 
+			*/
+			nTranslatedNote = TranslateNoteForGHWT(g_RxData); // uses FindFirstChannel()
+			
+			// if note is mapped, then go ahead and send it
+			if (nTranslatedNote != INVALID_NOTE_NUMBER)
+			{
+				g_TxData = nTranslatedNote; // send translated note
+				m_SendDataOut = TRUE;
+			}
+		}
+		else if (g_GameMode == gmROCK_BAND)
+		{
+			/*
+			Translate note into value to be sent out to MIDI PRO controller, 
+			returns INVALID_NOTE_NUMBER if note is not mapped. See note above about
+			the translated note value.
+			*/
+			nTranslatedNote = TranslateNoteForMidiPro(g_RxData); // uses FindFirstChannel()
+			
+			// if note is mapped, then go ahead and send it
+			if (nTranslatedNote != INVALID_NOTE_NUMBER)
+			{
+				g_TxData = nTranslatedNote; // send translated note
+				m_SendDataOut = TRUE;
+			}
+		}
+	#endif
+					
+	g_MidiOffNote = INVALID_NOTE_NUMBER;
 }
 
 
-void ClearMidiMapChannel(INT8 ChannelNumber)
+/*
+NOTE ON data 2 (the velocity). 
+*/
+static void OnNoteVelocity(void)
+{
+	g_NoteVelocity = g_RxData;
+	g_MidiOnNote = m_PendingNote; // note is "official" now that we got the velocity data
+
+	// NOTE ON with velocity 0 is really a NOTE OFF
+	if (g_NoteVelocity == 0) 
+	{
+		g_MidiOffNote = g_MidiOnNote;
+		g_MidiOnNote = INVALID_NOTE_NUMBER; // invalidate the ON note
+		
+		#if defined(NOTE_OFF_CLEARS_FLAG)
+			ClearMidiOutput(g_MidiOnNote);
+		#endif
+		
+		ledMIDI = LED_OUTPUT_OFF; 
+	}
+	else if (g_NoteVelocity >= g_MinVelocity) 
+	{
+		// Lookup the note and map it to an output
+		SetMidiOutputFlag(g_MidiOnNote, g_NoteVelocity); // uses m_NoteChannelIndex
+		g_MidiNoteTick = m_ParseTick;
+		++g_MidiNoteCount;
+	}
+#if defined(MIDI_OUT_ADAPTER)
+	else 
+		g_TxData = 0; // velocity < theshold, so set it to 0 so GHWT controller ignores the note
+
+	// if note wasn't supressed, then go ahead and send velocity
+	if (m_PendingNote != INVALID_NOTE_NUMBER)
+		m_SendDataOut = TRUE;
+#endif					
+}
+
+
+/*
+NOTE OFF data 1 (the note number). The OFF velocity is ignored.
+*/
+static void OnNoteOff(void)
 {
-	UINT8 nNoteIndex, nAddress;
+	g_MidiOffNote = g_RxData;
+	g_MidiOnNote = INVALID_NOTE_NUMBER; // note on is now invalidated
 	
-	for (nNoteIndex = 0; nNoteIndex < NOTES_PER_CHANNEL; ++nNoteIndex)
+	#if defined(NOTE_OFF_CLEARS_FLAG)
+		ClearMidiOutput(g_MidiOffNote);
+	#endif
+	
+	ledMIDI = LED_OUTPUT_OFF; 
+}
+
+
+/*
+Controller change data 1 (the controller number). The table has already set the state for
+a controller we don't care about.
+*/
+static void OnControllerNumber(void)
+{
+	if (g_RxData == 4) // hi hat pedal is controller 4
+	{
+		g_MessageState = WAITING_FOR_PEDAL_DATA; // get pedal position in next step
+	#if defined(MIDI_OUT_ADAPTER)
+		if (g_GameMode == gmROCK_BAND)
+			m_SendDataOut = TRUE;
+	#endif					
+	}
+}
+
+
+#if defined(NOTE_OFF_CLEARS_FLAG)
+static void ClearMidiOutput(UINT8 MidiNote)
+/*
+Clear the output which is mapped to the specified note.
+*/
+{
+	UINT8 nChannel, nChannels;
+
+	if (MidiNote >= MIDI_NOTE_COUNT)
+		return;
+
+	nChannels = m_NoteChannelIndex[m_ActiveMap][MidiNote];
+#if !defined(MULTIPLE_CHANNELS_PER_NOTE)
+	nChannels &= (UINT8)(0 - nChannels); // only the first (lowest) channel
+#endif
+
+	for (nChannel = 0; nChannels != 0; ++nChannel, nChannels >>= 1)
 	{
-		SetMidiMapEntry(ChannelNumber, nNoteIndex, INVALID_NOTE_NUMBER);	
+		if (nChannels & 0x01)
+			m_HitOut[nChannel] = m_HitIn[nChannel]; // throw away hits that haven't been output yet
 	}
 }
+#endif
+
+/*
+Replaces the NoteIndex'th note (in note order) of a channel in the active map with MidiNote,
+and saves the change in EEPROM. If the channel doesn't have that many notes, then MidiNote 
+is added to it. An invalid MidiNote just takes the old note off the channel.
+*/
+void SetMidiMapEntry(INT8 ChannelNumber, UINT8 NoteIndex, UINT8 MidiNote)
+{
+	UINT8 nMap, nMask, nPos, nFirst;
+
+	if ((ChannelNumber < 0) || (ChannelNumber >= MIDI_CHANNEL_COUNT))
+		return;
 
+	nMap = m_ActiveMap;
+	nMask = 1 << ChannelNumber;
+	nFirst = INVALID_NOTE_NUMBER; // first position that changed
 
+	nPos = FindChannelNote(nMap, ChannelNumber, NoteIndex);
+	if (nPos != INVALID_NOTE_NUMBER)
+		nFirst = SetNoteChannels(nMap, m_MapNotes[nMap][nPos], m_MapMasks[nMap][nPos] & ~nMask);
 
-static UINT8 DoMidiTableLookup(UINT8 MidiNote, UINT StartingOutputIndex)
+	if (MidiNote < MIDI_NOTE_COUNT)
+	{
+		nPos = SetNoteChannels(nMap, MidiNote, m_NoteChannelIndex[nMap][MidiNote] | nMask);
+		if (nPos < nFirst) // (INVALID_NOTE_NUMBER if the map is full)
+			nFirst = nPos;
+	}
+
+	if (nFirst != INVALID_NOTE_NUMBER)
+		SaveMidiMap(nMap, nFirst);
+}
+
+
+/*
+Add a note to the note map for the specified output.
+Returns the number of notes that are mapped to that output, 0 if note is already
+programmed, or -1 on error (including when the map is full).
+*/
+INT8 AddMidiNoteMapping(INT8 ChannelNumber, UINT8 MidiNote, UINT8 Velocity, BOOL Append)
 {
+	UINT8 nMap, nMask, nPos, nCount;
+
+	if ((ChannelNumber < 0) || (ChannelNumber >= MIDI_CHANNEL_COUNT) || (MidiNote >= MIDI_NOTE_COUNT))
+		return -1;
+
+	// if not appending, then the new note replaces all the notes for this output
+	if (!Append)
+		ClearMidiMapChannel(ChannelNumber);
+
+	nMap = m_ActiveMap;
+	nMask = 1 << ChannelNumber;
+
+	if (m_NoteChannelIndex[nMap][MidiNote] & nMask)
+		return 0; // note already programmed -- we are done
+
+	nPos = SetNoteChannels(nMap, MidiNote, m_NoteChannelIndex[nMap][MidiNote] | nMask);
+	if (nPos == INVALID_NOTE_NUMBER)
+		return -1; // no room
+
+	SaveMidiMap(nMap, nPos);
+
+	nCount = 0;
+	for (nPos = 0; nPos < m_MapLength[nMap]; ++nPos)
+	{
+		if (m_MapMasks[nMap][nPos] & nMask)
+			++nCount;
+	}
+
+	return nCount;
+}
+
 /*
-Return the output number to which the specified note is mapped. The StartingOutputIndex is allow
-for the case where the same note may be assigned to multiple outputs -- we can call this function
-multiple times and start the search at a different offset.
+Queues a hit (with the velocity) for the outputs to which the specified note is assigned. If the
+note is not assigned to any outputs, then it doesn't do anything.
 */
-	UINT8 nOutputIndex, nNoteIndex, nTableEntry;
+static void SetMidiOutputFlag(UINT8 MidiNote, UINT8 Velocity)
+{
+	UINT8 nChannel, nChannels;
 	
-	for (nOutputIndex = StartingOutputIndex; nOutputIndex < MIDI_CHANNEL_COUNT; ++nOutputIndex)
+#if defined(USE_HIHAT_THRESHOLD) 
+	/*
+	Change the hi hat open note to hi hat close note depending on the hi hat pedal position. This is
+	for some drum controllers which don't handle this very well.
+	*/
+	if (g_HiHatThreshold != INVALID_NOTE_NUMBER)	
 	{
-		for (nNoteIndex = 0; nNoteIndex < NOTES_PER_CHANNEL; ++nNoteIndex)
+		// change the hi hat note from an "open" to a "closed" depending on the current pedal position	
+		if ((MidiNote == HIHAT_OPEN_NOTE) || (MidiNote == HIHAT_RIM_OPEN_NOTE) 
+		|| (MidiNote == HIHAT_EDGE_OPEN_NOTE))
 		{
-			nTableEntry = m_MidiMapTable[nOutputIndex][nNoteIndex];			
+			// Note: the position value increases as the pedal is pressed, 0 means not pressed at all
+			// while 127 means fully pressed.
 			
-			// invalid note marks the end of the note maps for this output
-			if (nTableEntry == INVALID_NOTE_NUMBER)
-				break;
+			// if pedal is past threshold, then it's a "closed" note
+			if (g_HiHatPedalPosition > g_HiHatThreshold)
+				MidiNote = HIHAT_CLOSED_NOTE;
+			else
+				MidiNote = HIHAT_OPEN_NOTE;
+		}
+	}
+#endif	
+	
+	if (MidiNote >= MIDI_NOTE_COUNT)
+		return;
 
-			if (nTableEntry == MidiNote)
-			{
-				/*
-				Each output can have multiple MIDI note mappings, so we return the number
-				corresponding to the output, not the table index.
-				*/
-				return (nOutputIndex);			
-			}
+	nChannels = m_NoteChannelIndex[m_ActiveMap][MidiNote];
+#if !defined(MULTIPLE_CHANNELS_PER_NOTE)
+	nChannels &= (UINT8)(0 - nChannels); // only the first (lowest) channel
+#endif
+
+	for (nChannel = 0; nChannels != 0; ++nChannel, nChannels >>= 1)
+	{
+		if (nChannels & 0x01)
+			AddMidiHit(nChannel, Velocity); // activate this channel
+	}
+}
+
+void ClearMidiMapChannel(INT8 ChannelNumber)
+{
+/*
+Takes all the notes off a channel in the active map, and saves the change in EEPROM.
+*/
+	UINT8 nMap, nMask, nPos, nOut, nFirst;
+
+	if ((ChannelNumber < 0) || (ChannelNumber >= MIDI_CHANNEL_COUNT))
+		return;
+
+	nMap = m_ActiveMap;
+	nFirst = INVALID_NOTE_NUMBER; // first position that changed
+
+	// pack the notes that are still mapped to some channel down to the start of the list
+	nOut = 0;
+	for (nPos = 0; nPos < m_MapLength[nMap]; ++nPos)
+	{
+		nMask = m_MapMasks[nMap][nPos] & ~(1 << ChannelNumber);
+		m_NoteChannelIndex[nMap][m_MapNotes[nMap][nPos]] = nMask;
+
+		if ((nMask != m_MapMasks[nMap][nPos]) && (nFirst == INVALID_NOTE_NUMBER))
+			nFirst = nOut;
+
+		if (nMask)
+		{
+			m_MapNotes[nMap][nOut] = m_MapNotes[nMap][nPos];
+			m_MapMasks[nMap][nOut] = nMask;
+			++nOut;
 		}
 	}
 
+	m_MapLength[nMap] = nOut;
+
+	if (nFirst != INVALID_NOTE_NUMBER)
+		SaveMidiMap(nMap, nFirst);
+}
+
+
+
+static UINT8 FindFirstChannel(UINT8 MidiNote)
+{
+/*
+Return the lowest channel number to which the specified note is mapped, or INVALID_TABLE_INDEX
+if it isn't mapped to any.
+*/
+	UINT8 nChannel, nChannels;
+
+	if (MidiNote >= MIDI_NOTE_COUNT)
+		return (INVALID_TABLE_INDEX);
+
+	nChannels = m_NoteChannelIndex[m_ActiveMap][MidiNote];
+
+	for (nChannel = 0; nChannels != 0; ++nChannel, nChannels >>= 1)
+	{
+		if (nChannels & 0x01)
+			return (nChannel);
+	}
+
 	return (INVALID_TABLE_INDEX);
 }
 
 
+static void UpdateNoteIndex(UINT8 MapNumber)
+{
+/*
+Rebuild the m_NoteChannelIndex entries for a map from its note list.
+*/
+	UINT8 nNote, nPos;
+
+	for (nNote = 0; nNote < MIDI_NOTE_COUNT; ++nNote)
+		m_NoteChannelIndex[MapNumber][nNote] = 0;
+
+	for (nPos = 0; nPos < m_MapLength[MapNumber]; ++nPos)
+		m_NoteChannelIndex[MapNumber][m_MapNotes[MapNumber][nPos]] = m_MapMasks[MapNumber][nPos];
+}
+
+
 #if defined(MIDI_GUITAR)
 
 static void ProcessExtendedSystemData(void)
@@ -775,7 +1566,7 @@ Handle special system data in m_SysExtDataBuf[]. Count is in m_SysExtDataIndex.
 			// check velocity
 			if (m_SysExtDataBuf[6] > g_MinVelocity)
 			{
-				g_MidiChannelOutputs[5] = TRUE; // activate the strum 
+				AddMidiHit(5, m_SysExtDataBuf[6]); // activate the strum 
 #if defined(LOG_MIDI_DATA)
 				AddDataToLog(COLLECT_SYS_EX_DATA, m_SysExtDataBuf[5]); // log the string number
 #endif
@@ -787,13 +1578,17 @@ Handle special system data in m_SysExtDataBuf[]. Count is in m_SysExtDataIndex.
 #endif
 
 
-void SetMidiMapNumber(BYTE Value, BOOL ReadTableFromEEPROM)
+/*
+Makes the specified map the active one. All the maps are already in RAM, so this takes effect
+straight away, even for a note that is being parsed.
+*/
+void SetMidiMapNumber(BYTE Value)
 {
-	g_MidiMapNumber = Value;
-	g_MidiMapEEPROMAddress = EEADDR_MIDI_MAP1 + (Value * MIDI_TABLE_SIZE);
+	if (Value >= MIDI_MAP_COUNT)
+		Value = 0;
 
-	if (ReadTableFromEEPROM)
-		RecallMidiMap();
+	g_MidiMapNumber = Value;
+	m_ActiveMap = Value;
 
 #if defined(MR_LX)
 	// update LED indicators
@@ -819,7 +1614,7 @@ It uses the note map to find out which channel the input note is assigned to.
 	
 	Result = INVALID_NOTE_NUMBER;
 	
-	nChannel = DoMidiTableLookup(Note, 0);
+	nChannel = FindFirstChannel(Note);
 	
 	switch (nChannel)
 	{
@@ -862,7 +1657,7 @@ It uses the note map to find out which channel the input note is assigned to.
 	
 	Result = INVALID_NOTE_NUMBER;
 	
-	nChannel = DoMidiTableLookup(Note, 0);
+	nChannel = FindFirstChannel(Note);
 	
 	switch (nChannel)
 	{
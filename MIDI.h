@@ -43,9 +43,27 @@ MIDI message status ID's.
 #define INVALID_TABLE_INDEX -1
 
 #define MIDI_CHANNEL_COUNT 8  // how many channels can be programed with a MIDI note
-#define NOTES_PER_CHANNEL  8  // how many notes can be programmed to single channel
-#define MIDI_TABLE_SIZE (MIDI_CHANNEL_COUNT * NOTES_PER_CHANNEL)
 #define MIDI_MAP_COUNT 2
+#define MIDI_NOTE_COUNT 128 // valid note numbers are 0-127
+
+/*
+Each map is saved in EEPROM as the number of notes (N), followed by N pairs of (note, 
+channel mask) in note order. MIDI_MAP_EE_SIZE bytes are set aside for each map, which sets
+the number of notes a map can have (on any mix of channels). The last byte is a CRC-8 of
+the number of notes and the pairs (see UpdateCrc8()).
+*/
+#define MIDI_MAP_EE_SIZE	64
+#define MIDI_MAP_MAX_NOTES	((MIDI_MAP_EE_SIZE - 2) / 2)
+#define MIDI_MAP_EE_CRC		(MIDI_MAP_EE_SIZE - 1) // offset of the CRC byte
+
+/*
+Map library in program flash (see SaveMidiMapToLibrary()). The .lkr file keeps code out of
+this area, but a firmware update thru the bootloader erases it.
+*/
+#define MAP_LIBRARY_ADDRESS	0x7800
+#define MAP_LIBRARY_SLOTS	16
+#define MAP_SLOT_SIZE		128 // 2 erase blocks
+#define MAP_SLOT_MAX_NOTES	((MAP_SLOT_SIZE - 2) / 2)
 
 // special hi hat notes used by Roland (and others)
 #define HIHAT_OPEN_NOTE			46
@@ -56,31 +74,53 @@ MIDI message status ID's.
 // GLOBAL DATA ===========================================================
 
 extern BYTE g_MidiMapNumber;
-extern BYTE g_MidiMapEEPROMAddress;
 
 extern BYTE g_MessageID;
 extern BYTE g_MidiOnNote;
 extern BYTE g_NoteVelocity;
 extern BYTE g_MidiOffNote;
 extern UINT8 g_MinVelocity;
-extern BOOL g_MidiChannelOutputs[MIDI_CHANNEL_COUNT];
-extern UINT8 g_MidiChannelVelocity[MIDI_CHANNEL_COUNT];
+extern UINT8 g_MidiNoteTick;
+extern UINT8 g_MidiNoteCount;
+extern UINT8 g_MidiHitsDropped;
+extern UINT8 g_MidiHitsStale;
+
+// per channel stats (PERF_STATS)
+extern UINT16 g_ChannelHits[MIDI_CHANNEL_COUNT];
+extern UINT8 g_ChannelDropped[MIDI_CHANNEL_COUNT];
+extern UINT8 g_ChannelStale[MIDI_CHANNEL_COUNT];
+extern UINT8 g_ChannelMaxWait[MIDI_CHANNEL_COUNT];
 extern UINT8 g_HiHatPedalPosition;
 extern UINT8 g_HiHatThreshold;
 
+extern UINT8 g_MidiRxOverrunCount;
+extern UINT8 g_MidiRxOverflowCount;
+extern UINT8 g_MidiRxHighWater;
+
 
 // GLOBAL FUNCTIONS ======================================================
 
 extern INT8 AddMidiNoteMapping(INT8 ChannelNumber, UINT8 MidiNote, UINT8 Velocity, BOOL Append);
 extern void ClearMidiOutputs(void);
 extern void ClearMidiMapChannel(INT8 ChannelNumber);
+extern BOOL ConvertOldMidiMap(UINT8 MapNumber);
+extern void UpdateMidiMapCrc(UINT8 MapNumber);
 extern void EraseMidiMap(void);
+extern UINT8 GetLibraryMapSize(UINT8 Slot);
 extern UINT8 GetMidiMapEntry(INT8 ChannelNumber, UINT8 NoteIndex);
+extern UINT8 GetMidiMapNoteCount(void);
+extern BOOL GetMidiHit(UINT8 Channel, UINT8 MaxAge, UINT8 * pVelocity);
+extern BOOL LoadMidiMapFromLibrary(UINT8 Slot);
 extern void MIDI_Initialize(void);
+extern void MIDI_RxISR(void);
+extern UINT8 MIDI_ServiceRxBuffer(void);
 extern void MIDI_ServiceUARTRx(void);
-extern void RecallMidiMap(void);
+extern BOOL ReadLibraryMapEntry(UINT8 Slot, UINT8 Index, UINT8 * pNote, UINT8 * pChannelMask);
+extern UINT8 RecallMidiMaps(void);
 extern void RestoreDefaultMap(UINT8 MapNumber);
+extern BOOL SaveMidiMapToLibrary(UINT8 Slot);
+extern BOOL ServiceMidiMapSave(void);
 extern void SetMidiMapEntry(INT8 ChannelNumber, UINT8 NoteIndex, UINT8 MidiNote);
-extern void SetMidiMapNumber(BYTE Value, BOOL ReadTableFromEEPROM);
+extern void SetMidiMapNumber(BYTE Value);
 
 #endif // _INC_MIDI
@@ -48,32 +48,35 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 	
 	#define swEXT_PEDAL		PORTBbits.RB7  // external pedal jack
 	
-	// outputs
-	#define ledCH1		PORTBbits.RB3
-	#define ledCH2		PORTBbits.RB2
-	#define ledCH3		PORTBbits.RB1
-	#define ledCH4		PORTBbits.RB0
-	#define ledCH5		PORTDbits.RD7
-	#define ledCH6		PORTDbits.RD6
-	#define ledALT		PORTDbits.RD5
-	#define ledM1		PORTDbits.RD4
-	#define ledM2		PORTDbits.RD3
-	#define ledPROG		PORTDbits.RD2
+	/*
+	Outputs use the LAT registers, so setting one pin can't change another pin on the same
+	port that hasn't settled yet (a read-modify-write of PORTx reads the pins).
+	*/
+	#define ledCH1		LATBbits.LATB3
+	#define ledCH2		LATBbits.LATB2
+	#define ledCH3		LATBbits.LATB1
+	#define ledCH4		LATBbits.LATB0
+	#define ledCH5		LATDbits.LATD7
+	#define ledCH6		LATDbits.LATD6
+	#define ledALT		LATDbits.LATD5
+	#define ledM1		LATDbits.LATD4
+	#define ledM2		LATDbits.LATD3
+	#define ledPROG		LATDbits.LATD2
 
 	// spare I/O (on LXi)
-	#define outEXT0		PORTAbits.RA0 
-	#define outEXT1		PORTAbits.RA1 
-	#define outEXT2		PORTAbits.RA2 
-	#define outEXT3		PORTCbits.RC1 
-	#define outEXT4		PORTCbits.RC2 
-	#define outEXT5		PORTDbits.RD0 
-	#define outEXT6		PORTDbits.RD1 
-	#define outEXT7		PORTBbits.RB6 
+	#define outEXT0		LATAbits.LATA0 
+	#define outEXT1		LATAbits.LATA1 
+	#define outEXT2		LATAbits.LATA2 
+	#define outEXT3		LATCbits.LATC1 
+	#define outEXT4		LATCbits.LATC2 
+	#define outEXT5		LATDbits.LATD0 
+	#define outEXT6		LATDbits.LATD1 
+	#define outEXT7		LATBbits.LATB6 
 	
 	
 	// LED Outputs
-	#define ledUSB		PORTBbits.RB4  // OUT11
-	#define	ledMIDI		PORTBbits.RB5  // OUT12
+	#define ledUSB		LATBbits.LATB4  // OUT11
+	#define	ledMIDI		LATBbits.LATB5  // OUT12
 
 #else // regular MIDI Rocker
 	
@@ -103,17 +106,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 	#define swFUNCTION	PORTAbits.RA2  
 
 	// outputs
-	#define ledCH1		PORTDbits.RD5
-	#define ledCH2		PORTDbits.RD6
-	#define ledCH3		PORTDbits.RD7
-	#define ledCH4		PORTBbits.RB0
-	#define ledCH5		PORTBbits.RB1
-	#define outEXT6		PORTBbits.RB2
-	#define outEXT7		PORTBbits.RB6
+	#define ledCH1		LATDbits.LATD5
+	#define ledCH2		LATDbits.LATD6
+	#define ledCH3		LATDbits.LATD7
+	#define ledCH4		LATBbits.LATB0
+	#define ledCH5		LATBbits.LATB1
+	#define outEXT6		LATBbits.LATB2
+	#define outEXT7		LATBbits.LATB6
 
 	// LED Outputs
-	#define ledUSB		PORTBbits.RB4  
-	#define	ledMIDI		PORTBbits.RB5  
+	#define ledUSB		LATBbits.LATB4  
+	#define	ledMIDI		LATBbits.LATB5  
 
 #endif
 
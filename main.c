@@ -58,24 +58,124 @@ See the project's readme file for more information.
 #include "Pinout.h"
 #include "App.h"
 #include "MIDI.h"
+#include "EEData.h"
 
 /** CONFIGURATION **************************************************/
 
 #include "Config.h" // Processor configuration
 
 /** VARIABLES ******************************************************/
+#if (USB_PING_PONG_MODE == USB_PING_PONG__FULL_PING_PONG) || (USB_PING_PONG_MODE == USB_PING_PONG__ALL_BUT_EP0)
+	/*
+	The IN endpoint has an even and odd buffer descriptor, so the next report can be
+	queued up while the last one is still waiting for the host to read it. The USB
+	engine uses them in turn, so the report buffers are used in the same order.
+	*/
+	#define USB_IN_BUFFERS	2
+
+	#pragma udata USB_VARS
+	volatile unsigned char hid_report_in_odd[HID_INT_IN_EP_SIZE]; // report buffer for the odd BD
+#else
+	#define USB_IN_BUFFERS	1
+#endif
+
 #pragma udata
 
-USB_HANDLE USBInHandle = 0;
+USB_HANDLE USBInHandle[USB_IN_BUFFERS];
 USB_HANDLE USBOutHandle = 0;
 
+static BYTE m_NextIn = 0; // which IN buffer the next report goes in
+static BOOL m_InPending[USB_IN_BUFFERS]; // a report is waiting for the host to read it
+static BOOL m_InHasHit[USB_IN_BUFFERS];  // the report has a new hit in it
+static BYTE m_InHitTick[USB_IN_BUFFERS]; // g_MidiNoteTick for the hit
+static BYTE m_ReportNoteCount = 0;		 // g_MidiNoteCount when the last report was built
+static volatile BOOL m_EndpointReset = FALSE; // set by USBCBInitEP(), handled by HID_InputReport()
+
 BYTE g_PS3ControllerID = 0;
 
+// latency from the last MIDI NOTE ON to sending the report with the hit, in 128us units
+BYTE g_HitLatencyLast = 0;
+BYTE g_HitLatencyMax = 0;
+
+// latency from the last MIDI NOTE ON to the host reading the report with the hit, in 128us units
+BYTE g_HitDeliveryLast = 0;
+BYTE g_HitDeliveryMax = 0;
+
+// when nothing changes, the report is left alone and only rebuilt once per poll interval (g_UsbPollInterval)
+
+static BOOL m_ReportIdle = FALSE; // the last report built didn't need to be sent
+static BYTE m_NextBuildTime = 0;  // ms tick to build the next report when idle
+
+// main loop passes (ProcessIO() calls) counted over LOOP_RATE_MS
+#define LOOP_RATE_MS	100
+
+WORD g_MainLoopRate = 0;
+static WORD m_LoopCount = 0;
+static WORD m_LoopRateStart = 0;
+
+#if defined(PERF_STATS)
+	/*
+	Performance numbers for comparing builds (read with dcGET_PERF_STATS). The counts stop
+	at 0xFFFF. The histogram is of the time from a NOTE ON to the host reading the report 
+	with the hit: <0.5ms, <1ms, <2ms, <4ms, <8ms, <16ms, <32ms.
+	*/
+	WORD g_PerfLatencyHist[PERF_LATENCY_BUCKETS];
+	WORD g_PerfReportsBuilt = 0; // times the report was built
+	WORD g_PerfReportsSent = 0;  // times it was sent (the rest didn't change)
+	WORD g_PerfBuildTimeMax = 0; // longest report build (usecs)
+	WORD g_PerfParseTimeMax = 0; // longest MIDI_ServiceRxBuffer() call (usecs)
+	WORD g_PerfParseBytes = 0;	 // MIDI bytes parsed ...
+	WORD g_PerfParseTime = 0;	 // ... and the time it took (usecs), both stop when this is full
+	WORD g_PerfButtonTimeMax = 0;// longest UpdateButtonStates() call (usecs), in the USB or Xbox loop
+	WORD g_PerfBootTime = 0;	 // msecs from power on to the main loop (USB attached), not cleared
+	WORD g_PerfJournalTime = 0;	 // usecs to read the EEPROM journal at power up, not cleared
+	volatile WORD g_PerfTickDelayMax = 0; // longest an output tick waited for USBDeviceTasks() (instruction cycles)
+
+	static BYTE m_PerfStartTick;
+	static WORD m_PerfStartTimer;
+#endif
+
+/*
+Requests that came in through the USB callbacks that are handled from the main loop, 
+since the callbacks are called from the USB interrupt when USB_INTERRUPT is used.
+*/
+static volatile BOOL m_HostCmdPending = FALSE; // m_HostCmdIn has a new command in it
+static volatile BOOL m_SuspendPending = FALSE; // the host suspended the bus
+
+#ifdef PROCESS_HOST_CMD
+	/*
+	The command as it came in. ProcessIO() copies it to g_HostCmdBuffer before clearing 
+	m_HostCmdPending, and mySetReportHandler() ignores a new command while one is still
+	pending, so a command is never changed while it's being copied or run.
+	*/
+	static BYTE m_HostCmdIn[HOST_CMD_BUF_SIZE];
+#endif
+
+BYTE g_UsbPollPeriod = 0; // host's IN poll period in frames, 0 until it has been learned
+BYTE g_SofSyncMisses = 0; // IN transactions that didn't come when expected
+
+#if defined(USB_SOF_SYNC)
+	#define SOF_SYNC_LOCK_COUNT		4 // how many matching poll periods are needed to lock on
+	#define SOF_SYNC_LEAD_FRAMES	1 // how many frames before the IN token to build the report
+
+	static volatile BYTE m_SofFrame = 0; // low byte of USB frame number, updated every SOF
+	static BYTE m_LastInFrame = 0;	  // frame the last IN transaction finished in
+	static BYTE m_NextReportFrame = 0;// frame in which to build the next report
+	static BYTE m_PeriodMatches = 0;
+	static BYTE m_PeriodMisses = 0;
+#endif
+
 
 /** PRIVATE PROTOTYPES *********************************************/
 
 void BlinkUSBStatus(void);
 static void InitializeSystem(void);
+static void RecallSettings(void);
+
+#if defined(PERF_STATS)
+	static void PerfTimerStart(void);
+	static WORD PerfTimerStop(WORD * pMax);
+#endif
 
 void mySetReportHandler(void);
 void HID_InputReport(void);
@@ -162,12 +262,14 @@ BYTE ReportSupported(void);
 	#pragma code REMAPPED_HIGH_INTERRUPT_VECTOR = REMAPPED_HIGH_INTERRUPT_VECTOR_ADDRESS
 	void Remapped_High_ISR (void)
 	{
-		//     _asm goto YourHighPriorityISRCode _endasm
+	#if defined(MIDI_RX_BUFFERED)
+	     _asm goto YourHighPriorityISRCode _endasm
+	#endif
 	}
 	#pragma code REMAPPED_LOW_INTERRUPT_VECTOR = REMAPPED_LOW_INTERRUPT_VECTOR_ADDRESS
 	void Remapped_Low_ISR (void)
 	{
-		//     _asm goto YourLowPriorityISRCode _endasm
+	     _asm goto YourLowPriorityISRCode _endasm
 	}
 	
 	#if defined(PROGRAMMABLE_WITH_USB_HID_BOOTLOADER) || defined(PROGRAMMABLE_WITH_USB_LEGACY_CUSTOM_CLASS_BOOTLOADER)
@@ -203,24 +305,62 @@ BYTE ReportSupported(void);
 	#pragma code
 	
 	
-	//These are your actual interrupt handling routines.
-	#pragma interrupt YourHighPriorityISRCode
+	/*
+	These are your actual interrupt handling routines. Interrupt priorities:
+		high - UART receive (MIDI_RX_BUFFERED), a byte has to be read before the next one comes in
+		low  - output timer, then USB (USB_INTERRUPT)
+	MIDI_RxISR() etc. are function calls, so the compiler temp data has to be saved too.
+	*/
+	#pragma interrupt YourHighPriorityISRCode save=section(".tmpdata")
 	void YourHighPriorityISRCode()
 	{
-		//Check which interrupt flag caused the interrupt.
-		//Service the interrupt
-		//Clear the interrupt flag
-		//Etc.
-	
+	#if defined(MIDI_RX_BUFFERED)
+		// UART receive, the flag is cleared by reading RCREG
+		if (PIR1bits.RCIF)
+			MIDI_RxISR();
+	#endif
 	}	//This return will be a "retfie fast", since this is in a #pragma interrupt section 
-	#pragma interruptlow YourLowPriorityISRCode
+	#pragma interruptlow YourLowPriorityISRCode save=section(".tmpdata")
 	void YourLowPriorityISRCode()
 	{
-		//Check which interrupt flag caused the interrupt.
-		//Service the interrupt
-		//Clear the interrupt flag
-		//Etc.
-	
+		// output timer tick, OutputTimerISR() clears the flag
+		if (PIR1bits.CCP1IF)
+			OutputTimerISR();
+
+	#if defined(USB_INTERRUPT)
+		/*
+		USBDeviceTasks() clears the flags. An output tick that comes due while it's running
+		has to wait for it, so the output pulses can jitter while the host is sending control
+		transfers (mostly during enumeration). g_PerfTickDelayMax keeps the worst case.
+		*/
+		if (PIR2bits.USBIF && PIE2bits.USBIE)
+		{
+		#if defined(PERF_STATS)
+			BOOL bTickDue = PIR1bits.CCP1IF;
+			WORD nTimer;
+		#endif
+
+			USBDeviceTasks();
+
+			/*
+			USBDeviceInit() enables the USB interrupt as high priority again when it handles a
+			bus reset, so put it straight back to low. The bus stays in reset for at least 10ms, 
+			so nothing can set USBIF before this.
+			*/
+			IPR2bits.USBIP = 0;
+
+		#if defined(PERF_STATS)
+			if (PIR1bits.CCP1IF && !bTickDue)
+			{
+				// Timer1 is reset when the tick is due, so it has the cycles the tick is late by
+				nTimer = TMR1L;
+				nTimer |= (WORD)TMR1H << 8;
+				if (nTimer > g_PerfTickDelayMax)
+					g_PerfTickDelayMax = nTimer;
+			}
+		#endif
+		}
+	#endif
 	}	//This return will be a "retfie", since this is in a #pragma interruptlow section 
 
 #endif //of "#if defined(__18CXX)"
@@ -248,17 +388,33 @@ BYTE ReportSupported(void);
  *                  USBDeviceState is declared and updated in
  *                  usbd.c.
  *******************************************************************/
+/*
+Delay before the I/O is setup at power on. The power up timer and brown out reset (see Config.h) have 
+already held the CPU in reset until the supply is up, so this only has to let the inputs settle. It used to be 300ms
+(1000ms on the MIDI ROCKER), the boot LED display held things up for another 1.5 secs.
+*/
+#define POWER_SETTLE_MS		20
+
+#define USB_LED_BLINK_MS	250 // blink rate of ledUSB while suspended or being addressed
+
+// same as Velocity / 25 for 0-255 (the bar display level), but without a divide
+#define VELOCITY_BAR(Velocity)	((UINT8)(((UINT16)(Velocity) * 41) >> 10))
+
 void BlinkUSBStatus(void)
 {
-    static WORD led_count = 0;
-    
-    if (led_count == 0) 
-		led_count = 10000U;
-    led_count--;
+    static WORD led_time = 0;
+    WORD nNow;
+    BOOL bBlink;
+
+	// time the blink with the ms tick, so the rate doesn't depend on the main loop speed
+	nNow = ReadMsTick();
+	bBlink = ((WORD)(nNow - led_time) >= USB_LED_BLINK_MS);
+	if (bBlink)
+		led_time = nNow;
 
     if (USBSuspendControl == 1)
     {
-        if (led_count == 0)
+        if (bBlink)
         {
 			ledUSB = !ledUSB;
         }//end if
@@ -283,14 +439,14 @@ void BlinkUSBStatus(void)
         }
         else if (USBDeviceState == ADDRESS_STATE)
         {
-            if (led_count == 0)
+            if (bBlink)
             {
                 ledUSB = !ledUSB;
             }//end if
         }
         else if (USBDeviceState == CONFIGURED_STATE)
         {
-            if (led_count == 0)
+            if (bBlink)
             {
                 ledUSB = LED_OUTPUT_ON;
             }//end if
@@ -321,6 +477,52 @@ void ProcessIO(void)
     //Blink the LEDs according to the USB device status
     BlinkUSBStatus();
 
+#if defined(MIDI_RX_BUFFERED)
+	/*
+	Parse the MIDI data the UART ISR has collected, even if USB isn't active yet. This
+	keeps the parser in step with the data stream and keeps the ring buffer from filling up.
+	*/
+#if defined(PERF_STATS)
+	{
+		BYTE nBytes;
+		WORD nElapsed;
+
+		PerfTimerStart();
+		nBytes = MIDI_ServiceRxBuffer();
+		nElapsed = PerfTimerStop(&g_PerfParseTimeMax);
+
+		// g_PerfParseTime / g_PerfParseBytes is the average parse time per byte
+		if ((nBytes != 0) && (nElapsed < (WORD)(0xFFFF - g_PerfParseTime)))
+		{
+			g_PerfParseTime += nElapsed;
+			g_PerfParseBytes += nBytes;
+		}
+	}
+#else
+	MIDI_ServiceRxBuffer();
+#endif
+#endif
+
+	// start the next queued EEPROM write (if any), and queue more of a map being saved
+	ServiceEEQueue();
+	ServiceSettingsSave();
+
+	if (m_SuspendPending)
+	{
+		// host may be about to remove power, so don't leave any settings unsaved
+		m_SuspendPending = FALSE;
+		FlushSettingsSave();
+	}
+
+	// keep track of how fast the main loop is going
+	++m_LoopCount;
+	if ((WORD)(ReadMsTick() - m_LoopRateStart) >= LOOP_RATE_MS)
+	{
+		m_LoopRateStart += LOOP_RATE_MS;
+		g_MainLoopRate = m_LoopCount;
+		m_LoopCount = 0;
+	}
+
 	// in Wii/GH mode, we want to continue to processs IO even if USB not active	
 	if ((g_SystemMode == SYS_MODE_WII) && (g_GameMode == gmGUITAR_HERO))
 		; // do nothing
@@ -333,7 +535,20 @@ void ProcessIO(void)
 	HID_InputReport();
 	HID_OutputReport();
 
-#ifndef MIDI_INTERRUPT
+#ifdef PROCESS_HOST_CMD
+	if (m_HostCmdPending)
+	{
+		UINT8 nIndex;
+
+		for (nIndex = 0; nIndex < HOST_CMD_BUF_SIZE; ++nIndex)
+			g_HostCmdBuffer[nIndex] = m_HostCmdIn[nIndex];
+
+		m_HostCmdPending = FALSE; // the next command can come in now
+		ProcessHostCommand();
+	}
+#endif
+
+#if !defined(MIDI_INTERRUPT) && !defined(MIDI_RX_BUFFERED)
 	// poll the UART for MIDI data
 	if (PIR1bits.RCIF)
 		MIDI_ServiceUARTRx();
@@ -417,8 +632,35 @@ static void InitializeSystem(void)
     #endif
     
     USBDeviceInit();
+
+#if defined(USB_INTERRUPT)
+	USBDeviceAttach(); // enables the USB interrupt
+
+	// USB is low priority, so the UART interrupt can get in while a USB transfer is handled
+	IPR2bits.USBIP = 0;
+	INTCONbits.GIEL = 1;
+#endif
 }//end InitializeSystem
 
+
+/*
+Reads the settings and the maps from EEPROM. This is done once the USB is attached: the USB 
+descriptors only need the game mode and the poll rate, and an older or damaged EEPROM is 
+converted or fixed here (the writes for that are done from the main loop).
+*/
+static void RecallSettings(void)
+{
+	// initialize global settings, and load the maps
+	RecallStoredSettings();
+
+#if defined(MR_LX)
+	// display current velocity for a while (the LED sequencer turns the LEDs off again)
+	QueueLedStep(lsBAR, VELOCITY_BAR(g_MinVelocity), LED_MS(1500), 1);
+#endif
+
+	SetMidiMapNumber(g_MidiMapNumber); // the maps were loaded by RecallStoredSettings()
+}
+
 /********************************************************************
  * Function:        void main(void)
  *
@@ -436,28 +678,50 @@ static void InitializeSystem(void)
  *******************************************************************/
 void main(void)
 {
+#if defined(PERF_STATS)
+	BYTE nStartTick;
+	WORD nStartTimer;
+#endif
+
+	/*
+	Boot fast, so the MIDI input and the USB are being serviced soon after power on. The light 
+	show and the game mode LEDs are played by the LED sequencer from the main loop. Only the 
+	game mode and the poll rate are read before the USB is attached (the descriptors depend 
+	on them), the rest of the settings and the maps after (see RecallSettings()).
+	*/
+
+	// do a little delay to allow for power to settle
+	DelayMillisecs(POWER_SETTLE_MS);
+
 	// setup I/O pins
 #if defined(MR_LX)
-	// do a little delay to allow for power to settle
-	DelayMillisecs(300);
 	InitIO_LX();
+#else
+	InitIO_MR();
+#endif
+
+	// start the timer that controls the output pulse widths (g_MsTickCount starts counting)
+	InitOutputTimer();
+
+	// read the EEPROM journal, the boot mode select needs the game mode from it
+#if defined(PERF_STATS)
+	ReadPerfTime(&nStartTick, &nStartTimer);
+	InitEEJournal();
+	PerfTimeSince(nStartTick, nStartTimer, &g_PerfJournalTime);
+#else
+	InitEEJournal();
+#endif
 
+#if defined(MR_LX)
 	// figure out what mode go into to...
 	DoBootModeSelect_LX(); // updates g_SystemMode, g_GameMode
 #else
-	// do a little delay to allow for power to settle
-	DelayMillisecs(1000);
-	InitIO_MR();
-
 	// figure out what mode go into to...
 	DoBootModeSelect_MR(); // updates g_SystemMode, g_GameMode
 #endif
 
 	SetPID(g_GameMode); // sets game mode - affects USB descriptor
 
-	// initialize global settings
-	RecallStoredSettings();
-
 #if defined(MR_LX)
 
 	// turn on LEDs to indicate game mode
@@ -472,19 +736,13 @@ void main(void)
 		g_MidiMapNumber = 0; // default to using 1st map with Rock Band
 	}
 
-	// display current velocity
-	DisplayValue(g_MinVelocity / 25);
-	DelayMillisecs(1500);
-	DisplayValue(0); // turns off the LEDs
-
 #else
 
+	// turn on a LED for a little while to indicate game mode
 	if (g_GameMode == gmGUITAR_HERO)
-		ledCH5 = LED_OUTPUT_ON;
+		QueueLedStep(lsLED, lnCH5, LED_MS(1500), 1);
 	else
-		ledCH1 = LED_OUTPUT_ON;
-
-	DelayMillisecs(1500); // keep LED on for a little while
+		QueueLedStep(lsLED, lnCH1, LED_MS(1500), 1);
 
 	// function switch determines which map to use
 	if (swFUNCTION == SW_PRESSED)
@@ -494,8 +752,6 @@ void main(void)
 
 #endif
 
-	SetMidiMapNumber(g_MidiMapNumber, TRUE); // gets saved map
-
 	// initialize button state machine
 	InitButtonStates();
 
@@ -503,18 +759,32 @@ void main(void)
 	MIDI_Initialize();
 
 	if (g_SystemMode == SYS_MODE_XBOX)
+	{
+		RecallSettings();
+	#if defined(PERF_STATS)
+		g_PerfBootTime = POWER_SETTLE_MS + ReadMsTick();
+	#endif
 		Main_Xbox360();
+	}
 
 #if defined(TARGET_WII)
 	else if (g_SystemMode == SYS_MODE_WII) 
 	{
 		InitializeSystem(); // initialize all I/O, enable USB
+		RecallSettings();
+	#if defined(PERF_STATS)
+		g_PerfBootTime = POWER_SETTLE_MS + ReadMsTick();
+	#endif
 		Main_Wii();
 	}
 #else
 	else if (g_SystemMode == SYS_MODE_PS3) 
 	{
 		InitializeSystem(); // initialize all I/O, enable USB
+		RecallSettings();
+	#if defined(PERF_STATS)
+		g_PerfBootTime = POWER_SETTLE_MS + ReadMsTick();
+	#endif
 		Main_PS3();
 	}
 #endif
@@ -526,6 +796,9 @@ void main(void)
 
 void USBCBSuspend(void)
 {
+	// the EEPROM queue gets flushed from the main loop (see ProcessIO())
+	m_SuspendPending = TRUE;
+
     #if defined(__C30__)
     #if 0
         U1EIR = 0xFFFF;
@@ -590,6 +863,10 @@ void USBCB_SOF_Handler(void)
 {
     // No need to clear UIRbits.SOFIF to 0 here.
     // Callback caller is already doing that.
+
+#if defined(USB_SOF_SYNC)
+	m_SofFrame = UFRML; // frame number of the frame that just started
+#endif
 }
 
 /*******************************************************************
@@ -662,6 +939,12 @@ void USBCBInitEP(void)
 {
     //enable the HID endpoint
     USBEnableEndpoint(HID_EP,USB_IN_ENABLED|USB_OUT_ENABLED | USB_HANDSHAKE_ENABLED|USB_DISALLOW_SETUP);
+
+	/*
+	This can be called from the USB interrupt, in the middle of HID_InputReport() updating
+	the IN buffer state, so the state is reset there instead.
+	*/
+	m_EndpointReset = TRUE;
 }
 
 /********************************************************************
@@ -792,15 +1075,16 @@ void mySetReportHandler(void)
 					*/
 					UINT8 nIndex;
 
-					// clear the buffer
-					for (nIndex = 0; (nIndex < HOST_CMD_BUF_SIZE); ++nIndex)
-						g_HostCmdBuffer[nIndex] = 0;
+					// the host sends one command at a time, so one that comes in before the
+					// last one has been picked up is ignored
+					if (m_HostCmdPending)
+						break;
 
 					// copy data into buffer
 					for (nIndex = 0; nIndex < HOST_CMD_BUF_SIZE; ++nIndex)
-						g_HostCmdBuffer[nIndex] = hid_report_feature[nIndex];
+						m_HostCmdIn[nIndex] = hid_report_feature[nIndex];
 
-					ProcessHostCommand();
+					m_HostCmdPending = TRUE; // ProcessIO() takes care of it
 #endif
 				}
 				break;
@@ -836,7 +1120,9 @@ BYTE ReportSupported(void)
 {
 	// Find out if an Output or Feature report has arrived on the control pipe.
 
+#if defined(USB_POLLING)
 	USBDeviceTasks();
+#endif
 
 	switch (MSB(SetupPkt.W_Value))
     {
@@ -900,19 +1186,319 @@ BYTE ReportSupported(void)
  * Note:            
  *
  *****************************************************************************/
+#if defined(USB_SOF_SYNC)
+/*
+Called when the host has read the last input report. The frame numbers of the IN transactions 
+are used to learn the host's poll period, and once that's locked in the next report is built 
+SOF_SYNC_LEAD_FRAMES before the host asks for it (see HID_InputReport()). Until it's locked, or if
+the polls stop coming when expected, reports are sent as soon as the endpoint is free.
+*/
+static void TrackInPollPeriod(void)
+{
+	static BYTE m_Period = 0; // candidate period
+
+	BYTE nPeriod;
+
+	nPeriod = m_SofFrame - m_LastInFrame;
+	m_LastInFrame = m_SofFrame;
+
+	if (g_UsbPollPeriod == 0)
+	{
+		// not locked yet -- look for the same period several times in a row
+		if ((nPeriod == m_Period) && (nPeriod > SOF_SYNC_LEAD_FRAMES))
+		{
+			if (++m_PeriodMatches >= SOF_SYNC_LOCK_COUNT)
+			{
+				g_UsbPollPeriod = nPeriod;
+				m_PeriodMisses = 0;
+			}
+		}
+		else
+		{
+			m_Period = nPeriod;
+			m_PeriodMatches = 0;
+		}
+	}
+	else if (nPeriod != g_UsbPollPeriod)
+	{
+		// missed the poll (or the host changed the rate) 
+		if (g_SofSyncMisses < 0xFF)
+			++g_SofSyncMisses;
+
+		// give up on the period if it keeps happening
+		if (++m_PeriodMisses >= 2)
+		{
+			g_UsbPollPeriod = 0;
+			m_Period = 0;
+			m_PeriodMatches = 0;
+		}
+	}
+	else
+		m_PeriodMisses = 0;
+
+	m_NextReportFrame = m_LastInFrame + g_UsbPollPeriod - SOF_SYNC_LEAD_FRAMES;
+}
+#endif
+
+
+#if defined(PERF_STATS)
+void ClearPerfStats(void)
+{
+	BYTE nIndex;
+
+	for (nIndex = 0; nIndex < PERF_LATENCY_BUCKETS; ++nIndex)
+		g_PerfLatencyHist[nIndex] = 0;
+
+	g_PerfReportsBuilt = 0;
+	g_PerfReportsSent = 0;
+	g_PerfBuildTimeMax = 0;
+	g_PerfParseTimeMax = 0;
+	g_PerfParseBytes = 0;
+	g_PerfParseTime = 0;
+	g_PerfButtonTimeMax = 0;
+
+	// the USB interrupt updates this one
+	INTCONbits.GIEL = 0;
+	g_PerfTickDelayMax = 0;
+	INTCONbits.GIEL = 1;
+}
+
+
+/*
+Reads the output timer tick count and Timer1 (which counts instruction cycles and is reset 
+every tick) together.
+*/
+void ReadPerfTime(BYTE * pTick, WORD * pTimer)
+{
+	BYTE nTick;
+
+	do
+	{
+		nTick = g_TickCount;
+		*pTimer = TMR1L;
+		*pTimer |= (WORD)TMR1H << 8; // latched when TMR1L was read
+		*pTick = nTick;
+
+		// Timer1 may have been reset without the ISR having counted the tick yet
+		if (PIR1bits.CCP1IF && (*pTimer < (OUTPUT_TICK_US * 12 / 2)))
+			++*pTick;
+	} while (nTick != g_TickCount);
+}
+
+
+/*
+Start timing something, good for up to about 32ms.
+*/
+static void PerfTimerStart(void)
+{
+	ReadPerfTime(&m_PerfStartTick, &m_PerfStartTimer);
+}
+
+
+/*
+Works out the usecs since PerfTimerStart() was called, updates *pMax with it and returns it.
+*/
+static WORD PerfTimerStop(WORD * pMax)
+{
+	return PerfTimeSince(m_PerfStartTick, m_PerfStartTimer, pMax);
+}
+
+
+/*
+Works out the usecs since ReadPerfTime() returned StartTick and StartTimer, updates *pMax 
+with it and returns it. Good for up to about 32ms.
+*/
+WORD PerfTimeSince(BYTE StartTick, WORD StartTimer, WORD * pMax)
+{
+	BYTE nTick;
+	WORD nTimer;
+	WORD nElapsed;
+
+	ReadPerfTime(&nTick, &nTimer);
+
+	// 12 instruction cycles per usec
+	nElapsed = (WORD)(BYTE)(nTick - StartTick) * OUTPUT_TICK_US;
+	nElapsed = nElapsed + (nTimer / 12) - (StartTimer / 12);
+
+	if (nElapsed > *pMax)
+		*pMax = nElapsed;
+
+	return nElapsed;
+}
+#endif
+
+
+/*
+Called when the host has read the report in IN buffer nBuffer.
+*/
+static void InputReportSent(BYTE nBuffer)
+{
+	m_InPending[nBuffer] = FALSE;
+
+#if defined(USB_SOF_SYNC)
+	TrackInPollPeriod();
+#endif
+
+	// time from the MIDI note to the host having it
+	if (m_InHasHit[nBuffer])
+	{
+		m_InHasHit[nBuffer] = FALSE;
+
+		g_HitDeliveryLast = g_TickCount - m_InHitTick[nBuffer];
+		if (g_HitDeliveryLast > g_HitDeliveryMax)
+			g_HitDeliveryMax = g_HitDeliveryLast;
+
+	#if defined(PERF_STATS)
+		{
+			// bucket 0 is < 4 ticks (0.5ms), each one after that is twice as long
+			BYTE nBucket = 0;
+			BYTE nTicks = g_HitDeliveryLast >> 2;
+
+			while (nTicks && (nBucket < PERF_LATENCY_BUCKETS - 1))
+			{
+				nTicks >>= 1;
+				++nBucket;
+			}
+
+			if (g_PerfLatencyHist[nBucket] < 0xFFFF)
+				++g_PerfLatencyHist[nBucket];
+		}
+	#endif
+	}
+}
+
+
 void HID_InputReport(void)
 { 
-	if (!HIDTxHandleBusy(USBInHandle))		 
+	BYTE nBuffer;
+	BYTE * pReport;
+
+	if (m_EndpointReset)
 	{
+		m_EndpointReset = FALSE;
+
+		// the USB engine starts over with the even buffer
+		for (nBuffer = 0; nBuffer < USB_IN_BUFFERS; ++nBuffer)
+		{
+			USBInHandle[nBuffer] = 0;
+			m_InPending[nBuffer] = FALSE;
+		}
+		m_NextIn = 0;
+
+		// make sure the host gets a first report
+		ResendInputReport();
+		m_ReportIdle = FALSE;
+	}
+
+	// see which reports the host has read
+	for (nBuffer = 0; nBuffer < USB_IN_BUFFERS; ++nBuffer)
+	{
+		if (m_InPending[nBuffer] && !HIDTxHandleBusy(USBInHandle[nBuffer]))
+			InputReportSent(nBuffer);
+	}
+
+	if (HIDTxHandleBusy(USBInHandle[m_NextIn]))
+		return;
+
+#if (USB_IN_BUFFERS > 1)
+	if (m_InPending[m_NextIn ^ 1])
+	{
+		/*
+		The other report hasn't been read yet. Only queue this one up now if a new note
+		came in, so the hit goes out on the very next poll after that one.
+		*/
+		if (m_ReportNoteCount == g_MidiNoteCount)
+			return;
+	}
+	else
+#endif
+	{
+	#if defined(USB_SOF_SYNC)
+		// wait until just before the next poll, so the report has the latest data in it
+		if (g_UsbPollPeriod && ((BYTE)(m_SofFrame - m_NextReportFrame) >= 0x80))
+			return;
+	#endif
+
+		// the last report didn't change anything, so wait for the next poll interval, unless
+		// a new note came in (it goes out straight away)
+		if (m_ReportIdle && (m_ReportNoteCount == g_MidiNoteCount) 
+		&& ((BYTE)((BYTE)g_MsTickCount - m_NextBuildTime) >= 0x80))
+			return;
+	}
+
+	m_ReportNoteCount = g_MidiNoteCount;
+
+#if defined(PERF_STATS)
+	if (g_PerfReportsBuilt < 0xFFFF)
+		++g_PerfReportsBuilt;
+	PerfTimerStart();
+#endif
+
 	#if defined(MR_LX)
-		UpdateInputReportData_LX(); // populates hid_report_in array
+		UpdateInputReportData_LX(); // builds the next report
 	#else
-		UpdateInputReportData_MR(); // populates hid_report_in array
+		UpdateInputReportData_MR(); // builds the next report
 	#endif			
-		USBInHandle = HIDTxPacket(HID_EP, (BYTE*)&hid_report_in, HID_INPUT_REPORT_BYTES);
-	}					
 
+#if defined(PERF_STATS)
+	PerfTimerStop(&g_PerfBuildTimeMax);
+#endif
+
+#if (USB_IN_BUFFERS > 1)
+	pReport = (m_NextIn ? (BYTE*)&hid_report_in_odd : (BYTE*)&hid_report_in);
+
+	// copy the report to the free buffer, and don't send anything if there weren't any changes
+	if (!CommitInputReport(pReport, (m_NextIn ? (BYTE*)&hid_report_in : (BYTE*)&hid_report_in_odd)))
+#else
+	pReport = (BYTE*)&hid_report_in;
+
+	// copy any changes to hid_report_in, and don't send anything if there weren't any
+	if (!CommitInputReport(pReport, pReport))
+#endif
+	{
+	#if (USB_IN_BUFFERS > 1)
+		if (m_InPending[m_NextIn ^ 1])
+			return; // the idle timing picks up again once the other report is read
+	#endif
+
+		m_ReportIdle = TRUE;
+		m_NextBuildTime = (BYTE)g_MsTickCount + g_UsbPollInterval;
 
+	#if defined(USB_SOF_SYNC)
+		if (g_UsbPollPeriod)
+		{
+			// stay in step with the host's polls instead
+			m_NextReportFrame += g_UsbPollPeriod;
+			m_NextBuildTime = (BYTE)g_MsTickCount;
+		}
+	#endif
+		return;
+	}
+
+	m_ReportIdle = FALSE;
+	USBInHandle[m_NextIn] = HIDTxPacket(HID_EP, pReport, HID_INPUT_REPORT_BYTES);
+
+#if defined(PERF_STATS)
+	if (g_PerfReportsSent < 0xFFFF)
+		++g_PerfReportsSent;
+#endif
+	m_InPending[m_NextIn] = TRUE;
+	m_InHasHit[m_NextIn] = g_NewHitInReport;
+	m_InHitTick[m_NextIn] = g_MidiNoteTick;
+
+#if (USB_IN_BUFFERS > 1)
+	m_NextIn ^= 1;
+#endif
+
+	// time from the last MIDI note to here
+	if (g_NewHitInReport)
+	{
+		g_NewHitInReport = FALSE;
+
+		g_HitLatencyLast = g_TickCount - g_MidiNoteTick;
+		if (g_HitLatencyLast > g_HitLatencyMax)
+			g_HitLatencyMax = g_HitLatencyLast;
+	}
 } // end ReportLoopback
 
 
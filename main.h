@@ -47,6 +47,31 @@
 
 /** P U B L I C  P R O T O T Y P E S *****************************************/
 
+extern BYTE g_UsbPollPeriod;
+extern BYTE g_SofSyncMisses;
+extern BYTE g_HitLatencyLast;
+extern BYTE g_HitLatencyMax;
+extern BYTE g_HitDeliveryLast;
+extern BYTE g_HitDeliveryMax;
+extern WORD g_MainLoopRate;
+
+// PERF_STATS (see App.h)
+#define PERF_LATENCY_BUCKETS 7
+extern WORD g_PerfLatencyHist[PERF_LATENCY_BUCKETS];
+extern WORD g_PerfReportsBuilt;
+extern WORD g_PerfReportsSent;
+extern WORD g_PerfBuildTimeMax;
+extern WORD g_PerfParseTimeMax;
+extern WORD g_PerfParseBytes;
+extern WORD g_PerfParseTime;
+extern WORD g_PerfButtonTimeMax;
+extern WORD g_PerfBootTime;
+extern WORD g_PerfJournalTime;
+extern volatile WORD g_PerfTickDelayMax;
+extern void ClearPerfStats(void);
+extern void ReadPerfTime(BYTE * pTick, WORD * pTimer);
+extern WORD PerfTimeSince(BYTE StartTick, WORD StartTimer, WORD * pMax);
+
 extern void ProcessIO(void);
 extern void mySetReportHandler(void);
 extern BYTE ReportSupported(void);
@@ -0,0 +1,17 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostApp.c
+
+	Purpose:	The few things from App.c that MIDI.c and EEData.c use, for the host
+				tests that don't link App.c.
+
+------------------------------------------------------------------------------*/
+#include "GenericTypeDefs.h"
+#include "App.h"
+
+volatile UINT16 g_MsTickCount = 0;
+volatile UINT8 g_TickCount = 0;
+
+void AddDataToLog(UINT8 DataID, UINT Data)
+{
+}
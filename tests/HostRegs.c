@@ -0,0 +1,308 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostRegs.c
+
+	Purpose:	The registers from stub/p18cxxx.h, the virtual time, the UART and 
+				timer models (see HostRegs.h) and the C18 library functions from 
+				stub/Delays.h and stub/Timers.h, for the host tests.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <p18cxxx.h>
+#include <Delays.h>
+#include <Timers.h>
+#include "GenericTypeDefs.h"
+#include "App.h"
+#include "HostRegs.h"
+
+volatile LATAbits_t LATAbits;
+volatile LATBbits_t LATBbits;
+volatile LATCbits_t LATCbits;
+volatile LATDbits_t LATDbits;
+volatile LATEbits_t LATEbits;
+volatile PORTAbits_t PORTAbits;
+volatile PORTBbits_t PORTBbits;
+volatile PORTCbits_t PORTCbits;
+volatile PORTDbits_t PORTDbits;
+volatile PORTEbits_t PORTEbits;
+volatile TRISAbits_t TRISAbits;
+volatile TRISBbits_t TRISBbits;
+volatile TRISCbits_t TRISCbits;
+volatile TRISDbits_t TRISDbits;
+volatile TRISEbits_t TRISEbits;
+
+volatile INTCONbits_t INTCONbits;
+volatile RCONbits_t RCONbits;
+volatile PIE1bits_t PIE1bits;
+volatile IPR1bits_t IPR1bits;
+volatile PIE2bits_t PIE2bits;
+volatile PIR2bits_t PIR2bits;
+volatile IPR2bits_t IPR2bits;
+volatile T1CONbits_t T1CONbits;
+volatile ADCON0bits_t ADCON0bits;
+volatile ADCON2bits_t ADCON2bits;
+volatile UCONbits_t UCONbits;
+volatile UIRbits_t UIRbits;
+
+volatile unsigned char BAUDCON, INTCON2, SPBRG, SPBRGH;
+volatile unsigned char SSPCON1, TXREG, TXSTA;
+volatile unsigned char CCP1CON, CCPR1L, CCPR1H;
+volatile unsigned char ADCON1, ADRESH, CMCON, UFRML;
+volatile unsigned char EEADR, EECON2;
+volatile unsigned char TABLAT, TBLPTRU, TBLPTRH, TBLPTRL;
+volatile unsigned char TMR1H;
+
+unsigned char g_HostEEPROM[HOST_EEPROM_SIZE];
+UINT32 g_HostEEWrites[HOST_EEPROM_SIZE];
+UINT32 g_HostEEWriteMicros = 0;
+
+volatile EECON1bits_t * HostEECON1(void)
+{
+	static volatile EECON1bits_t m_EECON1bits;
+	static BOOL m_Writing = FALSE;
+	static UINT32 m_WriteDone;
+
+	// a write was started since the last time (EEADR doesn't change until it's done)
+	if (m_EECON1bits.WR && !m_Writing)
+	{
+		++g_HostEEWrites[EEADR];
+		m_Writing = TRUE;
+		m_WriteDone = g_HostMicros + g_HostEEWriteMicros;
+	}
+
+	if (m_Writing && (g_HostMicros >= m_WriteDone))
+	{
+		m_Writing = FALSE;
+		m_EECON1bits.WR = 0;
+	}
+
+	return &m_EECON1bits;
+}
+
+
+/*
+Virtual time. Nothing happens between calls to HostRun(), so the tests decide how long the
+firmware takes to do things.
+*/
+UINT32 g_HostMicros = 0;
+void (*g_HostRxISR)(void) = NULL;
+void (*g_HostTickISR)(void) = NULL;
+void (*g_HostSpendHook)(UINT32 Cycles) = NULL;
+UINT32 g_HostUartLost = 0;
+
+static UINT32 m_NextTick = OUTPUT_TICK_US;
+static BOOL m_InRun = FALSE;
+static UINT8 m_Cycles = 0; // instruction cycles to go before the next usec
+
+// Timer0
+#define TIMER0_HZ	46875 // 48MHz / 4 / 256
+
+static UINT32 m_Timer0Start = 0; // when it was written
+static UINT16 m_Timer0Value = 0; // ... and what with
+
+// the UART receiver
+#define UART_FIFO_SIZE	2
+#define RCSTA_OERR		0x02
+#define RCSTA_CREN		0x10
+
+static volatile PIR1bits_t m_PIR1bits;
+static volatile unsigned char m_RCSTA;
+static BYTE m_UartFifo[UART_FIFO_SIZE];
+static UINT8 m_UartCount = 0;
+
+// bytes on their way down the MIDI cable
+#define LINE_SIZE	4096 // must be a power of 2
+#define LINE_MASK	(LINE_SIZE - 1)
+
+static BYTE m_LineData[LINE_SIZE];
+static UINT32 m_LineDone[LINE_SIZE]; // when the stop bit is in
+static UINT16 m_LineHead = 0;
+static UINT16 m_LineCount = 0;
+static UINT32 m_LineFree = 0;
+
+
+volatile PIR1bits_t * HostPIR1(void)
+{
+	m_PIR1bits.RCIF = (m_UartCount != 0);
+	m_PIR1bits.TXIF = 1;
+	return &m_PIR1bits;
+}
+
+
+BYTE HostReadRCREG(void)
+{
+	BYTE nData;
+
+	if (m_UartCount == 0)
+		return 0;
+
+	nData = m_UartFifo[0];
+	m_UartFifo[0] = m_UartFifo[1];
+	--m_UartCount;
+	return nData;
+}
+
+
+volatile unsigned char * HostRCSTA(void)
+{
+	// clearing CREN clears an overrun
+	if (!(m_RCSTA & RCSTA_CREN))
+		m_RCSTA &= ~RCSTA_OERR;
+
+	return &m_RCSTA;
+}
+
+
+void HostUartReceive(BYTE Data)
+{
+	if (!(m_RCSTA & RCSTA_CREN) || (m_RCSTA & RCSTA_OERR))
+		++g_HostUartLost; // not receiving
+	else if (m_UartCount >= UART_FIFO_SIZE)
+	{
+		// the FIFO is full, so this byte is lost and reception stops until OERR is cleared
+		m_RCSTA |= RCSTA_OERR;
+		++g_HostUartLost;
+	}
+	else
+		m_UartFifo[m_UartCount++] = Data;
+
+	if (g_HostRxISR && (m_UartCount != 0))
+		g_HostRxISR();
+}
+
+
+void HostUartSend(UINT32 Start, BYTE Data)
+{
+	UINT16 nIndex;
+
+	if (m_LineCount >= LINE_SIZE)
+	{
+		printf("HostUartSend: the line is full, run some time first\n");
+		exit(2);
+	}
+
+	if (Start < m_LineFree)
+		Start = m_LineFree; // still sending the last byte
+	if (Start < g_HostMicros)
+		Start = g_HostMicros;
+
+	m_LineFree = Start + UART_BYTE_MICROS;
+
+	nIndex = (m_LineHead + m_LineCount) & LINE_MASK;
+	m_LineData[nIndex] = Data;
+	m_LineDone[nIndex] = m_LineFree;
+	++m_LineCount;
+}
+
+
+UINT32 HostUartLineFree(void)
+{
+	return (m_LineFree > g_HostMicros) ? m_LineFree : g_HostMicros;
+}
+
+
+UINT16 HostUartLineCount(void)
+{
+	return m_LineCount;
+}
+
+
+void HostRun(UINT32 Micros)
+{
+	UINT32 nEnd = g_HostMicros + Micros;
+	BOOL bByte, bTick;
+	BYTE nData;
+
+	// (an interrupt that waits for something just lets the time go by)
+	if (m_InRun)
+	{
+		g_HostMicros = nEnd;
+		return;
+	}
+
+	m_InRun = TRUE;
+
+	while (TRUE)
+	{
+		bByte = (m_LineCount != 0) && (m_LineDone[m_LineHead] <= nEnd);
+		bTick = (m_NextTick <= nEnd);
+
+		if (bByte && (!bTick || (m_LineDone[m_LineHead] <= m_NextTick)))
+		{
+			g_HostMicros = m_LineDone[m_LineHead];
+			nData = m_LineData[m_LineHead];
+			m_LineHead = (m_LineHead + 1) & LINE_MASK;
+			--m_LineCount;
+
+			HostUartReceive(nData);
+		}
+		else if (bTick)
+		{
+			g_HostMicros = m_NextTick;
+			m_NextTick += OUTPUT_TICK_US;
+
+			m_PIR1bits.CCP1IF = 1;
+			if (g_HostTickISR)
+				g_HostTickISR();
+		}
+		else
+			break;
+	}
+
+	g_HostMicros = nEnd;
+	m_InRun = FALSE;
+}
+
+
+
+void HostSpend(UINT32 Cycles)
+{
+	if (g_HostSpendHook)
+	{
+		g_HostSpendHook(Cycles);
+		return;
+	}
+
+	Cycles += m_Cycles;
+	m_Cycles = Cycles % 12;
+	HostRun(Cycles / 12);
+}
+
+
+void HostDelayCycles(unsigned long Cycles)
+{
+	HostSpend(Cycles);
+}
+
+
+volatile unsigned char * HostTMR1L(void)
+{
+	static volatile unsigned char m_TMR1L;
+	UINT16 nTimer;
+
+	// Timer1 is reset by the CCP1 special event trigger when each tick is due
+	nTimer = (UINT16)((g_HostMicros - (m_NextTick - OUTPUT_TICK_US)) * 12 + m_Cycles);
+	m_TMR1L = (BYTE)nTimer;
+	TMR1H = (BYTE)(nTimer >> 8);
+	return &m_TMR1L;
+}
+
+
+void OpenTimer0(unsigned char Config)
+{
+	WriteTimer0(0);
+}
+
+
+void WriteTimer0(unsigned int Timer)
+{
+	m_Timer0Start = g_HostMicros;
+	m_Timer0Value = Timer;
+}
+
+
+unsigned int ReadTimer0(void)
+{
+	return (UINT16)(m_Timer0Value + (UINT16)(((unsigned long long)(g_HostMicros - m_Timer0Start) * TIMER0_HZ) / 1000000));
+}
@@ -0,0 +1,56 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostRegs.h
+
+	Purpose:	The host test side of HostRegs.c: virtual time, and the bytes coming
+				in to the UART.
+
+------------------------------------------------------------------------------*/
+#ifndef _INC_HOST_REGS
+#define _INC_HOST_REGS
+
+#include "GenericTypeDefs.h"
+
+#define UART_BYTE_MICROS	320 // 10 bits at 31250 baud
+
+/*
+Virtual time in usecs. HostRun() lets it go by: the bytes sent with HostUartSend() come in 
+when their stop bit is done, and CCP1IF is set every OUTPUT_TICK_US, calling g_HostTickISR 
+the way the output timer interrupt is. A byte that comes in calls g_HostRxISR, the high 
+priority interrupt. Set either one to NULL to hold the interrupt off.
+*/
+extern UINT32 g_HostMicros;
+extern void (*g_HostRxISR)(void);
+extern void (*g_HostTickISR)(void);
+
+extern void HostRun(UINT32 Micros);
+
+/*
+HostSpend() is the firmware using up instruction cycles (12 per usec), the C18 delays call 
+it. It runs the time on with HostRun(), unless g_HostSpendHook is set, in which case that 
+gets the cycles instead (see HostSim.c).
+*/
+extern void (*g_HostSpendHook)(UINT32 Cycles);
+
+extern void HostSpend(UINT32 Cycles);
+
+/*
+HostUartSend() puts a byte on the line, starting at Start or as soon as the last one is 
+done. HostUartReceive() is a byte coming in to the UART right now. g_HostUartLost counts 
+the bytes the UART lost, because the FIFO was full (OERR) or reception was off.
+*/
+extern UINT32 g_HostUartLost;
+
+extern void HostUartReceive(BYTE Data);
+extern void HostUartSend(UINT32 Start, BYTE Data);
+extern UINT32 HostUartLineFree(void);
+extern UINT16 HostUartLineCount(void);
+
+/*
+g_HostEEWrites counts the writes to each byte of the EEPROM. A write takes
+g_HostEEWriteMicros of virtual time (WR stays set until then), 0 to finish straight away.
+*/
+extern UINT32 g_HostEEWrites[];
+extern UINT32 g_HostEEWriteMicros;
+
+#endif // _INC_HOST_REGS
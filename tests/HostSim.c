@@ -0,0 +1,527 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostSim.c
+
+	Purpose:	Runs the whole firmware on the PC in virtual time. The firmware is
+				built with -fsanitize-coverage=trace-pc, so every basic block it runs
+				calls __sanitizer_cov_trace_pc(), which uses up SIM_CYCLES_PER_BLOCK
+				instruction cycles. As the time goes by, the MIDI bytes come in to the
+				UART, the output timer ticks, the USB host (HostUsb.c) does its thing,
+				and the interrupts are taken when they're enabled, the same as on the
+				chip. With -finstrument-functions the calls to the functions in
+				g_SimFunctions are counted too.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <p18cxxx.h>
+#include "GenericTypeDefs.h"
+#include "App.h"
+#include "MIDI.h"
+#include "main.h"
+#include "Joystick.h"
+#include "USB/usb_device.h"
+#include "HostRegs.h"
+#include "HostUsb.h"
+#include "HostSim.h"
+
+extern void FirmwareMain(void); // main() in main.c (see the Makefile)
+extern void SimTrackAppFunctions(void);
+extern BYTE SimReadExtOutputs(void);
+
+TSimHit g_SimHits[SIM_MAX_HITS];
+UINT16 g_SimHitCount = 0;
+UINT16 g_SimExtraPresses = 0;
+UINT32 g_SimBlocks[3];
+TSimFunction g_SimFunctions[SIM_MAX_FUNCTIONS];
+UINT8 g_SimFunctionCount = 0;
+BYTE g_SimLaneNotes[SIM_LANES][16];
+
+#define LEVEL_MAIN	0
+#define LEVEL_LOW	1
+#define LEVEL_HIGH	2
+
+#define FEED_AHEAD_US	20000	// how far ahead of the time the MIDI is put on the line
+#define READY_TIMEOUT_US 5000000
+
+static jmp_buf m_Stop;
+static BOOL m_Paused = TRUE; // the firmware is being called from here, its time doesn't count
+static UINT8 m_Level = LEVEL_MAIN;
+static UINT32 m_Cycles = 0;
+
+static UINT32 m_ReadyAt = 0;
+static BOOL (*m_Feed)(UINT32 Until) = NULL;
+static BOOL m_Feeding = FALSE;
+static UINT32 m_NextFeed = 0;
+static UINT32 m_Tail = 0;
+static UINT32 m_StopAt = 0;
+
+static BYTE m_RunningStatus = 0;
+static BYTE m_NoteLanes[128];	// lanes each note is mapped to (bit mask)
+static BYTE m_ChannelLanes[MIDI_CHANNEL_COUNT];
+static BYTE m_LanesActive = 0;	// lanes the host sees pressed
+static UINT16 m_LaneFirst[SIM_LANES]; // no pending hits for the lane before this one
+
+// calls in progress
+#define CALL_DEPTH	32
+
+static struct
+{
+	UINT8 Function;
+	UINT8 Level;
+	UINT32 Start;
+} m_Calls[CALL_DEPTH];
+static UINT8 m_CallDepth = 0;
+
+
+const char * SimVariantName(void)
+{
+#if defined(MIDI_OUT_ADAPTER) && defined(TARGET_WII)
+	return "MRLX_MidiOut";
+#elif defined(MIDI_OUT_ADAPTER)
+	return "MRLX_MidiOut_Xbox";
+#elif defined(XBOX_RB2_INTERFACE)
+	return "MRLX_XB-RB2";
+#elif defined(TARGET_XBOX)
+	return "MRLX_XB-RB1";
+#elif defined(TARGET_WII)
+	return "MRLX_Wii";
+#else
+	return "MRLX_PS";
+#endif
+}
+
+
+const char * SimLaneName(BYTE Lane)
+{
+	static const char * LANE_NAMES[SIM_LANES] = { "red", "yellow", "blue", "green", "kick", "orange" };
+
+	return LANE_NAMES[Lane];
+}
+
+
+BOOL SimLaneUsed(BYTE Lane)
+{
+	return (Lane < 5) || (g_GameMode == gmGUITAR_HERO);
+}
+
+
+void SimTrackFunction(const char * pName, void * pFunction)
+{
+	TSimFunction * pTrack;
+
+	if (g_SimFunctionCount >= SIM_MAX_FUNCTIONS)
+		return;
+
+	pTrack = &g_SimFunctions[g_SimFunctionCount++];
+	memset(pTrack, 0, sizeof(*pTrack));
+	pTrack->pName = pName;
+	pTrack->pFunction = pFunction;
+}
+
+
+static UINT8 FindFunction(void * pFunction)
+{
+	UINT8 nIndex;
+
+	for (nIndex = 0; nIndex < g_SimFunctionCount; ++nIndex)
+	{
+		if (g_SimFunctions[nIndex].pFunction == pFunction)
+			return nIndex;
+	}
+
+	return 0xFF;
+}
+
+
+void __cyg_profile_func_enter(void * pFunction, void * pCaller)
+{
+	UINT8 nIndex;
+
+	if (m_Paused || ((nIndex = FindFunction(pFunction)) == 0xFF) || (m_CallDepth >= CALL_DEPTH))
+		return;
+
+	m_Calls[m_CallDepth].Function = nIndex;
+	m_Calls[m_CallDepth].Level = m_Level;
+	m_Calls[m_CallDepth].Start = g_SimBlocks[m_Level];
+	++m_CallDepth;
+}
+
+
+void __cyg_profile_func_exit(void * pFunction, void * pCaller)
+{
+	TSimFunction * pTrack;
+	UINT32 nBlocks;
+
+	if (m_Paused || (m_CallDepth == 0) || (g_SimFunctions[m_Calls[m_CallDepth - 1].Function].pFunction != pFunction))
+		return;
+
+	--m_CallDepth;
+	pTrack = &g_SimFunctions[m_Calls[m_CallDepth].Function];
+	nBlocks = g_SimBlocks[m_Calls[m_CallDepth].Level] - m_Calls[m_CallDepth].Start;
+
+	++pTrack->Calls;
+	pTrack->Blocks += nBlocks;
+	if (nBlocks > pTrack->MaxBlocks)
+		pTrack->MaxBlocks = nBlocks;
+}
+
+
+/*
+A press the host has seen on a lane is put down to the oldest hit on that lane that hasn't
+had one yet.
+*/
+static void LanePressed(BYTE Lane)
+{
+	UINT16 nHit;
+	TSimHit * pHit;
+
+	for (nHit = m_LaneFirst[Lane]; nHit < g_SimHitCount; ++nHit)
+	{
+		pHit = &g_SimHits[nHit];
+
+		if ((pHit->Lane != Lane) || (pHit->Result != hrPENDING) || (g_HostMicros - pHit->Sent > SIM_STALE_US))
+		{
+			if (nHit == m_LaneFirst[Lane])
+				++m_LaneFirst[Lane];
+			continue;
+		}
+
+		if (pHit->Sent > g_HostMicros)
+			break;
+
+		pHit->Result = hrDELIVERED;
+		pHit->Out = g_HostMicros;
+		return;
+	}
+
+	++g_SimExtraPresses;
+}
+
+
+static void LanesSeen(BYTE Lanes)
+{
+	BYTE nPressed, nLane;
+
+	if (m_ReadyAt == 0)
+		return;
+
+	nPressed = Lanes & ~m_LanesActive;
+	m_LanesActive = Lanes;
+
+	for (nLane = 0; nPressed != 0; ++nLane, nPressed >>= 1)
+	{
+		if (nPressed & 0x01)
+			LanePressed(nLane);
+	}
+}
+
+
+// an input report the host has read
+static void ReportRead(const BYTE * pReport, BYTE Length)
+{
+	BYTE nLanes = 0;
+
+	if (pReport[0] & RED_DRUM)
+		nLanes |= 0x01;
+	if (pReport[0] & YELLOW_DRUM)
+		nLanes |= 0x02;
+	if (pReport[0] & BLUE_DRUM)
+		nLanes |= 0x04;
+	if (pReport[0] & GREEN_DRUM)
+		nLanes |= 0x08;
+	if (pReport[0] & KICK_PEDAL)
+		nLanes |= 0x10;
+	if ((g_GameMode == gmGUITAR_HERO) && (pReport[0] & ORANGE_CYMBAL))
+		nLanes |= 0x20;
+
+	LanesSeen(nLanes);
+}
+
+
+#if defined(LX_EXT_OUTS)
+// the Xbox interface outputs
+static void WatchOutputs(void)
+{
+	BYTE nChannels, nChannel, nLanes = 0;
+
+	nChannels = SimReadExtOutputs();
+	for (nChannel = 0; nChannels != 0; ++nChannel, nChannels >>= 1)
+	{
+		if (nChannels & 0x01)
+			nLanes |= m_ChannelLanes[nChannel];
+	}
+
+	LanesSeen(nLanes);
+}
+#endif
+
+
+/*
+Works out which lanes each note shows up on, from the active map.
+*/
+static void FindNoteLanes(void)
+{
+	static const BYTE RB_LANES[MIDI_CHANNEL_COUNT] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x02, 0x04, 0x08 };
+	static const BYTE GH_LANES[MIDI_CHANNEL_COUNT] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x00, 0x00 };
+	BYTE nChannel, nIndex, nNote, nLane, nCount[SIM_LANES];
+
+	memset(m_NoteLanes, 0, sizeof(m_NoteLanes));
+	memset(g_SimLaneNotes, INVALID_NOTE_NUMBER, sizeof(g_SimLaneNotes));
+	memset(nCount, 0, sizeof(nCount));
+
+	for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
+	{
+		m_ChannelLanes[nChannel] = (g_GameMode == gmGUITAR_HERO) ? GH_LANES[nChannel] : RB_LANES[nChannel];
+
+		for (nIndex = 0; (nNote = GetMidiMapEntry(nChannel, nIndex)) != INVALID_NOTE_NUMBER; ++nIndex)
+		{
+			m_NoteLanes[nNote & 0x7F] |= m_ChannelLanes[nChannel];
+
+			for (nLane = 0; nLane < SIM_LANES; ++nLane)
+			{
+				if ((m_ChannelLanes[nChannel] & (1 << nLane)) && (nCount[nLane] < 15))
+					g_SimLaneNotes[nLane][nCount[nLane]++] = nNote;
+			}
+		}
+	}
+}
+
+
+static BOOL Ready(void)
+{
+	if (g_SystemMode == SYS_MODE_XBOX)
+		return (g_PerfBootTime != 0); // set just before the Xbox loop starts
+
+	return (g_HostUsbConfiguredAt != 0);
+}
+
+
+// same as YourHighPriorityISRCode() in main.c
+static void HighISR(void)
+{
+	if (PIR1bits.RCIF)
+		MIDI_RxISR();
+}
+
+
+// same as YourLowPriorityISRCode() in main.c
+static void LowISR(void)
+{
+	if (PIR1bits.CCP1IF)
+		OutputTimerISR();
+
+	if (PIR2bits.USBIF && PIE2bits.USBIE)
+	{
+		USBDeviceTasks();
+		IPR2bits.USBIP = 0;
+	}
+}
+
+
+// the interrupts that are waiting at Priority (1 high, 0 low)
+static BOOL InterruptWaiting(BYTE Priority)
+{
+	return (PIE1bits.RCIE && PIR1bits.RCIF && (IPR1bits.RCIP == Priority))
+		|| (PIE1bits.CCP1IE && PIR1bits.CCP1IF && (IPR1bits.CCP1IP == Priority))
+		|| (PIE2bits.USBIE && PIR2bits.USBIF && (IPR2bits.USBIP == Priority));
+}
+
+
+static void TakeInterrupts(void)
+{
+	UINT8 nLevel = m_Level;
+
+	while (INTCONbits.GIEH && (m_Level < LEVEL_HIGH))
+	{
+		if (InterruptWaiting(1))
+		{
+			if (PIE2bits.USBIE && PIR2bits.USBIF && IPR2bits.USBIP)
+			{
+				printf("%s: the USB interrupt is high priority, nothing would service it\n", SimVariantName());
+				exit(1);
+			}
+
+			m_Level = LEVEL_HIGH;
+			HighISR();
+			m_Level = nLevel;
+		}
+		else if ((m_Level == LEVEL_MAIN) && INTCONbits.GIEL && InterruptWaiting(0))
+		{
+			m_Level = LEVEL_LOW;
+			LowISR();
+			m_Level = nLevel;
+		}
+		else
+			break;
+	}
+}
+
+
+static void Step(void)
+{
+	HostRun(1);
+	HostUsbStep();
+
+	if (m_ReadyAt == 0)
+	{
+		if (Ready())
+		{
+			m_Paused = TRUE;
+			FindNoteLanes();
+			m_Paused = FALSE;
+
+			m_ReadyAt = g_HostMicros;
+			m_Feeding = TRUE;
+			m_NextFeed = g_HostMicros;
+		}
+		else if (g_HostMicros > READY_TIMEOUT_US)
+		{
+			printf("%s: the firmware didn't get going\n", SimVariantName());
+			exit(1);
+		}
+	}
+
+	if (m_Feeding && (g_HostMicros >= m_NextFeed))
+	{
+		m_NextFeed += 1000;
+		m_Feeding = m_Feed(g_HostMicros - m_ReadyAt + FEED_AHEAD_US);
+	}
+	else if (!m_Feeding && (m_ReadyAt != 0) && (m_StopAt == 0) && (HostUartLineCount() == 0))
+		m_StopAt = g_HostMicros + m_Tail;
+
+	if (m_StopAt && (g_HostMicros >= m_StopAt))
+		longjmp(m_Stop, 1);
+
+#if defined(LX_EXT_OUTS)
+	WatchOutputs();
+#endif
+
+	TakeInterrupts();
+}
+
+
+static void SimSpend(UINT32 Cycles)
+{
+	m_Cycles += Cycles;
+
+	while (m_Cycles >= 12)
+	{
+		m_Cycles -= 12;
+		Step();
+	}
+}
+
+
+void __sanitizer_cov_trace_pc(void)
+{
+	if (m_Paused)
+		return;
+
+	++g_SimBlocks[m_Level];
+	SimSpend(SIM_CYCLES_PER_BLOCK);
+}
+
+
+void SimSendMidi(UINT32 Time, BYTE Status, BYTE Data1, BYTE Data2)
+{
+	BYTE nLanes, nLane;
+	TSimHit * pHit;
+
+	if (Status >= 0xF8)
+	{
+		// real time, doesn't change the running status
+		HostUartSend(m_ReadyAt + Time, Status);
+		return;
+	}
+
+	// (the data bytes follow straight after the status byte)
+	if (Status != m_RunningStatus)
+		HostUartSend(m_ReadyAt + Time, Status);
+	m_RunningStatus = (Status < 0xF0) ? Status : 0;
+
+	HostUartSend(m_ReadyAt + Time, Data1);
+	if (((Status & 0xE0) != 0xC0) && (Status < 0xF0))
+		HostUartSend(0, Data2); // not program change or channel pressure
+
+	if (((Status & 0xF0) != NOTE_ON) || (Data2 == 0) || (Data2 < g_MinVelocity))
+		return;
+
+	nLanes = m_NoteLanes[Data1 & 0x7F];
+	for (nLane = 0; nLanes != 0; ++nLane, nLanes >>= 1)
+	{
+		if (!(nLanes & 0x01) || (g_SimHitCount >= SIM_MAX_HITS))
+			continue;
+
+		pHit = &g_SimHits[g_SimHitCount++];
+		pHit->Played = m_ReadyAt + Time;
+		pHit->Sent = HostUartLineFree();
+		pHit->Out = 0;
+		pHit->Lane = nLane;
+		pHit->Result = hrPENDING;
+	}
+}
+
+
+/*
+A hit that didn't get a press of its own was merged if a press for an earlier hit on the
+same lane went out after it came in, otherwise it was missed.
+*/
+static void SortOutHits(void)
+{
+	UINT16 nHit, nOther;
+	TSimHit * pHit, * pOther;
+
+	for (nHit = 0; nHit < g_SimHitCount; ++nHit)
+	{
+		pHit = &g_SimHits[nHit];
+		if (pHit->Result != hrPENDING)
+			continue;
+
+		pHit->Result = hrMISSED;
+
+		for (nOther = nHit; nOther-- > 0; )
+		{
+			pOther = &g_SimHits[nOther];
+			if (pHit->Sent - pOther->Sent > SIM_STALE_US)
+				break;
+
+			if ((pOther->Lane == pHit->Lane) && (pOther->Result == hrDELIVERED) && (pOther->Out >= pHit->Sent))
+			{
+				pHit->Result = hrMERGED;
+				break;
+			}
+		}
+	}
+}
+
+
+void SimRun(BOOL (*Feed)(UINT32 Until), UINT32 Tail)
+{
+	m_Feed = Feed;
+	m_Tail = Tail;
+
+	// blank EEPROM, which takes about 4ms to write a byte, and no buttons pressed
+	memset(g_HostEEPROM, 0xFF, sizeof(g_HostEEPROM));
+	g_HostEEWriteMicros = 4000;
+	PORTA = 0xFF;
+	PORTB = 0xFF;
+	PORTC = 0xFF;
+	PORTD = 0xFF;
+	PORTE = 0xFF;
+
+	SimTrackAppFunctions();
+	g_HostUsbReport = ReportRead;
+	g_HostSpendHook = SimSpend;
+
+	if (setjmp(m_Stop) == 0)
+	{
+		m_Paused = FALSE;
+		FirmwareMain();
+	}
+
+	m_Paused = TRUE;
+	SortOutHits();
+}
@@ -0,0 +1,92 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostSim.h
+
+	Purpose:	The host simulation of the whole firmware (see HostSim.c): MIDI in,
+				through the UART interrupt, the parser and DoMidiMapping(), to the
+				input reports the USB host reads, or the Xbox interface outputs.
+
+------------------------------------------------------------------------------*/
+#ifndef _INC_HOST_SIM
+#define _INC_HOST_SIM
+
+#include "GenericTypeDefs.h"
+
+/*
+Each x86 basic block the firmware runs is taken to be SIM_CYCLES_PER_BLOCK instruction
+cycles on the PIC. The block counts are exact, the times are only as good as that guess.
+*/
+#define SIM_CYCLES_PER_BLOCK	8
+
+/*
+Hits are followed per lane, which is what the host can tell apart: the red, yellow, blue
+and green buttons (pad or cymbal), the kick, and the orange cymbal in Guitar Hero mode.
+*/
+#define SIM_LANES			6
+#define SIM_NO_LANE			0xFF
+#define SIM_MAX_HITS		8192
+
+#define SIM_STALE_US		250000 // a press this long after a hit isn't for that hit
+
+typedef enum { hrPENDING, hrDELIVERED, hrMERGED, hrMISSED } THitResult;
+
+typedef struct
+{
+	UINT32 Played; // when it was meant to be played
+	UINT32 Sent;   // when the last byte of the NOTE ON was in
+	UINT32 Out;    // when the host saw the press
+	BYTE Lane;
+	BYTE Result;   // THitResult
+} TSimHit;
+
+extern TSimHit g_SimHits[SIM_MAX_HITS];
+extern UINT16 g_SimHitCount;
+extern UINT16 g_SimExtraPresses; // presses the host saw that weren't for any hit
+
+// the basic blocks run in the main loop [0], and the low [1] and high [2] priority interrupts
+extern UINT32 g_SimBlocks[3];
+
+/*
+The firmware functions whose calls are counted (see SimTrackFunction()), with the basic
+blocks each call ran (not counting interrupts).
+*/
+#define SIM_MAX_FUNCTIONS	16
+
+typedef struct
+{
+	const char * pName;
+	void * pFunction;
+	UINT32 Calls;
+	UINT32 Blocks;
+	UINT32 MaxBlocks;
+} TSimFunction;
+
+extern TSimFunction g_SimFunctions[SIM_MAX_FUNCTIONS];
+extern UINT8 g_SimFunctionCount;
+
+extern void SimTrackFunction(const char * pName, void * pFunction);
+
+/*
+SimRun() powers the firmware up with a blank EEPROM and runs it until it's ready (the USB is
+configured, or it's in the Xbox loop), then calls Feed every millisec with the time, relative
+to when it was ready, up to which the MIDI has to be on the line, until Feed returns FALSE
+and the line is empty again. Then it lets the firmware run for another Tail usecs, and works
+out what happened to each hit.
+*/
+extern void SimRun(BOOL (*Feed)(UINT32 Until), UINT32 Tail);
+
+/*
+Puts a MIDI message on the line at Time (relative to the start), or as soon as the line
+is free, with running status like a drum module sends it. A NOTE ON that's loud enough to
+be played is added to g_SimHits, for each lane its note is mapped to.
+*/
+extern void SimSendMidi(UINT32 Time, BYTE Status, BYTE Data1, BYTE Data2);
+
+// the notes mapped to each lane (in the active map), INVALID_NOTE_NUMBER at the end
+extern BYTE g_SimLaneNotes[SIM_LANES][16];
+
+extern const char * SimVariantName(void);
+extern BOOL SimLaneUsed(BYTE Lane);
+extern const char * SimLaneName(BYTE Lane);
+
+#endif // _INC_HOST_SIM
@@ -0,0 +1,244 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostSmf.c
+
+	Purpose:	Reads a Standard MIDI File (format 0 or 1) for the host simulation. The
+				tracks are merged, and the ticks turned into usecs with the tempo map.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "GenericTypeDefs.h"
+#include "HostSmf.h"
+
+#define SMF_MAX_SIZE	(1024 * 1024)
+#define SMF_MAX_EVENTS	65536
+#define SMF_MAX_TEMPOS	1024
+
+#define DEFAULT_TEMPO	500000 // usecs per quarter note (120 bpm)
+
+typedef struct
+{
+	UINT32 Tick;
+	UINT32 Order; // keeps events on the same tick in the order they were in the file
+	BYTE Status, Data1, Data2;
+} TSmfEvent;
+
+typedef struct
+{
+	UINT32 Tick;
+	UINT32 Tempo;
+} TSmfTempo;
+
+static TSmfEvent m_Events[SMF_MAX_EVENTS];
+static UINT32 m_EventCount;
+static TSmfTempo m_Tempos[SMF_MAX_TEMPOS];
+static UINT32 m_TempoCount;
+
+
+static UINT32 ReadBE(const BYTE * pData, UINT8 Length)
+{
+	UINT32 nValue = 0;
+
+	while (Length--)
+		nValue = (nValue << 8) | *pData++;
+
+	return nValue;
+}
+
+
+// a variable length quantity, FALSE if it runs past pEnd
+static BOOL ReadVLQ(const BYTE ** ppData, const BYTE * pEnd, UINT32 * pValue)
+{
+	UINT32 nValue = 0;
+	UINT8 nBytes;
+
+	for (nBytes = 0; (nBytes < 4) && (*ppData < pEnd); ++nBytes)
+	{
+		nValue = (nValue << 7) | (**ppData & 0x7F);
+		if (!(*(*ppData)++ & 0x80))
+		{
+			*pValue = nValue;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+
+static int CompareEvents(const void * p1, const void * p2)
+{
+	const TSmfEvent * pEvent1 = p1, * pEvent2 = p2;
+
+	if (pEvent1->Tick != pEvent2->Tick)
+		return (pEvent1->Tick < pEvent2->Tick) ? -1 : 1;
+
+	return (pEvent1->Order < pEvent2->Order) ? -1 : (pEvent1->Order > pEvent2->Order);
+}
+
+
+static int CompareTempos(const void * p1, const void * p2)
+{
+	const TSmfTempo * pTempo1 = p1, * pTempo2 = p2;
+
+	return (pTempo1->Tick < pTempo2->Tick) ? -1 : (pTempo1->Tick > pTempo2->Tick);
+}
+
+
+static BOOL ReadTrack(const BYTE * pData, const BYTE * pEnd)
+{
+	UINT32 nTick = 0, nDelta, nLength;
+	BYTE nStatus = 0, nType;
+	TSmfEvent * pEvent;
+
+	while (pData < pEnd)
+	{
+		if (!ReadVLQ(&pData, pEnd, &nDelta) || (pData >= pEnd))
+			return FALSE;
+		nTick += nDelta;
+
+		if (*pData & 0x80)
+			nStatus = *pData++;
+		else if (nStatus == 0)
+			return FALSE; // running status with nothing to run on
+
+		if (nStatus == 0xFF)
+		{
+			// meta event, only the tempo is wanted
+			if ((pData >= pEnd) || !(nType = *pData++, ReadVLQ(&pData, pEnd, &nLength)) || (pData + nLength > pEnd))
+				return FALSE;
+
+			if ((nType == 0x51) && (nLength == 3) && (m_TempoCount < SMF_MAX_TEMPOS))
+			{
+				m_Tempos[m_TempoCount].Tick = nTick;
+				m_Tempos[m_TempoCount].Tempo = ReadBE(pData, 3);
+				++m_TempoCount;
+			}
+			else if (nType == 0x2F)
+				return TRUE; // end of track
+
+			pData += nLength;
+			nStatus = 0; // meta and sysex events cancel running status
+		}
+		else if ((nStatus == 0xF0) || (nStatus == 0xF7))
+		{
+			if (!ReadVLQ(&pData, pEnd, &nLength) || (pData + nLength > pEnd))
+				return FALSE;
+
+			pData += nLength;
+			nStatus = 0;
+		}
+		else if (nStatus >= 0xF0)
+			return FALSE; // not allowed in a file
+		else
+		{
+			if (m_EventCount >= SMF_MAX_EVENTS)
+				return FALSE;
+
+			pEvent = &m_Events[m_EventCount];
+			pEvent->Tick = nTick;
+			pEvent->Order = m_EventCount++;
+			pEvent->Status = nStatus;
+			pEvent->Data1 = (pData < pEnd) ? *pData++ : 0;
+
+			// program change and channel pressure have one data byte
+			if ((nStatus & 0xE0) == 0xC0)
+				pEvent->Data2 = 0;
+			else
+				pEvent->Data2 = (pData < pEnd) ? *pData++ : 0;
+		}
+	}
+
+	return TRUE; // (no end of track event)
+}
+
+
+BOOL SmfRead(const char * pPath, void (*AddEvent)(UINT32 Time, BYTE Status, BYTE Data1, BYTE Data2))
+{
+	static BYTE nFile[SMF_MAX_SIZE];
+	FILE * pFile;
+	UINT32 nSize, nLength, nEvent, nTempo, nTick, nTime, nDivision;
+	UINT16 nTracks, nTrack;
+	const BYTE * pData, * pEnd;
+	double fTime, fTickUs;
+
+	if ((pFile = fopen(pPath, "rb")) == NULL)
+	{
+		printf("%s: can't open it\n", pPath);
+		return FALSE;
+	}
+
+	nSize = (UINT32)fread(nFile, 1, sizeof(nFile), pFile);
+	fclose(pFile);
+
+	if ((nSize < 14) || (memcmp(nFile, "MThd", 4) != 0) || (ReadBE(nFile + 4, 4) < 6))
+	{
+		printf("%s: not a Standard MIDI File\n", pPath);
+		return FALSE;
+	}
+
+	if (ReadBE(nFile + 8, 2) > 1)
+	{
+		printf("%s: only format 0 and 1 files can be played\n", pPath);
+		return FALSE;
+	}
+
+	nTracks = (UINT16)ReadBE(nFile + 10, 2);
+	nDivision = ReadBE(nFile + 12, 2);
+
+	m_EventCount = 0;
+	m_TempoCount = 0;
+
+	pData = nFile + 8 + ReadBE(nFile + 4, 4);
+	pEnd = nFile + nSize;
+
+	for (nTrack = 0; (nTrack < nTracks) && (pData + 8 <= pEnd); ++nTrack)
+	{
+		nLength = ReadBE(pData + 4, 4);
+		if (pData + 8 + nLength > pEnd)
+			nLength = (UINT32)(pEnd - pData - 8); // cut short, play what's there
+
+		if ((memcmp(pData, "MTrk", 4) == 0) && !ReadTrack(pData + 8, pData + 8 + nLength))
+		{
+			printf("%s: track %u is bad\n", pPath, nTrack + 1);
+			return FALSE;
+		}
+
+		pData += 8 + nLength;
+	}
+
+	qsort(m_Events, m_EventCount, sizeof(TSmfEvent), CompareEvents);
+	qsort(m_Tempos, m_TempoCount, sizeof(TSmfTempo), CompareTempos);
+
+	// ticks to usecs, with each tempo change
+	if (nDivision & 0x8000)
+	{
+		// SMPTE: frames per second (negative) and ticks per frame
+		fTickUs = 1e6 / ((double)(256 - (nDivision >> 8)) * (nDivision & 0xFF));
+		nDivision = 0;
+	}
+	else
+		fTickUs = (double)DEFAULT_TEMPO / nDivision;
+
+	nTempo = 0;
+	nTick = 0;
+	fTime = 0;
+
+	for (nEvent = 0; nEvent < m_EventCount; ++nEvent)
+	{
+		while (nDivision && (nTempo < m_TempoCount) && (m_Tempos[nTempo].Tick <= m_Events[nEvent].Tick))
+		{
+			fTime += (m_Tempos[nTempo].Tick - nTick) * fTickUs;
+			nTick = m_Tempos[nTempo].Tick;
+			fTickUs = (double)m_Tempos[nTempo].Tempo / nDivision;
+			++nTempo;
+		}
+
+		nTime = (UINT32)(fTime + (m_Events[nEvent].Tick - nTick) * fTickUs + 0.5);
+		AddEvent(nTime, m_Events[nEvent].Status, m_Events[nEvent].Data1, m_Events[nEvent].Data2);
+	}
+
+	return TRUE;
+}
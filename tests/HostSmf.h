@@ -0,0 +1,20 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostSmf.h
+
+	Purpose:	Reads a Standard MIDI File for the host simulation (see HostSmf.c).
+
+------------------------------------------------------------------------------*/
+#ifndef _INC_HOST_SMF
+#define _INC_HOST_SMF
+
+#include "GenericTypeDefs.h"
+
+/*
+Reads a format 0 or 1 file, and calls AddEvent with each channel message in it, in time order,
+with the time in usecs from the start (following the tempo changes). System exclusive and meta
+events are left out. Returns FALSE, after saying why, if the file can't be read.
+*/
+extern BOOL SmfRead(const char * pPath, void (*AddEvent)(UINT32 Time, BYTE Status, BYTE Data1, BYTE Data2));
+
+#endif // _INC_HOST_SMF
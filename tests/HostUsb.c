@@ -0,0 +1,255 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostUsb.c
+
+	Purpose:	A stand-in for the Microchip USB stack (usb_device.c, usb_function_hid.c
+				and the descriptors), and the USB host on the other end of the cable,
+				for the host simulation (see HostSim.c). The host enumerates the device,
+				sends a SOF every 1ms and reads the HID IN endpoint every poll interval,
+				all in the virtual time.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <p18cxxx.h>
+#include "GenericTypeDefs.h"
+#include "usb_config.h"
+#include "USB/usb_device.h"
+#include "USB/usb_function_hid.h"
+#include "App.h"
+#include "HostRegs.h"
+#include "HostUsb.h"
+
+// from usb_descriptors.c
+USB_DEVICE_DESCRIPTOR device_dsc;
+BYTE g_UsbConfigIndex = USB_CONFIG_CONSOLE;
+
+// from the stack
+volatile USB_DEVICE_STATE USBDeviceState = DETACHED_STATE;
+volatile BYTE USBSuspendControl = 0;
+volatile BYTE USBResumeControl = 0;
+volatile CTRL_TRF_SETUP SetupPkt;
+
+volatile unsigned char hid_report_in[HID_INT_IN_EP_SIZE];
+volatile unsigned char hid_report_out[HID_INT_OUT_EP_SIZE];
+volatile unsigned char hid_report_feature[HID_FEATURE_REPORT_BYTES];
+
+// callbacks in main.c
+extern void USBCBInitEP(void);
+extern void USBCB_SOF_Handler(void);
+
+void (*g_HostUsbReport)(const BYTE * pReport, BYTE Length) = NULL;
+UINT32 g_HostUsbConfiguredAt = 0;
+UINT32 g_HostUsbPolls = 0;
+UINT32 g_HostUsbReportsRead = 0;
+
+/*
+The host resets the bus ENUM_RESET_US after the device attaches, and it's configured
+ENUM_CONFIG_US after that. The IN endpoint is read IN_POLL_OFFSET_US into the frame.
+*/
+#define ENUM_RESET_US		50000
+#define ENUM_ADDRESS_US		10000
+#define ENUM_CONFIG_US		30000
+#define FRAME_US			1000
+#define IN_POLL_OFFSET_US	100
+
+// a guess at how long USBDeviceTasks() takes to look at the flags and call back
+#define USB_TASKS_CYCLES	300
+
+typedef enum { usbNONE, usbRESET, usbADDRESS, usbCONFIGURE, usbDONE } TEnumStep;
+
+static TEnumStep m_EnumStep = usbNONE;
+static UINT32 m_EnumTime = 0;  // when the next enumeration step is due
+static TEnumStep m_EnumPending = usbNONE; // waiting for USBDeviceTasks()
+
+static UINT32 m_NextFrame = 0; // when the next SOF is due
+static UINT16 m_Frame = 0;
+static UINT32 m_PollTime = 0;  // when the host reads the IN endpoint in this frame, 0 if not
+
+// the IN endpoint's ping-pong buffer descriptors
+typedef struct
+{
+	BOOL Armed; // UOWN
+	volatile BYTE * pData;
+	BYTE Length;
+} TBufferDesc;
+
+static TBufferDesc m_InBD[2];
+static BYTE m_InNextArm = 0;  // the one HIDTxPacket() uses next
+static BYTE m_InNextRead = 0; // the one the host reads next
+static BYTE m_OutBD;
+
+
+/*
+Enables the USB interrupt the same way the stack does, as a high priority interrupt.
+*/
+static void EnableUsbInterrupt(void)
+{
+	RCONbits.IPEN = 1;
+	IPR2bits.USBIP = 1;
+	PIE2bits.USBIE = 1;
+	INTCONbits.GIEH = 1;
+}
+
+
+void USBDeviceInit(void)
+{
+	USBDeviceState = DETACHED_STATE;
+	memset(m_InBD, 0, sizeof(m_InBD));
+	m_InNextArm = 0;
+	m_InNextRead = 0;
+
+	EnableUsbInterrupt();
+}
+
+
+void USBDeviceAttach(void)
+{
+	USBDeviceState = POWERED_STATE;
+	m_EnumStep = usbRESET;
+	m_EnumTime = g_HostMicros + ENUM_RESET_US;
+	m_NextFrame = 0;
+
+	EnableUsbInterrupt();
+}
+
+
+void USBDeviceTasks(void)
+{
+	HostSpend(USB_TASKS_CYCLES);
+
+	if (m_EnumPending == usbRESET)
+	{
+		// the stack starts over, like it does on a real bus reset
+		USBDeviceInit();
+		USBDeviceState = DEFAULT_STATE;
+	}
+	else if (m_EnumPending == usbADDRESS)
+		USBDeviceState = ADDRESS_STATE;
+	else if (m_EnumPending == usbCONFIGURE)
+	{
+		USBDeviceState = CONFIGURED_STATE;
+		g_HostUsbConfiguredAt = g_HostMicros;
+		USBCBInitEP();
+	}
+	m_EnumPending = usbNONE;
+
+	if (UIRbits.SOFIF)
+	{
+		UIRbits.SOFIF = 0;
+		USBCB_SOF_Handler();
+	}
+
+	UIRbits.TRNIF = 0;
+	PIR2bits.USBIF = 0;
+}
+
+
+void USBEnableEndpoint(BYTE EP, BYTE Options)
+{
+}
+
+
+USB_HANDLE HIDTxPacket(BYTE EP, BYTE * pData, BYTE Length)
+{
+	TBufferDesc * pBD = &m_InBD[m_InNextArm];
+
+	pBD->pData = pData;
+	pBD->Length = Length;
+	pBD->Armed = TRUE;
+	m_InNextArm ^= 1;
+
+	return (USB_HANDLE)pBD;
+}
+
+
+BOOL HIDTxHandleBusy(USB_HANDLE Handle)
+{
+	if (Handle == 0)
+		return FALSE;
+
+	return ((TBufferDesc *)Handle)->Armed;
+}
+
+
+// the host never sends output reports
+USB_HANDLE HIDRxPacket(BYTE EP, BYTE * pData, BYTE Length)
+{
+	return (USB_HANDLE)&m_OutBD;
+}
+
+
+BOOL HIDRxHandleBusy(USB_HANDLE Handle)
+{
+	return (Handle != 0);
+}
+
+
+void USBCheckHIDRequest(void)
+{
+}
+
+
+/*
+The host side, called as the virtual time goes by.
+*/
+void HostUsbStep(void)
+{
+	TBufferDesc * pBD;
+
+	if ((m_EnumStep != usbNONE) && (m_EnumStep != usbDONE) && (g_HostMicros >= m_EnumTime))
+	{
+		// a control transfer the stack handles in USBDeviceTasks()
+		m_EnumPending = m_EnumStep;
+		PIR2bits.USBIF = 1;
+
+		if (m_EnumStep == usbRESET)
+		{
+			m_EnumStep = usbADDRESS;
+			m_EnumTime += ENUM_ADDRESS_US;
+			m_NextFrame = g_HostMicros + FRAME_US;
+		}
+		else if (m_EnumStep == usbADDRESS)
+		{
+			m_EnumStep = usbCONFIGURE;
+			m_EnumTime += ENUM_CONFIG_US;
+		}
+		else
+			m_EnumStep = usbDONE;
+	}
+
+	if (m_NextFrame && (g_HostMicros >= m_NextFrame))
+	{
+		m_NextFrame += FRAME_US;
+		++m_Frame;
+		UFRML = (BYTE)m_Frame;
+		UIRbits.SOFIF = 1;
+		PIR2bits.USBIF = 1;
+
+		// the host polls the endpoint every g_UsbPollInterval frames
+		if ((USBDeviceState == CONFIGURED_STATE) && ((m_Frame % g_UsbPollInterval) == 0))
+			m_PollTime = g_HostMicros + IN_POLL_OFFSET_US;
+	}
+
+	if (m_PollTime && (g_HostMicros >= m_PollTime))
+	{
+		m_PollTime = 0;
+		++g_HostUsbPolls;
+
+		pBD = &m_InBD[m_InNextRead];
+		if (pBD->Armed)
+		{
+			// the SIE reads the buffer now
+			if (g_HostUsbReport)
+				g_HostUsbReport((const BYTE *)pBD->pData, pBD->Length);
+
+			++g_HostUsbReportsRead;
+			pBD->Armed = FALSE;
+			m_InNextRead ^= 1;
+
+			UIRbits.TRNIF = 1;
+			PIR2bits.USBIF = 1;
+		}
+		// (otherwise it's a NAK, which doesn't interrupt)
+	}
+}
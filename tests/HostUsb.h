@@ -0,0 +1,24 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	HostUsb.h
+
+	Purpose:	The USB host in HostUsb.c.
+
+------------------------------------------------------------------------------*/
+#ifndef _INC_HOST_USB
+#define _INC_HOST_USB
+
+#include "GenericTypeDefs.h"
+
+/*
+g_HostUsbReport is called with each input report the host reads, at g_HostMicros.
+g_HostUsbConfiguredAt is when the device was configured, 0 until then.
+*/
+extern void (*g_HostUsbReport)(const BYTE * pReport, BYTE Length);
+extern UINT32 g_HostUsbConfiguredAt;
+extern UINT32 g_HostUsbPolls;
+extern UINT32 g_HostUsbReportsRead;
+
+extern void HostUsbStep(void);
+
+#endif // _INC_HOST_USB
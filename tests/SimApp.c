@@ -0,0 +1,51 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	SimApp.c
+
+	Purpose:	App.c for the host simulation (see HostSim.c), with the functions the
+				simulation needs to get at its static functions and data. These are
+				left out of the block and call counts.
+
+------------------------------------------------------------------------------*/
+#include "../App.c"
+#include "HostSim.h"
+
+#define SIM_HOOK	__attribute__((no_instrument_function, no_sanitize_coverage))
+
+SIM_HOOK void SimTrackAppFunctions(void)
+{
+	SimTrackFunction("DoMidiMapping", (void *)DoMidiMapping);
+	SimTrackFunction("MIDI_ServiceRxBuffer", (void *)MIDI_ServiceRxBuffer);
+	SimTrackFunction("MIDI_RxISR", (void *)MIDI_RxISR);
+	SimTrackFunction("OutputTimerISR", (void *)OutputTimerISR);
+	SimTrackFunction("UpdateButtonStates", (void *)UpdateButtonStates);
+	SimTrackFunction("UpdateLedSequence", (void *)UpdateLedSequence);
+#if defined(MR_LX)
+	SimTrackFunction("UpdateInputReportData_LX", (void *)UpdateInputReportData_LX);
+#endif
+	SimTrackFunction("CommitInputReport", (void *)CommitInputReport);
+	SimTrackFunction("ServiceEEQueue", (void *)ServiceEEQueue);
+}
+
+
+#if defined(LX_EXT_OUTS)
+/*
+The channels the external output pins are showing, from the LATx registers.
+*/
+SIM_HOOK BYTE SimReadExtOutputs(void)
+{
+	BYTE nOutput, nChannels = 0;
+	BYTE nLatA = LATA ^ EXT_IDLE_A, nLatB = LATB ^ EXT_IDLE_B, nLatC = LATC ^ EXT_IDLE_C, nLatD = LATD ^ EXT_IDLE_D;
+
+	for (nOutput = 0; nOutput < MIDI_CHANNEL_COUNT; ++nOutput)
+	{
+		if ((nLatA & EXT_OUTPUT_PINS[nOutput].A) || (nLatB & EXT_OUTPUT_PINS[nOutput].B)
+			|| (nLatC & EXT_OUTPUT_PINS[nOutput].C) || (nLatD & EXT_OUTPUT_PINS[nOutput].D))
+		{
+			nChannels |= (1 << nOutput);
+		}
+	}
+
+	return nChannels;
+}
+#endif
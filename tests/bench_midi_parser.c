@@ -0,0 +1,416 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	bench_midi_parser.c
+
+	Purpose:	Counts the work the MIDI parser does for each byte, for the table
+				driven parser (m_MidiTransitions and ParseMidiByte() in MIDI.c) and
+				the nested switch parser it replaced, on the same byte streams.
+
+				This file is built with -fsanitize-coverage=trace-pc,trace-cmp, so each
+				basic block calls __sanitizer_cov_trace_pc() and each compare (and
+				switch) calls one of the trace-cmp hooks below, which count them while
+				a parser is running (and switches, which are counted on their own). These are x86 counts, not PIC cycles, but both
+				parsers are built the same way, with the same actions (OnNoteNumber()
+				etc.), so the difference is the dispatch.
+
+				The two parsers must also end up with the same notes, velocities and
+				pedal positions after every byte, except where the old one didn't
+				do running status (NOTE OFF and control change).
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include "../MIDI.c" // to get at the parser
+#include "HostRegs.h"
+
+#define NO_COUNT	__attribute__((no_sanitize_coverage))
+
+static BOOL m_Counting = FALSE;
+static UINT32 m_Blocks;
+static UINT32 m_Compares;
+static UINT32 m_Switches;
+
+NO_COUNT void __sanitizer_cov_trace_pc(void)
+{
+	if (m_Counting)
+		++m_Blocks;
+}
+
+#define COUNT_COMPARE(Name, Type) \
+	NO_COUNT void Name(Type Arg1, Type Arg2) { if (m_Counting) ++m_Compares; }
+
+COUNT_COMPARE(__sanitizer_cov_trace_cmp1, UINT8)
+COUNT_COMPARE(__sanitizer_cov_trace_cmp2, UINT16)
+COUNT_COMPARE(__sanitizer_cov_trace_cmp4, unsigned int)
+COUNT_COMPARE(__sanitizer_cov_trace_cmp8, unsigned long long)
+COUNT_COMPARE(__sanitizer_cov_trace_const_cmp1, UINT8)
+COUNT_COMPARE(__sanitizer_cov_trace_const_cmp2, UINT16)
+COUNT_COMPARE(__sanitizer_cov_trace_const_cmp4, unsigned int)
+COUNT_COMPARE(__sanitizer_cov_trace_const_cmp8, unsigned long long)
+
+NO_COUNT void __sanitizer_cov_trace_switch(unsigned long Value, void * pCases)
+{
+	if (m_Counting)
+		++m_Switches;
+}
+
+
+/*
+The parser as it was before m_MidiTransitions: a switch on the status byte, then a switch
+on the state for each data byte. The actions are the same functions ParseMidiByte() uses
+(they were taken out of this code), and the MIDI OUT adapter parts are left out.
+*/
+static void OldParseMidiByte(void)
+{
+	if (g_RxData & 0x80)	// Bit 7 is set in the first byte of every message.
+	{
+		g_MessageID	= g_RxData & 0xF0;
+
+		switch (g_MessageID)
+		{
+			case NOTE_ON:
+				g_MessageState = WAITING_FOR_NOTE_ON;
+				break;
+
+			case NOTE_OFF:
+				g_MessageState = WAITING_FOR_NOTE_OFF;
+				break;
+
+			case CONTROL_CHANGE:
+				g_MessageState = WAITING_FOR_CC_DATA1;
+				break;
+
+			case POLY_AFTERTOUCH:
+			case PITCH_BEND:
+				g_MessageState = WAITING_FOR_DATA1_OF_2;
+				break;
+
+			case PROGRAM_CHANGE:
+			case CHANNEL_AFTERTOUCH:
+				g_MessageState = WAITING_FOR_DATA1_ONLY;
+				break;
+
+			case SYS_EX_START: // (all of 0xF0-0xFF)
+				switch (g_RxData)
+				{
+					case SYS_EX_START:
+						g_MessageState = COLLECT_SYS_EX_DATA;
+						m_SysExtDataIndex = 0;
+						break;
+
+					case QUARTER_FRAME:
+					case SONG_SELECT:
+						g_MessageState = WAITING_FOR_DATA1_ONLY;
+						break;
+
+					case SONG_POSITION_PTR:
+						g_MessageState = WAITING_FOR_DATA1_OF_2;
+						break;
+
+					case SYS_EX_END:
+						g_MessageState = WAITING_FOR_STATUS;
+						break;
+
+					case ACTIVE_SENSING:
+					default:
+						break;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+	else
+	{
+		#if defined(LOG_MIDI_DATA)
+			AddDataToLog(g_MessageState, g_RxData);
+		#endif
+
+		switch (g_MessageState)
+		{
+			case WAITING_FOR_NOTE_ON:
+				OnNoteNumber();
+				g_MessageState = WAITING_FOR_ON_VELOCITY;
+				break;
+
+			case WAITING_FOR_ON_VELOCITY:
+				OnNoteVelocity();
+				g_MessageState = WAITING_FOR_NOTE_ON;
+				break;
+
+			case WAITING_FOR_NOTE_OFF:
+				OnNoteOff();
+				g_MessageState = WAITING_FOR_OFF_VELOCITY; // next data is OFF velocity
+				break;
+
+			case WAITING_FOR_OFF_VELOCITY:
+				g_MessageState = WAITING_FOR_STATUS;
+				break;
+
+			case WAITING_FOR_DATA1_OF_2:
+				g_MessageState = WAITING_FOR_DATA2;
+			 	break;
+
+			case COLLECT_SYS_EX_DATA:
+				if (m_SysExtDataIndex < (sizeof(m_SysExtDataBuf) - 1))
+				{
+					m_SysExtDataBuf[m_SysExtDataIndex++] = g_RxData;
+					m_SysExtDataBuf[m_SysExtDataIndex] = 0;
+				}
+				break;
+
+			case WAITING_FOR_CC_DATA1: // controller change data -- this is the controller number
+				g_MessageState = WAITING_FOR_CC_DATA2;
+				OnControllerNumber(); // sets WAITING_FOR_PEDAL_DATA for the hi hat pedal
+				break;
+
+			case WAITING_FOR_PEDAL_DATA: // hi hat pedal (controller 4) position
+				g_HiHatPedalPosition = g_RxData;
+				g_MessageState = WAITING_FOR_STATUS;
+				break;
+
+			case WAITING_FOR_DATA1_ONLY:
+			case WAITING_FOR_DATA2:
+			case WAITING_FOR_CC_DATA2:
+			default:
+				g_MessageState = WAITING_FOR_STATUS;
+				break;
+		}
+	}
+}
+
+
+/*
+The byte streams: what a drum module sends, with and without running status.
+*/
+typedef struct
+{
+	const char * pName;
+	const BYTE * pData;
+	UINT16 Length;
+	BOOL OldCanParse; // no running status for NOTE OFF or control change
+} TStream;
+
+#define STREAM_SIZE	4096
+
+static BYTE m_NotesRunning[STREAM_SIZE];
+static BYTE m_NotesStatus[STREAM_SIZE];
+static BYTE m_NotesPedal[STREAM_SIZE];
+static BYTE m_NotesSensing[STREAM_SIZE];
+static BYTE m_AllRunning[STREAM_SIZE];
+
+static const BYTE DRUM_NOTES[] = { 36, 38, 42, 46, 48, 45, 43, 49, 51, 44 };
+#define DRUM_NOTE_COUNT	(sizeof(DRUM_NOTES) / sizeof(DRUM_NOTES[0]))
+
+static UINT16 Put(BYTE * pStream, UINT16 Length, BYTE Status, BYTE * pRunning, BYTE Data1, BYTE Data2)
+{
+	if (Length + 3 > STREAM_SIZE)
+		return Length;
+
+	if (!pRunning || (*pRunning != Status))
+		pStream[Length++] = Status;
+	if (pRunning)
+		*pRunning = Status;
+
+	pStream[Length++] = Data1;
+	pStream[Length++] = Data2;
+	return Length;
+}
+
+
+/*
+Pairs of hits (one might be a flam or a chord), each with a NOTE ON with velocity 0 or a
+NOTE OFF after it. With Pedal, the hi-hat pedal moves (3 CC4 messages) before every other
+pair.
+*/
+static UINT16 MakeStream(BYTE * pStream, BOOL Running, BOOL Pedal, BOOL Sensing, BOOL NoteOff)
+{
+	UINT16 nLength = 0, nHit;
+	BYTE nRunning = 0, nNote1, nNote2, nStep;
+	BYTE * pRunning = Running ? &nRunning : NULL;
+
+	for (nHit = 0; nLength + 32 < STREAM_SIZE; nHit += 2)
+	{
+		nNote1 = DRUM_NOTES[nHit % DRUM_NOTE_COUNT];
+		nNote2 = DRUM_NOTES[(nHit + 1) % DRUM_NOTE_COUNT];
+
+		if (Pedal && ((nHit % 4) == 0))
+		{
+			for (nStep = 0; nStep < 3; ++nStep)
+				nLength = Put(pStream, nLength, CONTROL_CHANGE | 9, pRunning, 4, (BYTE)((nHit * 13 + nStep * 20) & 0x7F));
+		}
+
+		nLength = Put(pStream, nLength, NOTE_ON | 9, pRunning, nNote1, (BYTE)(40 + (nHit * 37) % 88));
+		nLength = Put(pStream, nLength, NOTE_ON | 9, pRunning, nNote2, (BYTE)(40 + (nHit * 53) % 88));
+
+		if (Sensing && ((nHit % 8) == 0))
+			pStream[nLength++] = ACTIVE_SENSING;
+
+		nLength = Put(pStream, nLength, NoteOff ? (NOTE_OFF | 9) : (NOTE_ON | 9), pRunning, nNote1, NoteOff ? 64 : 0);
+		nLength = Put(pStream, nLength, NoteOff ? (NOTE_OFF | 9) : (NOTE_ON | 9), pRunning, nNote2, NoteOff ? 64 : 0);
+	}
+
+	return nLength;
+}
+
+
+// what the parser has come up with, after each byte
+typedef struct
+{
+	BYTE OnNote, OffNote, Velocity, Pedal, NoteCount;
+} TParsed;
+
+static TParsed m_Parsed[2][STREAM_SIZE];
+
+typedef struct
+{
+	UINT32 Blocks, Compares, Switches, MaxBlocks;
+	UINT32 StatusBlocks, StatusBytes, DataBlocks, DataBytes;
+	UINT32 Notes, Offs, Pedals; // NOTE ONs used, NOTE OFFs and pedal positions parsed
+} TCounts;
+
+
+NO_COUNT static void ResetParser(void)
+{
+	g_MessageState = WAITING_FOR_STATUS;
+	g_MidiOnNote = INVALID_NOTE_NUMBER;
+	g_MidiOffNote = INVALID_NOTE_NUMBER;
+	g_NoteVelocity = 0;
+	g_HiHatPedalPosition = 0;
+	g_MidiNoteCount = 0;
+	ClearMidiOutputs();
+}
+
+
+NO_COUNT static void Run(void (*Parse)(void), const TStream * pStream, TParsed * pParsed, TCounts * pCounts)
+{
+	UINT16 nByte;
+	UINT32 nBlocks, nCompares;
+
+	ResetParser();
+	memset(pCounts, 0, sizeof(*pCounts));
+
+	for (nByte = 0; nByte < pStream->Length; ++nByte)
+	{
+		g_RxData = pStream->pData[nByte];
+
+		m_Blocks = 0;
+		m_Compares = 0;
+		m_Switches = 0;
+		m_Counting = TRUE;
+		Parse();
+		m_Counting = FALSE;
+		nBlocks = m_Blocks;
+		nCompares = m_Compares;
+
+		pCounts->Blocks += nBlocks;
+		pCounts->Compares += nCompares;
+		pCounts->Switches += m_Switches;
+		if (nBlocks > pCounts->MaxBlocks)
+			pCounts->MaxBlocks = nBlocks;
+
+		if (g_RxData & 0x80)
+		{
+			pCounts->StatusBlocks += nBlocks;
+			++pCounts->StatusBytes;
+		}
+		else
+		{
+			pCounts->DataBlocks += nBlocks;
+			++pCounts->DataBytes;
+		}
+
+		pParsed[nByte].OnNote = g_MidiOnNote;
+		pParsed[nByte].OffNote = g_MidiOffNote;
+		pParsed[nByte].Velocity = g_NoteVelocity;
+		pParsed[nByte].Pedal = g_HiHatPedalPosition;
+		if (nByte && (g_MidiNoteCount != pParsed[nByte - 1].NoteCount))
+			++pCounts->Notes;
+		if (nByte && (g_MidiOffNote != pParsed[nByte - 1].OffNote) && (g_MidiOffNote != INVALID_NOTE_NUMBER))
+			++pCounts->Offs;
+		if (nByte && (g_HiHatPedalPosition != pParsed[nByte - 1].Pedal))
+			++pCounts->Pedals;
+		pParsed[nByte].NoteCount = g_MidiNoteCount;
+
+		// keep the hit queues from filling up
+		ClearMidiOutputs();
+	}
+}
+
+
+NO_COUNT static UINT16 FirstDifference(UINT16 Length)
+{
+	UINT16 nByte;
+
+	for (nByte = 0; nByte < Length; ++nByte)
+	{
+		if (memcmp(&m_Parsed[0][nByte], &m_Parsed[1][nByte], sizeof(TParsed)) != 0)
+			return nByte;
+	}
+
+	return Length;
+}
+
+
+NO_COUNT int main(void)
+{
+	TStream Streams[] =
+	{
+		{ "notes, running status",     m_NotesRunning, 0, TRUE },
+		{ "notes, status every time",  m_NotesStatus,  0, TRUE },
+		{ "notes + CC4, status",       m_NotesPedal,   0, TRUE },
+		{ "notes + active sensing",    m_NotesSensing, 0, TRUE },
+		{ "notes + CC4 + NOTE OFF, running", m_AllRunning, 0, FALSE }
+	};
+	UINT8 nStream, nFailures = 0;
+	UINT16 nDiff;
+	TCounts Old, New;
+
+	Streams[0].Length = MakeStream(m_NotesRunning, TRUE, FALSE, FALSE, FALSE);
+	Streams[1].Length = MakeStream(m_NotesStatus, FALSE, FALSE, FALSE, FALSE);
+	Streams[2].Length = MakeStream(m_NotesPedal, FALSE, TRUE, FALSE, FALSE);
+	Streams[3].Length = MakeStream(m_NotesSensing, TRUE, FALSE, TRUE, FALSE);
+	Streams[4].Length = MakeStream(m_AllRunning, TRUE, TRUE, FALSE, TRUE);
+
+	// the default map, so the notes are looked up like they are in the firmware
+	g_MinVelocity = DEFAULT_VELOCITY_THRESHOLD;
+	RestoreDefaultMap(0);
+	SetMidiMapNumber(0);
+
+	printf("bench_midi_parser: per byte, old nested switch -> m_MidiTransitions (x86 counts)\n");
+	printf("  %-32s %5s  %-16s %-12s %-16s %-16s %-16s %s\n", "stream", "bytes", "blocks", "max blocks",
+		"compares", "switches", "blocks/status", "blocks/data");
+
+	for (nStream = 0; nStream < sizeof(Streams) / sizeof(Streams[0]); ++nStream)
+	{
+		Run(OldParseMidiByte, &Streams[nStream], m_Parsed[0], &Old);
+		Run(ParseMidiByte, &Streams[nStream], m_Parsed[1], &New);
+
+		printf("  %-32s %5u  %5.2f -> %5.2f  %2lu -> %2lu  %5.2f -> %5.2f  %5.2f -> %5.2f  %5.2f -> %5.2f  %5.2f -> %5.2f\n",
+			Streams[nStream].pName, Streams[nStream].Length,
+			(double)Old.Blocks / Streams[nStream].Length, (double)New.Blocks / Streams[nStream].Length,
+			(unsigned long)Old.MaxBlocks, (unsigned long)New.MaxBlocks,
+			(double)Old.Compares / Streams[nStream].Length, (double)New.Compares / Streams[nStream].Length,
+			(double)Old.Switches / Streams[nStream].Length, (double)New.Switches / Streams[nStream].Length,
+			Old.StatusBytes ? (double)Old.StatusBlocks / Old.StatusBytes : 0.0,
+			New.StatusBytes ? (double)New.StatusBlocks / New.StatusBytes : 0.0,
+			Old.DataBytes ? (double)Old.DataBlocks / Old.DataBytes : 0.0,
+			New.DataBytes ? (double)New.DataBlocks / New.DataBytes : 0.0);
+
+		nDiff = FirstDifference(Streams[nStream].Length);
+		if (Streams[nStream].OldCanParse && (nDiff != Streams[nStream].Length))
+		{
+			printf("  FAILED: the parsers differ at byte %u\n", nDiff);
+			++nFailures;
+		}
+		else if (!Streams[nStream].OldCanParse)
+		{
+			printf("    the old parser loses the running status: NOTE ONs %lu -> %lu, NOTE OFFs %lu -> %lu, pedal %lu -> %lu\n",
+				(unsigned long)Old.Notes, (unsigned long)New.Notes, (unsigned long)Old.Offs, (unsigned long)New.Offs,
+				(unsigned long)Old.Pedals, (unsigned long)New.Pedals);
+		}
+	}
+
+	return nFailures ? 1 : 0;
+}
@@ -0,0 +1,451 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	sim_report.c
+
+	Purpose:	Runs a drum pattern through the whole firmware in the host simulation
+				(see HostSim.c) and reports, for the build variant it was built for:
+				the time from each hit being in to the host seeing the press, the hits
+				that were merged with the one before or missed, the presses that weren't
+				for any hit, how far the presses are from when the hits were played, and
+				the basic blocks run per call of the busy functions.
+
+				The pattern is on MIDI channel 10 with running status, like a drum module
+				sends it: a groove with the hi-hat pedal (CC4) moving and active sensing,
+				fast single stroke rolls, chords, and flams/double hits that are close
+				enough that some have to be merged.
+
+				Or, with a Standard MIDI File on the command line, the file is played
+				instead, with active sensing added and, if the file doesn't have one, a
+				hi-hat pedal CC4 stream that follows the hi-hat notes.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <p18cxxx.h>
+#include "GenericTypeDefs.h"
+#include "App.h"
+#include "MIDI.h"
+#include "main.h"
+#include "HostRegs.h"
+#include "HostUsb.h"
+#include "HostSim.h"
+#include "HostSmf.h"
+
+#define DRUM_CHANNEL	9 // MIDI channel 10
+#define HIHAT_CC		4
+
+#define BEAT_US			500000 // 120 bpm
+#define NOTE_LENGTH_US	40000  // NOTE ON with velocity 0 this long after each hit
+#define SENSING_US		300000 // active sensing
+#define PEDAL_STEP_US	8000   // hi-hat pedal CC rate while it's moving
+#define TAIL_US			300000
+#define FILE_START_US	100000 // the file starts this long after the firmware is ready
+
+// General MIDI hi-hat notes
+#define GM_HIHAT_CLOSED	42
+#define GM_HIHAT_PEDAL	44
+#define GM_HIHAT_OPEN	46
+#define PEDAL_CLOSED	127
+#define PEDAL_SWEEP_STEPS 4 // CC4 messages the pedal takes to open or close
+
+#define MAX_EVENTS		16384
+
+typedef struct
+{
+	UINT32 Time;
+	UINT16 Order; // keeps events at the same time in the order they were added
+	BYTE Status, Data1, Data2;
+} TEvent;
+
+static TEvent m_Events[MAX_EVENTS];
+static UINT16 m_EventCount = 0;
+static UINT16 m_NextEvent = 0;
+static UINT32 m_PatternEnd = 0;
+static const char * m_pFileName = NULL;
+
+static void AddEvent(UINT32 Time, BYTE Status, BYTE Data1, BYTE Data2)
+{
+	TEvent * pEvent;
+
+	if (m_EventCount >= MAX_EVENTS)
+		return;
+
+	pEvent = &m_Events[m_EventCount];
+	pEvent->Time = Time;
+	pEvent->Order = m_EventCount++;
+	pEvent->Status = Status;
+	pEvent->Data1 = Data1;
+	pEvent->Data2 = Data2;
+
+	if (Time > m_PatternEnd)
+		m_PatternEnd = Time;
+}
+
+
+// a hit on a lane, with the first note the map has for it
+static void AddHit(UINT32 Time, BYTE Lane, BYTE Velocity)
+{
+	BYTE nNote = g_SimLaneNotes[Lane][0];
+
+	if (nNote == INVALID_NOTE_NUMBER)
+		return;
+
+	AddEvent(Time, NOTE_ON | DRUM_CHANNEL, nNote, Velocity);
+	AddEvent(Time + NOTE_LENGTH_US, NOTE_ON | DRUM_CHANNEL, nNote, 0);
+}
+
+
+static int CompareEvents(const void * p1, const void * p2)
+{
+	const TEvent * pEvent1 = p1, * pEvent2 = p2;
+
+	if (pEvent1->Time != pEvent2->Time)
+		return (pEvent1->Time < pEvent2->Time) ? -1 : 1;
+
+	return (int)pEvent1->Order - (int)pEvent2->Order;
+}
+
+
+#define LANE_RED	0
+#define LANE_YELLOW	1
+#define LANE_BLUE	2
+#define LANE_GREEN	3
+#define LANE_KICK	4
+#define LANE_ORANGE	5
+
+/*
+Moves a beat by up to 8ms, the same for everything played on it, so the hits don't all come
+in at the same point in the USB frames and polls.
+*/
+static UINT32 Humanize(UINT32 Time)
+{
+	UINT32 nHash = (Time / 1000) * 2654435761UL;
+
+	nHash ^= nHash >> 16;
+	return Time + nHash % 8000;
+}
+
+
+static BYTE Velocity(UINT16 Index)
+{
+	return (BYTE)(70 + (Index * 37) % 58);
+}
+
+
+static void MakePattern(void)
+{
+	UINT32 nStart, nTime;
+	UINT16 nBar, nStep, nIndex = 0;
+	BYTE nPedal, nCrash;
+
+	nCrash = SimLaneUsed(LANE_ORANGE) ? LANE_ORANGE : LANE_GREEN;
+
+	// 8 bars of groove: 8th note hi-hat, kick on 1 and 3, snare on 2 and 4
+	nStart = 100000;
+	for (nBar = 0; nBar < 8; ++nBar)
+	{
+		for (nStep = 0; nStep < 8; ++nStep)
+		{
+			nTime = Humanize(nStart + (nBar * 8 + nStep) * (BEAT_US / 2));
+
+			AddHit(nTime, LANE_YELLOW, Velocity(nIndex++));
+			if ((nStep == 0) || (nStep == 4))
+				AddHit(nTime, LANE_KICK, Velocity(nIndex++));
+			if ((nStep == 2) || (nStep == 6))
+				AddHit(nTime, LANE_RED, Velocity(nIndex++));
+		}
+
+		// the hi-hat pedal opens and closes again in the last beat of each bar
+		nTime = nStart + (nBar * 8 + 6) * (BEAT_US / 2);
+		for (nPedal = 0; nPedal < 32; ++nPedal, nTime += PEDAL_STEP_US)
+			AddEvent(nTime, CONTROL_CHANGE | DRUM_CHANNEL, HIHAT_CC, (nPedal < 16) ? (127 - nPedal * 8) : ((nPedal - 16) * 8));
+	}
+
+	// rolls, 16 strokes per lane, 60ms down to 30ms apart
+	nStart += 8 * 4 * BEAT_US;
+	nTime = nStart;
+	for (nBar = 0; nBar < 4; ++nBar)
+	{
+		for (nStep = 0; nStep < 16; ++nStep)
+		{
+			AddHit(Humanize(nTime), (BYTE)(LANE_RED + nStep / 4), Velocity(nIndex++));
+			nTime += 60000 - nBar * 10000;
+		}
+		nTime += BEAT_US;
+	}
+
+	// chords: kick, snare and a cymbal together, then all the pads
+	nStart = nTime + BEAT_US;
+	for (nStep = 0; nStep < 16; ++nStep)
+	{
+		nTime = Humanize(nStart + nStep * BEAT_US);
+
+		AddHit(nTime, LANE_KICK, Velocity(nIndex++));
+		AddHit(nTime, LANE_RED, Velocity(nIndex++));
+		if (nStep & 1)
+		{
+			AddHit(nTime, LANE_YELLOW, Velocity(nIndex++));
+			AddHit(nTime, LANE_BLUE, Velocity(nIndex++));
+		}
+		else
+			AddHit(nTime, nCrash, Velocity(nIndex++));
+	}
+
+	// flams and double hits on the same lane, 5ms up to 80ms apart
+	nStart += 16 * BEAT_US;
+	for (nStep = 0; nStep < 16; ++nStep)
+	{
+		static const UINT32 GAPS[8] = { 5000, 10000, 15000, 20000, 30000, 40000, 60000, 80000 };
+
+		nTime = Humanize(nStart + nStep * BEAT_US);
+		AddHit(nTime, (nStep & 1) ? LANE_KICK : LANE_RED, Velocity(nIndex++));
+		AddHit(nTime + GAPS[nStep / 2], (nStep & 1) ? LANE_KICK : LANE_RED, Velocity(nIndex++));
+	}
+
+	// active sensing all the way through
+	for (nTime = 0; nTime < m_PatternEnd; nTime += SENSING_US)
+		AddEvent(nTime, ACTIVE_SENSING, 0, 0);
+
+	qsort(m_Events, m_EventCount, sizeof(TEvent), CompareEvents);
+}
+
+
+static void AddFileEvent(UINT32 Time, BYTE Status, BYTE Data1, BYTE Data2)
+{
+	AddEvent(FILE_START_US + Time, Status, Data1, Data2);
+}
+
+
+/*
+A hi-hat pedal that moves the way the hi-hat notes say it has to: closed for a closed hi-hat,
+open for an open one, and closing onto a pedal hit. The pedal moves in PEDAL_SWEEP_STEPS
+CC4 messages, PEDAL_STEP_US apart, finishing just before the note.
+*/
+static void AddPedalStream(void)
+{
+	UINT16 nEvent, nCount = m_EventCount;
+	BYTE nPosition = 0, nWanted, nStep, nFrom;
+	UINT32 nTime, nLast = 0;
+	TEvent * pEvent;
+
+	for (nEvent = 0; nEvent < nCount; ++nEvent)
+	{
+		pEvent = &m_Events[nEvent];
+		if (((pEvent->Status & 0xF0) == CONTROL_CHANGE) && (pEvent->Data1 == HIHAT_CC))
+			return; // the file has its own
+	}
+
+	for (nEvent = 0; nEvent < nCount; ++nEvent)
+	{
+		pEvent = &m_Events[nEvent];
+		if (((pEvent->Status & 0xF0) != NOTE_ON) || (pEvent->Data2 == 0))
+			continue;
+
+		if ((pEvent->Data1 == GM_HIHAT_CLOSED) || (pEvent->Data1 == GM_HIHAT_PEDAL))
+			nWanted = PEDAL_CLOSED;
+		else if (pEvent->Data1 == GM_HIHAT_OPEN)
+			nWanted = 0;
+		else
+			continue;
+
+		// a pedal hit opens it again first, if it's closed
+		nFrom = ((pEvent->Data1 == GM_HIHAT_PEDAL) && (nPosition == PEDAL_CLOSED)) ? 0 : nPosition;
+		if (nFrom == nWanted)
+			continue;
+
+		nTime = pEvent->Time - PEDAL_SWEEP_STEPS * PEDAL_STEP_US;
+		if ((pEvent->Time < PEDAL_SWEEP_STEPS * PEDAL_STEP_US) || (nTime < nLast))
+			nTime = nLast;
+
+		for (nStep = 1; nStep <= PEDAL_SWEEP_STEPS; ++nStep, nTime += PEDAL_STEP_US)
+		{
+			AddEvent(nTime, CONTROL_CHANGE | (pEvent->Status & 0x0F), HIHAT_CC,
+				(BYTE)(nFrom + ((int)nWanted - nFrom) * nStep / PEDAL_SWEEP_STEPS));
+		}
+
+		nPosition = nWanted;
+		nLast = pEvent->Time;
+	}
+}
+
+
+static BOOL ReadFile(const char * pPath)
+{
+	UINT32 nTime;
+
+	if (!SmfRead(pPath, AddFileEvent))
+		return FALSE;
+
+	if (m_EventCount == 0)
+	{
+		printf("%s: there's nothing in it to play\n", pPath);
+		return FALSE;
+	}
+
+	AddPedalStream();
+
+	// active sensing all the way through
+	for (nTime = 0; nTime < m_PatternEnd; nTime += SENSING_US)
+		AddEvent(nTime, ACTIVE_SENSING, 0, 0);
+
+	qsort(m_Events, m_EventCount, sizeof(TEvent), CompareEvents);
+	return TRUE;
+}
+
+
+static BOOL Feed(UINT32 Until)
+{
+	TEvent * pEvent;
+
+	if (m_EventCount == 0)
+		MakePattern(); // the firmware is ready, so the map is known
+
+	while ((m_NextEvent < m_EventCount) && (m_Events[m_NextEvent].Time <= Until))
+	{
+		pEvent = &m_Events[m_NextEvent++];
+		SimSendMidi(pEvent->Time, pEvent->Status, pEvent->Data1, pEvent->Data2);
+	}
+
+	return (m_NextEvent < m_EventCount);
+}
+
+
+static int CompareLatency(const void * p1, const void * p2)
+{
+	UINT32 n1 = *(const UINT32 *)p1, n2 = *(const UINT32 *)p2;
+
+	return (n1 < n2) ? -1 : (n1 > n2);
+}
+
+
+static void ReportHits(void)
+{
+	static const UINT32 BUCKET_US[] = { 500, 1000, 2000, 4000, 8000, 16000, 32000 };
+	static const char * BUCKET_NAMES[] = { "<0.5", "<1", "<2", "<4", "<8", "<16", "<32", ">=32" };
+	static UINT32 nLatency[SIM_MAX_HITS], nError[SIM_MAX_HITS];
+	UINT32 nBuckets[8], nTotal = 0;
+	double fErrorTotal = 0, fErrorSquares = 0, fMean;
+	UINT16 nHit, nCount = 0, nMerged = 0, nMissed = 0;
+	UINT8 nBucket;
+	TSimHit * pHit;
+
+	memset(nBuckets, 0, sizeof(nBuckets));
+
+	for (nHit = 0; nHit < g_SimHitCount; ++nHit)
+	{
+		pHit = &g_SimHits[nHit];
+
+		if (pHit->Result == hrMERGED)
+			++nMerged;
+		else if (pHit->Result == hrMISSED)
+			++nMissed;
+		else if (pHit->Result == hrDELIVERED)
+		{
+			nLatency[nCount] = pHit->Out - pHit->Sent;
+			nTotal += nLatency[nCount];
+
+			nError[nCount] = pHit->Out - pHit->Played;
+			fErrorTotal += nError[nCount];
+			fErrorSquares += (double)nError[nCount] * nError[nCount];
+
+			for (nBucket = 0; (nBucket < 7) && (nLatency[nCount] >= BUCKET_US[nBucket]); ++nBucket)
+				;
+			++nBuckets[nBucket];
+			++nCount;
+		}
+	}
+
+	printf("hits: %u, delivered %u, merged %u, missed %u, extra presses %u\n",
+		g_SimHitCount, nCount, nMerged, nMissed, g_SimExtraPresses);
+
+	if (nCount == 0)
+		return;
+
+	qsort(nLatency, nCount, sizeof(UINT32), CompareLatency);
+	printf("hit in to press seen (usecs): mean %lu, p50 %lu, p95 %lu, max %lu\n",
+		(unsigned long)(nTotal / nCount), (unsigned long)nLatency[nCount / 2],
+		(unsigned long)nLatency[(nCount * 95) / 100], (unsigned long)nLatency[nCount - 1]);
+
+	printf("  ms:");
+	for (nBucket = 0; nBucket < 8; ++nBucket)
+		printf(" %s %lu", BUCKET_NAMES[nBucket], (unsigned long)nBuckets[nBucket]);
+	printf("\n");
+
+	// from when it was played (including the time on the MIDI cable), the spread is the jitter
+	fMean = fErrorTotal / nCount;
+	qsort(nError, nCount, sizeof(UINT32), CompareLatency);
+	printf("timing error, played to press seen (usecs): mean %.0f, spread %.0f, p95 %lu, max %lu\n",
+		fMean, sqrt(fErrorSquares / nCount - fMean * fMean),
+		(unsigned long)nError[(nCount * 95) / 100], (unsigned long)nError[nCount - 1]);
+
+	if (g_SystemMode == SYS_MODE_XBOX)
+		return;
+
+	// the firmware's own numbers, from the NOTE ON being parsed to the host reading the report
+	printf("  firmware g_PerfLatencyHist:");
+	for (nBucket = 0; nBucket < PERF_LATENCY_BUCKETS; ++nBucket)
+		printf(" %s %u", BUCKET_NAMES[nBucket], g_PerfLatencyHist[nBucket]);
+	printf("\n");
+}
+
+
+static void ReportFunctions(void)
+{
+	UINT8 nIndex;
+	TSimFunction * pTrack;
+
+	printf("basic blocks per call (%d cycles each):\n", SIM_CYCLES_PER_BLOCK);
+	for (nIndex = 0; nIndex < g_SimFunctionCount; ++nIndex)
+	{
+		pTrack = &g_SimFunctions[nIndex];
+		if (pTrack->Calls == 0)
+			continue;
+
+		printf("  %-26s calls %7lu  mean %6.1f  max %5lu\n", pTrack->pName, (unsigned long)pTrack->Calls,
+			(double)pTrack->Blocks / pTrack->Calls, (unsigned long)pTrack->MaxBlocks);
+	}
+}
+
+
+int main(int argc, char * argv[])
+{
+	UINT32 nTotalBlocks;
+
+	if (argc > 1)
+	{
+		m_pFileName = argv[1];
+		if (!ReadFile(m_pFileName))
+			return 1;
+	}
+
+	SimRun(Feed, TAIL_US);
+
+	nTotalBlocks = g_SimBlocks[0] + g_SimBlocks[1] + g_SimBlocks[2];
+
+	printf("== %s (%s mode, ", SimVariantName(), (g_GameMode == gmGUITAR_HERO) ? "GH" : "RB");
+	if (g_SystemMode == SYS_MODE_XBOX)
+		printf("Xbox interface outputs)\n");
+	else
+		printf("USB, %ums polls, %lu reports read)\n", (unsigned)g_UsbPollInterval, (unsigned long)g_HostUsbReportsRead);
+	printf("boot %ums, %u MIDI events (%s) over %.1fs, %lu UART bytes lost\n",
+		g_PerfBootTime, m_EventCount, m_pFileName ? m_pFileName : "drum pattern", m_PatternEnd / 1e6,
+		(unsigned long)g_HostUartLost);
+
+	ReportHits();
+
+	printf("blocks: main %lu, low ISR %lu, high ISR %lu (%.1f%% of the time in ISRs)\n",
+		(unsigned long)g_SimBlocks[0], (unsigned long)g_SimBlocks[1], (unsigned long)g_SimBlocks[2],
+		nTotalBlocks ? (100.0 * (g_SimBlocks[1] + g_SimBlocks[2]) / nTotalBlocks) : 0.0);
+	if (g_SystemMode != SYS_MODE_XBOX)
+		printf("main loop %u passes per 100ms, ", g_MainLoopRate);
+	printf("MIDI rx high water %u, overruns %u, overflows %u, hits dropped %u, stale %u\n",
+		g_MidiRxHighWater, g_MidiRxOverrunCount, g_MidiRxOverflowCount,
+		g_MidiHitsDropped, g_MidiHitsStale);
+
+	ReportFunctions();
+	printf("\n");
+
+	return 0;
+}
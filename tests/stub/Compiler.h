@@ -0,0 +1,10 @@
+/*
+Host test stub for the Microchip Compiler.h.
+*/
+#ifndef _INC_COMPILER_STUB
+#define _INC_COMPILER_STUB
+
+#include <p18cxxx.h>
+#include "GenericTypeDefs.h"
+
+#endif // _INC_COMPILER_STUB
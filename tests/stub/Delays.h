@@ -0,0 +1,15 @@
+/*
+Host test stub for the C18 delay functions. They let the virtual time go by (see HostDelay()
+in HostRegs.c), at 12 instruction cycles per usec.
+*/
+#ifndef _INC_DELAYS_STUB
+#define _INC_DELAYS_STUB
+
+extern void HostDelayCycles(unsigned long Cycles);
+
+#define Delay10TCYx(n)	HostDelayCycles(10UL * (n))
+#define Delay100TCYx(n)	HostDelayCycles(100UL * (n))
+#define Delay1KTCYx(n)	HostDelayCycles(1000UL * (n))
+#define Delay10KTCYx(n)	HostDelayCycles(10000UL * (n))
+
+#endif // _INC_DELAYS_STUB
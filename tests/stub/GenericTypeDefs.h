@@ -0,0 +1,24 @@
+/*
+Host test stub for the Microchip GenericTypeDefs.h (only the types the firmware uses).
+*/
+#ifndef _INC_GENERIC_TYPE_DEFS_STUB
+#define _INC_GENERIC_TYPE_DEFS_STUB
+
+typedef unsigned char	BYTE;
+typedef unsigned short	WORD;
+typedef unsigned long	DWORD;
+typedef unsigned char	UINT8;
+typedef unsigned short	UINT16;
+typedef unsigned long	UINT32;
+typedef signed char		INT8;
+typedef signed short	INT16;
+typedef unsigned int	UINT;
+typedef unsigned char	BOOL;
+
+#define TRUE	1
+#define FALSE	0
+
+#define rom		const
+#define ROM		const
+
+#endif // _INC_GENERIC_TYPE_DEFS_STUB
@@ -0,0 +1,17 @@
+/*
+Host test stub for the C18 timer library, just Timer0. It counts at 46875Hz (48MHz / 4 / 256)
+in the virtual time (see HostRegs.c).
+*/
+#ifndef _INC_TIMERS_STUB
+#define _INC_TIMERS_STUB
+
+#define TIMER_INT_OFF	0x7F
+#define T0_16BIT		0xBF
+#define T0_SOURCE_INT	0xDF
+#define T0_PS_1_256		0xF7
+
+extern void OpenTimer0(unsigned char Config);
+extern void WriteTimer0(unsigned int Timer);
+extern unsigned int ReadTimer0(void);
+
+#endif // _INC_TIMERS_STUB
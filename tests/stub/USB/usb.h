@@ -0,0 +1,9 @@
+/*
+Host test stub for the Microchip USB stack's usb.h.
+*/
+#ifndef _INC_USB_STUB
+#define _INC_USB_STUB
+
+#include "USB/usb_device.h"
+
+#endif // _INC_USB_STUB
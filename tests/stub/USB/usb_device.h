@@ -0,0 +1,75 @@
+/*
+Host test stub for the Microchip USB device stack: the part of usb_device.h that main.c and 
+App.c use. The stack is modelled in tests/HostUsb.c.
+*/
+#ifndef _INC_USB_DEVICE_STUB
+#define _INC_USB_DEVICE_STUB
+
+#include "GenericTypeDefs.h"
+
+typedef enum
+{
+	DETACHED_STATE,
+	ATTACHED_STATE,
+	POWERED_STATE,
+	DEFAULT_STATE,
+	ADR_PENDING_STATE,
+	ADDRESS_STATE,
+	CONFIGURED_STATE
+} USB_DEVICE_STATE;
+
+typedef struct
+{
+	BYTE bmRequestType;
+	BYTE bRequest;
+	union { WORD Val; BYTE v[2]; } W_Value;
+	union { WORD Val; BYTE v[2]; } W_Index;
+	union { WORD Val; BYTE v[2]; } W_Length;
+} CTRL_TRF_SETUP;
+
+typedef struct
+{
+	BYTE bLength;
+	BYTE bDescriptorType;
+	WORD bcdUSB;
+	BYTE bDeviceClass;
+	BYTE bDeviceSubClass;
+	BYTE bDeviceProtocol;
+	BYTE bMaxPacketSize0;
+	WORD idVendor;
+	WORD idProduct;
+	WORD bcdDevice;
+	BYTE iManufacturer;
+	BYTE iProduct;
+	BYTE iSerialNumber;
+	BYTE bNumConfigurations;
+} USB_DEVICE_DESCRIPTOR;
+
+typedef void * USB_HANDLE;
+
+#define USB_IN_ENABLED			0x02
+#define USB_OUT_ENABLED			0x04
+#define USB_HANDSHAKE_ENABLED	0x10
+#define USB_DISALLOW_SETUP		0x08
+
+#define USB_PING_PONG__NO_PING_PONG		0x00
+#define USB_PING_PONG__EP0_OUT_ONLY		0x01
+#define USB_PING_PONG__FULL_PING_PONG	0x02
+#define USB_PING_PONG__ALL_BUT_EP0		0x03
+
+#define _PUEN	0x10
+#define _TRINT	0x00
+#define _FS		0x04
+
+extern volatile USB_DEVICE_STATE USBDeviceState;
+extern volatile BYTE USBSuspendControl;
+extern volatile BYTE USBResumeControl;
+extern volatile CTRL_TRF_SETUP SetupPkt;
+extern USB_DEVICE_DESCRIPTOR device_dsc; // in RAM (USB_DESCRIPTOR_IN_RAM)
+
+void USBDeviceInit(void);
+void USBDeviceAttach(void);
+void USBDeviceTasks(void);
+void USBEnableEndpoint(BYTE EP, BYTE Options);
+
+#endif // _INC_USB_DEVICE_STUB
@@ -0,0 +1,21 @@
+/*
+Host test stub for the Microchip USB stack's HID function driver (see tests/HostUsb.c).
+*/
+#ifndef _INC_USB_FUNCTION_HID_STUB
+#define _INC_USB_FUNCTION_HID_STUB
+
+#include "GenericTypeDefs.h"
+#include "USB/usb_device.h"
+
+// the report buffers (sized in usb_config.h)
+extern volatile unsigned char hid_report_in[];
+extern volatile unsigned char hid_report_out[];
+extern volatile unsigned char hid_report_feature[];
+
+USB_HANDLE HIDTxPacket(BYTE EP, BYTE * pData, BYTE Length);
+USB_HANDLE HIDRxPacket(BYTE EP, BYTE * pData, BYTE Length);
+BOOL HIDTxHandleBusy(USB_HANDLE Handle);
+BOOL HIDRxHandleBusy(USB_HANDLE Handle);
+void USBCheckHIDRequest(void);
+
+#endif // _INC_USB_FUNCTION_HID_STUB
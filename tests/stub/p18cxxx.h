@@ -0,0 +1,135 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	p18cxxx.h (host test stub)
+
+	Purpose:	Enough of the PIC18F4550 registers for the firmware to build and run
+				on a PC (see tests/Makefile). The registers are plain variables
+				(HostRegs.c), with the bits at the same positions as on the chip, except:
+				EEDATA is the byte of the simulated EEPROM at EEADR, so ReadEEData()
+				and WriteEEData() work as they are; the UART registers are a model of
+				the UART receiver (see HostUartReceive()); and TMR1L/TMR1H count the
+				instruction cycles since the last output tick in the virtual time.
+
+------------------------------------------------------------------------------*/
+#ifndef _INC_P18CXXX_STUB
+#define _INC_P18CXXX_STUB
+
+#include "GenericTypeDefs.h"
+
+// a register with its bits, Name is the byte and Name##bits the bits
+#define SFR_BITS(Name, ...) \
+	typedef union { struct { unsigned char __VA_ARGS__; }; unsigned char Byte; } Name##bits_t; \
+	extern volatile Name##bits_t Name##bits;
+
+#define BITS8(Name)	Name##0:1, Name##1:1, Name##2:1, Name##3:1, Name##4:1, Name##5:1, Name##6:1, Name##7:1
+
+SFR_BITS(LATA, BITS8(LATA))
+SFR_BITS(LATB, BITS8(LATB))
+SFR_BITS(LATC, BITS8(LATC))
+SFR_BITS(LATD, BITS8(LATD))
+SFR_BITS(LATE, BITS8(LATE))
+SFR_BITS(PORTA, BITS8(RA))
+SFR_BITS(PORTB, BITS8(RB))
+SFR_BITS(PORTC, BITS8(RC))
+SFR_BITS(PORTD, BITS8(RD))
+SFR_BITS(PORTE, BITS8(RE))
+SFR_BITS(TRISA, BITS8(TRISA))
+SFR_BITS(TRISB, BITS8(TRISB))
+SFR_BITS(TRISC, BITS8(TRISC))
+SFR_BITS(TRISD, BITS8(TRISD))
+SFR_BITS(TRISE, BITS8(TRISE))
+
+#define LATA	(LATAbits.Byte)
+#define LATB	(LATBbits.Byte)
+#define LATC	(LATCbits.Byte)
+#define LATD	(LATDbits.Byte)
+#define LATE	(LATEbits.Byte)
+#define PORTA	(PORTAbits.Byte)
+#define PORTB	(PORTBbits.Byte)
+#define PORTC	(PORTCbits.Byte)
+#define PORTD	(PORTDbits.Byte)
+#define PORTE	(PORTEbits.Byte)
+#define TRISA	(TRISAbits.Byte)
+#define TRISB	(TRISBbits.Byte)
+#define TRISC	(TRISCbits.Byte)
+#define TRISD	(TRISDbits.Byte)
+#define TRISE	(TRISEbits.Byte)
+
+// interrupts (IPEN is set, so GIE is GIEH and PEIE is GIEL)
+typedef union
+{
+	struct { unsigned char RBIF:1, INT0IF:1, TMR0IF:1, RBIE:1, INT0IE:1, TMR0IE:1, PEIE:1, GIE:1; };
+	struct { unsigned char :6, GIEL:1, GIEH:1; };
+	unsigned char Byte;
+} INTCONbits_t;
+extern volatile INTCONbits_t INTCONbits;
+#define INTCON	(INTCONbits.Byte)
+
+SFR_BITS(RCON, BOR:1, POR:1, PD:1, TO:1, RI:1, :1, SBOREN:1, IPEN:1)
+SFR_BITS(PIE1, TMR1IE:1, TMR2IE:1, CCP1IE:1, SSPIE:1, TXIE:1, RCIE:1, ADIE:1, SPPIE:1)
+SFR_BITS(IPR1, TMR1IP:1, TMR2IP:1, CCP1IP:1, SSPIP:1, TXIP:1, RCIP:1, ADIP:1, SPPIP:1)
+SFR_BITS(PIE2, CCP2IE:1, TMR3IE:1, HLVDIE:1, BCLIE:1, EEIE:1, USBIE:1, CMIE:1, OSCFIE:1)
+SFR_BITS(PIR2, CCP2IF:1, TMR3IF:1, HLVDIF:1, BCLIF:1, EEIF:1, USBIF:1, CMIF:1, OSCFIF:1)
+SFR_BITS(IPR2, CCP2IP:1, TMR3IP:1, HLVDIP:1, BCLIP:1, EEIP:1, USBIP:1, CMIP:1, OSCFIP:1)
+SFR_BITS(T1CON, TMR1ON:1, TMR1CS:1, T1SYNC:1, T1OSCEN:1, T1CKPS0:1, T1CKPS1:1, T1RUN:1, RD16:1)
+SFR_BITS(ADCON0, ADON:1, GO_DONE:1, CHS0:1, CHS1:1, CHS2:1, CHS3:1, :2)
+SFR_BITS(ADCON2, ADCS0:1, ADCS1:1, ADCS2:1, ACQT0:1, ACQT1:1, ACQT2:1, :1, ADFM:1)
+SFR_BITS(UCON, :1, SUSPND:1, RESUME:1, USBEN:1, PKTDIS:1, SE0:1, PPBRST:1, :1)
+SFR_BITS(UIR, URSTIF:1, UERRIF:1, ACTVIF:1, TRNIF:1, IDLEIF:1, STALLIF:1, SOFIF:1, :1)
+
+#define RCON	(RCONbits.Byte)
+#define PIE1	(PIE1bits.Byte)
+#define IPR1	(IPR1bits.Byte)
+#define PIE2	(PIE2bits.Byte)
+#define PIR2	(PIR2bits.Byte)
+#define IPR2	(IPR2bits.Byte)
+#define T1CON	(T1CONbits.Byte)
+#define ADCON0	(ADCON0bits.Byte)
+#define ADCON2	(ADCON2bits.Byte)
+#define UCON	(UCONbits.Byte)
+#define UIR		(UIRbits.Byte)
+
+// a write finishes straight away, or after g_HostEEWriteMicros of virtual time (HostRegs.h): WR is
+// clear again the first time EECON1bits is used after that
+typedef struct { unsigned char RD:1, WR:1, WREN:1, WRERR:1, FREE:1, :1, CFGS:1, EEPGD:1; } EECON1bits_t;
+extern volatile EECON1bits_t * HostEECON1(void);
+#define EECON1bits	(*HostEECON1())
+
+/*
+The UART receiver: RCIF is set while there is a byte in the 2 byte FIFO, reading RCREG
+takes the oldest one out, and OERR (RCSTA bit 1) stays set until CREN is cleared. TXIF
+is always set, the MIDI OUT sends straight away.
+*/
+typedef struct { unsigned char TMR1IF:1, TMR2IF:1, CCP1IF:1, SSPIF:1, TXIF:1, RCIF:1, ADIF:1, SPPIF:1; } PIR1bits_t;
+extern volatile PIR1bits_t * HostPIR1(void);
+extern BYTE HostReadRCREG(void);
+extern volatile unsigned char * HostRCSTA(void);
+#define PIR1bits	(*HostPIR1())
+#define PIR1		(*(volatile unsigned char *)HostPIR1())
+#define RCREG		HostReadRCREG()
+#define RCSTA		(*HostRCSTA())
+
+// Timer1, reading TMR1L latches TMR1H like the chip does in 16 bit mode
+extern volatile unsigned char * HostTMR1L(void);
+extern volatile unsigned char TMR1H;
+#define TMR1L		(*HostTMR1L())
+
+extern volatile unsigned char BAUDCON, INTCON2, SPBRG, SPBRGH;
+extern volatile unsigned char SSPCON1, TXREG, TXSTA;
+extern volatile unsigned char CCP1CON, CCPR1L, CCPR1H;
+extern volatile unsigned char ADCON1, ADRESH, CMCON, UFRML;
+extern volatile unsigned char EEADR, EECON2;
+extern volatile unsigned char TABLAT, TBLPTRU, TBLPTRH, TBLPTRL;
+
+// the simulated data EEPROM
+#define HOST_EEPROM_SIZE	256
+extern unsigned char g_HostEEPROM[HOST_EEPROM_SIZE];
+#define EEDATA	(g_HostEEPROM[EEADR])
+
+#define Nop()
+#define ClrWdt()
+#define _asm
+#define _endasm
+#define TBLWTPOSTINC
+
+#endif // _INC_P18CXXX_STUB
@@ -0,0 +1,178 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	test_buttons.c
+
+	Purpose:	Host test of the button debounce and hold timing (UpdateButtonStates()
+				in App.c). A button is pressed and held with the main loop running
+				every 1ms and every 20ms, and the times that it becomes PRESSED,
+				HELD, LONG and SUPER_LONG are checked to be the same for both. Also
+				that one read after a long stall can't change a button.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include "../App.c" // to get at the button state machine
+
+static int m_Failures = 0;
+
+#define CHECK(Condition) \
+	do { if (!(Condition)) { printf("%s:%d: FAILED %s\n", __FILE__, __LINE__, #Condition); ++m_Failures; } } while (0)
+
+#define PRESS_AT	1003 // ms, off the sample grid
+#define HOLD_FOR	9000
+#define RUN_FOR		(PRESS_AT + HOLD_FOR + 500)
+
+// when each state was first seen (0 = never), in ms of g_MsTickCount
+typedef struct
+{
+	UINT16 Pressed, Held, Long, SuperLong, Released, Up;
+} TTimes;
+
+static void SetButton(BOOL Pressed)
+{
+	swNAV_CENTER = Pressed ? SW_PRESSED : !SW_PRESSED;
+}
+
+
+static void Note(UINT16 * pTime)
+{
+	if (*pTime == 0)
+		*pTime = g_MsTickCount;
+}
+
+
+// g_MsTickCount starts near the top, so it wraps during the hold
+#define START_TICK	0xF000
+
+static void ResetButtons(void)
+{
+	UINT8 nIndex;
+
+	PORTA = PORTB = PORTC = PORTD = PORTE = 0xFF; // all the switches up
+	m_ButtonsDown = 0;
+	m_ButtonCount0 = m_ButtonCount1 = (TButtonBits)~0;
+	m_ButtonsTimed = 0;
+	m_ButtonsChanged = FALSE;
+	for (nIndex = 0; nIndex < BUTTON_COUNT; ++nIndex)
+	{
+		m_ButtonStatus[nIndex].State = bsUP;
+		m_ButtonStatus[nIndex].StateChanged = FALSE;
+	}
+
+	g_MsTickCount = START_TICK;
+	m_NextButtonTime = (UINT8)START_TICK;
+}
+
+
+/*
+Runs the main loop every LoopMs from power on, with NAV_CENTER pressed at PRESS_AT for
+HOLD_FOR ms.
+*/
+static void RunButtons(UINT8 LoopMs, TTimes * pTimes)
+{
+	TButtonStatus * pStatus = &m_ButtonStatus[NAV_CENTER_INDEX];
+	UINT16 nMs;
+
+	ResetButtons();
+	memset(pTimes, 0, sizeof(TTimes));
+
+	for (nMs = 0; nMs < RUN_FOR; nMs += LoopMs)
+	{
+		g_MsTickCount = START_TICK + nMs;
+		SetButton((nMs >= PRESS_AT) && (nMs < PRESS_AT + HOLD_FOR));
+
+		UpdateButtonStates();
+
+		if (!pStatus->StateChanged)
+			continue;
+
+		if (pStatus->State == bsPRESSED)
+			Note(&pTimes->Pressed);
+		if (pStatus->State & bsHELD_DOWN)
+			Note(&pTimes->Held);
+		if (pStatus->State & bsHELD_DOWN_LONG)
+			Note(&pTimes->Long);
+		if (pStatus->State & bsHELD_DOWN_SUPER_LONG)
+			Note(&pTimes->SuperLong);
+		if (pStatus->State & bsHOLD_RELEASED)
+			Note(&pTimes->Released);
+		if (pStatus->State == bsUP)
+			Note(&pTimes->Up);
+	}
+
+	// back to ms from power on
+	pTimes->Pressed -= START_TICK;
+	pTimes->Held -= START_TICK;
+	pTimes->Long -= START_TICK;
+	pTimes->SuperLong -= START_TICK;
+	pTimes->Released -= START_TICK;
+	pTimes->Up -= START_TICK;
+
+	printf("  %2ums loop: pressed %u, held %u, long %u, super long %u, released %u, up %u\n", LoopMs,
+		pTimes->Pressed, pTimes->Held, pTimes->Long, pTimes->SuperLong, pTimes->Released, pTimes->Up);
+}
+
+
+static void TestLoopPeriods(void)
+{
+	TTimes Fast, Slow;
+
+	RunButtons(1, &Fast);
+	RunButtons(20, &Slow);
+
+	// debounced on the 10ms grid, 4 samples that read pressed
+	CHECK((Fast.Pressed >= PRESS_AT + 3 * BUTTON_SAMPLE_MS) && (Fast.Pressed <= PRESS_AT + 4 * BUTTON_SAMPLE_MS));
+	CHECK(Fast.Held - Fast.Pressed == BUTTON_HOLD_MS);
+	CHECK(Fast.Long - Fast.Pressed == BUTTON_LONG_HOLD_MS);
+	CHECK(Fast.SuperLong - Fast.Pressed == BUTTON_SUPER_LONG_HOLD_MS);
+	CHECK((Fast.Released >= PRESS_AT + HOLD_FOR + 3 * BUTTON_SAMPLE_MS) && (Fast.Released <= PRESS_AT + HOLD_FOR + 4 * BUTTON_SAMPLE_MS));
+	CHECK(Fast.Up - Fast.Released == BUTTON_RELEASED_MS);
+
+	// the same with the slow loop, to within a pass of it
+	CHECK((Slow.Pressed >= Fast.Pressed) && (Slow.Pressed < Fast.Pressed + 20));
+	CHECK(Slow.Held - Slow.Pressed == BUTTON_HOLD_MS);
+	CHECK(Slow.Long - Slow.Pressed == BUTTON_LONG_HOLD_MS);
+	CHECK(Slow.SuperLong - Slow.Pressed == BUTTON_SUPER_LONG_HOLD_MS);
+	CHECK((Slow.Released >= Fast.Released) && (Slow.Released < Fast.Released + 20));
+	CHECK(Slow.Up - Slow.Released == BUTTON_RELEASED_MS);
+}
+
+
+/*
+The button is pressed while the loop is held up for 100ms. The read after that counts
+for two samples, the next two for one each.
+*/
+static void TestStall(void)
+{
+	ResetButtons();
+	UpdateButtonStates();
+
+	SetButton(TRUE);
+	g_MsTickCount += 100;
+	UpdateButtonStates();
+	CHECK(m_ButtonStatus[NAV_CENTER_INDEX].State == bsUP);
+
+	g_MsTickCount += BUTTON_SAMPLE_MS;
+	UpdateButtonStates();
+	CHECK(m_ButtonStatus[NAV_CENTER_INDEX].State == bsUP);
+
+	g_MsTickCount += BUTTON_SAMPLE_MS;
+	UpdateButtonStates();
+	CHECK(m_ButtonStatus[NAV_CENTER_INDEX].State == bsPRESSED);
+}
+
+
+int main(void)
+{
+	TestLoopPeriods();
+	TestStall();
+
+	if (m_Failures)
+	{
+		printf("test_buttons: %d FAILED\n", m_Failures);
+		return 1;
+	}
+
+	printf("test_buttons: passed\n");
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	test_ee_journal.c
+
+	Purpose:	Host test of the EEPROM journal in EEData.c: finding the head again
+				after the ring has wrapped, skipping a record that was cut off by a
+				power loss, and copying a setting forward before its record is 
+				written over.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include "../EEData.c" // to get at the journal state
+
+static int m_Failures = 0;
+
+#define CHECK(Condition) \
+	do { if (!(Condition)) { printf("%s:%d: FAILED %s\n", __FILE__, __LINE__, #Condition); ++m_Failures; } } while (0)
+
+/*
+Power off and on again: the queued writes are lost, and the journal is read again from 
+the EEPROM.
+*/
+static void PowerCycle(void)
+{
+	UINT8 nId;
+
+	m_EEQueueCount = 0;
+
+	// so nothing is left over from before
+	for (nId = 0; nId < EE_JOURNAL_IDS; ++nId)
+	{
+		m_JournalSlot[nId] = 0x55;
+		m_JournalValue[nId] = 0x55;
+	}
+	m_JournalHead = 0x55;
+	m_JournalLap = 0x55;
+
+	InitEEJournal();
+}
+
+static void ClearEEPROM(void)
+{
+	m_EEQueueCount = 0;
+	memset(g_HostEEPROM, 0xFF, sizeof(g_HostEEPROM));
+	InitEEJournal(); // formats it
+	FlushEEQueue();
+}
+
+static BYTE ReadJournal(BYTE Id)
+{
+	BYTE nValue;
+
+	if (!ReadEEJournal(Id, &nValue))
+		return 0xEE; // (not a value the tests use)
+
+	return nValue;
+}
+
+
+static void TestHeadAfterWrap(void)
+{
+	UINT8 nCount, nHead;
+	BYTE nLap;
+
+	ClearEEPROM();
+	CHECK(ReadJournal(0) == 0xEE);
+
+	// go round the ring more than once, stopping at a few different places
+	for (nCount = 1; nCount <= (EE_JOURNAL_SLOTS * 2) + 5; ++nCount)
+	{
+		WriteEEJournal(0, nCount);
+		WriteEEJournal(1, (BYTE)(nCount + 100));
+		FlushEEQueue();
+
+		nHead = m_JournalHead;
+		nLap = m_JournalLap;
+
+		PowerCycle();
+		CHECK(m_JournalHead == nHead);
+		CHECK(m_JournalLap == nLap);
+		CHECK(ReadJournal(0) == nCount);
+		CHECK(ReadJournal(1) == (BYTE)(nCount + 100));
+	}
+
+	// the head is found again right at the end of the ring too
+	while (m_JournalHead != EE_JOURNAL_SLOTS - 1)
+		WriteEEJournal(0, ++nCount);
+	FlushEEQueue();
+	nLap = m_JournalLap;
+	PowerCycle();
+	CHECK(m_JournalHead == EE_JOURNAL_SLOTS - 1);
+	CHECK(m_JournalLap == nLap);
+}
+
+
+static void TestTornRecord(void)
+{
+	BYTE nAddress;
+
+	ClearEEPROM();
+
+	WriteEEJournal(2, 10);
+	FlushEEQueue();
+
+	// only the value gets written before the power goes off (the key goes last)
+	nAddress = EEADDR_JOURNAL_SLOTS + (m_JournalHead * 2);
+	WriteEEJournal(2, 20);
+	ServiceEEQueue();
+	CHECK(g_HostEEPROM[nAddress + 1] == 20);
+
+	PowerCycle();
+	CHECK(ReadJournal(2) == 10);
+
+	// the next save goes in the slot that was cut off
+	CHECK(EEADDR_JOURNAL_SLOTS + (m_JournalHead * 2) == nAddress);
+	WriteEEJournal(2, 30);
+	FlushEEQueue();
+	PowerCycle();
+	CHECK(ReadJournal(2) == 30);
+
+	// a key that doesn't match its value (e.g. the value changed later) is skipped too
+	g_HostEEPROM[nAddress + 1] ^= 0x01;
+	PowerCycle();
+	CHECK(ReadJournal(2) == 10);
+}
+
+
+static void TestCopyForward(void)
+{
+	UINT8 nCount;
+	UINT8 nFirstSlot;
+	BYTE nFirstKey;
+
+	ClearEEPROM();
+	g_EEJournalSaves = 0;
+	g_EEJournalRecords = 0;
+
+	// settings 3 and 4 are saved once, then setting 0 over and over
+	WriteEEJournal(3, 33);
+	WriteEEJournal(4, 44);
+	FlushEEQueue();
+	nFirstSlot = m_JournalSlot[3];
+	nFirstKey = g_HostEEPROM[EEADDR_JOURNAL_SLOTS + (nFirstSlot * 2)];
+
+	for (nCount = 0; nCount < EE_JOURNAL_SLOTS * 3; ++nCount)
+	{
+		WriteEEJournal(0, nCount);
+		FlushEEQueue();
+
+		// when the head gets back round to it, setting 3 is written again (as the newest
+		// record, with the next lap bit) before anything else goes in its slot
+		if (nCount == EE_JOURNAL_SLOTS)
+		{
+			CHECK(g_HostEEPROM[EEADDR_JOURNAL_SLOTS + (nFirstSlot * 2)] == JournalKey((nFirstKey & JOURNAL_LAP) ^ JOURNAL_LAP, 3, 33));
+			CHECK(g_HostEEPROM[EEADDR_JOURNAL_SLOTS + (nFirstSlot * 2) + 1] == 33);
+		}
+	}
+
+	// they're still there after their records have been written over a few times
+	PowerCycle();
+	CHECK(ReadJournal(3) == 33);
+	CHECK(ReadJournal(4) == 44);
+	CHECK(ReadJournal(0) == (BYTE)(nCount - 1));
+
+	// each lap costs 2 extra records to carry them forward
+	CHECK(g_EEJournalSaves == (EE_JOURNAL_SLOTS * 3) + 2);
+	CHECK(g_EEJournalRecords > g_EEJournalSaves);
+	CHECK(g_EEJournalRecords <= g_EEJournalSaves + 2 * 4);
+
+	// saving the same value again doesn't write anything
+	nCount = m_JournalHead;
+	WriteEEJournal(3, 33);
+	CHECK(m_JournalHead == nCount);
+}
+
+
+int main(void)
+{
+	TestHeadAfterWrap();
+	TestTornRecord();
+	TestCopyForward();
+
+	if (m_Failures)
+	{
+		printf("test_ee_journal: %d failed\n", m_Failures);
+		return 1;
+	}
+
+	printf("test_ee_journal: passed\n");
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	test_midi_parser.c
+
+	Purpose:	Host test of the MIDI message parser (m_MidiTransitions and 
+				ParseMidiByte() in MIDI.c): running status, real-time bytes in the 
+				middle of a message, and system common messages.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include "../MIDI.c" // to get at the parser state
+#include "HostRegs.h"
+
+static int m_Failures = 0;
+
+#define CHECK(Condition) \
+	do { if (!(Condition)) { printf("%s:%d: FAILED %s\n", __FILE__, __LINE__, #Condition); ++m_Failures; } } while (0)
+
+static void Send(const BYTE * pData, UINT8 Count)
+{
+	while (Count--)
+	{
+		HostUartReceive(*pData++);
+		MIDI_ServiceUARTRx();
+	}
+}
+
+#define SEND(...) \
+	do { static const BYTE Data[] = { __VA_ARGS__ }; Send(Data, sizeof(Data)); } while (0)
+
+static void Reset(void)
+{
+	g_MessageState = WAITING_FOR_STATUS;
+	g_MidiOnNote = INVALID_NOTE_NUMBER;
+	g_MidiOffNote = INVALID_NOTE_NUMBER;
+	g_NoteVelocity = 0;
+	g_HiHatPedalPosition = 0;
+	g_MinVelocity = 1;
+}
+
+
+static void TestNoteOnRunningStatus(void)
+{
+	UINT8 nCount;
+
+	Reset();
+	nCount = g_MidiNoteCount;
+
+	SEND(NOTE_ON | 9, 36, 100);
+	CHECK(g_MidiOnNote == 36);
+	CHECK(g_NoteVelocity == 100);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 1));
+
+	// no status byte this time
+	SEND(38, 90);
+	CHECK(g_MidiOnNote == 38);
+	CHECK(g_NoteVelocity == 90);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 2));
+
+	// velocity 0 is a NOTE OFF
+	SEND(38, 0);
+	CHECK(g_MidiOnNote == INVALID_NOTE_NUMBER);
+	CHECK(g_MidiOffNote == 38);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 2));
+}
+
+
+static void TestNoteOffRunningStatus(void)
+{
+	Reset();
+
+	SEND(NOTE_ON | 9, 36, 100);
+	SEND(NOTE_OFF | 9, 36, 64);
+	CHECK(g_MidiOnNote == INVALID_NOTE_NUMBER);
+	CHECK(g_MidiOffNote == 36);
+
+	SEND(40, 64);
+	CHECK(g_MidiOffNote == 40);
+	SEND(42, 0);
+	CHECK(g_MidiOffNote == 42);
+	CHECK(g_MessageState == WAITING_FOR_NOTE_OFF);
+}
+
+
+static void TestControlChangeRunningStatus(void)
+{
+	Reset();
+
+	SEND(CONTROL_CHANGE | 9, 4, 64);
+	CHECK(g_HiHatPedalPosition == 64);
+
+	SEND(4, 100);
+	CHECK(g_HiHatPedalPosition == 100);
+
+	// another controller doesn't change the pedal, and the one after it still works
+	SEND(7, 50, 4, 10);
+	CHECK(g_HiHatPedalPosition == 10);
+	CHECK(g_MessageState == WAITING_FOR_CC_DATA1);
+
+	// a NOTE ON after the CCs
+	SEND(NOTE_ON | 9, 45, 70);
+	CHECK(g_MidiOnNote == 45);
+	CHECK(g_HiHatPedalPosition == 10);
+}
+
+
+static void TestRealTimeBytes(void)
+{
+	UINT8 nCount;
+
+	Reset();
+	nCount = g_MidiNoteCount;
+
+	// clock and active sensing between the bytes of a NOTE ON
+	SEND(TIMING_CLOCK, NOTE_ON | 9, TIMING_CLOCK, 40, 0xFE, 80);
+	CHECK(g_MidiOnNote == 40);
+	CHECK(g_NoteVelocity == 80);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 1));
+
+	// ... and in running status
+	SEND(41, 0xFA, 0xFC, 81);
+	CHECK(g_MidiOnNote == 41);
+	CHECK(g_NoteVelocity == 81);
+
+	// ... and in a CC
+	SEND(CONTROL_CHANGE | 9, TIMING_CLOCK, 4, TIMING_CLOCK, 33);
+	CHECK(g_HiHatPedalPosition == 33);
+	CHECK(g_MessageID == CONTROL_CHANGE);
+}
+
+
+static void TestSystemCommon(void)
+{
+	UINT8 nCount;
+
+	Reset();
+
+	// song select cancels the running status, so the bytes after it aren't a note
+	SEND(NOTE_ON | 9, 36, 100);
+	nCount = g_MidiNoteCount;
+	SEND(0xF3, 5);
+	CHECK(g_MessageState == WAITING_FOR_STATUS);
+	SEND(38, 90);
+	CHECK(g_MidiOnNote == 36);
+	CHECK(g_MidiNoteCount == nCount);
+
+	// tune request (no data) in the middle of a NOTE ON drops it
+	SEND(NOTE_ON | 9, 50, 0xF6, 60);
+	CHECK(g_MidiNoteCount == nCount);
+	CHECK(g_MessageState == WAITING_FOR_STATUS);
+
+	// song position has 2 data bytes
+	SEND(NOTE_ON | 9, 0xF2, 1, 2, 3, 4);
+	CHECK(g_MidiNoteCount == nCount);
+
+	// end of sys-ex ends the running status too
+	SEND(CONTROL_CHANGE | 9, 4, 20, SYS_EX_START, 1, 2, 0xF7, 4, 30);
+	CHECK(g_HiHatPedalPosition == 20);
+
+	// a new status byte starts over
+	SEND(NOTE_ON | 9, 52, 70);
+	CHECK(g_MidiOnNote == 52);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 1));
+}
+
+
+int main(void)
+{
+	MIDI_Initialize(); // turns the UART receiver on
+
+	TestNoteOnRunningStatus();
+	TestNoteOffRunningStatus();
+	TestControlChangeRunningStatus();
+	TestRealTimeBytes();
+	TestSystemCommon();
+
+	if (m_Failures)
+	{
+		printf("test_midi_parser: %d failed\n", m_Failures);
+		return 1;
+	}
+
+	printf("test_midi_parser: passed\n");
+	return 0;
+}
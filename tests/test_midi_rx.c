@@ -0,0 +1,221 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	test_midi_rx.c
+
+	Purpose:	Host test of the buffered MIDI receive (MIDI_RxISR() and
+				MIDI_ServiceRxBuffer() in MIDI.c). Bursts of notes come in at 31250
+				baud while the main loop stalls for as long as it really can, and the
+				overflow, overrun and high water counts and the number of notes
+				parsed are checked.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include "../MIDI.c" // to get at the ring buffer size
+#include "HostRegs.h"
+
+static int m_Failures = 0;
+
+#define CHECK(Condition) \
+	do { if (!(Condition)) { printf("%s:%d: FAILED %s\n", __FILE__, __LINE__, #Condition); ++m_Failures; } } while (0)
+
+/*
+A pass of the main loop when nothing else is going on, and the stalls: a blocking EEPROM
+write (FlushEEQueue()), a 10ms report poll interval, and the longest that the ring buffer
+can cover at full speed (MIDI_RX_BUF_SIZE - 1 bytes is 20.2ms).
+*/
+#define LOOP_PASS_MICROS	100
+#define EE_WRITE_STALL		4000
+#define POLL_STALL			10000
+#define LONGEST_STALL		19000
+
+#define UART_FIFO_BYTES		2
+
+static const BYTE DRUM_NOTES[] = { 36, 38, 42, 46, 48, 45, 49, 51 };
+
+static UINT16 m_BytesIn; // bytes that made it into the UART
+
+static void CountingRxISR(void)
+{
+	++m_BytesIn;
+
+	// same as YourHighPriorityISRCode() in main.c
+	if (PIR1bits.RCIF)
+		MIDI_RxISR();
+}
+
+
+static void Reset(void)
+{
+	HostRun(HostUartLineFree() - g_HostMicros);
+	MIDI_ServiceRxBuffer();
+
+	g_HostRxISR = CountingRxISR;
+	g_MidiRxOverrunCount = 0;
+	g_MidiRxOverflowCount = 0;
+	g_MidiRxHighWater = 0;
+	g_HostUartLost = 0;
+	m_BytesIn = 0;
+}
+
+
+/*
+Puts Count NOTE ONs on the line back to back, in running status after the first one.
+Returns how long they take to come in.
+*/
+static UINT32 SendNotes(UINT16 Count)
+{
+	UINT32 nStart = HostUartLineFree();
+	UINT16 nNote;
+
+	HostUartSend(nStart, NOTE_ON | 9);
+
+	for (nNote = 0; nNote < Count; ++nNote)
+	{
+		HostUartSend(0, DRUM_NOTES[nNote % sizeof(DRUM_NOTES)]);
+		HostUartSend(0, 64 + (nNote % 64));
+	}
+
+	return HostUartLineFree() - nStart;
+}
+
+
+static void RunMainLoop(UINT32 Micros)
+{
+	UINT32 nEnd = g_HostMicros + Micros;
+
+	while (g_HostMicros < nEnd)
+	{
+		HostRun(LOOP_PASS_MICROS);
+		MIDI_ServiceRxBuffer();
+	}
+}
+
+
+static void Stall(UINT32 Micros)
+{
+	HostRun(Micros);
+	MIDI_ServiceRxBuffer();
+}
+
+
+/*
+A stream with no gaps at all (a dense e-kit roll) and every stall the buffer can cover.
+*/
+static void TestNoBytesLost(void)
+{
+	static const UINT32 STALLS[] = { EE_WRITE_STALL, POLL_STALL, LONGEST_STALL };
+	UINT8 nCount, nStall;
+	UINT32 nEnd;
+
+	Reset();
+	nCount = g_MidiNoteCount;
+	nEnd = g_HostMicros + SendNotes(200);
+
+	for (nStall = 0; g_HostMicros < nEnd; nStall = (nStall + 1) % 3)
+	{
+		RunMainLoop(15000);
+		Stall(STALLS[nStall]);
+	}
+	RunMainLoop(1000);
+
+	CHECK(m_BytesIn == 401);
+	CHECK(g_HostUartLost == 0);
+	CHECK(g_MidiRxOverrunCount == 0);
+	CHECK(g_MidiRxOverflowCount == 0);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 200));
+
+	// the longest stall filled the buffer up to the bytes that came in during it
+	CHECK(g_MidiRxHighWater >= LONGEST_STALL / UART_BYTE_MICROS);
+	CHECK(g_MidiRxHighWater < MIDI_RX_BUF_SIZE);
+	printf("test_midi_rx: high water after a %ums stall is %u of %u bytes\n",
+		(unsigned)(LONGEST_STALL / 1000), g_MidiRxHighWater, MIDI_RX_BUF_SIZE - 1);
+}
+
+
+/*
+A stall that is too long: the ring buffer overflows, and each byte that didn't fit is
+counted. The notes after it are all parsed.
+*/
+static void TestOverflowCounted(void)
+{
+	UINT8 nCount;
+	UINT16 nBytes;
+
+	Reset();
+	SendNotes(100);
+	RunMainLoop(5000);
+
+	nBytes = m_BytesIn;
+	Stall(30000);
+	nBytes = m_BytesIn - nBytes; // came in during the stall
+
+	RunMainLoop(HostUartLineFree() - g_HostMicros + 1000);
+
+	CHECK(m_BytesIn == 201);
+	CHECK(g_HostUartLost == 0);
+	CHECK(g_MidiRxOverrunCount == 0);
+	CHECK(g_MidiRxOverflowCount == nBytes - (MIDI_RX_BUF_SIZE - 1));
+	CHECK(g_MidiRxHighWater == MIDI_RX_BUF_SIZE - 1);
+
+	nCount = g_MidiNoteCount;
+	SendNotes(50);
+	RunMainLoop(HostUartLineFree() - g_HostMicros + 1000);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 50));
+	CHECK(g_MidiRxOverflowCount == nBytes - (MIDI_RX_BUF_SIZE - 1));
+}
+
+
+/*
+The UART interrupt held off for 1ms: the FIFO takes 2 bytes, the third is an overrun. The
+ISR clears it when it gets in, and reception carries on.
+*/
+static void TestOverrunCounted(void)
+{
+	UINT8 nCount;
+	UINT16 nBytes;
+	UINT32 nLost;
+
+	Reset();
+	SendNotes(100);
+	RunMainLoop(5000);
+
+	nBytes = HostUartLineCount();
+	g_HostRxISR = NULL;
+	HostRun(1000);
+	nBytes -= HostUartLineCount(); // came in while the interrupt was held off
+	nLost = g_HostUartLost;
+	g_HostRxISR = CountingRxISR;
+	MIDI_RxISR(); // the interrupt that was waiting
+
+	RunMainLoop(HostUartLineFree() - g_HostMicros + 1000);
+
+	CHECK(nLost == nBytes - UART_FIFO_BYTES);
+	CHECK(g_HostUartLost == nLost);
+	CHECK(g_MidiRxOverrunCount == 1);
+	CHECK(g_MidiRxOverflowCount == 0);
+
+	nCount = g_MidiNoteCount;
+	SendNotes(50);
+	RunMainLoop(HostUartLineFree() - g_HostMicros + 1000);
+	CHECK(g_MidiNoteCount == (UINT8)(nCount + 50));
+	CHECK(g_MidiRxOverrunCount == 1);
+}
+
+
+int main(void)
+{
+	MIDI_Initialize(); // turns the UART receiver on
+
+	TestNoBytesLost();
+	TestOverflowCounted();
+	TestOverrunCounted();
+
+	if (m_Failures)
+	{
+		printf("test_midi_rx: %d failed\n", m_Failures);
+		return 1;
+	}
+
+	printf("test_midi_rx: passed\n");
+	return 0;
+}
@@ -0,0 +1,352 @@
+/*------------------------------------------------------------------------------
+
+	Filename:	test_settings.c
+
+	Purpose:	Host test of RecallStoredSettings() in App.c over the EEPROM journal:
+				a blank EEPROM only gets journal records for the hot settings, the
+				other settings keep their saved values over a power cycle, the
+				journal's values win over the settings record (also when it's
+				repaired), and version 1 maps are converted without the power up
+				waiting for the EEPROM. How long the journal takes to read at power
+				up and how many EEPROM writes a setting change costs are reported.
+
+------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include "../App.c" // to get at the settings and the velocity curve
+#include "HostRegs.h"
+
+#define NO_COUNT	__attribute__((no_sanitize_coverage))
+
+static int m_Failures = 0;
+
+#define CHECK(Condition) \
+	do { if (!(Condition)) { printf("%s:%d: FAILED %s\n", __FILE__, __LINE__, #Condition); ++m_Failures; } } while (0)
+
+/*
+Basic blocks run by the firmware, counted the way the simulation does (see HostSim.c), 8
+cycles each at 12 cycles per usec.
+*/
+#define CYCLES_PER_BLOCK	8
+#define CYCLES_PER_USEC		12
+
+static UINT32 m_Blocks;
+
+NO_COUNT void __sanitizer_cov_trace_pc(void)
+{
+	++m_Blocks;
+}
+
+
+static UINT32 BlockMicros(UINT32 Blocks)
+{
+	return (Blocks * CYCLES_PER_BLOCK + CYCLES_PER_USEC / 2) / CYCLES_PER_USEC;
+}
+
+
+/*
+Power off and on again, once the writes are done: the journal and the settings are read
+again the way main.c does, and the main loop is left to save what they changed. Returns the
+blocks it took to read the journal, and to recall the settings.
+*/
+static void PowerCycle(UINT32 * pJournalBlocks, UINT32 * pRecallBlocks)
+{
+	FlushSettingsSave();
+	g_MinVelocity = 0x55;
+	g_MidiHoldCount = 0x55;
+	m_pVelocityCurve = NULL;
+	m_MapsConverted = FALSE;
+
+	m_Blocks = 0;
+	InitEEJournal();
+	if (pJournalBlocks != NULL)
+		*pJournalBlocks = m_Blocks;
+
+	m_Blocks = 0;
+	RecallStoredSettings();
+	if (pRecallBlocks != NULL)
+		*pRecallBlocks = m_Blocks;
+
+	FlushSettingsSave();
+}
+
+
+static UINT32 EEWrites(void)
+{
+	UINT32 nWrites = 0;
+	UINT16 nAddress;
+
+	for (nAddress = 0; nAddress < HOST_EEPROM_SIZE; ++nAddress)
+		nWrites += g_HostEEWrites[nAddress];
+
+	return nWrites;
+}
+
+
+static UINT32 MaxEEWrites(void)
+{
+	UINT32 nMax = 0;
+	UINT16 nAddress;
+
+	for (nAddress = 0; nAddress < HOST_EEPROM_SIZE; ++nAddress)
+	{
+		if (g_HostEEWrites[nAddress] > nMax)
+			nMax = g_HostEEWrites[nAddress];
+	}
+
+	return nMax;
+}
+
+
+static void BlankEEPROM(void)
+{
+	memset(g_HostEEPROM, 0xFF, HOST_EEPROM_SIZE);
+	PowerCycle(NULL, NULL);
+}
+
+
+/*
+A blank EEPROM gets the defaults, with journal records for the hot settings only, and the
+maps are saved from the main loop without the EEPROM queue filling up. The others keep
+what's saved for them over a power cycle (the velocity curve used to be put back to
+linear every time, from a record of the poll rate's default).
+*/
+static void TestBlank(void)
+{
+	BYTE nValue, nKeyId;
+	UINT8 nId, nSlot, nForced;
+
+	memset(g_HostEEPROM, 0xFF, HOST_EEPROM_SIZE);
+	nForced = g_EEQueueForced;
+	FlushEEQueue();
+	InitEEJournal();
+	RecallStoredSettings();
+	CHECK(ReadEEData(EEADDR_VERSION) != EE_VERSION); // not until the maps are saved
+
+	while (!ServiceSettingsSave() || (GetEEQueueCount() != 0))
+		ServiceEEQueue();
+	CHECK(g_EEQueueForced == nForced);
+
+	PowerCycle(NULL, NULL);
+	CHECK(ReadEEData(EEADDR_VERSION) == EE_VERSION);
+	CHECK(g_MinVelocity == DEFAULT_VELOCITY_THRESHOLD);
+	CHECK(m_pVelocityCurve == VELOCITY_CURVES[vcLINEAR]);
+
+	// (the game mode isn't in the settings record, it's saved by the boot mode select)
+	CHECK(ReadEEJournal(HotSettingID(EEADDR_VEL_THRESH), &nValue) && (nValue == DEFAULT_VELOCITY_THRESHOLD));
+	CHECK(ReadEEJournal(HotSettingID(EEADDR_HOLD_COUNT), &nValue));
+	CHECK(ReadEEJournal(HotSettingID(EEADDR_HIHAT_THRESHOLD), &nValue));
+	for (nId = HOT_SETTING_COUNT; nId < EE_JOURNAL_IDS; ++nId)
+		CHECK(!ReadEEJournal(nId, &nValue));
+
+	// the setting ID in each record's key (7 = empty, see EEData.c)
+	for (nSlot = 0; nSlot < EE_JOURNAL_SLOTS; ++nSlot)
+	{
+		nKeyId = (g_HostEEPROM[EEADDR_JOURNAL + 2 + (nSlot * 2)] >> 4) & 0x07;
+		CHECK((nKeyId < HOT_SETTING_COUNT) || (nKeyId == 7));
+	}
+
+	SaveSetting(EEADDR_VEL_CURVE, vcEXP);
+	SaveSetting(EEADDR_POLL_RATE, POLL_RATE_FAST);
+	FlushEEQueue();
+
+	PowerCycle(NULL, NULL);
+	CHECK(m_pVelocityCurve == VELOCITY_CURVES[vcEXP]);
+	CHECK(ReadSetting(EEADDR_POLL_RATE) == POLL_RATE_FAST);
+	CHECK(ReadEEData(EEADDR_SETTINGS_CRC) == CalcSettingsCrc());
+}
+
+
+/*
+The hot settings come back from the journal, after it has wrapped around many times, and
+their own bytes aren't written. A damaged settings record is repaired without losing them.
+*/
+static void TestHotSettings(void)
+{
+	UINT16 nSave;
+	BYTE nOwnThreshold, nOwnHold;
+
+	BlankEEPROM();
+	nOwnThreshold = g_HostEEPROM[EEADDR_VEL_THRESH];
+	nOwnHold = g_HostEEPROM[EEADDR_HOLD_COUNT];
+
+	for (nSave = 0; nSave < 500; ++nSave)
+	{
+		SaveSetting(EEADDR_VEL_THRESH, (BYTE)(nSave % 100));
+		if ((nSave % 7) == 0)
+			SaveSetting(EEADDR_HOLD_COUNT, (BYTE)(1 + nSave % 20));
+		FlushEEQueue();
+	}
+
+	PowerCycle(NULL, NULL);
+	CHECK(g_MinVelocity == 499 % 100);
+	CHECK(g_MidiHoldCount == 1 + 497 % 20);
+	CHECK(g_HostEEPROM[EEADDR_VEL_THRESH] == nOwnThreshold);
+	CHECK(g_HostEEPROM[EEADDR_HOLD_COUNT] == nOwnHold);
+
+	// damage the record: the bad setting goes back to its default, the journal ones stay
+	g_HostEEPROM[EEADDR_VEL_CURVE] = 0x42;
+	PowerCycle(NULL, NULL);
+	CHECK(m_pVelocityCurve == VELOCITY_CURVES[vcLINEAR]);
+	CHECK(g_HostEEPROM[EEADDR_VEL_CURVE] == vcLINEAR);
+	CHECK(ReadEEData(EEADDR_SETTINGS_CRC) == CalcSettingsCrc());
+	CHECK(g_MinVelocity == 499 % 100);
+	CHECK(g_MidiHoldCount == 1 + 497 % 20);
+}
+
+
+/*
+Version 1 saved the maps as 8x8 tables (a column of notes for each channel). They're
+converted to the new maps in RAM at power up, saved from the main loop behind
+EE_VERSION_1_MIGRATING, and read back the same at the next power up.
+*/
+static const BYTE OLD_TABLE[MIDI_CHANNEL_COUNT][8] =
+{
+	{ 38, 40, 0xFF }, { 48, 0xFF }, { 45, 47, 0xFF }, { 41, 43, 0xFF },
+	{ 36, 35, 0xFF }, { 42, 44, 46, 0xFF }, { 51, 53, 59, 0xFF }, { 49, 52, 55, 57, 0xFF }
+};
+
+static void CheckOldTable(void)
+{
+	UINT8 nChannel, nNote, nIndex, nLast;
+
+	for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
+	{
+		// in note order
+		nLast = 0;
+		for (nIndex = 0; OLD_TABLE[nChannel][nIndex] != 0xFF; ++nIndex)
+		{
+			nNote = GetMidiMapEntry(nChannel, nIndex);
+			CHECK((nNote > nLast) && (nNote != INVALID_NOTE_NUMBER));
+			nLast = nNote;
+		}
+		CHECK(GetMidiMapEntry(nChannel, nIndex) == INVALID_NOTE_NUMBER);
+
+		for (nIndex = 0; OLD_TABLE[nChannel][nIndex] != 0xFF; ++nIndex)
+		{
+			for (nNote = 0; GetMidiMapEntry(nChannel, nNote) != OLD_TABLE[nChannel][nIndex]; ++nNote)
+			{
+				if (nNote >= 8)
+				{
+					CHECK(!"note in the old table was lost");
+					break;
+				}
+			}
+		}
+	}
+}
+
+
+static void TestVersion1(void)
+{
+	UINT8 nMap, nChannel, nIndex, nForced;
+
+	BlankEEPROM();
+
+	for (nMap = 0; nMap < MIDI_MAP_COUNT; ++nMap)
+	{
+		for (nChannel = 0; nChannel < MIDI_CHANNEL_COUNT; ++nChannel)
+		{
+			for (nIndex = 0; nIndex < 8; ++nIndex)
+				g_HostEEPROM[EEADDR_MIDI_MAP1 + (nMap * 64) + (nChannel * 8) + nIndex] = OLD_TABLE[nChannel][nIndex];
+		}
+	}
+	g_HostEEPROM[EEADDR_VERSION] = EE_VERSION_1;
+	g_HostEEPROM[EEADDR_SETTINGS_CRC] = 0xFF; // version 1 didn't have CRCs
+
+	nForced = g_EEQueueForced;
+	InitEEJournal();
+	RecallStoredSettings();
+	CHECK(g_EEQueueForced == nForced);
+
+	// the version change goes first
+	ServiceEEQueue();
+	CHECK(g_HostEEPROM[EEADDR_VERSION] == EE_VERSION_1_MIGRATING);
+
+	for (nMap = 0; nMap < MIDI_MAP_COUNT; ++nMap)
+	{
+		SetMidiMapNumber(nMap);
+		CheckOldTable();
+	}
+
+	while (!ServiceSettingsSave() || (GetEEQueueCount() != 0))
+	{
+		CHECK(g_HostEEPROM[EEADDR_VERSION] == EE_VERSION_1_MIGRATING);
+		ServiceEEQueue();
+	}
+	CHECK(g_EEQueueForced == nForced);
+	CHECK(g_HostEEPROM[EEADDR_VERSION] == EE_VERSION);
+
+	// read back from EEPROM, with good CRCs
+	PowerCycle(NULL, NULL);
+	CHECK(RecallMidiMaps() == 0);
+	for (nMap = 0; nMap < MIDI_MAP_COUNT; ++nMap)
+	{
+		SetMidiMapNumber(nMap);
+		CheckOldTable();
+	}
+}
+
+
+/*
+Power up time with an empty and a full journal, and the EEPROM writes per change of a hot
+setting (in the journal) and of one in the settings record.
+*/
+static void ReportCosts(void)
+{
+	UINT32 nEmptyJournal, nEmptyRecall, nFullJournal, nFullRecall, nWrites, nMax;
+	UINT16 nSave;
+
+	BlankEEPROM();
+	PowerCycle(&nEmptyJournal, &nEmptyRecall);
+
+	#define SAVES 1000
+
+	memset(g_HostEEWrites, 0, HOST_EEPROM_SIZE * sizeof(g_HostEEWrites[0]));
+	for (nSave = 0; nSave < SAVES; ++nSave)
+	{
+		SaveSetting(EEADDR_VEL_THRESH, (BYTE)(nSave % 100));
+		FlushEEQueue();
+	}
+	nWrites = EEWrites();
+	nMax = MaxEEWrites();
+
+	PowerCycle(&nFullJournal, &nFullRecall);
+
+	printf("  power up, journal read + settings recalled (usecs): empty %lu + %lu, full %lu + %lu\n",
+		(unsigned long)BlockMicros(nEmptyJournal), (unsigned long)BlockMicros(nEmptyRecall),
+		(unsigned long)BlockMicros(nFullJournal), (unsigned long)BlockMicros(nFullRecall));
+	printf("  velocity threshold (journal), per change: %.2f EEPROM bytes written, busiest byte %.3f writes\n",
+		(double)nWrites / SAVES, (double)nMax / SAVES);
+
+	memset(g_HostEEWrites, 0, HOST_EEPROM_SIZE * sizeof(g_HostEEWrites[0]));
+	for (nSave = 0; nSave < SAVES; ++nSave)
+	{
+		SaveSetting(EEADDR_SWAP_NOTE, (BYTE)(nSave % 100));
+		FlushEEQueue();
+	}
+
+	printf("  swap note (settings record), per change: %.2f EEPROM bytes written, busiest byte %.3f writes\n",
+		(double)EEWrites() / SAVES, (double)MaxEEWrites() / SAVES);
+
+	// the journal has to keep up with the wear it saves
+	CHECK(nMax * 10 < SAVES);
+}
+
+
+int main(void)
+{
+	TestBlank();
+	TestHotSettings();
+	TestVersion1();
+	ReportCosts();
+
+	if (m_Failures)
+	{
+		printf("test_settings: %d FAILED\n", m_Failures);
+		return 1;
+	}
+
+	printf("test_settings: passed\n");
+	return 0;
+}
@@ -68,12 +68,19 @@
 #define USB_NUM_MESSAGES_EP1 1
 
 //Make sure only one of the below "#define USB_PING_PONG_MODE" is uncommented
-#define USB_PING_PONG_MODE USB_PING_PONG__NO_PING_PONG
-//#define USB_PING_PONG_MODE USB_PING_PONG__FULL_PING_PONG
+//#define USB_PING_PONG_MODE USB_PING_PONG__NO_PING_PONG
+#define USB_PING_PONG_MODE USB_PING_PONG__FULL_PING_PONG // lets the next input report be queued (see HID_InputReport())
 //#define USB_PING_PONG_MODE USB_PING_PONG__EP0_OUT_ONLY
 //#define USB_PING_PONG_MODE USB_PING_PONG__ALL_BUT_EP0 //NOTE: this is not supported in 18F4550 rev Ax
 
-#define USB_POLLING
+/*
+USB_INTERRUPT services the USB from the low priority interrupt (the UART is high priority), so
+the main loop only has to build reports and parse MIDI data. USB_POLLING calls USBDeviceTasks()
+from the main loop instead. dcGET_LATENCY can report the main loop rate to compare the two.
+*/
+//#define USB_POLLING
+#define USB_INTERRUPT
+#define USB_ENABLE_SOF_HANDLER // USBCB_SOF_Handler() is used to sync the input reports
 
 #define USB_MAX_EP_NUMBER       2  // <<< not sure about this, should it be 1?
 
@@ -89,6 +96,15 @@
 #define PROGRAMMABLE_WITH_USB_HID_BOOTLOADER
 //#define PROGRAMMABLE_WITH_USB_LEGACY_CUSTOM_CLASS_BOOTLOADER
 
+/*
+The console and fast poll rate config descriptors are both in ROM (USB_CD_Ptr[]), the stack
+reads the one picked by g_UsbConfigIndex. The device still reports a single configuration.
+*/
+#define USB_CONFIG_CONSOLE	0
+#define USB_CONFIG_FAST		1
+#define USB_USER_CONFIG_DESCRIPTOR (USB_CD_Ptr + g_UsbConfigIndex)
+#define USB_USER_CONFIG_DESCRIPTOR_INCLUDE extern ROM BYTE *ROM USB_CD_Ptr[]; extern BYTE g_UsbConfigIndex
+
 #define SUPPORT_SET_DSC
 #define SUPPORT_SYNC_FRAME
 
@@ -82,56 +82,61 @@
     0x01                    // Number of possible configurations
 };
 
-/* Configuration 1 Descriptor */
-ROM BYTE configDescriptor1[] =
-{
-    /* Configuration Descriptor */
-    9,    					// Size of this descriptor in bytes
-    USB_DESCRIPTOR_CONFIGURATION,                // CONFIGURATION descriptor type
-    WORD_BYTES(0x29),       // Total length of data for this cfg (41 bytes)
-    1,                      // Number of interfaces in this cfg
-    1,                      // Index value of this configuration
-    0,                      // Configuration string index
-    _DEFAULT | _SELF,       // Attributes, see usb_device.h
-    50,                     // Max power consumption (2X mA)
-	
-						
-    /* Interface Descriptor */
-    9,  					// Size of this descriptor in bytes
-    USB_DESCRIPTOR_INTERFACE,               // INTERFACE descriptor type
-    0,                      // Interface Number
-    0,                      // Alternate Setting Number
-    2,                      // Number of endpoints in this intf
-    HID_INTF,               // Class code
-    0,     					// Subclass code
-    0,     					// Protocol code
-    0,                      // Interface string index
-
-    /* HID Class-Specific Descriptor */
-    9,    				 	// Size of this descriptor in bytes
-    DSC_HID,                // HID descriptor type
-    WORD_BYTES(0x0111),     // HID Spec Release Number in BCD format (1.11)
-    0x00,                   // Country Code (0x00 for Not supported)
-    HID_NUM_OF_DSC,         // Number of class descriptors, see usbcfg.h
-    DSC_RPT,                // Report descriptor type
-	WORD_BYTES(HID_RPT01_SIZE), // Size of the report descriptor
-    
-    /* Endpoint Descriptor */
-    7,						// Size of this descriptor in bytes
-    USB_DESCRIPTOR_ENDPOINT,// Endpoint Descriptor
-    HID_EP | _EP_IN,        // EndpointAddress
-    _INTERRUPT,             // Attributes
-    WORD_BYTES(64),         // Max Packet Size
-    10,                     // Interval
-
-    /* Endpoint Descriptor */
-    7,						// Size of this descriptor in bytes
-    USB_DESCRIPTOR_ENDPOINT,// Endpoint Descriptor
-    HID_EP | _EP_OUT,       // EndpointAddress
-    _INTERRUPT,             // Attributes
-    WORD_BYTES(64),         // Max Packet Size
-    10                      // Interval
-};
+/* 
+Configuration 1 Descriptor. Interval is the HID endpoint poll interval (ms), there's
+a console and a fast (PC) version of it -- see SetPollRate(). 
+*/
+#define CONFIG_DESCRIPTOR_1(Interval) \
+{ \
+    /* Configuration Descriptor */ \
+    9,    					/* Size of this descriptor in bytes */ \
+    USB_DESCRIPTOR_CONFIGURATION, /* CONFIGURATION descriptor type */ \
+    WORD_BYTES(0x29),       /* Total length of data for this cfg (41 bytes) */ \
+    1,                      /* Number of interfaces in this cfg */ \
+    1,                      /* Index value of this configuration */ \
+    0,                      /* Configuration string index */ \
+    _DEFAULT | _SELF,       /* Attributes, see usb_device.h */ \
+    50,                     /* Max power consumption (2X mA) */ \
+ \
+    /* Interface Descriptor */ \
+    9,  					/* Size of this descriptor in bytes */ \
+    USB_DESCRIPTOR_INTERFACE, /* INTERFACE descriptor type */ \
+    0,                      /* Interface Number */ \
+    0,                      /* Alternate Setting Number */ \
+    2,                      /* Number of endpoints in this intf */ \
+    HID_INTF,               /* Class code */ \
+    0,     					/* Subclass code */ \
+    0,     					/* Protocol code */ \
+    0,                      /* Interface string index */ \
+ \
+    /* HID Class-Specific Descriptor */ \
+    9,    				 	/* Size of this descriptor in bytes */ \
+    DSC_HID,                /* HID descriptor type */ \
+    WORD_BYTES(0x0111),     /* HID Spec Release Number in BCD format (1.11) */ \
+    0x00,                   /* Country Code (0x00 for Not supported) */ \
+    HID_NUM_OF_DSC,         /* Number of class descriptors, see usbcfg.h */ \
+    DSC_RPT,                /* Report descriptor type */ \
+	WORD_BYTES(HID_RPT01_SIZE), /* Size of the report descriptor */ \
+ \
+    /* Endpoint Descriptor */ \
+    7,						/* Size of this descriptor in bytes */ \
+    USB_DESCRIPTOR_ENDPOINT,/* Endpoint Descriptor */ \
+    HID_EP | _EP_IN,        /* EndpointAddress */ \
+    _INTERRUPT,             /* Attributes */ \
+    WORD_BYTES(64),         /* Max Packet Size */ \
+    (Interval),             /* Interval */ \
+ \
+    /* Endpoint Descriptor */ \
+    7,						/* Size of this descriptor in bytes */ \
+    USB_DESCRIPTOR_ENDPOINT,/* Endpoint Descriptor */ \
+    HID_EP | _EP_OUT,       /* EndpointAddress */ \
+    _INTERRUPT,             /* Attributes */ \
+    WORD_BYTES(64),         /* Max Packet Size */ \
+    (Interval)              /* Interval */ \
+}
+
+ROM BYTE configDescriptor1[] = CONFIG_DESCRIPTOR_1(USB_POLL_INTERVAL_CONSOLE);
+ROM BYTE configDescriptor1Fast[] = CONFIG_DESCRIPTOR_1(USB_POLL_INTERVAL_FAST);
 
 //Language code string descriptor
 ROM struct { BYTE bLength;BYTE bDscType;WORD string[1]; } sd000 =
@@ -300,12 +305,15 @@ ROM struct { BYTE report[HID_RPT01_SIZE]; } hid_rpt01 = {
 	}
 };                  
 
-//Array of configuration descriptors
+//Array of configuration descriptors, indexed by g_UsbConfigIndex (see usb_config.h)
 ROM BYTE *ROM USB_CD_Ptr[]=
 {
-    (ROM BYTE *ROM)&configDescriptor1
+    (ROM BYTE *ROM)&configDescriptor1,	 // USB_CONFIG_CONSOLE
+    (ROM BYTE *ROM)&configDescriptor1Fast // USB_CONFIG_FAST
 };
 
+BYTE g_UsbConfigIndex = USB_CONFIG_CONSOLE; // set by SetPollRate()
+
 //Array of string descriptors
 ROM BYTE *ROM USB_SD_Ptr[]=
 {